@@ -8,6 +8,7 @@
 #include "vulkan/wsi/wsi.hpp"
 #include "vulkan/graphics/shader.hpp"
 #include "vulkan/graphics/render_pass.hpp"
+#include "vulkan/graphics/frame_graph.hpp"
 #include "vulkan/images/image.hpp"
 #include "vulkan/images/sampler.hpp"
 #include "vulkan/memory/buffer.hpp"
\ No newline at end of file
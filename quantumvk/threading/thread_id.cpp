@@ -17,6 +17,11 @@ unsigned GetCurrentThreadIndex()
 	return ret;
 }
 
+bool IsThreadIndexRegistered()
+{
+	return thread_id_to_index != ~0u;
+}
+
 void register_thread_index(unsigned index)
 {
 	thread_id_to_index = index;
@@ -5,5 +5,6 @@
 namespace Vulkan
 {
 	unsigned GetCurrentThreadIndex();
+	bool IsThreadIndexRegistered();
 	void register_thread_index(unsigned thread_index);
 }
\ No newline at end of file
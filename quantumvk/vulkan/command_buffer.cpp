@@ -1,7 +1,10 @@
 #include "command_buffer.hpp"
 #include "device.hpp"
+#include "quantumvk/threading/thread_group.hpp"
+#include "quantumvk/utils/hashmap.hpp"
 
 #include "images/format.hpp"
+#include <algorithm>
 #include <cstring>
 
 namespace Vulkan
@@ -34,6 +37,7 @@ namespace Vulkan
 
 	void CommandBuffer::FillBuffer(const Buffer& dst, uint32_t value, VkDeviceSize offset, VkDeviceSize size)
 	{
+		FlushBarriers();
 		table.vkCmdFillBuffer(cmd, dst.GetBuffer(), offset, size, value);
 	}
 
@@ -43,6 +47,7 @@ namespace Vulkan
 		const VkBufferCopy region = {
 			src_offset, dst_offset, size,
 		};
+		FlushBarriers();
 		table.vkCmdCopyBuffer(cmd, src.GetBuffer(), dst.GetBuffer(), 1, &region);
 	}
 
@@ -54,6 +59,7 @@ namespace Vulkan
 
 	void CommandBuffer::CopyBuffer(const Buffer& dst, const Buffer& src, const VkBufferCopy* copies, size_t count)
 	{
+		FlushBarriers();
 		table.vkCmdCopyBuffer(cmd, src.GetBuffer(), dst.GetBuffer(), count, copies);
 	}
 
@@ -69,6 +75,7 @@ namespace Vulkan
 		region.srcSubresource = src_subresource;
 		region.dstSubresource = dst_subresource;
 
+		FlushBarriers();
 		table.vkCmdCopyImage(cmd, src.GetImage(), src.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL),
 			dst.GetImage(), dst.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL),
 			1, &region);
@@ -103,6 +110,7 @@ namespace Vulkan
 			VK_ASSERT(region.srcSubresource.aspectMask == region.dstSubresource.aspectMask);
 		}
 
+		FlushBarriers();
 		table.vkCmdCopyImage(cmd, src.GetImage(), src.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL),
 			dst.GetImage(), dst.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL),
 			levels, regions);
@@ -111,6 +119,7 @@ namespace Vulkan
 	void CommandBuffer::CopyBufferToImage(const Image& image, const Buffer& buffer, uint32_t num_blits,
 		const VkBufferImageCopy* blits)
 	{
+		FlushBarriers();
 		table.vkCmdCopyBufferToImage(cmd, buffer.GetBuffer(),
 			image.GetImage(), image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL), num_blits, blits);
 	}
@@ -118,6 +127,7 @@ namespace Vulkan
 	void CommandBuffer::CopyImageToBuffer(const Buffer& buffer, const Image& image, uint32_t num_blits,
 		const VkBufferImageCopy* blits)
 	{
+		FlushBarriers();
 		table.vkCmdCopyImageToBuffer(cmd, image.GetImage(), image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL),
 			buffer.GetBuffer(), num_blits, blits);
 	}
@@ -130,6 +140,7 @@ namespace Vulkan
 			row_length, slice_height,
 			subresource, offset, extent,
 		};
+		FlushBarriers();
 		table.vkCmdCopyBufferToImage(cmd, src.GetBuffer(), image.GetImage(), image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL),
 			1, &region);
 	}
@@ -143,6 +154,7 @@ namespace Vulkan
 			row_length, slice_height,
 			subresource, offset, extent,
 		};
+		FlushBarriers();
 		table.vkCmdCopyImageToBuffer(cmd, image.GetImage(), image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL),
 			buffer.GetBuffer(), 1, &region);
 	}
@@ -165,6 +177,8 @@ namespace Vulkan
 		range.baseMipLevel = 0;
 		range.levelCount = image.GetCreateInfo().levels;
 		range.layerCount = image.GetCreateInfo().layers;
+
+		FlushBarriers();
 		if (aspect & (VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT))
 		{
 			table.vkCmdClearDepthStencilImage(cmd, image.GetImage(), image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL),
@@ -182,6 +196,7 @@ namespace Vulkan
 	{
 		VK_ASSERT(framebuffer);
 		VK_ASSERT(actual_render_pass);
+		VK_ASSERT(!deferred.active);
 		VkClearAttachment att = {};
 		att.clearValue = value;
 		att.colorAttachment = attachment;
@@ -193,6 +208,7 @@ namespace Vulkan
 	{
 		VK_ASSERT(framebuffer);
 		VK_ASSERT(actual_render_pass);
+		VK_ASSERT(!deferred.active);
 		table.vkCmdClearAttachments(cmd, num_attachments, attachments, 1, &rect);
 	}
 
@@ -213,13 +229,14 @@ namespace Vulkan
 	{
 		VK_ASSERT(actual_render_pass);
 		VK_ASSERT(framebuffer);
+		VK_ASSERT(!deferred.active);
 		VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
 		barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 		barrier.dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
 		table.vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_DEPENDENCY_BY_REGION_BIT, 1, &barrier, 0, nullptr, 0, nullptr);
 	}
 
-	static inline void fixup_src_stage(VkPipelineStageFlags& src_stages, bool fixup)
+	static inline void fixup_src_stage(VkPipelineStageFlags2KHR& src_stages, bool fixup)
 	{
 		// ALL_GRAPHICS_BIT waits for vertex as well which causes performance issues on some drivers.
 		// It shouldn't matter, but hey.
@@ -227,22 +244,283 @@ namespace Vulkan
 		// We aren't using vertex with side-effects on relevant hardware so dropping VERTEX_SHADER_BIT is fine.
 		if ((src_stages & VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT) != 0 && fixup)
 		{
-			src_stages &= ~VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT;
+			src_stages &= ~VkPipelineStageFlags2KHR(VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT);
 			src_stages |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
 				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
 				VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
 		}
 	}
 
-	void CommandBuffer::Barrier(VkPipelineStageFlags src_stages, VkAccessFlags src_access, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access)
+	static inline bool ranges_overlap(const VkImageSubresourceRange& a, const VkImageSubresourceRange& b)
+	{
+		// VK_REMAINING_* counts reach past the end of any image
+		const auto overlap = [](uint32_t a_base, uint32_t a_count, uint32_t b_base, uint32_t b_count) {
+			return uint64_t(a_base) < uint64_t(b_base) + b_count && uint64_t(b_base) < uint64_t(a_base) + a_count;
+		};
+
+		return (a.aspectMask & b.aspectMask) != 0 &&
+			overlap(a.baseMipLevel, a.levelCount, b.baseMipLevel, b.levelCount) &&
+			overlap(a.baseArrayLayer, a.layerCount, b.baseArrayLayer, b.layerCount);
+	}
+
+	// Synchronization2 stages and accesses are supersets of the legacy ones with the same bit values, the new bits are all above 32 bits.
+	// Those are folded into the legacy bits containing them.
+	static inline VkPipelineStageFlags legacy_stages(VkPipelineStageFlags2KHR stages, VkPipelineStageFlags none)
+	{
+		if (stages & (VK_PIPELINE_STAGE_2_COPY_BIT_KHR | VK_PIPELINE_STAGE_2_RESOLVE_BIT_KHR | VK_PIPELINE_STAGE_2_BLIT_BIT_KHR | VK_PIPELINE_STAGE_2_CLEAR_BIT_KHR))
+			stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+		if (stages & (VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT_KHR | VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR))
+			stages |= VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+		if (stages & VK_PIPELINE_STAGE_2_PRE_RASTERIZATION_SHADERS_BIT_KHR)
+			stages |= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_TESSELLATION_CONTROL_SHADER_BIT |
+				VK_PIPELINE_STAGE_TESSELLATION_EVALUATION_SHADER_BIT | VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT;
+
+		// Legacy barriers can't have empty stage masks
+		VkPipelineStageFlags legacy = VkPipelineStageFlags(stages & 0xffffffffu);
+		return legacy ? legacy : none;
+	}
+
+	static inline VkAccessFlags legacy_access(VkAccessFlags2KHR access)
+	{
+		if (access & (VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR | VK_ACCESS_2_SHADER_STORAGE_READ_BIT_KHR))
+			access |= VK_ACCESS_SHADER_READ_BIT;
+		if (access & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT_KHR)
+			access |= VK_ACCESS_SHADER_WRITE_BIT;
+		return VkAccessFlags(access & 0xffffffffu);
+	}
+
+	// A dependency folded into the arguments of vkCmdPipelineBarrier or vkCmdWaitEvents
+	struct LegacyDependency
+	{
+		VkPipelineStageFlags2KHR src_stages = 0;
+		VkPipelineStageFlags2KHR dst_stages = 0;
+		VkMemoryBarrier global = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+		Util::SmallVector<VkBufferMemoryBarrier> buffers;
+		Util::SmallVector<VkImageMemoryBarrier> images;
+
+		void Add(const VkDependencyInfoKHR& dependency)
+		{
+			for (uint32_t i = 0; i < dependency.memoryBarrierCount; i++)
+			{
+				auto& barrier = dependency.pMemoryBarriers[i];
+				src_stages |= barrier.srcStageMask;
+				dst_stages |= barrier.dstStageMask;
+				global.srcAccessMask |= legacy_access(barrier.srcAccessMask);
+				global.dstAccessMask |= legacy_access(barrier.dstAccessMask);
+			}
+
+			for (uint32_t i = 0; i < dependency.bufferMemoryBarrierCount; i++)
+			{
+				auto& barrier = dependency.pBufferMemoryBarriers[i];
+				src_stages |= barrier.srcStageMask;
+				dst_stages |= barrier.dstStageMask;
+
+				VkBufferMemoryBarrier legacy = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+				legacy.srcAccessMask = legacy_access(barrier.srcAccessMask);
+				legacy.dstAccessMask = legacy_access(barrier.dstAccessMask);
+				legacy.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+				legacy.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+				legacy.buffer = barrier.buffer;
+				legacy.offset = barrier.offset;
+				legacy.size = barrier.size;
+				buffers.push_back(legacy);
+			}
+
+			for (uint32_t i = 0; i < dependency.imageMemoryBarrierCount; i++)
+			{
+				auto& barrier = dependency.pImageMemoryBarriers[i];
+				src_stages |= barrier.srcStageMask;
+				dst_stages |= barrier.dstStageMask;
+
+				VkImageMemoryBarrier legacy = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+				legacy.srcAccessMask = legacy_access(barrier.srcAccessMask);
+				legacy.dstAccessMask = legacy_access(barrier.dstAccessMask);
+				legacy.oldLayout = barrier.oldLayout;
+				legacy.newLayout = barrier.newLayout;
+				legacy.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+				legacy.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+				legacy.image = barrier.image;
+				legacy.subresourceRange = barrier.subresourceRange;
+				images.push_back(legacy);
+			}
+		}
+
+		VkPipelineStageFlags GetSrcStages() const
+		{
+			return legacy_stages(src_stages, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+		}
+
+		VkPipelineStageFlags GetDstStages() const
+		{
+			return legacy_stages(dst_stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+		}
+
+		uint32_t GetGlobalCount() const
+		{
+			return (global.srcAccessMask || global.dstAccessMask) ? 1 : 0;
+		}
+	};
+
+	void CommandBuffer::FlushOverlappingBarriers(VkImage image, const VkImageSubresourceRange& range)
+	{
+		for (auto& pending : pending_barriers.images)
+		{
+			if (pending.image == image && ranges_overlap(pending.subresourceRange, range))
+			{
+				FlushBarriers();
+				return;
+			}
+		}
+	}
+
+	void CommandBuffer::AddBarriers(VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages,
+		uint32_t barriers, const VkMemoryBarrier* globals,
+		uint32_t buffer_barriers, const VkBufferMemoryBarrier* buffers,
+		uint32_t image_barriers, const VkImageMemoryBarrier* images)
 	{
 		VK_ASSERT(!actual_render_pass);
 		VK_ASSERT(!framebuffer);
+
+		// Layout transitions within one vkCmdPipelineBarrier aren't ordered, so a second transition of a subresource has to go into the next one.
+		for (uint32_t i = 0; i < image_barriers; i++)
+			FlushOverlappingBarriers(images[i].image, images[i].subresourceRange);
+
+		VkPipelineStageFlags2KHR src = src_stages;
+		fixup_src_stage(src, device->GetWorkarounds().optimize_all_graphics_barrier);
+
+		// The stages of a legacy barrier apply to all of its barriers, buffer and image barriers carry them themselves
+		if (barriers || (!buffer_barriers && !image_barriers))
+		{
+			pending_barriers.src_stages |= src;
+			pending_barriers.dst_stages |= dst_stages;
+		}
+
+		for (uint32_t i = 0; i < barriers; i++)
+		{
+			pending_barriers.src_access |= globals[i].srcAccessMask;
+			pending_barriers.dst_access |= globals[i].dstAccessMask;
+		}
+
+		for (uint32_t i = 0; i < buffer_barriers; i++)
+		{
+			VkBufferMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2_KHR };
+			barrier.srcStageMask = src;
+			barrier.srcAccessMask = buffers[i].srcAccessMask;
+			barrier.dstStageMask = dst_stages;
+			barrier.dstAccessMask = buffers[i].dstAccessMask;
+			barrier.srcQueueFamilyIndex = buffers[i].srcQueueFamilyIndex;
+			barrier.dstQueueFamilyIndex = buffers[i].dstQueueFamilyIndex;
+			barrier.buffer = buffers[i].buffer;
+			barrier.offset = buffers[i].offset;
+			barrier.size = buffers[i].size;
+			pending_barriers.buffers.push_back(barrier);
+		}
+
+		for (uint32_t i = 0; i < image_barriers; i++)
+		{
+			VkImageMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR };
+			barrier.srcStageMask = src;
+			barrier.srcAccessMask = images[i].srcAccessMask;
+			barrier.dstStageMask = dst_stages;
+			barrier.dstAccessMask = images[i].dstAccessMask;
+			barrier.oldLayout = images[i].oldLayout;
+			barrier.newLayout = images[i].newLayout;
+			barrier.srcQueueFamilyIndex = images[i].srcQueueFamilyIndex;
+			barrier.dstQueueFamilyIndex = images[i].dstQueueFamilyIndex;
+			barrier.image = images[i].image;
+			barrier.subresourceRange = images[i].subresourceRange;
+			pending_barriers.images.push_back(barrier);
+		}
+
+		barrier_stats.requested++;
+	}
+
+	void CommandBuffer::Barrier(const VkDependencyInfoKHR& dependency)
+	{
+		VK_ASSERT(!actual_render_pass);
+		VK_ASSERT(!framebuffer);
+
+		for (uint32_t i = 0; i < dependency.imageMemoryBarrierCount; i++)
+			FlushOverlappingBarriers(dependency.pImageMemoryBarriers[i].image, dependency.pImageMemoryBarriers[i].subresourceRange);
+
+		bool fixup = device->GetWorkarounds().optimize_all_graphics_barrier;
+
+		for (uint32_t i = 0; i < dependency.memoryBarrierCount; i++)
+		{
+			auto& barrier = dependency.pMemoryBarriers[i];
+			VkPipelineStageFlags2KHR src = barrier.srcStageMask;
+			fixup_src_stage(src, fixup);
+			pending_barriers.src_stages |= src;
+			pending_barriers.dst_stages |= barrier.dstStageMask;
+			pending_barriers.src_access |= barrier.srcAccessMask;
+			pending_barriers.dst_access |= barrier.dstAccessMask;
+		}
+
+		for (uint32_t i = 0; i < dependency.bufferMemoryBarrierCount; i++)
+		{
+			pending_barriers.buffers.push_back(dependency.pBufferMemoryBarriers[i]);
+			pending_barriers.buffers.back().pNext = nullptr;
+			fixup_src_stage(pending_barriers.buffers.back().srcStageMask, fixup);
+		}
+
+		for (uint32_t i = 0; i < dependency.imageMemoryBarrierCount; i++)
+		{
+			pending_barriers.images.push_back(dependency.pImageMemoryBarriers[i]);
+			pending_barriers.images.back().pNext = nullptr;
+			fixup_src_stage(pending_barriers.images.back().srcStageMask, fixup);
+		}
+
+		barrier_stats.requested++;
+	}
+
+	void CommandBuffer::FlushBarriers()
+	{
+		if (!pending_barriers.src_stages && !pending_barriers.dst_stages && pending_barriers.buffers.empty() && pending_barriers.images.empty())
+			return;
+
+		// An execution dependency alone doesn't need access masks, buffer and image barriers only wait for their own stages
+		VkMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR };
+		barrier.srcStageMask = pending_barriers.src_stages;
+		barrier.srcAccessMask = pending_barriers.src_access;
+		barrier.dstStageMask = pending_barriers.dst_stages;
+		barrier.dstAccessMask = pending_barriers.dst_access;
+
+		VkDependencyInfoKHR dependency = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
+		dependency.memoryBarrierCount = (barrier.srcStageMask || barrier.dstStageMask) ? 1 : 0;
+		dependency.pMemoryBarriers = &barrier;
+		dependency.bufferMemoryBarrierCount = uint32_t(pending_barriers.buffers.size());
+		dependency.pBufferMemoryBarriers = pending_barriers.buffers.data();
+		dependency.imageMemoryBarrierCount = uint32_t(pending_barriers.images.size());
+		dependency.pImageMemoryBarriers = pending_barriers.images.data();
+
+		if (device->GetDeviceExtensions().synchronization2_features.synchronization2)
+			table.vkCmdPipelineBarrier2KHR(cmd, &dependency);
+		else
+		{
+			LegacyDependency legacy;
+			legacy.Add(dependency);
+			table.vkCmdPipelineBarrier(cmd, legacy.GetSrcStages(), legacy.GetDstStages(), 0,
+				legacy.GetGlobalCount(), &legacy.global,
+				uint32_t(legacy.buffers.size()), legacy.buffers.data(),
+				uint32_t(legacy.images.size()), legacy.images.data());
+		}
+
+		pending_barriers.src_stages = 0;
+		pending_barriers.dst_stages = 0;
+		pending_barriers.src_access = 0;
+		pending_barriers.dst_access = 0;
+		pending_barriers.buffers.clear();
+		pending_barriers.images.clear();
+
+		barrier_stats.emitted++;
+	}
+
+	void CommandBuffer::Barrier(VkPipelineStageFlags src_stages, VkAccessFlags src_access, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access)
+	{
 		VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
 		barrier.srcAccessMask = src_access;
 		barrier.dstAccessMask = dst_access;
-		fixup_src_stage(src_stages, device->GetWorkarounds().optimize_all_graphics_barrier);
-		table.vkCmdPipelineBarrier(cmd, src_stages, dst_stages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+		AddBarriers(src_stages, dst_stages, 1, &barrier, 0, nullptr, 0, nullptr);
 	}
 
 	void CommandBuffer::Barrier(VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages, 
@@ -250,33 +528,27 @@ namespace Vulkan
 		uint32_t buffer_barriers, const VkBufferMemoryBarrier* buffers,
 		uint32_t image_barriers, const VkImageMemoryBarrier* images)
 	{
-		VK_ASSERT(!actual_render_pass);
-		VK_ASSERT(!framebuffer);
-		fixup_src_stage(src_stages, device->GetWorkarounds().optimize_all_graphics_barrier);
-		table.vkCmdPipelineBarrier(cmd, src_stages, dst_stages, 0, barriers, globals, buffer_barriers, buffers, image_barriers, images);
+		AddBarriers(src_stages, dst_stages, barriers, globals, buffer_barriers, buffers, image_barriers, images);
 	}
 
 	void CommandBuffer::BufferBarrier(const Buffer& buffer, VkPipelineStageFlags src_stages, VkAccessFlags src_access, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access)
 	{
-		VK_ASSERT(!actual_render_pass);
-		VK_ASSERT(!framebuffer);
 		VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
 		barrier.srcAccessMask = src_access;
 		barrier.dstAccessMask = dst_access;
 		barrier.buffer = buffer.GetBuffer();
 		barrier.offset = 0;
 		barrier.size = buffer.GetCreateInfo().size;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 
-		fixup_src_stage(src_stages, device->GetWorkarounds().optimize_all_graphics_barrier);
-		table.vkCmdPipelineBarrier(cmd, src_stages, dst_stages, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		AddBarriers(src_stages, dst_stages, 0, nullptr, 1, &barrier, 0, nullptr);
 	}
 
 	void CommandBuffer::ImageBarrier(const Image& image, VkImageLayout old_layout, VkImageLayout new_layout,
 		VkPipelineStageFlags src_stages, VkAccessFlags src_access,
 		VkPipelineStageFlags dst_stages, VkAccessFlags dst_access)
 	{
-		VK_ASSERT(!actual_render_pass);
-		VK_ASSERT(!framebuffer);
 		VK_ASSERT(image.GetCreateInfo().domain != ImageDomain::Transient);
 
 		VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
@@ -291,8 +563,83 @@ namespace Vulkan
 		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 
-		fixup_src_stage(src_stages, device->GetWorkarounds().optimize_all_graphics_barrier);
-		table.vkCmdPipelineBarrier(cmd, src_stages, dst_stages, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		AddBarriers(src_stages, dst_stages, 0, nullptr, 0, nullptr, 1, &barrier);
+	}
+
+	void CommandBuffer::TrackImage(const Image& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		tracker.TrackImage(image, layout, stages, access);
+	}
+
+	void CommandBuffer::TrackBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		tracker.TrackBuffer(buffer, stages, access);
+	}
+
+	void CommandBuffer::UseImage(const Image& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access, const VkImageSubresourceRange* range)
+	{
+		if (!tracker.IsTracked(image))
+		{
+			QM_LOG_ERROR("Image must be tracked with TrackImage() before its barriers can be inferred.\n");
+			return;
+		}
+
+		const VkImageSubresourceRange whole = { 0, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+		InferredBarriers barriers;
+		tracker.UseImage(image, range ? *range : whole, layout, stages, access, barriers);
+
+		if (!barriers.Empty())
+		{
+			AddBarriers(barriers.src_stages, barriers.dst_stages, 0, nullptr, 0, nullptr,
+				uint32_t(barriers.images.size()), barriers.images.data());
+		}
+	}
+
+	void CommandBuffer::UseBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		InferredBarriers barriers;
+		tracker.UseBuffer(buffer, stages, access, barriers);
+
+		if (!barriers.Empty())
+		{
+			AddBarriers(barriers.src_stages, barriers.dst_stages, 0, nullptr,
+				uint32_t(barriers.buffers.size()), barriers.buffers.data(), 0, nullptr);
+		}
+	}
+
+	void CommandBuffer::UseForSampling(const Image& image, VkPipelineStageFlags stages, const VkImageSubresourceRange* range)
+	{
+		UseImage(image, image.GetLayout(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL), stages, VK_ACCESS_SHADER_READ_BIT, range);
+	}
+
+	void CommandBuffer::UseAsStorage(const Image& image, VkPipelineStageFlags stages, bool write, const VkImageSubresourceRange* range)
+	{
+		UseImage(image, VK_IMAGE_LAYOUT_GENERAL, stages, VK_ACCESS_SHADER_READ_BIT | (write ? VK_ACCESS_SHADER_WRITE_BIT : 0), range);
+	}
+
+	void CommandBuffer::UseAsStorage(const Buffer& buffer, VkPipelineStageFlags stages, bool write)
+	{
+		UseBuffer(buffer, stages, VK_ACCESS_SHADER_READ_BIT | (write ? VK_ACCESS_SHADER_WRITE_BIT : 0));
+	}
+
+	void CommandBuffer::UseAsTransferSrc(const Image& image, const VkImageSubresourceRange* range)
+	{
+		UseImage(image, image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, range);
+	}
+
+	void CommandBuffer::UseAsTransferSrc(const Buffer& buffer)
+	{
+		UseBuffer(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	}
+
+	void CommandBuffer::UseAsTransferDst(const Image& image, const VkImageSubresourceRange* range)
+	{
+		UseImage(image, image.GetLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, range);
+	}
+
+	void CommandBuffer::UseAsTransferDst(const Buffer& buffer)
+	{
+		UseBuffer(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
 	}
 
 	void CommandBuffer::WaitEvents(uint32_t num_events, const VkEvent* events,
@@ -313,6 +660,7 @@ namespace Vulkan
 		}
 		else
 		{
+			FlushBarriers();
 			table.vkCmdWaitEvents(cmd, num_events, events, src_stages, dst_stages,
 				barriers, globals, buffer_barriers, buffers, image_barriers, images);
 		}
@@ -322,13 +670,67 @@ namespace Vulkan
 	{
 		VK_ASSERT(!framebuffer);
 		VK_ASSERT(!actual_render_pass);
+		VK_ASSERT(!deferred.active);
 		auto event = device->RequestPipelineEvent();
 		if (!device->GetWorkarounds().emulate_event_as_pipeline_barrier)
+		{
+			FlushBarriers();
 			table.vkCmdSetEvent(cmd, event->get_event(), stages);
+		}
 		event->set_stages(stages);
 		return event;
 	}
 
+	PipelineEvent CommandBuffer::SignalEvent(const VkDependencyInfoKHR& dependency)
+	{
+		VK_ASSERT(!framebuffer);
+		VK_ASSERT(!actual_render_pass);
+		VK_ASSERT(!deferred.active);
+
+		LegacyDependency legacy;
+		legacy.Add(dependency);
+
+		auto event = device->RequestPipelineEvent();
+		if (!device->GetWorkarounds().emulate_event_as_pipeline_barrier)
+		{
+			FlushBarriers();
+			if (device->GetDeviceExtensions().synchronization2_features.synchronization2)
+				table.vkCmdSetEvent2KHR(cmd, event->get_event(), &dependency);
+			else
+				table.vkCmdSetEvent(cmd, event->get_event(), legacy.GetSrcStages());
+		}
+		event->set_stages(legacy.GetSrcStages());
+		return event;
+	}
+
+	void CommandBuffer::WaitEvents(uint32_t num_events, const VkEvent* events, const VkDependencyInfoKHR* dependencies)
+	{
+		VK_ASSERT(!framebuffer);
+		VK_ASSERT(!actual_render_pass);
+
+		if (device->GetWorkarounds().emulate_event_as_pipeline_barrier)
+		{
+			for (uint32_t i = 0; i < num_events; i++)
+				Barrier(dependencies[i]);
+			return;
+		}
+
+		FlushBarriers();
+		if (device->GetDeviceExtensions().synchronization2_features.synchronization2)
+			table.vkCmdWaitEvents2KHR(cmd, num_events, events, dependencies);
+		else
+		{
+			LegacyDependency legacy;
+			for (uint32_t i = 0; i < num_events; i++)
+				legacy.Add(dependencies[i]);
+
+			table.vkCmdWaitEvents(cmd, num_events, events, legacy.GetSrcStages(), legacy.GetDstStages(),
+				legacy.GetGlobalCount(), &legacy.global,
+				uint32_t(legacy.buffers.size()), legacy.buffers.data(),
+				uint32_t(legacy.images.size()), legacy.images.data());
+		}
+	}
+
 	void CommandBuffer::BlitImage(const Image& dst, const Image& src,
 		const VkOffset3D& dst_offset, const VkOffset3D& dst_extent, const VkOffset3D& src_offset, const VkOffset3D& src_extent,
 		uint32_t dst_level, uint32_t src_level, uint32_t dst_base_layer, uint32_t src_base_layer,
@@ -338,6 +740,8 @@ namespace Vulkan
 			return { a.x + b.x, a.y + b.y, a.z + b.z };
 		};
 
+		FlushBarriers();
+
 #if 0
 		VkImageBlit blit{};
 
@@ -475,6 +879,8 @@ namespace Vulkan
 		pipeline_state.program = nullptr;
 		memset(&index_state, 0, sizeof(index_state));
 		memset(vbo.buffers, 0, sizeof(vbo.buffers));
+		// Descriptor sets are bound per bind point, and secondaries leave the primary's state undefined
+		InvalidateBoundState();
 	}
 
 	void CommandBuffer::BeginCompute()
@@ -530,19 +936,92 @@ namespace Vulkan
 		VK_ASSERT(!is_secondary);
 
 		auto secondary_cmd = device->RequestSecondaryCommandBufferForThread(thread_index_, framebuffer, subpass_);
-		secondary_cmd->BeginGraphics();
+		InheritRenderPass(*secondary_cmd, subpass_);
+		return secondary_cmd;
+	}
 
-		secondary_cmd->framebuffer = framebuffer;
-		secondary_cmd->pipeline_state.compatible_render_pass = pipeline_state.compatible_render_pass;
-		secondary_cmd->actual_render_pass = actual_render_pass;
-		memcpy(secondary_cmd->framebuffer_attachments, framebuffer_attachments, sizeof(framebuffer_attachments));
+	void CommandBuffer::InheritRenderPass(CommandBuffer& secondary, uint32_t subpass_) const
+	{
+		secondary.BeginGraphics();
 
-		secondary_cmd->pipeline_state.subpass_index = subpass_;
-		secondary_cmd->viewport = viewport;
-		secondary_cmd->scissor = scissor;
-		secondary_cmd->current_contents = VK_SUBPASS_CONTENTS_INLINE;
+		secondary.framebuffer = framebuffer;
+		secondary.pipeline_state.compatible_render_pass = pipeline_state.compatible_render_pass;
+		secondary.actual_render_pass = actual_render_pass;
+		memcpy(secondary.framebuffer_attachments, framebuffer_attachments, sizeof(framebuffer_attachments));
 
-		return secondary_cmd;
+		secondary.pipeline_state.subpass_index = subpass_;
+		secondary.viewport = viewport;
+		secondary.scissor = scissor;
+		secondary.current_contents = VK_SUBPASS_CONTENTS_INLINE;
+	}
+
+	void CommandBuffer::RecordRenderPassParallel(const RenderPassInfo& info, uint32_t draw_count, const ParallelDrawCallback& record,
+		Quantum::ThreadGroup* group, uint32_t first_thread_index, uint32_t min_chunk_draws)
+	{
+		VK_ASSERT(!is_secondary);
+		VK_ASSERT(min_chunk_draws != 0);
+
+		// Every chunk gets a worker and a thread index of its own, starting at first_thread_index
+		unsigned num_chunks = 0;
+		if (group && first_thread_index < device->GetNumThreadIndices())
+		{
+			num_chunks = std::min(group->get_num_threads(), device->GetNumThreadIndices() - first_thread_index);
+			num_chunks = std::min(num_chunks, (draw_count + min_chunk_draws - 1) / min_chunk_draws);
+		}
+
+		unsigned num_subpasses = std::max(info.num_subpasses, 1u);
+
+		if (num_chunks <= 1)
+		{
+			BeginRenderPass(info);
+			for (unsigned subpass = 0; subpass < num_subpasses; subpass++)
+			{
+				if (subpass != 0)
+					NextSubpass();
+				record(*this, 0, draw_count);
+			}
+			EndRenderPass();
+			return;
+		}
+
+		// The secondaries' pools must not be the one this command buffer records into
+		VK_ASSERT(thread_index < first_thread_index || thread_index >= first_thread_index + num_chunks);
+
+		BeginRenderPass(info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+		CommandBufferSavedState state;
+		SaveState(COMMAND_BUFFER_SAVED_VIEWPORT_BIT | COMMAND_BUFFER_SAVED_SCISSOR_BIT | COMMAND_BUFFER_SAVED_RENDER_STATE_BIT, state);
+
+		std::vector<CommandBufferHandle> secondaries(num_chunks);
+		for (unsigned subpass = 0; subpass < num_subpasses; subpass++)
+		{
+			if (subpass != 0)
+				NextSubpass(VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+			device->RequestSecondaryCommandBuffers(first_thread_index, num_chunks, framebuffer, subpass, secondaries.data());
+
+			auto task = group->create_task();
+			for (unsigned chunk = 0; chunk < num_chunks; chunk++)
+			{
+				CommandBuffer* secondary = secondaries[chunk].Get();
+				InheritRenderPass(*secondary, subpass);
+				secondary->RestoreState(state);
+
+				uint32_t first_draw = uint32_t(uint64_t(draw_count) * chunk / num_chunks);
+				uint32_t end_draw = uint32_t(uint64_t(draw_count) * (chunk + 1) / num_chunks);
+				group->enqueue_task(task, [secondary, first_draw, end_draw, &record]() {
+					record(*secondary, first_draw, end_draw - first_draw);
+				});
+			}
+			group->submit(task);
+			task->wait();
+
+			device->SubmitSecondaries(*this, num_chunks, secondaries.data());
+			for (auto& secondary : secondaries)
+				secondary.Reset();
+		}
+
+		EndRenderPass();
 	}
 
 	void CommandBuffer::SubmitSecondary(Util::IntrusivePtr<CommandBuffer> secondary)
@@ -562,6 +1041,7 @@ namespace Vulkan
 		VK_ASSERT(actual_render_pass);
 		pipeline_state.subpass_index++;
 		VK_ASSERT(pipeline_state.subpass_index < actual_render_pass->GetNumSubpasses());
+		VK_ASSERT(!deferred.active);
 		table.vkCmdNextSubpass(cmd, contents);
 		current_contents = contents;
 		BeginGraphics();
@@ -616,6 +1096,7 @@ namespace Vulkan
 		begin_info.clearValueCount = num_clear_values;
 		begin_info.pClearValues = clear_values;
 
+		FlushBarriers();
 		table.vkCmdBeginRenderPass(cmd, &begin_info, contents);
 
 		current_contents = contents;
@@ -627,6 +1108,7 @@ namespace Vulkan
 		VK_ASSERT(framebuffer);
 		VK_ASSERT(actual_render_pass);
 		VK_ASSERT(pipeline_state.compatible_render_pass);
+		VK_ASSERT(!deferred.active);
 
 		table.vkCmdEndRenderPass(cmd);
 
@@ -1114,14 +1596,7 @@ namespace Vulkan
 		FlushDescriptorSets();
 
 		if (GetAndClear(COMMAND_BUFFER_DIRTY_PUSH_CONSTANTS_BIT))
-		{
-			auto& range = current_layout->GetUniformManager().GetPushConstantRange();
-			if (range.stageFlags != 0)
-			{
-				VK_ASSERT(range.offset == 0);
-				table.vkCmdPushConstants(cmd, current_uniform_layout, range.stageFlags, 0, range.size, push_constant_data);
-			}
-		}
+			FlushPushConstants();
 
 		return true;
 	}
@@ -1155,14 +1630,7 @@ namespace Vulkan
 		FlushDescriptorSets();
 
 		if (GetAndClear(COMMAND_BUFFER_DIRTY_PUSH_CONSTANTS_BIT))
-		{
-			auto& range = current_layout->GetUniformManager().GetPushConstantRange();
-			if (range.stageFlags != 0)
-			{
-				VK_ASSERT(range.offset == 0);
-				table.vkCmdPushConstants(cmd, current_uniform_layout, range.stageFlags, 0, range.size, push_constant_data);
-			}
-		}
+			FlushPushConstants();
 
 		if (GetAndClear(COMMAND_BUFFER_DIRTY_VIEWPORT_BIT))
 			table.vkCmdSetViewport(cmd, 0, 1, &viewport);
@@ -1187,6 +1655,7 @@ namespace Vulkan
 				VK_ASSERT(vbo.buffers[i] != VK_NULL_HANDLE);
 #endif
 			table.vkCmdBindVertexBuffers(cmd, binding, binding_count, vbo.buffers + binding, vbo.offsets + binding);
+			bind_stats.vertex_buffers_emitted++;
 			});
 		dirty_vbos &= ~update_vbo_mask;
 
@@ -1225,13 +1694,20 @@ namespace Vulkan
 	{
 		//If index buffer is already set to this, return
 		if (index_state.buffer == buffer.GetBuffer() && index_state.offset == offset && index_state.index_type == index_type)
+		{
+			bind_stats.index_buffers_skipped++;
 			return;
+		}
 
 		index_state.buffer = buffer.GetBuffer();
 		index_state.offset = offset;
 		index_state.index_type = index_type;
+		//Deferred draws bind the index buffer they captured when they are replayed
+		if (deferred.active)
+			return;
 		//Bind the index buffer
 		table.vkCmdBindIndexBuffer(cmd, buffer.GetBuffer(), offset, index_type);
+		bind_stats.index_buffers_emitted++;
 	}
 
 	void CommandBuffer::SetVertexBinding(uint32_t binding, VkDeviceSize stride, VkVertexInputRate step_rate)
@@ -1255,6 +1731,8 @@ namespace Vulkan
 		VkBuffer vkbuffer = buffer.GetBuffer();
 		if (vbo.buffers[binding] != vkbuffer || vbo.offsets[binding] != offset)
 			dirty_vbos |= 1u << binding; //Indicate wich bindings in the vbo are now dirty
+		else
+			bind_stats.vertex_buffers_skipped++;
 
 		vbo.buffers[binding] = vkbuffer;
 		vbo.offsets[binding] = offset;
@@ -1320,6 +1798,16 @@ namespace Vulkan
 	void* CommandBuffer::AllocateConstantData(uint32_t set, uint32_t binding, uint32_t array_index, VkDeviceSize size)
 	{
 		VK_ASSERT(size <= VULKAN_MAX_UBO_SIZE);
+		if (transient_rings)
+		{
+			auto data = transient_rings->ubo.Allocate(size);
+			if (data.host)
+			{
+				SetUniformBuffer(set, binding, array_index, transient_rings->ubo.GetBuffer(), data.offset, data.padded_size);
+				return data.host;
+			}
+		}
+
 		auto data = ubo_block.Allocate(size);
 		if (!data.host)
 		{
@@ -1332,6 +1820,16 @@ namespace Vulkan
 
 	void* CommandBuffer::AllocateIndexData(VkDeviceSize size, VkIndexType index_type)
 	{
+		if (transient_rings)
+		{
+			auto data = transient_rings->ibo.Allocate(size);
+			if (data.host)
+			{
+				BindIndexBuffer(transient_rings->ibo.GetBuffer(), data.offset, index_type);
+				return data.host;
+			}
+		}
+
 		auto data = ibo_block.Allocate(size);
 		if (!data.host)
 		{
@@ -1344,6 +1842,17 @@ namespace Vulkan
 
 	void* CommandBuffer::AllocateVertexData(uint32_t binding, VkDeviceSize size)
 	{
+		// A full ring falls back to the block pools
+		if (transient_rings)
+		{
+			auto data = transient_rings->vbo.Allocate(size);
+			if (data.host)
+			{
+				BindVertexBuffer(binding, transient_rings->vbo.GetBuffer(), data.offset);
+				return data.host;
+			}
+		}
+
 		auto data = vbo_block.Allocate(size);
 		if (!data.host)
 		{
@@ -1418,23 +1927,24 @@ namespace Vulkan
 		VK_ASSERT(current_uniforms->HasDescriptorBinding(set, binding));
 		VK_ASSERT(array_index < current_uniforms->GetDescriptorBindingArraySize(set, binding));
 
-		auto& b = current_uniforms->GetUniformResource(thread_index, set, binding, array_index);
+		uint32_t slot = GetBindingSlot(set, binding, array_index);
+		auto& b = bindings->infos[slot];
 
-		if (buffer.GetCookie() == b.cookie && b.buffer.range == range)
+		if (buffer.GetCookie() == bindings->cookies[slot] && b.buffer.range == range)
 		{
-			if (b.dynamic_offset != offset)
+			if (bindings->dynamic_offsets[slot] != offset)
 			{
 				//If just the offset changed, indicate that the dynamic set is dirty
 				dirty_sets_dynamic |= 1u << set;
-				b.dynamic_offset = offset;
+				bindings->dynamic_offsets[slot] = uint32_t(offset);
 			}
 		}
 		else
 		{
 			b.buffer = { buffer.GetBuffer(), 0, range };
-			b.dynamic_offset = offset;
-			b.cookie = buffer.GetCookie();
-			b.secondary_cookie = 0;
+			bindings->dynamic_offsets[slot] = uint32_t(offset);
+			bindings->cookies[slot] = buffer.GetCookie();
+			bindings->secondary_cookies[slot] = 0;
 			//Indicate that a static set is dirty
 			dirty_sets |= 1u << set;
 		}
@@ -1450,15 +1960,16 @@ namespace Vulkan
 		VK_ASSERT(current_uniforms->HasDescriptorBinding(set, binding));
 		VK_ASSERT(array_index < current_uniforms->GetDescriptorBindingArraySize(set, binding));
 
-		auto& b = current_uniforms->GetUniformResource(thread_index, set, binding, array_index);
+		uint32_t slot = GetBindingSlot(set, binding, array_index);
+		auto& b = bindings->infos[slot];
 
-		if (buffer.GetCookie() == b.cookie && b.buffer.offset == offset && b.buffer.range == range)
+		if (buffer.GetCookie() == bindings->cookies[slot] && b.buffer.offset == offset && b.buffer.range == range)
 			return;
 
 		b.buffer = { buffer.GetBuffer(), offset, range };
-		b.dynamic_offset = 0;
-		b.cookie = buffer.GetCookie();
-		b.secondary_cookie = 0;
+		bindings->dynamic_offsets[slot] = 0;
+		bindings->cookies[slot] = buffer.GetCookie();
+		bindings->secondary_cookies[slot] = 0;
 		dirty_sets |= 1u << set;
 	}
 
@@ -1481,16 +1992,15 @@ namespace Vulkan
 		VK_ASSERT(current_uniforms->HasDescriptorBinding(set, binding));
 		VK_ASSERT(array_index < current_uniforms->GetDescriptorBindingArraySize(set, binding));
 
-		auto& b = current_uniforms->GetUniformResource(thread_index, set, binding, array_index);
+		uint32_t slot = GetBindingSlot(set, binding, array_index);
 
-		if (sampler.GetCookie() == b.secondary_cookie)
+		if (sampler.GetCookie() == bindings->secondary_cookies[slot])
 			return;
 
-		b.image.sampler = sampler.GetSampler();
-		b.image.sampler = sampler.GetSampler();
+		bindings->infos[slot].image.sampler = sampler.GetSampler();
 		//Indicate that the set must be updated
 		dirty_sets |= 1u << set;
-		b.secondary_cookie = sampler.GetCookie();
+		bindings->secondary_cookies[slot] = sampler.GetCookie();
 	}
 
 	void CommandBuffer::SetBufferView(uint32_t set, uint32_t binding, uint32_t array_index, const BufferView& view)
@@ -1504,14 +2014,14 @@ namespace Vulkan
 
 		VK_ASSERT(view.GetBuffer().GetCreateInfo().usage & VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT);
 
-		auto& b = current_uniforms->GetUniformResource(thread_index, set, binding, array_index);
+		uint32_t slot = GetBindingSlot(set, binding, array_index);
 
-		if (view.GetCookie() == b.cookie)
+		if (view.GetCookie() == bindings->cookies[slot])
 			return;
 
-		b.buffer_view = view.GetView();
-		b.cookie = view.GetCookie();
-		b.secondary_cookie = 0;
+		bindings->infos[slot].buffer_view = view.GetView();
+		bindings->cookies[slot] = view.GetCookie();
+		bindings->secondary_cookies[slot] = 0;
 		dirty_sets |= 1u << set;
 	}
 
@@ -1531,9 +2041,10 @@ namespace Vulkan
 			VK_ASSERT(view);
 			VK_ASSERT(view->GetImage().GetCreateInfo().usage & VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT);
 
-			auto& b = current_uniforms->GetUniformResource(thread_index, set, start_binding + i, 0);
+			uint32_t slot = GetBindingSlot(set, start_binding + i, 0);
+			auto& b = bindings->infos[slot];
 
-			if (view->GetCookie() == b.cookie && b.image.imageLayout == ref.layout)
+			if (view->GetCookie() == bindings->cookies[slot] && b.image.imageLayout == ref.layout)
 			{
 				continue;
 			}
@@ -1542,7 +2053,7 @@ namespace Vulkan
 			b.image.imageLayout = ref.layout;
 			b.image.imageView = current_uniforms->IsFloatDescriptor(set, start_binding + i) ? view->GetFloatView() : view->GetIntegerView();
 
-			b.cookie = view->GetCookie();
+			bindings->cookies[slot] = view->GetCookie();
 			dirty_sets |= 1u << set;
 		}
 	}
@@ -1560,14 +2071,15 @@ namespace Vulkan
 		VK_ASSERT(current_uniforms->HasDescriptorBinding(set, binding));
 		VK_ASSERT(array_index < current_uniforms->GetDescriptorBindingArraySize(set, binding));
 
-		auto& b = current_uniforms->GetUniformResource(thread_index, set, binding, array_index);
+		uint32_t slot = GetBindingSlot(set, binding, array_index);
+		auto& b = bindings->infos[slot];
 
-		if (cookie == b.cookie && b.image.imageLayout == layout)
+		if (cookie == bindings->cookies[slot] && b.image.imageLayout == layout)
 			return;
 
 		b.image.imageLayout = layout;
 		b.image.imageView = current_uniforms->IsFloatDescriptor(set, binding) ? float_view : integer_view;
-		b.cookie = cookie;
+		bindings->cookies[slot] = cookie;
 		dirty_sets |= 1u << set;
 	}
 
@@ -1651,10 +2163,10 @@ namespace Vulkan
 		Util::ForEachBit(set_layout.uniform_buffer_mask, [&](uint32_t binding) {
 			uint32_t array_size = set_layout.array_size[binding];
 			for (uint32_t i = 0; i < array_size; i++)
-				dynamic_offsets[num_dynamic_offsets++] = current_uniforms->GetUniformResource(thread_index, set, binding, 0).dynamic_offset;
+				dynamic_offsets[num_dynamic_offsets++] = bindings->dynamic_offsets[GetBindingSlot(set, binding, i)];
 			});
 
-		table.vkCmdBindDescriptorSets(cmd, actual_render_pass ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE, current_uniform_layout, set, 1, &allocated_sets[set], num_dynamic_offsets, dynamic_offsets.Data());
+		BindDescriptorSet(set, allocated_sets[set], num_dynamic_offsets, dynamic_offsets.Data());
 
 		device->FreeHeapArray(dynamic_offsets);
 	}
@@ -1690,19 +2202,81 @@ namespace Vulkan
 		Util::ForEachBit(set_layout.uniform_buffer_mask, [&](uint32_t binding) {
 			uint32_t array_size = set_layout.array_size[binding];
 			for (uint32_t i = 0; i < array_size; i++)
-				dynamic_offsets[num_dynamic_offsets++] = current_uniforms->GetUniformResource(thread_index, set, binding, i).dynamic_offset;
+				dynamic_offsets[num_dynamic_offsets++] = bindings->dynamic_offsets[GetBindingSlot(set, binding, i)];
 			});
 
 		// Gets the descriptor set (updates if the descriptor set has been changed)
-		VkDescriptorSet desc_set = current_uniforms->FlushDescriptorSet(thread_index, set);
+		VkDescriptorSet desc_set = current_uniforms->FlushDescriptorSet(thread_index, set, *bindings);
 
-		table.vkCmdBindDescriptorSets(cmd, actual_render_pass ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE, current_uniform_layout, set, 1, &desc_set, num_dynamic_offsets, dynamic_offsets.Data());
+		BindDescriptorSet(set, desc_set, num_dynamic_offsets, dynamic_offsets.Data());
 
 		device->FreeHeapArray(dynamic_offsets);
 
 		allocated_sets[set] = desc_set;
 	}
 
+	void CommandBuffer::BindDescriptorSet(uint32_t set, VkDescriptorSet desc_set, uint32_t num_dynamic_offsets, const uint32_t* dynamic_offsets)
+	{
+		// A set bound with the same pipeline layout stays valid, a set with too many offsets to remember is always bound
+		auto& bound = bound_sets[set];
+		if (bound.set == desc_set && bound.layout == current_uniform_layout && bound.num_dynamic_offsets == num_dynamic_offsets &&
+			(num_dynamic_offsets == 0 || memcmp(bound.dynamic_offsets, dynamic_offsets, num_dynamic_offsets * sizeof(uint32_t)) == 0))
+		{
+			bind_stats.descriptor_sets_skipped++;
+			return;
+		}
+
+		table.vkCmdBindDescriptorSets(cmd, actual_render_pass ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE, current_uniform_layout, set, 1, &desc_set, num_dynamic_offsets, dynamic_offsets);
+		bind_stats.descriptor_sets_emitted++;
+
+		// Other sets are only known to survive if they were bound with the same layout, the push constants likewise
+		for (uint32_t i = 0; i < VULKAN_NUM_DESCRIPTOR_SETS; i++)
+			if (i != set && bound_sets[i].layout != current_uniform_layout)
+				bound_sets[i].set = VK_NULL_HANDLE;
+		if (bound_push_constant_layout != current_uniform_layout)
+			bound_push_constant_layout = VK_NULL_HANDLE;
+
+		if (num_dynamic_offsets <= VULKAN_NUM_BINDINGS)
+		{
+			bound.set = desc_set;
+			bound.layout = current_uniform_layout;
+			bound.num_dynamic_offsets = num_dynamic_offsets;
+			if (num_dynamic_offsets)
+				memcpy(bound.dynamic_offsets, dynamic_offsets, num_dynamic_offsets * sizeof(uint32_t));
+		}
+		else
+			bound.set = VK_NULL_HANDLE;
+	}
+
+	void CommandBuffer::FlushPushConstants()
+	{
+		auto& range = current_layout->GetUniformManager().GetPushConstantRange();
+		if (range.stageFlags == 0)
+			return;
+		VK_ASSERT(range.offset == 0);
+
+		if (bound_push_constant_layout == current_uniform_layout && bound_push_constant_size == range.size &&
+			memcmp(bound_push_constant_data, push_constant_data, range.size) == 0)
+		{
+			bind_stats.push_constants_skipped++;
+			return;
+		}
+
+		table.vkCmdPushConstants(cmd, current_uniform_layout, range.stageFlags, 0, range.size, push_constant_data);
+		bind_stats.push_constants_emitted++;
+
+		bound_push_constant_layout = current_uniform_layout;
+		bound_push_constant_size = range.size;
+		memcpy(bound_push_constant_data, push_constant_data, range.size);
+	}
+
+	void CommandBuffer::InvalidateBoundState()
+	{
+		memset(bound_sets, 0, sizeof(bound_sets));
+		bound_push_constant_layout = VK_NULL_HANDLE;
+		bound_push_constant_size = 0;
+	}
+
 	void CommandBuffer::FlushDescriptorSets()
 	{
 		uint32_t set_update = current_uniforms->GetDescriptorSetMask() & dirty_sets;
@@ -1721,7 +2295,9 @@ namespace Vulkan
 	void CommandBuffer::Draw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance)
 	{
 		VK_ASSERT(!is_compute);
-		if (FlushRenderState(true))
+		if (deferred.active)
+			CaptureDraw(false, vertex_count, instance_count, first_vertex, 0, first_instance);
+		else if (FlushRenderState(true))
 		{
 			table.vkCmdDraw(cmd, vertex_count, instance_count, first_vertex, first_instance);
 		}
@@ -1733,7 +2309,9 @@ namespace Vulkan
 	{
 		VK_ASSERT(!is_compute);
 		VK_ASSERT(index_state.buffer != VK_NULL_HANDLE);
-		if (FlushRenderState(true))
+		if (deferred.active)
+			CaptureDraw(true, index_count, instance_count, first_index, vertex_offset, first_instance);
+		else if (FlushRenderState(true))
 		{
 			table.vkCmdDrawIndexed(cmd, index_count, instance_count, first_index, vertex_offset, first_instance);
 		}
@@ -1741,9 +2319,299 @@ namespace Vulkan
 			QM_LOG_ERROR("Failed to flush render state, draw call will be dropped.\n");
 	}
 
+	void CommandBuffer::BeginDeferredDraws()
+	{
+		VK_ASSERT(framebuffer);
+		VK_ASSERT(!is_compute);
+		VK_ASSERT(!deferred.active);
+		VK_ASSERT(current_contents == VK_SUBPASS_CONTENTS_INLINE);
+
+		deferred.active = true;
+		deferred.draws.clear();
+		deferred.dynamic_offsets.clear();
+		deferred.push_constants.clear();
+	}
+
+	bool CommandBuffer::CaptureRenderState(DeferredDraw& draw)
+	{
+		if (!pipeline_state.program)
+			return false;
+		VK_ASSERT(current_layout);
+
+		if (current_pipeline == VK_NULL_HANDLE)
+			set_dirty(COMMAND_BUFFER_DIRTY_PIPELINE_BIT);
+
+		if (GetAndClear(COMMAND_BUFFER_DIRTY_STATIC_STATE_BIT | COMMAND_BUFFER_DIRTY_PIPELINE_BIT | COMMAND_BUFFER_DIRTY_STATIC_VERTEX_BIT))
+		{
+			if (!FlushGraphicsPipeline(true))
+				return false;
+		}
+
+		if (current_pipeline == VK_NULL_HANDLE)
+			return false;
+
+		draw.pipeline = current_pipeline;
+		draw.layout = current_uniform_layout;
+
+		draw.set_mask = 0;
+		Util::ForEachBit(current_uniforms->GetDescriptorSetMask(), [&](uint32_t set) {
+			if (current_uniforms->HasDescriptorSet(set))
+				draw.set_mask |= 1u << set;
+		});
+
+		// Sets are allocated now, as they would be by FlushDescriptorSet(), but only bound on replay
+		uint32_t set_update = draw.set_mask & dirty_sets;
+		Util::ForEachBit(set_update, [&](uint32_t set) {
+			allocated_sets[set] = current_uniforms->FlushDescriptorSet(thread_index, set, *bindings);
+		});
+		dirty_sets &= ~set_update;
+
+		Util::ForEachBit(draw.set_mask, [&](uint32_t set) {
+			auto& set_layout = current_uniforms->GetSetLayout(set);
+			draw.sets[set] = allocated_sets[set];
+			draw.first_dynamic_offset[set] = uint32_t(deferred.dynamic_offsets.size());
+			Util::ForEachBit(set_layout.uniform_buffer_mask, [&](uint32_t binding) {
+				uint32_t array_size = set_layout.array_size[binding];
+				for (uint32_t i = 0; i < array_size; i++)
+					deferred.dynamic_offsets.push_back(bindings->dynamic_offsets[GetBindingSlot(set, binding, i)]);
+			});
+			draw.num_dynamic_offsets[set] = uint32_t(deferred.dynamic_offsets.size()) - draw.first_dynamic_offset[set];
+		});
+
+		auto& range = current_layout->GetUniformManager().GetPushConstantRange();
+		draw.push_constant_stages = range.stageFlags;
+		draw.push_constant_size = range.size;
+		draw.push_constant_offset = uint32_t(deferred.push_constants.size());
+		if (range.stageFlags != 0)
+		{
+			VK_ASSERT(range.offset == 0);
+			deferred.push_constants.insert(deferred.push_constants.end(), push_constant_data, push_constant_data + range.size);
+		}
+
+		draw.vbo_mask = active_vbos;
+		draw.vbo = vbo;
+		draw.index = index_state;
+		draw.viewport = viewport;
+		draw.scissor = scissor;
+		draw.dynamic_state = dynamic_state;
+		draw.depth_bias = pipeline_state.static_state.state.depth_bias_enable != 0;
+		draw.stencil = pipeline_state.static_state.state.stencil_test != 0;
+
+		return true;
+	}
+
+	void CommandBuffer::CaptureDraw(bool indexed, uint32_t count, uint32_t instance_count, uint32_t first, int32_t vertex_offset, uint32_t first_instance)
+	{
+		DeferredDraw draw = {};
+		if (!CaptureRenderState(draw))
+		{
+			QM_LOG_ERROR("Failed to flush render state, draw call will be dropped.\n");
+			return;
+		}
+
+		draw.indexed = indexed;
+		draw.count = count;
+		draw.instance_count = instance_count;
+		draw.first = first;
+		draw.vertex_offset = vertex_offset;
+		draw.first_instance = first_instance;
+		deferred.draws.push_back(draw);
+	}
+
+	void CommandBuffer::EndDeferredDraws()
+	{
+		VK_ASSERT(deferred.active);
+		deferred.active = false;
+
+		auto& draws = deferred.draws;
+		if (!draws.empty())
+		{
+			// Handles are replaced by ids in order of first use, which keeps the key at 16 bits per level.
+			// The sort is stable, so draws with the same state stay in the order they were captured in.
+			Util::HashMap<uint64_t> ids[4];
+			const auto id = [](Util::HashMap<uint64_t>& map, uint64_t handle) -> uint64_t {
+				auto itr = map.find(handle);
+				if (itr != map.end())
+					return itr->second;
+				uint64_t next = std::min<uint64_t>(map.size(), UINT16_MAX);
+				map[handle] = next;
+				return next;
+			};
+
+			std::vector<uint32_t> order(draws.size());
+			for (uint32_t i = 0; i < draws.size(); i++)
+			{
+				auto& draw = draws[i];
+				uint64_t set0 = (draw.set_mask & 1u) ? uint64_t(draw.sets[0]) : 0;
+				uint64_t set1 = (draw.set_mask & 2u) ? uint64_t(draw.sets[1]) : 0;
+				uint64_t vbo0 = (draw.vbo_mask & 1u) ? uint64_t(draw.vbo.buffers[0]) : 0;
+				draw.sort_key = (id(ids[0], uint64_t(draw.pipeline)) << 48) | (id(ids[1], set0) << 32) | (id(ids[2], set1) << 16) | id(ids[3], vbo0);
+				order[i] = i;
+			}
+
+			DeferredBindCounts unsorted;
+			ReplayDeferredDraws(order, false, unsorted);
+
+			std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+				return draws[a].sort_key < draws[b].sort_key;
+			});
+
+			DeferredBindCounts sorted;
+			ReplayDeferredDraws(order, true, sorted);
+
+			deferred_stats.draws += uint32_t(draws.size());
+			deferred_stats.sorted.pipelines += sorted.pipelines;
+			deferred_stats.sorted.descriptor_sets += sorted.descriptor_sets;
+			deferred_stats.sorted.vertex_buffers += sorted.vertex_buffers;
+			deferred_stats.sorted.index_buffers += sorted.index_buffers;
+			deferred_stats.sorted.push_constants += sorted.push_constants;
+			deferred_stats.sorted.dynamic_states += sorted.dynamic_states;
+			deferred_stats.unsorted.pipelines += unsorted.pipelines;
+			deferred_stats.unsorted.descriptor_sets += unsorted.descriptor_sets;
+			deferred_stats.unsorted.vertex_buffers += unsorted.vertex_buffers;
+			deferred_stats.unsorted.index_buffers += unsorted.index_buffers;
+			deferred_stats.unsorted.push_constants += unsorted.push_constants;
+			deferred_stats.unsorted.dynamic_states += unsorted.dynamic_states;
+		}
+
+		// What the replay left bound is unknown to the regular flushes, everything is bound again by the next draw
+		InvalidateBoundState();
+		current_pipeline = VK_NULL_HANDLE;
+		set_dirty(~0u);
+		dirty_sets = ~0u;
+		dirty_vbos = ~0u;
+		if (index_state.buffer != VK_NULL_HANDLE)
+			table.vkCmdBindIndexBuffer(cmd, index_state.buffer, index_state.offset, index_state.index_type);
+
+		draws.clear();
+		deferred.dynamic_offsets.clear();
+		deferred.push_constants.clear();
+	}
+
+	void CommandBuffer::ReplayDeferredDraws(const std::vector<uint32_t>& order, bool emit, DeferredBindCounts& counts)
+	{
+		VkPipeline bound_pipeline = VK_NULL_HANDLE;
+		VkPipelineLayout bound_layout = VK_NULL_HANDLE;
+		const DeferredDraw* bound_sets[VULKAN_NUM_DESCRIPTOR_SETS] = {};
+		const DeferredDraw* bound_push_constants = nullptr;
+		const DeferredDraw* bound_dynamic = nullptr;
+		VertexBindingState bound_vbo = {};
+		IndexState bound_index = {};
+
+		const uint32_t* dynamic_offsets = deferred.dynamic_offsets.data();
+		const uint8_t* push_constants = deferred.push_constants.data();
+
+		for (uint32_t index : order)
+		{
+			auto& draw = deferred.draws[index];
+
+			bool pipeline_changed = draw.pipeline != bound_pipeline;
+			if (pipeline_changed)
+			{
+				if (emit)
+					table.vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.pipeline);
+				bound_pipeline = draw.pipeline;
+				counts.pipelines++;
+			}
+
+			// Sets and push constants bound with another layout may be disturbed
+			if (draw.layout != bound_layout)
+			{
+				memset(bound_sets, 0, sizeof(bound_sets));
+				bound_push_constants = nullptr;
+				bound_layout = draw.layout;
+			}
+
+			Util::ForEachBit(draw.set_mask, [&](uint32_t set) {
+				const uint32_t* offsets = dynamic_offsets + draw.first_dynamic_offset[set];
+				uint32_t num_offsets = draw.num_dynamic_offsets[set];
+				const DeferredDraw* bound = bound_sets[set];
+				if (bound && bound->sets[set] == draw.sets[set] && bound->num_dynamic_offsets[set] == num_offsets &&
+					(num_offsets == 0 || memcmp(dynamic_offsets + bound->first_dynamic_offset[set], offsets, num_offsets * sizeof(uint32_t)) == 0))
+					return;
+
+				if (emit)
+					table.vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.layout, set, 1, &draw.sets[set], num_offsets, offsets);
+				bound_sets[set] = &draw;
+				counts.descriptor_sets++;
+			});
+
+			if (draw.push_constant_stages != 0)
+			{
+				const uint8_t* data = push_constants + draw.push_constant_offset;
+				if (!bound_push_constants || memcmp(push_constants + bound_push_constants->push_constant_offset, data, draw.push_constant_size) != 0)
+				{
+					if (emit)
+						table.vkCmdPushConstants(cmd, draw.layout, draw.push_constant_stages, 0, draw.push_constant_size, data);
+					bound_push_constants = &draw;
+					counts.push_constants++;
+				}
+			}
+
+			// Like FlushRenderState(), dynamic state is set again after the pipeline changed
+			bool dynamic_changed = pipeline_changed || !bound_dynamic ||
+				memcmp(&bound_dynamic->viewport, &draw.viewport, sizeof(draw.viewport)) != 0 ||
+				memcmp(&bound_dynamic->scissor, &draw.scissor, sizeof(draw.scissor)) != 0 ||
+				memcmp(&bound_dynamic->dynamic_state, &draw.dynamic_state, sizeof(draw.dynamic_state)) != 0;
+			if (dynamic_changed)
+			{
+				if (emit)
+				{
+					table.vkCmdSetViewport(cmd, 0, 1, &draw.viewport);
+					table.vkCmdSetScissor(cmd, 0, 1, &draw.scissor);
+					if (draw.depth_bias)
+						table.vkCmdSetDepthBias(cmd, draw.dynamic_state.depth_bias_constant, 0.0f, draw.dynamic_state.depth_bias_slope);
+					if (draw.stencil)
+					{
+						table.vkCmdSetStencilCompareMask(cmd, VK_STENCIL_FACE_FRONT_BIT, draw.dynamic_state.front_compare_mask);
+						table.vkCmdSetStencilReference(cmd, VK_STENCIL_FACE_FRONT_BIT, draw.dynamic_state.front_reference);
+						table.vkCmdSetStencilWriteMask(cmd, VK_STENCIL_FACE_FRONT_BIT, draw.dynamic_state.front_write_mask);
+						table.vkCmdSetStencilCompareMask(cmd, VK_STENCIL_FACE_BACK_BIT, draw.dynamic_state.back_compare_mask);
+						table.vkCmdSetStencilReference(cmd, VK_STENCIL_FACE_BACK_BIT, draw.dynamic_state.back_reference);
+						table.vkCmdSetStencilWriteMask(cmd, VK_STENCIL_FACE_BACK_BIT, draw.dynamic_state.back_write_mask);
+					}
+				}
+				bound_dynamic = &draw;
+				counts.dynamic_states++;
+			}
+
+			uint32_t vbo_update = 0;
+			Util::ForEachBit(draw.vbo_mask, [&](uint32_t binding) {
+				if (bound_vbo.buffers[binding] != draw.vbo.buffers[binding] || bound_vbo.offsets[binding] != draw.vbo.offsets[binding])
+				{
+					bound_vbo.buffers[binding] = draw.vbo.buffers[binding];
+					bound_vbo.offsets[binding] = draw.vbo.offsets[binding];
+					vbo_update |= 1u << binding;
+				}
+			});
+			Util::ForEachBitRange(vbo_update, [&](uint32_t binding, uint32_t binding_count) {
+				if (emit)
+					table.vkCmdBindVertexBuffers(cmd, binding, binding_count, draw.vbo.buffers + binding, draw.vbo.offsets + binding);
+				counts.vertex_buffers++;
+			});
+
+			if (draw.indexed && (bound_index.buffer != draw.index.buffer || bound_index.offset != draw.index.offset || bound_index.index_type != draw.index.index_type))
+			{
+				if (emit)
+					table.vkCmdBindIndexBuffer(cmd, draw.index.buffer, draw.index.offset, draw.index.index_type);
+				bound_index = draw.index;
+				counts.index_buffers++;
+			}
+
+			if (!emit)
+				continue;
+
+			if (draw.indexed)
+				table.vkCmdDrawIndexed(cmd, draw.count, draw.instance_count, draw.first, draw.vertex_offset, draw.first_instance);
+			else
+				table.vkCmdDraw(cmd, draw.count, draw.instance_count, draw.first, draw.first_instance);
+		}
+	}
+
 	void CommandBuffer::DrawIndirect(const Vulkan::Buffer& buffer, uint32_t offset, uint32_t draw_count, uint32_t stride)
 	{
 		VK_ASSERT(!is_compute);
+		VK_ASSERT(!deferred.active);
 		if (FlushRenderState(true))
 		{
 			table.vkCmdDrawIndirect(cmd, buffer.GetBuffer(), offset, draw_count, stride);
@@ -1756,6 +2624,7 @@ namespace Vulkan
 		uint32_t offset, uint32_t draw_count, uint32_t stride)
 	{
 		VK_ASSERT(!is_compute);
+		VK_ASSERT(!deferred.active);
 		if (FlushRenderState(true))
 		{
 			table.vkCmdDrawIndexedIndirect(cmd, buffer.GetBuffer(), offset, draw_count, stride);
@@ -1767,6 +2636,7 @@ namespace Vulkan
 	void CommandBuffer::DrawMultiIndirect(const Buffer& buffer, uint32_t offset, uint32_t draw_count, uint32_t stride, const Buffer& count, uint32_t count_offset)
 	{
 		VK_ASSERT(!is_compute);
+		VK_ASSERT(!deferred.active);
 		if (!GetDevice().GetDeviceExtensions().supports_draw_indirect_count)
 		{
 			QM_LOG_ERROR("VK_KHR_draw_indirect_count not supported, dropping draw call.\n");
@@ -1786,6 +2656,7 @@ namespace Vulkan
 	void CommandBuffer::DrawIndexedMultiIndirect(const Buffer& buffer, uint32_t offset, uint32_t draw_count, uint32_t stride, const Buffer& count, uint32_t count_offset)
 	{
 		VK_ASSERT(!is_compute);
+		VK_ASSERT(!deferred.active);
 		if (!GetDevice().GetDeviceExtensions().supports_draw_indirect_count)
 		{
 			QM_LOG_ERROR("VK_KHR_draw_indirect_count not supported, dropping draw call.\n");
@@ -1805,6 +2676,7 @@ namespace Vulkan
 		VK_ASSERT(is_compute);
 		if (FlushComputeState(true))
 		{
+			FlushBarriers();
 			table.vkCmdDispatch(cmd, groups_x, groups_y, groups_z);
 		}
 		else
@@ -1816,6 +2688,7 @@ namespace Vulkan
 		VK_ASSERT(is_compute);
 		if (FlushComputeState(true))
 		{
+			FlushBarriers();
 			table.vkCmdDispatchIndirect(cmd, buffer.GetBuffer(), offset);
 		}
 		else
@@ -1967,6 +2840,8 @@ namespace Vulkan
 
 	void CommandBuffer::End()
 	{
+		VK_ASSERT(!deferred.active);
+		FlushBarriers();
 		if (table.vkEndCommandBuffer(cmd) != VK_SUCCESS)
 			QM_LOG_ERROR("Failed to end command buffer.\n");
 
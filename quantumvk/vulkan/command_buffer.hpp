@@ -4,20 +4,32 @@
 
 #include "vulkan_common.hpp"
 #include <string.h>
+#include <functional>
+#include <vector>
 
 #include "memory/buffer.hpp"
+#include "memory/buffer_arena.hpp"
 #include "memory/buffer_pool.hpp"
+#include "memory/transient_ring.hpp"
 
 #include "images/image.hpp"
 #include "images/sampler.hpp"
 
 #include "sync/pipeline_event.hpp"
+#include "sync/resource_tracker.hpp"
 
 #include "graphics/render_pass.hpp"
 #include "graphics/shader.hpp"
 
 #include "misc/limits.hpp"
 
+#include "quantumvk/utils/small_vector.hpp"
+
+namespace Quantum
+{
+	class ThreadGroup;
+}
+
 namespace Vulkan
 {
 	class DebugChannelInterface;
@@ -199,6 +211,82 @@ namespace Vulkan
 		void operator()(CommandBuffer* cmd);
 	};
 
+	//Barriers requested through the Barrier functions of a command buffer, and the vkCmdPipelineBarrier calls they were merged into
+	struct BarrierStats
+	{
+		uint32_t requested = 0;
+		uint32_t emitted = 0;
+	};
+
+	//Binds a command buffer recorded, and binds it skipped because the same state was bound already
+	struct BindStats
+	{
+		uint32_t index_buffers_emitted = 0;
+		uint32_t index_buffers_skipped = 0;
+		uint32_t vertex_buffers_emitted = 0;
+		uint32_t vertex_buffers_skipped = 0;
+		uint32_t descriptor_sets_emitted = 0;
+		uint32_t descriptor_sets_skipped = 0;
+		uint32_t push_constants_emitted = 0;
+		uint32_t push_constants_skipped = 0;
+	};
+
+	//A draw captured between BeginDeferredDraws and EndDeferredDraws, with its state resolved to the Vulkan handles to bind
+	struct DeferredDraw
+	{
+		uint64_t sort_key;
+		VkPipeline pipeline;
+		VkPipelineLayout layout;
+		uint32_t set_mask;
+		VkDescriptorSet sets[VULKAN_NUM_DESCRIPTOR_SETS];
+		//First dynamic offset of each set in the captured dynamic offsets, and their number
+		uint32_t first_dynamic_offset[VULKAN_NUM_DESCRIPTOR_SETS];
+		uint32_t num_dynamic_offsets[VULKAN_NUM_DESCRIPTOR_SETS];
+		uint32_t vbo_mask;
+		VertexBindingState vbo;
+		IndexState index;
+		//Push constants are stored in the captured push constant data
+		VkShaderStageFlags push_constant_stages;
+		uint32_t push_constant_size;
+		uint32_t push_constant_offset;
+		VkViewport viewport;
+		VkRect2D scissor;
+		DynamicState dynamic_state;
+		bool depth_bias;
+		bool stencil;
+
+		bool indexed;
+		uint32_t count;
+		uint32_t instance_count;
+		uint32_t first;
+		int32_t vertex_offset;
+		uint32_t first_instance;
+	};
+
+	//Binds needed by a sequence of deferred draws, redundant binds already skipped
+	struct DeferredBindCounts
+	{
+		uint32_t pipelines = 0;
+		uint32_t descriptor_sets = 0;
+		uint32_t vertex_buffers = 0;
+		uint32_t index_buffers = 0;
+		uint32_t push_constants = 0;
+		uint32_t dynamic_states = 0;
+	};
+
+	//Binds recorded by replaying deferred draws sorted, and the binds the same draws needed in the order they were captured in
+	struct DeferredDrawStats
+	{
+		uint32_t draws = 0;
+		DeferredBindCounts sorted;
+		DeferredBindCounts unsorted;
+	};
+
+	//Records draws first_draw to first_draw + draw_count - 1 of a parallel render pass
+	using ParallelDrawCallback = std::function<void(CommandBuffer& cmd, uint32_t first_draw, uint32_t draw_count)>;
+	//Fewer draws than this aren't worth a secondary command buffer of their own
+	static const uint32_t VULKAN_PARALLEL_MIN_DRAWS_PER_CHUNK = 64;
+
 	//Forward declare device
 	class Device;
 
@@ -250,6 +338,11 @@ namespace Vulkan
 			return thread_index;
 		}
 
+		void SetResourceBindings(ResourceBindings* bindings_)
+		{
+			bindings = bindings_;
+		}
+
 		void SetIsSecondary()
 		{
 			is_secondary = true;
@@ -260,6 +353,23 @@ namespace Vulkan
 			return is_secondary;
 		}
 
+		// Rings of the frame context this command buffer is recorded in, nullptr if vertex, index and uniform data come from the block pools
+		void SetTransientRings(TransientRings* rings)
+		{
+			transient_rings = rings;
+		}
+
+		// Readbacks recorded into this command buffer, the device learns their completion point when it is submitted
+		void AddReadbackTicket(uint64_t ticket)
+		{
+			readback_tickets.push_back(ticket);
+		}
+
+		const std::vector<uint64_t>& GetReadbackTickets() const
+		{
+			return readback_tickets;
+		}
+
 		//Fill a buffer with a specific value.
 		//Executes in: VK_PIPELINE_STAGE_TRANSFER_BIT.
 		//Buffer must have usage VK_BUFFER_USAGE_TRANSFER_DST_BIT.
@@ -289,6 +399,13 @@ namespace Vulkan
 		//Dst Buffer must have usage VK_BUFFER_USAGE_TRANSFER_DST_BIT.
 		//Equivelent vulkan function: vkCmdCopyBuffer()
 		void CopyBuffer(const Buffer& dst, const Buffer& src, const VkBufferCopy* copies, size_t count);
+		//Copy the whole range of one SubBuffer into another, which must be at least as large.
+		//Executes in: VK_PIPELINE_STAGE_TRANSFER_BIT.
+		void CopyBuffer(const SubBuffer& dst, const SubBuffer& src)
+		{
+			VK_ASSERT(dst.GetSize() >= src.GetSize());
+			CopyBuffer(dst.GetBuffer(), dst.GetOffset(), src.GetBuffer(), src.GetOffset(), src.GetSize());
+		}
 		//Copy one Image to another
 		//Executes in: VK_PIPELINE_STAGE_TRANSFER_BIT.
 		//Src Image must be in layout VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL_BIT
@@ -339,6 +456,10 @@ namespace Vulkan
 		void ClearQuad(uint32_t attachment, const VkClearRect& rect, const VkClearValue& value, VkImageAspectFlags = VK_IMAGE_ASPECT_COLOR_BIT);
 		void ClearQuad(const VkClearRect& rect, uint32_t num_attachments, const VkClearAttachment* attachments);
 
+		//Barriers aren't recorded immediately, they're merged into a single vkCmdPipelineBarrier which is recorded before the next
+		//command which could depend on them (copies, clears, blits, dispatches, render passes, events and End()).
+		//With VK_KHR_synchronization2, that is a vkCmdPipelineBarrier2KHR in which every buffer and image barrier keeps its own stages.
+
 		//Ensures that all commands before this one will be finished before any commands after the barrier.
 		void FullBarrier();
 		//Ensures that all current draws to color attachments will be finished before input reads after this barrier. (Executes with dependency VK_DEPENDENCY_BY_REGION_BIT).
@@ -356,6 +477,59 @@ namespace Vulkan
 		void ImageBarrier(const Image& image, VkImageLayout old_layout, VkImageLayout new_layout,
 			VkPipelineStageFlags src_stage, VkAccessFlags src_access, VkPipelineStageFlags dst_stage,
 			VkAccessFlags dst_access);
+		//Inserts synchronization2 barriers, which can use its finer stages and accesses, e.g. copy, blit and clear instead of transfer.
+		//Without synchronization2, the barriers are recorded with the legacy stages and accesses which contain theirs. Dependency flags are ignored.
+		void Barrier(const VkDependencyInfoKHR& dependency);
+		//Records all pending barriers. Only needs to be called before recording into GetCommandBuffer() directly.
+		void FlushBarriers();
+
+		BarrierStats GetBarrierStats() const
+		{
+			return barrier_stats;
+		}
+
+		//Draw() and DrawIndexed() calls until EndDeferredDraws() are captured instead of recorded. EndDeferredDraws() replays them sorted by
+		//pipeline, then descriptor set 0, descriptor set 1 and the first vertex buffer, so each is bound as rarely as possible. Only for draws
+		//which may execute in any order, e.g. opaque geometry with depth testing. Must begin and end in the same subpass.
+		void BeginDeferredDraws();
+		void EndDeferredDraws();
+
+		DeferredDrawStats GetDeferredDrawStats() const
+		{
+			return deferred_stats;
+		}
+
+		//Counts binds of the regular Set*/Draw path. Recording into GetCommandBuffer() directly isn't seen by the bind tracking,
+		//so state bound that way must be rebound by the caller.
+		BindStats GetBindStats() const
+		{
+			return bind_stats;
+		}
+
+		//Opt-in state tracking. Once an image or buffer is tracked, the Use* functions infer the barrier needed before a use from
+		//the earlier ones, and add it to the pending barriers. Tracked resources shouldn't be transitioned by other barriers in between,
+		//images used as attachments of a render pass must be tracked again afterwards. Tracking doesn't carry over into other command buffers.
+
+		//Starts tracking an image, or resets its state. stages and access are those of the last use before this command buffer which isn't synchronized by the submission.
+		void TrackImage(const Image& image, VkImageLayout layout, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VkAccessFlags access = 0);
+		//Starts tracking a buffer, or resets its state. Buffers are tracked implicitly by their first use.
+		void TrackBuffer(const Buffer& buffer, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VkAccessFlags access = 0);
+		//Declares a use of a tracked image. range defaults to the whole image.
+		void UseImage(const Image& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access, const VkImageSubresourceRange* range = nullptr);
+		//Declares a use of a buffer
+		void UseBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access);
+		void UseForSampling(const Image& image, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, const VkImageSubresourceRange* range = nullptr);
+		void UseAsStorage(const Image& image, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, bool write = true, const VkImageSubresourceRange* range = nullptr);
+		void UseAsStorage(const Buffer& buffer, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, bool write = true);
+		void UseAsTransferSrc(const Image& image, const VkImageSubresourceRange* range = nullptr);
+		void UseAsTransferSrc(const Buffer& buffer);
+		void UseAsTransferDst(const Image& image, const VkImageSubresourceRange* range = nullptr);
+		void UseAsTransferDst(const Buffer& buffer);
+		//Layout of a tracked image's subresource after its last use, VK_IMAGE_LAYOUT_UNDEFINED if the image isn't tracked
+		VkImageLayout GetTrackedLayout(const Image& image, uint32_t level = 0, uint32_t layer = 0) const
+		{
+			return tracker.GetLayout(image, level, layer);
+		}
 
 		PipelineEvent SignalEvent(VkPipelineStageFlags stages);
 		void WaitEvents(uint32_t num_events, const VkEvent* events,
@@ -363,6 +537,9 @@ namespace Vulkan
 			uint32_t barriers, const VkMemoryBarrier* globals,
 			uint32_t buffer_barriers, const VkBufferMemoryBarrier* buffers,
 			uint32_t image_barriers, const VkImageMemoryBarrier* images);
+		//Synchronization2 events, each wait must use the dependency its event was signalled with. Fall back to legacy events like Barrier().
+		PipelineEvent SignalEvent(const VkDependencyInfoKHR& dependency);
+		void WaitEvents(uint32_t num_events, const VkEvent* events, const VkDependencyInfoKHR* dependencies);
 
 		// Blits one image into another
 		void BlitImage(const Image& dst, const Image& src,
@@ -393,6 +570,14 @@ namespace Vulkan
 
 		Util::IntrusivePtr<CommandBuffer> RequestSecondaryCommandBuffer(uint32_t thread_index, uint32_t subpass);
 		static Util::IntrusivePtr<CommandBuffer> RequestSecondaryCommandBuffer(Device& device, const RenderPassInfo& rp, uint32_t thread_index, uint32_t subpass);
+		//Records a whole render pass, splitting the draw_count draws of every subpass into contiguous chunks. Each chunk is recorded by a worker of group
+		//into its own secondary command buffer, which inherits the viewport, scissor and render state set on this command buffer. The secondaries are
+		//executed in chunk order. The secondaries use the thread indices first_thread_index to first_thread_index + n - 1 of the device, which must not
+		//include the thread index of this command buffer or be in use by any other recording while this runs.
+		//Must not be called from a worker of group, it waits for the chunks to complete.
+		//Without a group, or with too few draws for two chunks, the render pass is recorded inline.
+		void RecordRenderPassParallel(const RenderPassInfo& info, uint32_t draw_count, const ParallelDrawCallback& record,
+			Quantum::ThreadGroup* group, uint32_t first_thread_index = 1, uint32_t min_chunk_draws = VULKAN_PARALLEL_MIN_DRAWS_PER_CHUNK);
 
         // A program MUST NOT be set by multiple command buffers at once.
 		// No uniforms are retained between submissions (though common descriptor sets are hashed, so don't worry about calling
@@ -432,6 +617,15 @@ namespace Vulkan
 		void SetUniformBuffer(uint32_t set, uint32_t binding, uint32_t array_index, const Buffer& buffer, VkDeviceSize offset, VkDeviceSize range);
 		void SetStorageBuffer(uint32_t set, uint32_t binding, uint32_t array_index,  const Buffer& buffer);
 		void SetStorageBuffer(uint32_t set, uint32_t binding, uint32_t array_index,  const Buffer& buffer, VkDeviceSize offset, VkDeviceSize range);
+		//Binds the range of a SubBuffer, offset is relative to the SubBuffer
+		void SetUniformBuffer(uint32_t set, uint32_t binding, uint32_t array_index, const SubBuffer& buffer, VkDeviceSize offset = 0)
+		{
+			SetUniformBuffer(set, binding, array_index, buffer.GetBuffer(), buffer.GetOffset() + offset, buffer.GetSize() - offset);
+		}
+		void SetStorageBuffer(uint32_t set, uint32_t binding, uint32_t array_index, const SubBuffer& buffer, VkDeviceSize offset = 0)
+		{
+			SetStorageBuffer(set, binding, array_index, buffer.GetBuffer(), buffer.GetOffset() + offset, buffer.GetSize() - offset);
+		}
 
 		// void SetBindless(unsigned set, VkDescriptorSet desc_set);
 		void PushConstants(const void* data, VkDeviceSize offset, VkDeviceSize range);
@@ -478,6 +672,16 @@ namespace Vulkan
 		void BindVertexBuffer(uint32_t binding, const Buffer& buffer, VkDeviceSize offset);
 		//Bind an index buffer for DrawIndexed calls
 		void BindIndexBuffer(const Buffer& buffer, VkDeviceSize offset, VkIndexType index_type);
+		//Binds a SubBuffer as vertex buffer, offset is relative to the SubBuffer
+		void BindVertexBuffer(uint32_t binding, const SubBuffer& buffer, VkDeviceSize offset = 0)
+		{
+			BindVertexBuffer(binding, buffer.GetBuffer(), buffer.GetOffset() + offset);
+		}
+		//Binds a SubBuffer as index buffer, offset is relative to the SubBuffer
+		void BindIndexBuffer(const SubBuffer& buffer, VkIndexType index_type, VkDeviceSize offset = 0)
+		{
+			BindIndexBuffer(buffer.GetBuffer(), buffer.GetOffset() + offset, index_type);
+		}
 		//Submit a draw call
 		void Draw(uint32_t vertex_count, uint32_t instance_count = 1, uint32_t first_vertex = 0, uint32_t first_instance = 0);
 		void DrawIndexed(uint32_t index_count, uint32_t instance_count = 1, uint32_t first_index = 0, int32_t vertex_offset = 0, uint32_t first_instance = 0);
@@ -776,6 +980,9 @@ namespace Vulkan
 		UniformManager* current_uniforms = nullptr;
 		VkSubpassContents current_contents = VK_SUBPASS_CONTENTS_INLINE;
 		uint32_t thread_index = 0;
+		// Descriptor state of the thread this command buffer is recorded on
+		ResourceBindings* bindings = nullptr;
+		TransientRings* transient_rings = nullptr;
 
 		VkViewport viewport = {};
 		VkRect2D scissor = {};
@@ -790,6 +997,63 @@ namespace Vulkan
 		bool uses_swapchain = false;
 		bool is_compute = true;
 		bool is_secondary = false;
+		std::vector<uint64_t> readback_tickets;
+
+		//Barriers requested since the last FlushBarriers(), in synchronization2 form. Global barriers are merged into a single memory barrier.
+		struct PendingBarriers
+		{
+			VkPipelineStageFlags2KHR src_stages = 0;
+			VkPipelineStageFlags2KHR dst_stages = 0;
+			VkAccessFlags2KHR src_access = 0;
+			VkAccessFlags2KHR dst_access = 0;
+			Util::SmallVector<VkBufferMemoryBarrier2KHR> buffers;
+			Util::SmallVector<VkImageMemoryBarrier2KHR> images;
+		};
+		PendingBarriers pending_barriers;
+		BarrierStats barrier_stats;
+		ResourceTracker tracker;
+
+		struct DeferredDrawState
+		{
+			bool active = false;
+			std::vector<DeferredDraw> draws;
+			std::vector<uint32_t> dynamic_offsets;
+			std::vector<uint8_t> push_constants;
+		};
+		DeferredDrawState deferred;
+		DeferredDrawStats deferred_stats;
+
+		//Descriptor sets and push constants last recorded, binding the same state again is skipped
+		struct BoundDescriptorSet
+		{
+			VkDescriptorSet set;
+			VkPipelineLayout layout;
+			uint32_t num_dynamic_offsets;
+			uint32_t dynamic_offsets[VULKAN_NUM_BINDINGS];
+		};
+		BoundDescriptorSet bound_sets[VULKAN_NUM_DESCRIPTOR_SETS] = {};
+		VkPipelineLayout bound_push_constant_layout = VK_NULL_HANDLE;
+		uint32_t bound_push_constant_size = 0;
+		uint8_t bound_push_constant_data[VULKAN_PUSH_CONSTANT_SIZE];
+		BindStats bind_stats;
+
+		void BindDescriptorSet(uint32_t set, VkDescriptorSet desc_set, uint32_t num_dynamic_offsets, const uint32_t* dynamic_offsets);
+		void FlushPushConstants();
+		//Forgets the bound descriptor sets and push constants, when they may have been changed outside the tracking
+		void InvalidateBoundState();
+
+		//Resolves the state of a draw without recording anything
+		bool CaptureRenderState(DeferredDraw& draw);
+		void CaptureDraw(bool indexed, uint32_t count, uint32_t instance_count, uint32_t first, int32_t vertex_offset, uint32_t first_instance);
+		//Counts the binds the deferred draws need in the order given, and records them with the draws if emit is set
+		void ReplayDeferredDraws(const std::vector<uint32_t>& order, bool emit, DeferredBindCounts& counts);
+
+		void AddBarriers(VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages,
+			uint32_t barriers, const VkMemoryBarrier* globals,
+			uint32_t buffer_barriers, const VkBufferMemoryBarrier* buffers,
+			uint32_t image_barriers, const VkImageMemoryBarrier* images);
+		//Flushes the pending barriers if one of them transitions an overlapping range of the image
+		void FlushOverlappingBarriers(VkImage image, const VkImageSubresourceRange& range);
 
 		void set_dirty(CommandBufferDirtyFlags flags)
 		{
@@ -833,6 +1097,8 @@ namespace Vulkan
 		void SetTexture(uint32_t set, uint32_t binding, uint32_t array_index, VkImageView float_view, VkImageView integer_view, VkImageLayout layout, uint64_t cookie);
 
 		void InitViewportScissor(const RenderPassInfo& info, const Framebuffer* framebuffer);
+		//Sets up a secondary command buffer to record a subpass of the current render pass
+		void InheritRenderPass(CommandBuffer& secondary, uint32_t subpass) const;
 
 		//Recalculates a graphics pipeline's hash
 		static void UpdateHashGraphicsPipeline(DeferredPipelineCompile& compile, uint32_t& active_vbos);
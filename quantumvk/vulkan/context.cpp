@@ -840,6 +840,7 @@ namespace Vulkan
 		ext->scalar_block_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SCALAR_BLOCK_LAYOUT_FEATURES_EXT };
 		ext->ubo_std430_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_UNIFORM_BUFFER_STANDARD_LAYOUT_FEATURES_KHR };
 		ext->timeline_semaphore_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR };
+		ext->synchronization2_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR };
 		ext->descriptor_indexing_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT };
 		ext->performance_query_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PERFORMANCE_QUERY_FEATURES_KHR };
 		ext->sampler_ycbcr_conversion_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SAMPLER_YCBCR_CONVERSION_FEATURES_KHR };
@@ -929,6 +930,13 @@ namespace Vulkan
 				ppNext = &ext->timeline_semaphore_features.pNext;
 			}
 
+			if (has_extension(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME))
+			{
+				enabled_extensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+				*ppNext = &ext->synchronization2_features;
+				ppNext = &ext->synchronization2_features.pNext;
+			}
+
 			if (ext->supports_maintenance_3 && has_extension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME))
 			{
 				enabled_extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
@@ -1006,6 +1014,15 @@ namespace Vulkan
 			if (features.features.shaderStorageImageArrayDynamicIndexing)
 				enabled_features.shaderStorageImageArrayDynamicIndexing = VK_TRUE;
 
+			if (features.features.sparseBinding)
+				enabled_features.sparseBinding = VK_TRUE;
+			if (features.features.sparseResidencyImage2D)
+				enabled_features.sparseResidencyImage2D = VK_TRUE;
+			if (features.features.shaderResourceResidency)
+				enabled_features.shaderResourceResidency = VK_TRUE;
+			if (features.features.shaderResourceMinLod)
+				enabled_features.shaderResourceMinLod = VK_TRUE;
+
 			features.features = enabled_features;
 			feat = enabled_features;
 		}
@@ -1028,6 +1045,12 @@ namespace Vulkan
 			enabled_extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
 		}
 
+		if (ext->supports_physical_device_properties2 && has_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME))
+		{
+			ext->supports_memory_budget = true;
+			enabled_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+		}
+
 		// Only need GetPhysicalDeviceProperties2 for Vulkan 1.1-only code, so don't bother getting KHR variant.
 		ext->subgroup_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES };
 		ext->host_memory_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT };
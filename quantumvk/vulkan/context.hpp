@@ -26,6 +26,7 @@ namespace Vulkan
 		bool supports_vulkan_12_instance = false;
 		bool supports_vulkan_12_device = false;
 		bool supports_external_memory_host = false;
+		bool supports_memory_budget = false;
 		bool supports_surface_capabilities2 = false;
 		bool supports_full_screen_exclusive = false;
 		bool supports_update_template = false;
@@ -54,6 +55,7 @@ namespace Vulkan
 		VkPhysicalDeviceScalarBlockLayoutFeaturesEXT scalar_block_features = {};
 		VkPhysicalDeviceUniformBufferStandardLayoutFeaturesKHR ubo_std430_features = {};
 		VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_semaphore_features = {};
+		VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2_features = {};
 		VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptor_indexing_features = {};
 		VkPhysicalDeviceDescriptorIndexingPropertiesEXT descriptor_indexing_properties = {};
 		VkPhysicalDeviceConservativeRasterizationPropertiesEXT conservative_rasterization_properties = {};
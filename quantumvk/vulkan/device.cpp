@@ -41,6 +41,7 @@ namespace Vulkan
 		: framebuffer_allocator(this)
 		, transient_allocator(this)
 		, physical_allocator(this)
+		, aliased_allocator(this)
 	{
 #ifdef QM_VULKAN_MT
 		cookie.store(0);
@@ -180,6 +181,7 @@ namespace Vulkan
 		gpu = context_->GetGPU();
 		device = context_->GetDevice();
 		num_thread_indices = context_->GetNumThreadIndices();
+		thread_bindings.resize(num_thread_indices);
 
 		graphics_queue_family_index = context_->GetGraphicsQueueFamily();
 		graphics_queue = context_->GetGraphicsQueue();
@@ -194,6 +196,23 @@ namespace Vulkan
 
 		InitWorkarounds();
 
+		// Sparse binds go to an existing queue, preferring those which don't record rendering work
+		sparse_queue = VK_NULL_HANDLE;
+		if (feat.sparseBinding)
+		{
+			uint32_t queue_count = 0;
+			vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_count, nullptr);
+			std::vector<VkQueueFamilyProperties> queue_props(queue_count);
+			vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_count, queue_props.data());
+
+			if (queue_props[transfer_queue_family_index].queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)
+				sparse_queue = transfer_queue;
+			else if (queue_props[compute_queue_family_index].queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)
+				sparse_queue = compute_queue;
+			else if (queue_props[graphics_queue_family_index].queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)
+				sparse_queue = graphics_queue;
+		}
+
 		InitStockSamplers();
 		InitTimelineSemaphores();
 
@@ -207,6 +226,7 @@ namespace Vulkan
 		managers.semaphore.Init(this);
 		managers.fence.Init(this);
 		managers.event.Init(this);
+		managers.descriptor_pool.Init(this);
 		managers.vbo.Init(this, 4 * 1024, 16, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, ImplementationQuirks::get().staging_need_device_local);
 		managers.ibo.Init(this, 4 * 1024, 16, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, ImplementationQuirks::get().staging_need_device_local);
 		managers.ubo.Init(this, 256 * 1024, std::max<VkDeviceSize>(16u, gpu_props.limits.minUniformBufferOffsetAlignment), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, ImplementationQuirks::get().staging_need_device_local);
@@ -338,9 +358,10 @@ namespace Vulkan
 		if (block.mapped)
 			device.UnmapHostBuffer(*block.cpu, MEMORY_ACCESS_WRITE_BIT);
 
+		// Every block goes back to the pool, which decides whether to keep it
 		if (block.offset == 0)
 		{
-			if (block.size == pool.GetBlockSize())
+			if (block.gpu)
 				pool.RecycleBlock(std::move(block));
 		}
 		else
@@ -351,8 +372,7 @@ namespace Vulkan
 				dma->push_back(block);
 			}
 
-			if (block.size == pool.GetBlockSize())
-				recycle.push_back(block);
+			recycle.push_back(block);
 		}
 
 		if (size)
@@ -405,6 +425,34 @@ namespace Vulkan
 		RequestBlock(*this, block, size, managers.staging, nullptr, Frame().staging_blocks);
 	}
 
+	BufferPoolStats Device::GetBufferPoolStats(MemoryCategory category)
+	{
+		LOCK();
+		switch (category)
+		{
+		case MemoryCategory::VertexPool:
+			return managers.vbo.GetStats();
+		case MemoryCategory::IndexPool:
+			return managers.ibo.GetStats();
+		case MemoryCategory::UniformPool:
+			return managers.ubo.GetStats();
+		case MemoryCategory::Staging:
+			return managers.staging.GetStats();
+		default:
+			QM_LOG_ERROR("Memory category has no buffer pool.\n");
+			return {};
+		}
+	}
+
+	void Device::SetBufferPoolTrimFrames(uint32_t frames)
+	{
+		LOCK();
+		managers.vbo.SetTrimFrames(frames);
+		managers.ibo.SetTrimFrames(frames);
+		managers.ubo.SetTrimFrames(frames);
+		managers.staging.SetTrimFrames(frames);
+	}
+
 	Fence Device::RequestLegacyFence()
 	{
 		VkFence fence = managers.fence.RequestClearedFence();
@@ -446,7 +494,24 @@ namespace Vulkan
 
 	Device::~Device()
 	{
+		SetCompletionWatcher(false);
 		WaitIdle();
+		submission_thread.reset();
+
+		// Everything submitted has completed now
+		completions.completed[0] = graphics.current_timeline;
+		completions.completed[1] = compute.current_timeline;
+		completions.completed[2] = transfer.current_timeline;
+		PollCompletions();
+
+		// Run the callbacks of outstanding readbacks before their memory goes away
+		PollReadbacks();
+		for (auto& request : readbacks.requests)
+			if (request.task)
+				request.task->wait();
+		readbacks.requests.clear();
+		readbacks.ring.Reset();
+		readbacks.ring_mapped = nullptr;
 
 		wsi.acquire.Reset();
 		wsi.release.Reset();
@@ -460,6 +525,7 @@ namespace Vulkan
 		framebuffer_allocator.Clear();
 		transient_allocator.Clear();
 		physical_allocator.Clear();
+		aliased_allocator.Clear();
 		for (auto& sampler : samplers)
 			sampler.Reset();
 
@@ -509,6 +575,7 @@ namespace Vulkan
 		framebuffer_allocator.Clear();
 		transient_allocator.Clear();
 		physical_allocator.Clear();
+		aliased_allocator.Clear();
 		per_frame.clear();
 
 		for (unsigned i = 0; i < count; i++)
@@ -516,6 +583,69 @@ namespace Vulkan
 			auto frame = std::unique_ptr<PerFrame>(new PerFrame(this, i));
 			per_frame.emplace_back(std::move(frame));
 		}
+
+		telemetry.gpu_frame_end_valid = false;
+	}
+
+	void Device::SetFramesInFlight(unsigned count)
+	{
+		DRAIN_FRAME_LOCK();
+		VK_ASSERT(count != 0);
+		VK_ASSERT(!per_frame.empty());
+
+		unsigned old_count = unsigned(per_frame.size());
+		if (count == old_count)
+			return;
+
+		// Frame contexts are reused in ring order after the current one. With the current one rotated to the back,
+		// the front holds the oldest contexts, which is where contexts are added or removed.
+		unsigned shift = frame_context_index + 1;
+		std::rotate(per_frame.begin(), per_frame.begin() + shift, per_frame.end());
+		unsigned defrag_context = (defrag.pass_frame_context + old_count - shift) % old_count;
+		bool defrag_context_removed = false;
+
+		if (count > old_count)
+		{
+			// New contexts are idle, so they are used first
+			unsigned added = count - old_count;
+			for (unsigned i = 0; i < added; i++)
+				per_frame.insert(per_frame.begin(), std::unique_ptr<PerFrame>(new PerFrame(this, 0)));
+			defrag_context += added;
+		}
+		else
+		{
+			// The oldest contexts are the most likely to have completed already
+			unsigned removed = old_count - count;
+			for (unsigned i = 0; i < removed; i++)
+			{
+				auto& frame = *per_frame[i];
+				const uint64_t frame_timelines[3] = { frame.timeline_fence_graphics, frame.timeline_fence_compute, frame.timeline_fence_transfer };
+				frame.Begin();
+				for (unsigned j = 0; j < 3; j++)
+					completions.completed[j] = std::max(completions.completed[j], frame_timelines[j]);
+			}
+			per_frame.erase(per_frame.begin(), per_frame.begin() + removed);
+
+			defrag_context_removed = defrag_context < removed;
+			if (!defrag_context_removed)
+				defrag_context -= removed;
+		}
+
+		for (unsigned i = 0; i < count; i++)
+			per_frame[i]->frame_index = i;
+		frame_context_index = count - 1;
+
+		if (defrag.pass_in_flight)
+		{
+			// The copies of the pass completed when its frame context was waited on
+			if (defrag_context_removed)
+				CommitDefragmentationPassNolock();
+			else
+				defrag.pass_frame_context = defrag_context;
+		}
+
+		// Timestamps of removed frame contexts are lost, the next idle gap would span them
+		telemetry.gpu_frame_end_valid = false;
 	}
 
 	void Device::InitExternalSwapchain(const std::vector<SwapchainImages>& swapchain_images)
@@ -870,4 +1000,38 @@ namespace Vulkan
 		queue_unlock_callback = move(unlock_callback);
 	}
 
+	void Device::QueryMemoryHeapBudgets(MemoryHeapBudget* budgets)
+	{
+		managers.memory.QueryHeapBudgets(budgets);
+	}
+
+	bool Device::IsMemoryHeapUnderPressure(uint32_t heap_index) const
+	{
+		const MemoryHeapBudget& budget = GetMemoryHeapBudget(heap_index);
+		return budget.usage > VkDeviceSize(double(budget.budget) * memory_pressure_threshold);
+	}
+
+	void Device::SetMemoryPressureCallback(std::function<void(uint32_t heap_index, const MemoryHeapBudget& budget)> callback, float threshold)
+	{
+		memory_pressure_callback = move(callback);
+		memory_pressure_threshold = threshold;
+	}
+
+	void Device::SetDefragmentation(bool enable, const DefragmentationInfo& info)
+	{
+		LOCK();
+		defrag.enabled = enable;
+		defrag.info = info;
+	}
+
+	void Device::NotifyMemoryPressure()
+	{
+		if (!memory_pressure_callback)
+			return;
+
+		for (uint32_t i = 0; i < mem_props.memoryHeapCount; i++)
+			if (IsMemoryHeapUnderPressure(i))
+				memory_pressure_callback(i, GetMemoryHeapBudget(i));
+	}
+
 }
\ No newline at end of file
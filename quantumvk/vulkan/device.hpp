@@ -9,13 +9,17 @@
 
 #include <memory>
 #include <vector>
+#include <deque>
+#include <atomic>
 #include <functional>
 #include <unordered_map>
 #include <stdio.h>
 #include <utility>
 
 #include "memory/buffer.hpp"
+#include "memory/buffer_arena.hpp"
 #include "memory/buffer_pool.hpp"
+#include "memory/transient_ring.hpp"
 #include "memory/memory_allocator.hpp"
 
 #include "images/image.hpp"
@@ -30,6 +34,7 @@
 #include "sync/semaphore_manager.hpp"
 #include "sync/pipeline_event.hpp"
 #include "sync/event_manager.hpp"
+#include "sync/submission_thread.hpp"
 
 #ifdef QM_VULKAN_MT
 #include <atomic>
@@ -66,6 +71,8 @@ namespace Vulkan
 		VulkanObjectPool<LinearHostImage> linear_images;
 		VulkanObjectPool<ImageView> image_views;
 		VulkanObjectPool<BufferView> buffer_views;
+		VulkanObjectPool<BufferArena> buffer_arenas;
+		VulkanObjectPool<SubBuffer> sub_buffers;
 		VulkanObjectPool<Sampler> samplers;
 		VulkanObjectPool<FenceHolder> fences;
 		VulkanObjectPool<SemaphoreHolder> semaphores;
@@ -84,6 +91,122 @@ namespace Vulkan
 		std::vector<BufferBlock> ubo;
 	};
 	
+	// Uploads up to VULKAN_UPLOAD_RING_MAX_ALLOCATION are staged in a persistent ring buffer, larger ones get their own staging buffer
+	static const VkDeviceSize VULKAN_UPLOAD_RING_SIZE = 32 * 1024 * 1024;
+	static const VkDeviceSize VULKAN_UPLOAD_RING_MAX_ALLOCATION = VULKAN_UPLOAD_RING_SIZE / 4;
+	// Pending uploads are submitted early once they add up to this many bytes
+	static const VkDeviceSize VULKAN_UPLOAD_FLUSH_THRESHOLD = 8 * 1024 * 1024;
+
+	struct PendingBufferUpload
+	{
+		VkBuffer dst;
+		// VK_NULL_HANDLE fills the buffer with zeros
+		VkBuffer src;
+		VkDeviceSize src_offset;
+		VkDeviceSize dst_offset;
+		VkDeviceSize size;
+	};
+
+	struct PendingImageUpload
+	{
+		VkImage dst;
+		VkBuffer src;
+		// Range in UploadQueues::blits
+		uint32_t first_blit;
+		uint32_t num_blits;
+	};
+
+	struct UploadBatch
+	{
+		uint64_t timeline;
+		Fence fence;
+		// Ring position after the batch's last staging region
+		uint64_t ring_end;
+		// Imported host memory copied from by the batch, freed as soon as it completes
+		std::vector<BufferAllocation> imported;
+	};
+
+	// Copies of initial resource data, recorded into a single AsyncTransfer command buffer when flushed
+	struct UploadQueues
+	{
+		BufferHandle ring;
+		uint8_t* ring_mapped = nullptr;
+		// Monotonic byte positions, the write offset is ring_head % VULKAN_UPLOAD_RING_SIZE
+		uint64_t ring_head = 0;
+		uint64_t ring_tail = 0;
+
+		std::vector<PendingBufferUpload> buffers;
+		std::vector<PendingImageUpload> images;
+		std::vector<VkBufferImageCopy> blits;
+		std::vector<VkImageMemoryBarrier> image_transitions;
+		// Layout transitions and queue family releases recorded after the copies
+		std::vector<VkBufferMemoryBarrier> buffer_releases;
+		std::vector<VkImageMemoryBarrier> image_releases;
+		// Stages of the graphics and compute queues which have to wait for the batch
+		VkPipelineStageFlags graphics_stages = 0;
+		VkPipelineStageFlags compute_stages = 0;
+		VkDeviceSize pending_bytes = 0;
+		std::vector<BufferAllocation> imported;
+
+		std::deque<UploadBatch> in_flight;
+		uint64_t submitted_timeline = 0;
+		uint64_t completed_timeline = 0;
+	};
+
+	// Size of each frame context's transient rings, used instead of the block pools when memory is both device local and host visible
+	static const VkDeviceSize VULKAN_TRANSIENT_VBO_RING_SIZE = 4 * 1024 * 1024;
+	static const VkDeviceSize VULKAN_TRANSIENT_IBO_RING_SIZE = 2 * 1024 * 1024;
+	static const VkDeviceSize VULKAN_TRANSIENT_UBO_RING_SIZE = 4 * 1024 * 1024;
+
+	// Readbacks up to VULKAN_READBACK_RING_MAX_ALLOCATION are copied into a persistent host cached ring. Larger ones,
+	// and those made while the ring is full, get a buffer of their own.
+	static const VkDeviceSize VULKAN_READBACK_RING_SIZE = 16 * 1024 * 1024;
+	static const VkDeviceSize VULKAN_READBACK_RING_MAX_ALLOCATION = VULKAN_READBACK_RING_SIZE / 4;
+
+	// Called with the read back data, which stays valid until the callback returns
+	using ReadbackCallback = std::function<void(const void* data, VkDeviceSize size)>;
+	// Identifies a readback, 0 is never a valid ticket
+	using ReadbackTicket = uint64_t;
+
+	struct ReadbackRequest
+	{
+		ReadbackTicket ticket = 0;
+		// Dedicated buffer, the ring is used if this is empty
+		BufferHandle buffer;
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+		// Ring position after the request's region
+		uint64_t ring_end = 0;
+		ReadbackCallback callback;
+
+		// Completion point, set when the command buffer is submitted
+		bool submitted = false;
+		VkSemaphore timeline = VK_NULL_HANDLE;
+		uint64_t timeline_value = 0;
+		uint64_t frame_serial = 0;
+		bool gpu_complete = false;
+
+		bool dispatched = false;
+		Quantum::TaskGroup task;
+		// Set once the callback has returned
+		std::atomic_bool done{ false };
+	};
+
+	struct ReadbackQueues
+	{
+		BufferHandle ring;
+		uint8_t* ring_mapped = nullptr;
+		uint64_t ring_head = 0;
+		uint64_t ring_tail = 0;
+
+		// Ordered by ticket
+		std::deque<ReadbackRequest> requests;
+		ReadbackTicket next_ticket = 1;
+		// Number of frame contexts begun, used to detect completion without timeline semaphores
+		uint64_t frame_serial = 0;
+		Quantum::ThreadGroup* thread_group = nullptr;
+	};
+
 	struct SwapchainImages
 	{
 		ImageHandle image;
@@ -101,14 +224,123 @@ namespace Vulkan
 	};
 
 	//Contains data about a queue
+	//A submit recorded by SubmitQueue, handed to the driver together with the other batches of its queue
+	struct QueueBatch
+	{
+		Util::SmallVector<VkCommandBuffer> cmds;
+		Util::SmallVector<VkSemaphore> waits;
+		Util::SmallVector<uint64_t> wait_values;
+		Util::SmallVector<VkPipelineStageFlags> wait_stages;
+		Util::SmallVector<VkSemaphore> signals;
+		Util::SmallVector<uint64_t> signal_values;
+		//Signals the WSI release semaphore, so later batches must not delay it
+		bool sealed = false;
+	};
+
 	struct QueueData
 	{
 		Util::SmallVector<Semaphore> wait_semaphores;
 		Util::SmallVector<VkPipelineStageFlags> wait_stages;
+		//Timeline values of other queues the next batch waits on, one per timeline
+		Util::SmallVector<VkSemaphore> wait_timelines;
+		Util::SmallVector<uint64_t> wait_timeline_values;
+		Util::SmallVector<VkPipelineStageFlags> wait_timeline_stages;
 		bool need_fence = false;
 
 		VkSemaphore timeline_semaphore = VK_NULL_HANDLE;
 		uint64_t current_timeline = 0;
+		//Highest timeline value passed to the driver, values above it are still in batches
+		uint64_t submitted_timeline = 0;
+		std::vector<QueueBatch> batches;
+
+		bool HasWaits() const
+		{
+			return !wait_semaphores.empty() || !wait_timelines.empty();
+		}
+	};
+
+	//A point on the timeline of a queue, reached once everything submitted to the queue up to it has completed
+	struct QueuePoint
+	{
+		CommandBuffer::Type queue = CommandBuffer::Type::Generic;
+		uint64_t value = 0;
+	};
+
+	//Makes a submit wait for a point on another queue
+	struct QueueWait
+	{
+		QueuePoint point;
+		VkPipelineStageFlags stages = 0;
+	};
+
+	// Called once the GPU has reached a value on a queue's timeline
+	using CompletionCallback = std::function<void()>;
+
+	// The completion watcher wakes up at least this often to pick up requests with lower values than the ones it waits on
+	static const uint64_t VULKAN_COMPLETION_WATCHER_TIMEOUT_NS = 1000000;
+
+	struct CompletionRequest
+	{
+		// Physical queue type
+		CommandBuffer::Type queue;
+		uint64_t value;
+		CompletionCallback callback;
+	};
+
+	struct CompletionQueues
+	{
+		// In registration order
+		std::vector<CompletionRequest> requests;
+		// Highest value known to be complete on the graphics, compute and transfer queue
+		uint64_t completed[3] = {};
+
+		std::thread watcher;
+		std::mutex watcher_lock;
+		std::condition_variable watcher_cond;
+		bool watcher_running = false;
+		bool watcher_wake = false;
+	};
+
+	//Queue submission counters for a single frame
+	struct SubmissionStats
+	{
+		//Flushes of a queue's command buffers, one per Submit() with a fence or semaphores and per frame flush
+		uint32_t flushes = 0;
+		//Flushes appended to the previous batch instead of starting their own
+		uint32_t merged_flushes = 0;
+		//Batches (VkSubmitInfo) handed to the driver
+		uint32_t batches = 0;
+		//vkQueueSubmit or vkQueueSubmit2 calls
+		uint32_t queue_submits = 0;
+	};
+
+	//CPU/GPU overlap of a single frame, measured by NextFrameContext
+	struct FrameTelemetry
+	{
+		//Frame contexts in use
+		uint32_t frames_in_flight = 0;
+		//Time NextFrameContext blocked on the GPU before it could reuse the frame context
+		uint64_t cpu_wait_ns = 0;
+		//Time since the previous NextFrameContext
+		uint64_t cpu_frame_ns = 0;
+		//Jobs left in the submission thread once the frame was submitted, 0 without one
+		uint32_t submission_queue_depth = 0;
+		//Only set with frame timestamps enabled. Refers to the frame which last used the frame context, which just completed.
+		bool gpu_valid = false;
+		//Graphics queue time from the first to the last command of that frame
+		uint64_t gpu_frame_ns = 0;
+		//Time the graphics queue was idle between the previous frame and that one
+		uint64_t gpu_idle_ns = 0;
+	};
+
+	struct FrameTelemetryState
+	{
+		FrameTelemetry last;
+		bool timestamps = false;
+		int64_t frame_begin_ns = 0;
+		//End timestamp of the last frame whose results were read
+		uint64_t gpu_frame_end = 0;
+		bool gpu_frame_end_valid = false;
 	};
 
 	//Fence used internally by device
@@ -126,6 +358,7 @@ namespace Vulkan
 		FenceManager fence;
 		SemaphoreManager semaphore;
 		EventManager event;
+		DescriptorPoolManager descriptor_pool;
 		BufferPool vbo, ibo, ubo, staging;
 		//TimestampIntervalManager timestamps;
 	};
@@ -169,6 +402,7 @@ namespace Vulkan
 		std::vector<BufferBlock> ibo_blocks;
 		std::vector<BufferBlock> ubo_blocks;
 		std::vector<BufferBlock> staging_blocks;
+		TransientRings transient_rings;
 
 		VkSemaphore graphics_timeline_semaphore;
 		VkSemaphore compute_timeline_semaphore;
@@ -180,12 +414,29 @@ namespace Vulkan
 		std::vector<VkFence> wait_fences;
 		std::vector<VkFence> recycle_fences;
 
+		//Start and end of the frame's graphics work, created once frame timestamps are enabled
+		VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+		bool timestamp_started = false;
+		bool timestamp_ended = false;
+
 		std::vector<VkFramebuffer> destroyed_framebuffers;
 		std::vector<VkSampler> destroyed_samplers;
 		std::vector<VkImageView> destroyed_image_views;
 		std::vector<VkBufferView> destroyed_buffer_views;
 		std::vector<std::pair<VkImage, DeviceAllocation>> destroyed_images;
 		std::vector<std::pair<VkBuffer, DeviceAllocation>> destroyed_buffers;
+		// Memory shared by aliased images, freed after the images are destroyed
+		std::vector<DeviceAllocation> freed_aliased_memory;
+
+		// Arena ranges of destroyed SubBuffers
+		struct FreedSubBuffer
+		{
+			BufferArenaHandle arena;
+			BufferArenaChunk* chunk;
+			VkDeviceSize offset;
+			uint32_t order;
+		};
+		std::vector<FreedSubBuffer> freed_sub_buffers;
 
 		std::vector<Program*> destroyed_programs;
 		std::vector<Shader*> destroyed_shaders;
@@ -212,6 +463,7 @@ namespace Vulkan
 		friend class SemaphoreHolder;
 		friend struct SemaphoreHolderDeleter;
 		friend class FenceHolder;
+		friend class SubmissionThread;
 		friend struct FenceHolderDeleter;
 		friend class Sampler;
 		friend struct SamplerDeleter;
@@ -219,6 +471,10 @@ namespace Vulkan
 		friend struct BufferDeleter;
 		friend class BufferView;
 		friend struct BufferViewDeleter;
+		friend class BufferArena;
+		friend struct BufferArenaDeleter;
+		friend class SubBuffer;
+		friend struct SubBufferDeleter;
 		friend class ImageView;
 		friend struct ImageViewDeleter;
 		friend class Image;
@@ -237,6 +493,9 @@ namespace Vulkan
 		friend class Cookie;
 		friend class Framebuffer;
 		friend class FramebufferAllocator;
+		friend class AliasedAttachmentAllocator;
+		friend class FrameGraph;
+		friend class ResidencyManager;
 		friend class RenderPass;
 		friend class Texture;
 		friend class UniformManager;
@@ -261,6 +520,9 @@ namespace Vulkan
 		// (since TBDR renderers typically require a bit more buffering for optimal performance).
 		// A frame context generally maps to an on-screen frame, but it does not have to.
 		void InitFrameContexts(unsigned count);
+		// Changes the number of frame contexts without waiting for the device to go idle.
+		// Only the frame contexts which are removed are waited on. Frame context indices may change.
+		void SetFramesInFlight(unsigned count);
 
 		// Returns the current image view
 		ImageView& GetSwapchainView();
@@ -290,8 +552,34 @@ namespace Vulkan
 
 		// Submission interface, may be called from any thread at any time.
 
-		// Make sure all pending submits to the current frame are processed
+		// Make sure all pending submits to the current frame are processed and handed to the driver
 		void FlushFrame();
+		// With timeline semaphores, submits are batched per queue and only handed to the driver by FlushFrame(), the end of the frame context,
+		// or when a fence wait or a batch on another queue depends on them. Enabled by default, disabling submits on every flush again.
+		void SetSubmissionBatching(bool enable);
+		// Moves vkQueueSubmit and Present() onto a dedicated thread, Submit() and FlushFrame() then return once the work is enqueued.
+		// Submits go through the thread in the order they were made, so dependencies between them are kept. Disabled by default.
+		void SetSubmissionThread(bool enable);
+		bool HasSubmissionThread() const
+		{
+			return submission_thread != nullptr;
+		}
+		// Presents on the graphics queue, ordered after all submits so far. With a submission thread, the present is enqueued
+		// and the return value is the error of an earlier present if there was one, VK_SUCCESS otherwise.
+		VkResult Present(const PresentRequest& request);
+		// Returns queue submission counters of the last frame context
+		const SubmissionStats& GetSubmissionStats() const
+		{
+			return last_submission_stats;
+		}
+		// Returns CPU/GPU overlap counters of the last NextFrameContext()
+		const FrameTelemetry& GetFrameTelemetry() const
+		{
+			return telemetry.last;
+		}
+		// Writes timestamps around the graphics work of every frame, so FrameTelemetry has GPU times.
+		// Needs timestamp support on the graphics queue.
+		void SetFrameTimestamps(bool enable);
 
 		// Command buffers are transient in QuantumVk.
 		// Once you request a command buffer you must submit it in the current frame context before moving to the next one.
@@ -309,6 +597,13 @@ namespace Vulkan
 		void SubmitEmpty(CommandBuffer::Type type,  Fence* fence = nullptr,unsigned semaphore_count = 0, Semaphore* semaphore = nullptr);
 		//Adds a wait semaphore and wait stages to the next queue submit of a certain type
 		void AddWaitSemaphore(CommandBuffer::Type type, Semaphore semaphore, VkPipelineStageFlags stages, bool flush);
+		// Submits cmd after the points in waits were reached, and returns the point its queue reaches once cmd completed.
+		// Waits go on the queues' timeline semaphores directly, no semaphores are allocated. Flushes the command buffers pending on the queue.
+		QueuePoint Submit(CommandBufferHandle& cmd, unsigned wait_count, const QueueWait* waits);
+		// Makes the next submit of a certain type wait for a point. Points of the same queue are ordered by submission already and ignored.
+		void AddWaitPoint(CommandBuffer::Type type, const QueuePoint& point, VkPipelineStageFlags stages);
+		// Returns a fence for CPU waits on a point, a plain (timeline, value) pair if timeline semaphores are supported
+		Fence RequestFence(const QueuePoint& point);
 		CommandBuffer::Type GetPhysicalQueueType(CommandBuffer::Type queue_type) const;
 
 		// Creates a new shader using spirv code. Code is stored in 4 byte words. num_words in the number of words in the spirv shader program.
@@ -339,13 +634,31 @@ namespace Vulkan
 
 		// Creates and allocates a buffer and images.
 		BufferHandle CreateBuffer(const BufferCreateInfo& info,  const void* initial = nullptr);
+		// Creates an arena which suballocates SubBuffers out of large buffers
+		BufferArenaHandle CreateBufferArena(const BufferArenaCreateInfo& info);
+		// Suballocates a range of at least size bytes from the arena. Initial data is uploaded like with CreateBuffer.
+		SubBufferHandle CreateSubBuffer(BufferArena& arena, VkDeviceSize size, const void* initial = nullptr);
+		// Wraps host memory in a buffer without copying it, using VK_EXT_external_memory_host. The domain is ignored.
+		// host_pointer and info.size must be multiples of GetHostImportAlignment(), and the memory must outlive the buffer.
+		// Returns an empty handle if the import is not possible.
+		BufferHandle ImportHostBuffer(const BufferCreateInfo& info, void* host_pointer);
+		// Returns the alignment required by ImportHostBuffer, or 0 if host memory can't be imported
+		VkDeviceSize GetHostImportAlignment() const;
 		// Creates and allocates an image
 		ImageHandle CreateImage(const ImageCreateInfo& info);
-		ImageHandle CreateImage(const ImageCreateInfo& info, size_t buffer_size, void* buffer, uint32_t num_copies, ImageStagingCopyInfo* copies);
+		ImageHandle CreateImage(const ImageCreateInfo& info, size_t buffer_size, const void* buffer, uint32_t num_copies, const ImageStagingCopyInfo* copies);
 		ImageHandle CreateUncompressedImage(const ImageCreateInfo& info, InitialImageData initial);
 
 		// Creates an image using a staging buffer
 		ImageHandle CreateImageFromStagingBuffer(const ImageCreateInfo& info, const InitialImageBuffer* buffer);
+		// Returns the memory requirements an image created with info would have
+		bool GetImageMemoryRequirements(const ImageCreateInfo& info, VkMemoryRequirements* reqs);
+		// Allocates memory which several images can be bound to with CreateAliasedImage. Only Physical and Transient domains are supported.
+		bool AllocateAliasedMemory(const VkMemoryRequirements& reqs, ImageDomain domain, DeviceAllocation* allocation);
+		// Frees aliased memory once the current frame context completes. Images bound to it must be released first.
+		void FreeAliasedMemory(const DeviceAllocation& allocation);
+		// Creates an image bound to memory at offset, without allocating. Contents are undefined whenever another image bound to the same range was written.
+		ImageHandle CreateAliasedImage(const ImageCreateInfo& info, const DeviceAllocation& memory, VkDeviceSize offset);
 		// Essentially an image that can be sampled on the GPU as a vk image, but it also has a vkbuffer conterpart on the cpu
 		LinearHostImageHandle CreateLinearHostImage(const LinearHostImageCreateInfo& info);
 
@@ -353,7 +666,7 @@ namespace Vulkan
 
 		// Image must be uncompressed.
 		InitialImageBuffer CreateUncompressedImageStagingBuffer(const ImageCreateInfo& info, InitialImageData initial);
-		InitialImageBuffer CreateImageStagingBuffer(const ImageCreateInfo& info, size_t buffer_size, void* buffer, uint32_t num_copies, ImageStagingCopyInfo* copies);
+		InitialImageBuffer CreateImageStagingBuffer(const ImageCreateInfo& info, size_t buffer_size, const void* buffer, uint32_t num_copies, const ImageStagingCopyInfo* copies);
 
 		// Create image view
 		ImageViewHandle CreateImageView(const ImageViewCreateInfo& view_info);
@@ -376,6 +689,8 @@ namespace Vulkan
 		ImageView& GetTransientAttachment(uint32_t width, uint32_t height, VkFormat format, uint32_t index = 0, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT, uint32_t layers = 1);
 		// Returns a physical attachment
 		ImageView& GetPhysicalAttachment(uint32_t width, uint32_t height, VkFormat format, uint32_t index = 0, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT, uint32_t layers = 1);
+		// Returns the allocator placing attachments with non-overlapping lifetimes in shared memory
+		AliasedAttachmentAllocator& GetAliasedAttachmentAllocator() { return aliased_allocator; }
 		// Gets the renderpassinfo from a SwapchainRenderPass enum
 		RenderPassInfo GetSwapchainRenderPass(SwapchainRenderPass style);
 
@@ -439,10 +754,86 @@ namespace Vulkan
 		}
 		// Return whether the swapchain has been used in this frame
 		bool SwapchainTouched() const;
+		// Returns whether images can be created with IMAGE_MISC_SPARSE_RESIDENCY_BIT
+		bool SupportsSparseResidency() const
+		{
+			return sparse_queue != VK_NULL_HANDLE && feat.sparseResidencyImage2D;
+		}
+		// Executes sparse binds on the sparse queue. The next graphics and compute submissions wait for the binds in the given stages.
+		void BindSparse(const VkBindSparseInfo& info, VkPipelineStageFlags graphics_stages, VkPipelineStageFlags compute_stages);
 
 		// Returns the queue family index associated with a particular command buffer type
 		uint32_t GetQueueFamilyIndex(CommandBuffer::Type type) const;
 
+		// Returns the number of thread indices the device was set up with
+		unsigned GetNumThreadIndices() const
+		{
+			return num_thread_indices;
+		}
+
+		// Returns descriptor pool and set counters of the last completed frame context
+		const DescriptorStats& GetDescriptorStats() const
+		{
+			return managers.descriptor_pool.GetLastFrameStats();
+		}
+
+		// Returns the usage and budget of a memory heap as queried at the start of the frame context
+		const MemoryHeapBudget& GetMemoryHeapBudget(uint32_t heap_index) const
+		{
+			VK_ASSERT(heap_index < mem_props.memoryHeapCount);
+			return managers.memory.GetHeapBudgets()[heap_index];
+		}
+		// Queries up to date usage and budget of every memory heap. budgets must hold GetMemoryProperties().memoryHeapCount entries.
+		void QueryMemoryHeapBudgets(MemoryHeapBudget* budgets);
+		// Returns the bytes currently allocated for a category
+		VkDeviceSize GetMemoryCategoryUsage(MemoryCategory category) const
+		{
+			return managers.memory.GetCategoryUsage(category);
+		}
+		// Returns whether the heap's usage exceeded the pressure threshold at the start of the frame context
+		bool IsMemoryHeapUnderPressure(uint32_t heap_index) const;
+		// Sets a callback called by NextFrameContext for every heap whose usage exceeds threshold * budget.
+		// The device lock isn't held during the call, so resources can be released from it. Not thread safe, set it during init.
+		void SetMemoryPressureCallback(std::function<void(uint32_t heap_index, const MemoryHeapBudget& budget)> callback, float threshold = 0.9f);
+
+		// Enables incremental defragmentation of buffers created with BUFFER_MISC_DEFRAGMENTABLE_BIT. Every frame context moves at most
+		// info.max_moves_per_frame buffers, copying them on the AsyncTransfer queue. Disabling lets the running plan finish first.
+		void SetDefragmentation(bool enable, const DefragmentationInfo& info = {});
+
+		// Initial data of buffers and images is copied through a persistent staging ring and batched into one AsyncTransfer submission,
+		// made when graphics or compute work is submitted, at the end of the frame context or after VULKAN_UPLOAD_FLUSH_THRESHOLD bytes.
+		// Returns the upload timeline value which covers every upload recorded so far
+		uint64_t GetUploadTimeline();
+		// Returns whether every upload up to value has completed on the GPU, never blocks
+		bool IsUploadTimelineComplete(uint64_t value);
+		// Submits pending uploads if needed and blocks until every upload up to value has completed
+		void WaitUploadTimeline(uint64_t value);
+		// Submits all pending uploads
+		void FlushUploads();
+
+		// Records a copy of a buffer range into cmd, the callback is called with the data once cmd has completed on the GPU.
+		// Writes to the source must be visible to VK_PIPELINE_STAGE_TRANSFER_BIT. Returns 0 if no readback memory was available.
+		ReadbackTicket RequestReadback(CommandBuffer& cmd, const Buffer& buffer, VkDeviceSize offset, VkDeviceSize size, ReadbackCallback callback);
+		// Same as above for an image region in layout, the data is tightly packed
+		ReadbackTicket RequestReadback(CommandBuffer& cmd, const Image& image, VkImageLayout layout, const VkImageSubresourceLayers& subresource,
+			VkOffset3D offset, VkExtent3D extent, ReadbackCallback callback);
+		// Returns whether the readback's callback has returned
+		bool IsReadbackComplete(ReadbackTicket ticket);
+		// Dispatches the callbacks of completed readbacks. Called by NextFrameContext, never blocks on the GPU.
+		void PollReadbacks();
+		// Callbacks run as tasks on the thread group, or on the polling thread if there is none. Set it during init.
+		void SetReadbackThreadGroup(Quantum::ThreadGroup* group);
+
+		// Registers a callback for when a queue reached timeline_value, e.g. the value of a QueuePoint. Callbacks are called in registration order
+		// by PollCompletions(), never from OnComplete() itself. A value only completes once it was handed to the driver, by the end of its frame context at the latest.
+		void OnComplete(CommandBuffer::Type type, uint64_t timeline_value, CompletionCallback callback);
+		void OnComplete(const QueuePoint& point, CompletionCallback callback);
+		// Calls the callbacks of completed values. Called by NextFrameContext and the completion watcher, never blocks on the GPU.
+		void PollCompletions();
+		// Starts a thread which waits for the lowest pending value of every queue with a single vkWaitSemaphores, so callbacks are called
+		// as soon as their value completes instead of at the next frame context. Needs timeline semaphores, disabled by default.
+		void SetCompletionWatcher(bool enable);
+
 	private:
 
 		//Hold on to a reference to context
@@ -455,6 +846,8 @@ namespace Vulkan
 		VkQueue graphics_queue = VK_NULL_HANDLE;
 		VkQueue compute_queue = VK_NULL_HANDLE;
 		VkQueue transfer_queue = VK_NULL_HANDLE;
+		// One of the queues above whose family supports sparse binding, or VK_NULL_HANDLE
+		VkQueue sparse_queue = VK_NULL_HANDLE;
 		uint32_t timestamp_valid_bits = 0;
 		unsigned num_thread_indices = 1;
 
@@ -471,9 +864,21 @@ namespace Vulkan
 		void RequestUniformBlock(BufferBlock& block, VkDeviceSize size);
 		void RequestStagingBlock(BufferBlock& block, VkDeviceSize size);
 
+		// Returns the counters of the block pool for VertexPool, IndexPool, UniformPool or Staging
+		BufferPoolStats GetBufferPoolStats(MemoryCategory category);
+		// Sets how many frames free blocks of every pool are kept before they are released, 0 keeps them forever
+		void SetBufferPoolTrimFrames(uint32_t frames);
+
 		void SetAcquireSemaphore(unsigned index, Semaphore acquire);
 		Semaphore ConsumeReleaseSemaphore();
 
+		// Host data, when given, is staged through the upload ring if the copy can be batched
+		// Aliased images are bound to alias at alias_offset instead of getting their own allocation
+		ImageHandle CreateImageInner(const ImageCreateInfo& info, const InitialImageBuffer* staging_buffer, const void* staging_data, VkDeviceSize staging_size,
+			const DeviceAllocation* alias = nullptr, VkDeviceSize alias_offset = 0);
+		// Translates create_info, sharing_indices must hold 3 entries. Returns false if the image can't be created.
+		bool FillImageCreateInfo(const ImageCreateInfo& create_info, bool has_staging, VkImageCreateInfo* info, uint32_t* sharing_indices, VkImageFormatListCreateInfoKHR* format_info);
+
 		const Framebuffer& RequestFramebuffer(const RenderPassInfo& info);
 		const RenderPass& RequestRenderPass(const RenderPassInfo& info, bool compatible);
 
@@ -506,6 +911,34 @@ namespace Vulkan
 		DmaQueues dma;
 		//Flush all pending submission to a certain queue type. 
 		void SubmitQueue(CommandBuffer::Type type, InternalFence* fence,  unsigned semaphore_count = 0, Semaphore* semaphore = nullptr);
+		//Returns the batch to record into, which is the previous one if there are no waits to add
+		QueueBatch& AddQueueBatchNolock(QueueData& data, bool has_waits);
+		void ConsumeWaitSemaphoresNolock(QueueData& data, QueueBatch& batch);
+		//Signals the timeline, fence and semaphores of the last batch, and submits it unless it can be deferred
+		void FinishQueueBatchNolock(CommandBuffer::Type type, InternalFence* fence, unsigned semaphore_count, Semaphore* semaphores);
+		//Hands all batches of a queue to the driver in a single call, after the batches of other queues they wait on
+		void SubmitBatchesNolock(CommandBuffer::Type type, VkFence fence = VK_NULL_HANDLE);
+		void SubmitAllBatchesNolock();
+		//Makes sure a timeline value was handed to the driver, so the CPU can wait on it
+		void FlushTimeline(VkSemaphore timeline, uint64_t value);
+		void FlushTimelineNolock(VkSemaphore timeline, uint64_t value);
+
+		//Executes batches on a queue, possibly from the submission thread
+		VkResult SubmitQueueBatches(VkQueue queue, const std::vector<QueueBatch>& batches, VkFence fence);
+		VkResult PresentQueue(VkQueue queue, const PresentRequest& request);
+		//Waits for the submission thread, before queue operations which don't go through it
+		void DrainSubmissionThreadNolock();
+		std::unique_ptr<SubmissionThread> submission_thread;
+
+		bool submission_batching = true;
+		SubmissionStats submission_stats;
+		SubmissionStats last_submission_stats;
+
+		FrameTelemetryState telemetry;
+		//Records the start and end timestamp of the current frame context's graphics work
+		void WriteFrameTimestampNolock(bool start);
+		//Reads the timestamps of the frame which last used the current frame context into telemetry
+		void ReadFrameTimestampsNolock(FrameTelemetry& frame_telemetry);
 
 		//Return the current PerFrame object
 		PerFrame& Frame()
@@ -541,6 +974,7 @@ namespace Vulkan
 		FramebufferAllocator framebuffer_allocator;
 		TransientAttachmentAllocator transient_allocator;
 		PhysicalAttachmentAllocator physical_allocator;
+		AliasedAttachmentAllocator aliased_allocator;
 
 		VulkanDynamicArrayPool array_pool;
 
@@ -574,6 +1008,72 @@ namespace Vulkan
 		std::function<void()> queue_lock_callback;
 		std::function<void()> queue_unlock_callback;
 
+		struct DefragmentableBuffer
+		{
+			Buffer* buffer = nullptr;
+			// Whether the allocation was handed to the running defragmentation
+			bool in_context = false;
+			// Create info of the VkBuffer, a moved buffer is recreated with it. pQueueFamilyIndices is left null, the families are kept here.
+			VkBufferCreateInfo create_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+			uint32_t queue_families[3] = {};
+		};
+
+		struct DefragmentationState
+		{
+			bool enabled = false;
+			// Set when memory was freed since the last plan, a new plan is only made if something could have changed
+			bool dirty = true;
+			DefragmentationInfo info;
+			std::unordered_map<VmaAllocation, DefragmentableBuffer> buffers;
+			VmaDefragmentationContext context = VK_NULL_HANDLE;
+			// Buffers destroyed while their allocation is part of the running defragmentation, freed when it ends
+			std::vector<std::pair<VkBuffer, DeviceAllocation>> deferred_frees;
+			// Old handles of the buffers moved by the pass in flight
+			std::vector<VkBuffer> retired_buffers;
+			bool pass_in_flight = false;
+			unsigned pass_frame_context = 0;
+			uint32_t cycle_moves = 0;
+		};
+
+		DefragmentationState defrag;
+		void DefragmentStepNolock();
+		void RecordDefragmentationPassNolock();
+		void CommitDefragmentationPassNolock();
+		void EndDefragmentationNolock();
+		void FinishDefragmentationNolock();
+
+		UploadQueues uploads;
+		bool HasPendingUploadsNolock() const;
+		// Copies data into the upload ring, waiting for old batches if it is full
+		bool WriteUploadRingNolock(const void* data, VkDeviceSize size, VkDeviceSize alignment, VkBuffer* buffer, VkDeviceSize* offset);
+		void AddBufferUploadNolock(VkBuffer dst, VkDeviceSize dst_offset, VkBuffer src, VkDeviceSize src_offset, VkDeviceSize size);
+		void AddImageUploadNolock(const Image& image, VkBuffer src, VkDeviceSize src_offset, VkDeviceSize size, uint32_t num_blits, const VkBufferImageCopy* blits, VkImageLayout final_layout);
+		// Makes the queue of type wait for the batch containing the current uploads
+		void AddUploadConsumerNolock(CommandBuffer::Type type, VkPipelineStageFlags stages);
+		// Called once every command of an upload was added, submits the batch if it grew past the threshold
+		void CommitUploadNolock();
+		void FlushUploadsNolock();
+		void RetireUploadsNolock();
+
+		// Returns the current frame context's transient rings, or nullptr if they aren't supported
+		TransientRings* GetTransientRingsNolock();
+		bool transient_rings_supported = true;
+
+		ReadbackQueues readbacks;
+		// Adds a request with space for size bytes, returns nullptr if none could be allocated
+		ReadbackRequest* AllocateReadbackNolock(VkDeviceSize size, VkDeviceSize alignment, ReadbackCallback callback);
+		void SubmitReadbackNolock(ReadbackTicket ticket, VkSemaphore timeline, uint64_t timeline_value);
+		bool IsReadbackGPUCompleteNolock(const ReadbackRequest& request);
+
+		CompletionQueues completions;
+		void UpdateCompletedTimelinesNolock();
+		void CompletionWatcherLoop();
+
+		std::function<void(uint32_t, const MemoryHeapBudget&)> memory_pressure_callback;
+		float memory_pressure_threshold = 0.9f;
+		//Calls the memory pressure callback for every heap over the threshold
+		void NotifyMemoryPressure();
+
 		//Flushs all pending submission of a certain type for the current frame
 		void FlushFrame(CommandBuffer::Type type);
 		//Flushes all pending DMA staging writes
@@ -581,6 +1081,8 @@ namespace Vulkan
 		void SubmitEmptyInner(CommandBuffer::Type type, InternalFence* fence, unsigned semaphore_count, Semaphore* semaphore);
 
 		void DestroyBuffer(VkBuffer buffer, const DeviceAllocation& allocation);
+		void FreeSubBuffer(const BufferArenaHandle& arena, BufferArenaChunk* chunk, VkDeviceSize offset, uint32_t order);
+		void ReleaseBufferArenaChunks(std::vector<std::unique_ptr<BufferArenaChunk>>& chunks);
 		void DestroyImage(VkImage image, const DeviceAllocation& allocation);
 		void DestroyImageView(VkImageView view);
 		void DestroyBufferView(VkBufferView view);
@@ -594,7 +1096,9 @@ namespace Vulkan
 		void DestroyProgramNoLock(Program* program);
 
 		void DestroyBufferNolock(VkBuffer buffer, const DeviceAllocation& allocation);
+		void FreeSubBufferNolock(const BufferArenaHandle& arena, BufferArenaChunk* chunk, VkDeviceSize offset, uint32_t order);
 		void DestroyImageNolock(VkImage image, const DeviceAllocation& allocation);
+		void FreeAliasedMemoryNolock(const DeviceAllocation& allocation);
 		void DestroyImageViewNolock(VkImageView view);
 		void DestroyBufferViewNolock(VkBufferView view);
 		void DestroySamplerNolock(VkSampler sampler);
@@ -606,10 +1110,11 @@ namespace Vulkan
 
 		void FlushFrameNolock();
 		CommandBufferHandle RequestCommandBufferNolock(unsigned thread_index, CommandBuffer::Type type);
-		//Ends command buffer. If there is a fence or semaphore to signal, this submits to queue immediately, otherwise deffer submission.
+		//Ends command buffer. If there is a fence or semaphore to signal, this flushes the queue into a batch, otherwise deffer submission.
 		void SubmitNolock(CommandBufferHandle cmd, Fence* fence, unsigned semaphore_count, Semaphore* semaphore);
 		void SubmitEmptyNolock(CommandBuffer::Type type, Fence* fence, unsigned semaphore_count, Semaphore* semaphore);
 		void AddWaitSemaphoreNolock(CommandBuffer::Type type, Semaphore semaphore, VkPipelineStageFlags stages, bool flush);
+		void AddWaitPointNolock(CommandBuffer::Type type, const QueuePoint& point, VkPipelineStageFlags stages);
 
 		void RequestVertexBlockNolock(BufferBlock& block, VkDeviceSize size);
 		void RequestIndexBlockNolock(BufferBlock& block, VkDeviceSize size);
@@ -617,9 +1122,19 @@ namespace Vulkan
 		void RequestStagingBlockNolock(BufferBlock& block, VkDeviceSize size);
 
 		CommandBufferHandle RequestSecondaryCommandBufferForThread(unsigned thread_index, const Framebuffer* framebuffer, unsigned subpass, CommandBuffer::Type type = CommandBuffer::Type::Generic);
+		CommandBufferHandle RequestSecondaryCommandBufferNolock(unsigned thread_index, const Framebuffer* framebuffer, unsigned subpass, CommandBuffer::Type type);
+		// Requests count secondary command buffers under a single lock, the i-th one for thread index first_thread_index + i
+		void RequestSecondaryCommandBuffers(unsigned first_thread_index, unsigned count, const Framebuffer* framebuffer, unsigned subpass, CommandBufferHandle* secondaries);
+
+		// Descriptor bindings of each thread, shared by every program and command buffer recorded on that thread
+		std::vector<std::unique_ptr<ResourceBindings>> thread_bindings;
+		ResourceBindings& GetResourceBindingsNolock(unsigned thread_index);
+
 		void AddFrameCounterNolock();
 		void DecrementFrameCounterNolock();
 		void SubmitSecondary(CommandBuffer& primary, CommandBuffer& secondary);
+		// Executes the secondaries in order with a single vkCmdExecuteCommands
+		void SubmitSecondaries(CommandBuffer& primary, unsigned count, CommandBufferHandle* secondaries);
 		void WaitIdleNolock();
 		void EndFrameNolock();
 
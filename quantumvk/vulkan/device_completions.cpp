@@ -0,0 +1,185 @@
+#include "device.hpp"
+
+#include <algorithm>
+
+#ifdef QM_VULKAN_MT
+#define LOCK() std::lock_guard<std::mutex> holder__{lock.lock}
+#else
+#define LOCK() ((void)0)
+#endif
+
+namespace Vulkan
+{
+	static unsigned CompletionQueueIndex(CommandBuffer::Type type)
+	{
+		switch (type)
+		{
+		default:
+		case CommandBuffer::Type::Generic:
+			return 0;
+		case CommandBuffer::Type::AsyncCompute:
+			return 1;
+		case CommandBuffer::Type::AsyncTransfer:
+			return 2;
+		}
+	}
+
+	static const CommandBuffer::Type completion_queue_types[3] = {
+		CommandBuffer::Type::Generic, CommandBuffer::Type::AsyncCompute, CommandBuffer::Type::AsyncTransfer
+	};
+
+	void Device::OnComplete(CommandBuffer::Type type, uint64_t timeline_value, CompletionCallback callback)
+	{
+		{
+			LOCK();
+			CompletionRequest request;
+			request.queue = GetPhysicalQueueType(type);
+			request.value = timeline_value;
+			request.callback = std::move(callback);
+			completions.requests.push_back(std::move(request));
+		}
+
+		{
+			std::lock_guard<std::mutex> holder{ completions.watcher_lock };
+			completions.watcher_wake = true;
+		}
+		completions.watcher_cond.notify_one();
+	}
+
+	void Device::OnComplete(const QueuePoint& point, CompletionCallback callback)
+	{
+		OnComplete(point.queue, point.value, std::move(callback));
+	}
+
+	void Device::UpdateCompletedTimelinesNolock()
+	{
+		// Without timeline semaphores, NextFrameContext advances the values of the frame context it waited on
+		if (!ext->timeline_semaphore_features.timelineSemaphore)
+			return;
+
+		for (unsigned i = 0; i < 3; i++)
+		{
+			uint64_t value = 0;
+			auto& data = GetQueueData(completion_queue_types[i]);
+			if (table->vkGetSemaphoreCounterValueKHR(device, data.timeline_semaphore, &value) == VK_SUCCESS)
+				completions.completed[i] = std::max(completions.completed[i], value);
+		}
+	}
+
+	void Device::PollCompletions()
+	{
+		std::vector<CompletionCallback> ready;
+		{
+			LOCK();
+			if (completions.requests.empty())
+				return;
+
+			UpdateCompletedTimelinesNolock();
+
+			// Keeps the pending requests in order
+			size_t pending = 0;
+			for (auto& request : completions.requests)
+			{
+				if (request.value <= completions.completed[CompletionQueueIndex(request.queue)])
+					ready.push_back(std::move(request.callback));
+				else
+					completions.requests[pending++] = std::move(request);
+			}
+			completions.requests.resize(pending);
+		}
+
+		// The callbacks may use the device, which takes the lock
+		for (auto& callback : ready)
+			if (callback)
+				callback();
+	}
+
+	void Device::SetCompletionWatcher(bool enable)
+	{
+		if (enable && !ext->timeline_semaphore_features.timelineSemaphore)
+		{
+			QM_LOG_ERROR("The completion watcher needs timeline semaphores.\n");
+			return;
+		}
+
+		if (enable == completions.watcher.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> holder{ completions.watcher_lock };
+			completions.watcher_running = enable;
+			completions.watcher_wake = enable;
+		}
+
+		if (enable)
+			completions.watcher = std::thread(&Device::CompletionWatcherLoop, this);
+		else
+		{
+			completions.watcher_cond.notify_one();
+			completions.watcher.join();
+		}
+	}
+
+	void Device::CompletionWatcherLoop()
+	{
+		bool idle = false;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> holder{ completions.watcher_lock };
+				if (idle)
+				{
+					completions.watcher_cond.wait(holder, [&]() {
+						return completions.watcher_wake || !completions.watcher_running;
+					});
+				}
+
+				if (!completions.watcher_running)
+					return;
+				// Cleared before looking at the requests, so one registered after that wakes the next iteration
+				completions.watcher_wake = false;
+			}
+
+			// The lowest pending value of every queue, any of them completing may make callbacks ready
+			VkSemaphore semaphores[3];
+			uint64_t values[3];
+			uint32_t count = 0;
+			{
+				LOCK();
+				uint64_t lowest[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+				for (auto& request : completions.requests)
+				{
+					unsigned index = CompletionQueueIndex(request.queue);
+					lowest[index] = std::min(lowest[index], request.value);
+				}
+
+				for (unsigned i = 0; i < 3; i++)
+				{
+					if (lowest[i] == UINT64_MAX)
+						continue;
+					semaphores[count] = GetQueueData(completion_queue_types[i]).timeline_semaphore;
+					values[count] = lowest[i];
+					count++;
+				}
+			}
+
+			idle = count == 0;
+			if (idle)
+				continue;
+
+			VkSemaphoreWaitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
+			info.flags = VK_SEMAPHORE_WAIT_ANY_BIT_KHR;
+			info.semaphoreCount = count;
+			info.pSemaphores = semaphores;
+			info.pValues = values;
+			VkResult result = table->vkWaitSemaphoresKHR(device, &info, VULKAN_COMPLETION_WATCHER_TIMEOUT_NS);
+			if (result == VK_SUCCESS)
+				PollCompletions();
+			else if (result != VK_TIMEOUT)
+			{
+				QM_LOG_ERROR("Completion watcher failed to wait for timeline semaphores (code: %d).\n", int(result));
+				idle = true;
+			}
+		}
+	}
+}
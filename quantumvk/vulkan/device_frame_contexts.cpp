@@ -40,7 +40,10 @@ namespace Vulkan
 	void Device::FlushFrame(CommandBuffer::Type type)
 	{
 		if (type == CommandBuffer::Type::AsyncTransfer)
+		{
 			SyncBufferBlocks();
+			FlushUploadsNolock();
+		}
 		SubmitQueue(type, nullptr, 0, nullptr);
 	}
 
@@ -93,6 +96,13 @@ namespace Vulkan
 	{
 		UpdateInvalidProgramsNoLock();
 
+		// Upload command buffers belong to this frame context, so they can't stay pending.
+		FlushUploadsNolock();
+
+		// Closes the frame's graphics work before it is flushed
+		if (Frame().timestamp_started && !Frame().timestamp_ended)
+			WriteFrameTimestampNolock(false);
+
 		// Make sure we have a fence which covers all submissions in the frame.
 		InternalFence fence;
 
@@ -128,12 +138,18 @@ namespace Vulkan
 			}
 			compute.need_fence = false;
 		}
+
+		// Nothing recorded in this frame context may stay in a batch, the next Begin() waits on it
+		SubmitAllBatchesNolock();
+		last_submission_stats = submission_stats;
+		submission_stats = {};
 	}
 
 	void Device::FlushFrame()
 	{
 		LOCK();
 		FlushFrameNolock();
+		SubmitAllBatchesNolock();
 	}
 
 	void Device::FlushFrameNolock()
@@ -191,6 +207,18 @@ namespace Vulkan
 		DestroyBufferNolock(buffer, allocation);
 	}
 
+	void Device::FreeSubBuffer(const BufferArenaHandle& arena, BufferArenaChunk* chunk, VkDeviceSize offset, uint32_t order)
+	{
+		LOCK();
+		FreeSubBufferNolock(arena, chunk, offset, order);
+	}
+
+	void Device::ReleaseBufferArenaChunks(std::vector<std::unique_ptr<BufferArenaChunk>>& chunks)
+	{
+		LOCK();
+		chunks.clear();
+	}
+
 	void Device::DestroyProgramNoLock(Program* program)
 	{
 		Frame().destroyed_programs.push_back(program);
@@ -220,6 +248,12 @@ namespace Vulkan
 		DestroyImageNolock(image, allocation);
 	}
 
+	void Device::FreeAliasedMemory(const DeviceAllocation& allocation)
+	{
+		LOCK();
+		FreeAliasedMemoryNolock(allocation);
+	}
+
 	void Device::DestroySemaphore(VkSemaphore semaphore)
 	{
 		LOCK();
@@ -287,16 +321,45 @@ namespace Vulkan
 
 	void Device::DestroyImageNolock(VkImage image, const DeviceAllocation& allocation)
 	{
+		defrag.dirty = true;
 		//VK_ASSERT(!exists(Frame().destroyed_images, std::make_pair(image, allocation)));
 		Frame().destroyed_images.push_back(std::make_pair(image, allocation));
 	}
 
+	void Device::FreeAliasedMemoryNolock(const DeviceAllocation& allocation)
+	{
+		Frame().freed_aliased_memory.push_back(allocation);
+	}
+
 	void Device::DestroyBufferNolock(VkBuffer buffer, const DeviceAllocation& allocation)
 	{
+		if (!defrag.buffers.empty())
+		{
+			auto itr = defrag.buffers.find(allocation.vma_allocation);
+			if (itr != defrag.buffers.end())
+			{
+				bool in_context = itr->second.in_context;
+				defrag.buffers.erase(itr);
+
+				// VMA must not see the allocation freed before the defragmentation that planned its move ends
+				if (in_context)
+				{
+					defrag.deferred_frees.push_back(std::make_pair(buffer, allocation));
+					return;
+				}
+			}
+		}
+
+		defrag.dirty = true;
 		//VK_ASSERT(!exists(Frame().destroyed_buffers, std::make_pair(buffer, allocation)));
 		Frame().destroyed_buffers.push_back(std::make_pair(buffer, allocation));
 	}
 
+	void Device::FreeSubBufferNolock(const BufferArenaHandle& arena, BufferArenaChunk* chunk, VkDeviceSize offset, uint32_t order)
+	{
+		Frame().freed_sub_buffers.push_back({ arena, chunk, offset, order });
+	}
+
 	void Device::DestroySamplerNolock(VkSampler sampler)
 	{
 		VK_ASSERT(!exists(Frame().destroyed_samplers, sampler));
@@ -371,6 +434,17 @@ namespace Vulkan
 		for (auto& pool : transfer_cmd_pool)
 			pool.Begin();
 
+		// Released before the destroyed lists are processed, arenas may release empty chunks while freeing
+		for (auto& freed : freed_sub_buffers)
+		{
+			freed.arena->Free(freed.chunk, freed.offset, freed.order);
+			// If this is the last reference, the arena is destroyed here with the lock held
+			if (freed.arena->GetRefCount() == 1)
+				freed.arena->SetInternalSyncObject();
+			freed.arena.Reset();
+		}
+		freed_sub_buffers.clear();
+
 		for (auto& framebuffer : destroyed_framebuffers)
 			table.vkDestroyFramebuffer(vkdevice, framebuffer, nullptr);
 		for (auto& sampler : destroyed_samplers)
@@ -383,6 +457,8 @@ namespace Vulkan
 			device.managers.memory.FreeImage(image.first, image.second);
 		for (auto& buffer : destroyed_buffers)
 			device.managers.memory.FreeBuffer(buffer.first, buffer.second);
+		for (auto& memory : freed_aliased_memory)
+			device.managers.memory.FreeMemory(memory);
 		for (auto& semaphore : destroyed_semaphores)
 			table.vkDestroySemaphore(vkdevice, semaphore, nullptr);
 		for (auto& semaphore : recycled_semaphores)
@@ -419,12 +495,17 @@ namespace Vulkan
 		ubo_blocks.clear();
 		staging_blocks.clear();
 
+		transient_rings.vbo.Reset();
+		transient_rings.ibo.Reset();
+		transient_rings.ubo.Reset();
+
 		destroyed_framebuffers.clear();
 		destroyed_samplers.clear();
 		destroyed_image_views.clear();
 		destroyed_buffer_views.clear();
 		destroyed_images.clear();
 		destroyed_buffers.clear();
+		freed_aliased_memory.clear();
 		destroyed_semaphores.clear();
 		recycled_semaphores.clear();
 		recycled_events.clear();
@@ -439,6 +520,9 @@ namespace Vulkan
 	PerFrame::~PerFrame()
 	{
 		Begin();
+
+		if (timestamp_pool != VK_NULL_HANDLE)
+			table.vkDestroyQueryPool(device.GetDevice(), timestamp_pool, nullptr);
 	}
 
 
@@ -457,6 +541,16 @@ namespace Vulkan
 		compute.wait_stages.clear();
 		transfer.wait_semaphores.clear();
 		transfer.wait_stages.clear();
+
+		graphics.wait_timelines.clear();
+		graphics.wait_timeline_values.clear();
+		graphics.wait_timeline_stages.clear();
+		compute.wait_timelines.clear();
+		compute.wait_timeline_values.clear();
+		compute.wait_timeline_stages.clear();
+		transfer.wait_timelines.clear();
+		transfer.wait_timeline_values.clear();
+		transfer.wait_timeline_stages.clear();
 	}
 
 	void Device::WaitIdle()
@@ -470,6 +564,8 @@ namespace Vulkan
 		if (!per_frame.empty())
 			EndFrameNolock();
 
+		DrainSubmissionThreadNolock();
+
 		if (device != VK_NULL_HANDLE)
 		{
 			if (queue_lock_callback)
@@ -481,24 +577,58 @@ namespace Vulkan
 				queue_unlock_callback();
 		}
 
+		FinishDefragmentationNolock();
+
+		// Presents to swapchains which are about to be torn down aren't of interest anymore
+		if (submission_thread)
+			submission_thread->ConsumePresentResult();
+
+		// Everything has completed, release the upload ring along with the buffer pools.
+		for (auto& batch : uploads.in_flight)
+			for (auto& imported : batch.imported)
+				managers.memory.FreeBuffer(imported.buffer, imported.alloc);
+		uploads.in_flight.clear();
+		uploads.completed_timeline = uploads.submitted_timeline;
+		uploads.ring.Reset();
+		uploads.ring_mapped = nullptr;
+		uploads.ring_head = 0;
+		uploads.ring_tail = 0;
+
+		// Submitted readbacks are complete, their callbacks are dispatched by the next poll
+		for (auto& request : readbacks.requests)
+			if (request.submitted)
+				request.gpu_complete = true;
+
 		ClearWaitSemaphores();
 
 		// Free memory for buffer pools.
-		managers.vbo.Reset();
-		managers.ubo.Reset();
-		managers.ibo.Reset();
-		managers.staging.Reset();
 		for (auto& frame : per_frame)
 		{
+			for (auto& block : frame->vbo_blocks)
+				managers.vbo.RecycleBlock(std::move(block));
+			for (auto& block : frame->ibo_blocks)
+				managers.ibo.RecycleBlock(std::move(block));
+			for (auto& block : frame->ubo_blocks)
+				managers.ubo.RecycleBlock(std::move(block));
+			for (auto& block : frame->staging_blocks)
+				managers.staging.RecycleBlock(std::move(block));
 			frame->vbo_blocks.clear();
 			frame->ibo_blocks.clear();
 			frame->ubo_blocks.clear();
 			frame->staging_blocks.clear();
+			frame->transient_rings.vbo.Release();
+			frame->transient_rings.ibo.Release();
+			frame->transient_rings.ubo.Release();
 		}
+		managers.vbo.Reset();
+		managers.ubo.Reset();
+		managers.ibo.Reset();
+		managers.staging.Reset();
 
 		framebuffer_allocator.Clear();
 		transient_allocator.Clear();
 		physical_allocator.Clear();
+		aliased_allocator.Clear();
 
 		{
 #ifdef QM_VULKAN_MT
@@ -520,32 +650,345 @@ namespace Vulkan
 
 	void Device::NextFrameContext()
 	{
-		DRAIN_FRAME_LOCK();
+		{
+			DRAIN_FRAME_LOCK();
 
-		// Flush the frame here as we might have pending staging command buffers from init stage.
-		EndFrameNolock();
+			// Flush the frame here as we might have pending staging command buffers from init stage.
+			EndFrameNolock();
 
-		framebuffer_allocator.BeginFrame();
-		transient_allocator.BeginFrame();
-		physical_allocator.BeginFrame();
+			FrameTelemetry frame_telemetry;
+			frame_telemetry.frames_in_flight = uint32_t(per_frame.size());
+			if (submission_thread)
+				frame_telemetry.submission_queue_depth = submission_thread->GetQueueDepth();
 
-		{
+			framebuffer_allocator.BeginFrame();
+			transient_allocator.BeginFrame();
+			physical_allocator.BeginFrame();
+			aliased_allocator.BeginFrame();
+
+			managers.descriptor_pool.BeginFrame();
+
+			{
 #ifdef QM_VULKAN_MT
-			std::lock_guard holder_{ lock.program_lock };
+				std::lock_guard holder_{ lock.program_lock };
 #endif
 
-			for (auto& program : active_programs)
-				if (program)
-					program->BeginFrame();
+				for (auto& program : active_programs)
+					if (program)
+						program->BeginFrame();
+			}
+
+			VK_ASSERT(!per_frame.empty());
+
+			frame_context_index++;
+			if (frame_context_index >= per_frame.size())
+				frame_context_index = 0;
+
+			// Everything the frame context submitted has completed once it was waited on
+			auto& frame = Frame();
+			const uint64_t frame_timelines[3] = { frame.timeline_fence_graphics, frame.timeline_fence_compute, frame.timeline_fence_transfer };
+			int64_t wait_start = Util::get_current_time_nsecs();
+			frame.Begin();
+			frame_telemetry.cpu_wait_ns = uint64_t(Util::get_current_time_nsecs() - wait_start);
+			if (telemetry.frame_begin_ns != 0)
+				frame_telemetry.cpu_frame_ns = uint64_t(wait_start - telemetry.frame_begin_ns);
+			telemetry.frame_begin_ns = wait_start;
+
+			for (unsigned i = 0; i < 3; i++)
+				completions.completed[i] = std::max(completions.completed[i], frame_timelines[i]);
+			readbacks.frame_serial++;
+
+			RetireUploadsNolock();
+			DefragmentStepNolock();
+
+			managers.vbo.BeginFrame();
+			managers.ibo.BeginFrame();
+			managers.ubo.BeginFrame();
+			managers.staging.BeginFrame();
+
+			// Budgets are refreshed after the old frame's resources were freed
+			managers.memory.BeginFrame();
+
+			ReadFrameTimestampsNolock(frame_telemetry);
+			if (telemetry.timestamps)
+				WriteFrameTimestampNolock(true);
+			telemetry.last = frame_telemetry;
+		}
+
+		// The callbacks may release resources, which takes the device lock
+		NotifyMemoryPressure();
+		PollReadbacks();
+		PollCompletions();
+	}
+
+	void Device::SetFrameTimestamps(bool enable)
+	{
+		LOCK();
+		if (enable && timestamp_valid_bits == 0)
+		{
+			QM_LOG_ERROR("Frame timestamps need timestamp support on the graphics queue.\n");
+			return;
+		}
+
+		// Takes effect with the next frame context
+		telemetry.timestamps = enable;
+	}
+
+	void Device::WriteFrameTimestampNolock(bool start)
+	{
+		auto& frame = Frame();
+		if (frame.timestamp_pool == VK_NULL_HANDLE)
+		{
+			VkQueryPoolCreateInfo info = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+			info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			info.queryCount = 2;
+			if (table->vkCreateQueryPool(device, &info, nullptr, &frame.timestamp_pool) != VK_SUCCESS)
+			{
+				QM_LOG_ERROR("Failed to create frame timestamp query pool.\n");
+				frame.timestamp_pool = VK_NULL_HANDLE;
+				return;
+			}
+		}
+
+		// Only called while no command buffers are being recorded, so the pools of thread 0 are free to use
+		auto cmd = RequestCommandBufferNolock(0, CommandBuffer::Type::Generic);
+		if (start)
+		{
+			table->vkCmdResetQueryPool(cmd->GetCommandBuffer(), frame.timestamp_pool, 0, 2);
+			table->vkCmdWriteTimestamp(cmd->GetCommandBuffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.timestamp_pool, 0);
+		}
+		else
+			table->vkCmdWriteTimestamp(cmd->GetCommandBuffer(), VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.timestamp_pool, 1);
+		SubmitNolock(cmd, nullptr, 0, nullptr);
+
+		frame.timestamp_started = start;
+		frame.timestamp_ended = !start;
+	}
+
+	// Ticks from one timestamp to a later one, 0 if it is earlier
+	static uint64_t TimestampDelta(uint64_t from, uint64_t to, uint32_t valid_bits)
+	{
+		uint64_t mask = valid_bits >= 64 ? UINT64_MAX : ((uint64_t(1) << valid_bits) - 1);
+		uint64_t delta = (to - from) & mask;
+		// Deltas in the upper half of the range wrapped around
+		return delta > (mask >> 1) ? 0 : delta;
+	}
+
+	void Device::ReadFrameTimestampsNolock(FrameTelemetry& frame_telemetry)
+	{
+		auto& frame = Frame();
+		if (!frame.timestamp_ended)
+			return;
+		frame.timestamp_started = false;
+		frame.timestamp_ended = false;
+
+		// Frame().Begin() waited for the frame, the results are available
+		uint64_t timestamps[2] = {};
+		if (table->vkGetQueryPoolResults(device, frame.timestamp_pool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+		{
+			telemetry.gpu_frame_end_valid = false;
+			return;
 		}
 
-		VK_ASSERT(!per_frame.empty());
+		double period = double(gpu_props.limits.timestampPeriod);
+		frame_telemetry.gpu_valid = true;
+		frame_telemetry.gpu_frame_ns = uint64_t(double(TimestampDelta(timestamps[0], timestamps[1], timestamp_valid_bits)) * period);
+		if (telemetry.gpu_frame_end_valid)
+			frame_telemetry.gpu_idle_ns = uint64_t(double(TimestampDelta(telemetry.gpu_frame_end, timestamps[0], timestamp_valid_bits)) * period);
+
+		telemetry.gpu_frame_end = timestamps[1];
+		telemetry.gpu_frame_end_valid = true;
+	}
+
+	void Device::DefragmentStepNolock()
+	{
+		if (defrag.pass_in_flight)
+		{
+			// Frame().Begin() waited for the frame context the copies were submitted in
+			if (defrag.pass_frame_context != frame_context_index)
+				return;
+
+			CommitDefragmentationPassNolock();
+		}
+
+		if (defrag.context == VK_NULL_HANDLE)
+		{
+			if (!defrag.enabled || !defrag.dirty || defrag.buffers.empty())
+				return;
+
+			auto allocations = AllocateHeapArray<VmaAllocation>(defrag.buffers.size());
+			uint32_t count = 0;
+			for (auto& buffer : defrag.buffers)
+				allocations[count++] = buffer.first;
+
+			defrag.context = managers.memory.BeginDefragmentation(allocations.Data(), count, defrag.info.max_bytes_per_cycle);
+			FreeHeapArray(allocations);
 
-		frame_context_index++;
-		if (frame_context_index >= per_frame.size())
-			frame_context_index = 0;
+			defrag.dirty = false;
+			if (defrag.context == VK_NULL_HANDLE)
+				return;
 
-		Frame().Begin();
+			for (auto& buffer : defrag.buffers)
+				buffer.second.in_context = true;
+			defrag.cycle_moves = 0;
+		}
+
+		RecordDefragmentationPassNolock();
+	}
+
+	void Device::RecordDefragmentationPassNolock()
+	{
+		VK_ASSERT(!defrag.pass_in_flight);
+
+		auto moves = AllocateHeapArray<VmaDefragmentationPassMoveInfo>(defrag.info.max_moves_per_frame);
+		uint32_t move_count = managers.memory.BeginDefragmentationPass(defrag.context, moves.Data(), defrag.info.max_moves_per_frame);
+
+		if (move_count == 0)
+		{
+			FreeHeapArray(moves);
+			if (managers.memory.EndDefragmentationPass(defrag.context))
+				EndDefragmentationNolock();
+			return;
+		}
+
+		bool graphics_sem_needed = graphics_queue != transfer_queue;
+		bool compute_sem_needed = compute_queue != transfer_queue && compute_queue != graphics_queue;
+
+		// Earlier frames may still be using the buffers on the other queues
+		if (graphics_sem_needed)
+		{
+			Semaphore sem;
+			SubmitEmptyNolock(CommandBuffer::Type::Generic, nullptr, 1, &sem);
+			AddWaitSemaphoreNolock(CommandBuffer::Type::AsyncTransfer, sem, VK_PIPELINE_STAGE_TRANSFER_BIT, false);
+		}
+		if (compute_sem_needed)
+		{
+			Semaphore sem;
+			SubmitEmptyNolock(CommandBuffer::Type::AsyncCompute, nullptr, 1, &sem);
+			AddWaitSemaphoreNolock(CommandBuffer::Type::AsyncTransfer, sem, VK_PIPELINE_STAGE_TRANSFER_BIT, false);
+		}
+
+		auto cmd = RequestCommandBufferNolock(GetThreadIndex(), CommandBuffer::Type::AsyncTransfer);
+		cmd->Barrier(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+		// The copies are recorded directly
+		cmd->FlushBarriers();
+
+		for (uint32_t i = 0; i < move_count; i++)
+		{
+			// The buffer was destroyed during the defragmentation, its contents don't matter anymore
+			auto itr = defrag.buffers.find(moves[i].allocation);
+			if (itr == defrag.buffers.end())
+				continue;
+
+			Buffer& buffer = *itr->second.buffer;
+
+			// Same sharing mode and queue families as the original, so ownership and memory requirements don't change
+			VkBufferCreateInfo info = itr->second.create_info;
+			info.pQueueFamilyIndices = info.queueFamilyIndexCount ? itr->second.queue_families : nullptr;
+
+			VkBuffer new_buffer = VK_NULL_HANDLE;
+			if (table->vkCreateBuffer(device, &info, nullptr, &new_buffer) != VK_SUCCESS)
+			{
+				QM_LOG_ERROR("Failed to create buffer for defragmentation, contents of the buffer will be lost.\n");
+				continue;
+			}
+
+			// The planned spot must fit the new buffer. VMA 2.x can't ignore a planned move, so a misfit is skipped on our side only.
+			VkMemoryRequirements reqs;
+			table->vkGetBufferMemoryRequirements(device, new_buffer, &reqs);
+
+			VmaAllocationInfo alloc_info;
+			managers.memory.GetAllocationInfo(moves[i].allocation, &alloc_info);
+
+			if (reqs.size > alloc_info.size || (moves[i].offset & (reqs.alignment - 1)) != 0 || (reqs.memoryTypeBits & (1u << alloc_info.memoryType)) == 0)
+			{
+				QM_LOG_ERROR("Defragmentation planned a move the recreated buffer doesn't fit, contents of the buffer will be lost.\n");
+				table->vkDestroyBuffer(device, new_buffer, nullptr);
+				continue;
+			}
+
+			table->vkBindBufferMemory(device, new_buffer, moves[i].memory, moves[i].offset);
+
+			VkBufferCopy region = {};
+			region.size = info.size;
+			table->vkCmdCopyBuffer(cmd->GetCommandBuffer(), buffer.GetBuffer(), new_buffer, 1, &region);
+
+			defrag.retired_buffers.push_back(buffer.GetBuffer());
+			buffer.Relocate(new_buffer);
+		}
+
+		FreeHeapArray(moves);
+
+		cmd->Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT);
+
+		// Work recorded from now on uses the new buffers, so it must wait for the copies
+		Semaphore sems[2];
+		SubmitNolock(cmd, nullptr, uint32_t(graphics_sem_needed) + uint32_t(compute_sem_needed), sems);
+
+		uint32_t sem_index = 0;
+		if (graphics_sem_needed)
+			AddWaitSemaphoreNolock(CommandBuffer::Type::Generic, sems[sem_index++], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, false);
+		if (compute_sem_needed)
+			AddWaitSemaphoreNolock(CommandBuffer::Type::AsyncCompute, sems[sem_index++], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, false);
+
+		defrag.cycle_moves += move_count;
+		defrag.pass_in_flight = true;
+		defrag.pass_frame_context = frame_context_index;
+	}
+
+	void Device::CommitDefragmentationPassNolock()
+	{
+		bool done = managers.memory.EndDefragmentationPass(defrag.context);
+		defrag.pass_in_flight = false;
+
+		// The old handles are bound to memory VMA just released. Destroy them without freeing the allocations, which moved on.
+		for (VkBuffer buffer : defrag.retired_buffers)
+			Frame().destroyed_buffers.push_back(std::make_pair(buffer, DeviceAllocation{}));
+		defrag.retired_buffers.clear();
+
+		if (done)
+			EndDefragmentationNolock();
+	}
+
+	void Device::EndDefragmentationNolock()
+	{
+		managers.memory.EndDefragmentation(defrag.context);
+		defrag.context = VK_NULL_HANDLE;
+
+		for (auto& buffer : defrag.buffers)
+			buffer.second.in_context = false;
+
+		for (auto& buffer : defrag.deferred_frees)
+			Frame().destroyed_buffers.push_back(buffer);
+		defrag.deferred_frees.clear();
+
+		// Moving things around may have opened up room for more moves
+		if (defrag.cycle_moves != 0)
+			defrag.dirty = true;
+	}
+
+	void Device::FinishDefragmentationNolock()
+	{
+		// Planned moves have to be carried out before the allocations can be freed, run the remaining passes back to back
+		while (defrag.context != VK_NULL_HANDLE)
+		{
+			if (!defrag.pass_in_flight)
+				RecordDefragmentationPassNolock();
+
+			if (defrag.pass_in_flight)
+			{
+				EndFrameNolock();
+				DrainSubmissionThreadNolock();
+
+				if (queue_lock_callback)
+					queue_lock_callback();
+				table->vkDeviceWaitIdle(device);
+				if (queue_unlock_callback)
+					queue_unlock_callback();
+
+				CommitDefragmentationPassNolock();
+			}
+		}
 	}
 
 	void Device::AddFrameCounterNolock()
@@ -0,0 +1,263 @@
+#include "device.hpp"
+#include "images/format.hpp"
+
+#ifdef QM_VULKAN_MT
+#define LOCK() std::lock_guard<std::mutex> holder__{lock.lock}
+#else
+#define LOCK() ((void)0)
+#endif
+
+namespace Vulkan
+{
+	void Device::SetReadbackThreadGroup(Quantum::ThreadGroup* group)
+	{
+		LOCK();
+		readbacks.thread_group = group;
+	}
+
+	ReadbackTicket Device::RequestReadback(CommandBuffer& cmd, const Buffer& buffer, VkDeviceSize offset, VkDeviceSize size, ReadbackCallback callback)
+	{
+		VK_ASSERT(!cmd.GetIsSecondary());
+		VK_ASSERT(offset + size <= buffer.GetCreateInfo().size);
+
+		VkBuffer dst;
+		VkDeviceSize dst_offset;
+		ReadbackTicket ticket;
+		{
+			LOCK();
+			auto* request = AllocateReadbackNolock(size, 16, std::move(callback));
+			if (!request)
+				return 0;
+
+			dst = request->buffer ? request->buffer->GetBuffer() : readbacks.ring->GetBuffer();
+			dst_offset = request->offset;
+			ticket = request->ticket;
+		}
+
+		VkBufferCopy region = { offset, dst_offset, size };
+		cmd.FlushBarriers();
+		table->vkCmdCopyBuffer(cmd.GetCommandBuffer(), buffer.GetBuffer(), dst, 1, &region);
+		cmd.Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		cmd.AddReadbackTicket(ticket);
+		return ticket;
+	}
+
+	ReadbackTicket Device::RequestReadback(CommandBuffer& cmd, const Image& image, VkImageLayout layout, const VkImageSubresourceLayers& subresource,
+		VkOffset3D offset, VkExtent3D extent, ReadbackCallback callback)
+	{
+		VK_ASSERT(!cmd.GetIsSecondary());
+
+		VkFormat format = image.GetFormat();
+		uint32_t block_size = TextureFormatLayout::FormatBlockSize(format, subresource.aspectMask);
+		uint32_t blocks_x = extent.width;
+		uint32_t blocks_y = extent.height;
+		FormatNumBlocks(format, blocks_x, blocks_y);
+		VkDeviceSize size = VkDeviceSize(block_size) * blocks_x * blocks_y * extent.depth * subresource.layerCount;
+
+		// Buffer offsets must be a multiple of both the texel block size and 4
+		VkDeviceSize alignment = 16;
+		while (alignment % block_size)
+			alignment += 16;
+
+		VkBuffer dst;
+		VkDeviceSize dst_offset;
+		ReadbackTicket ticket;
+		{
+			LOCK();
+			auto* request = AllocateReadbackNolock(size, alignment, std::move(callback));
+			if (!request)
+				return 0;
+
+			dst = request->buffer ? request->buffer->GetBuffer() : readbacks.ring->GetBuffer();
+			dst_offset = request->offset;
+			ticket = request->ticket;
+		}
+
+		VkBufferImageCopy region = {};
+		region.bufferOffset = dst_offset;
+		region.imageSubresource = subresource;
+		region.imageOffset = offset;
+		region.imageExtent = extent;
+		cmd.FlushBarriers();
+		table->vkCmdCopyImageToBuffer(cmd.GetCommandBuffer(), image.GetImage(), layout, dst, 1, &region);
+		cmd.Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		cmd.AddReadbackTicket(ticket);
+		return ticket;
+	}
+
+	bool Device::IsReadbackComplete(ReadbackTicket ticket)
+	{
+		LOCK();
+		if (readbacks.requests.empty() || ticket < readbacks.requests.front().ticket)
+			return true;
+
+		uint64_t index = ticket - readbacks.requests.front().ticket;
+		VK_ASSERT(index < readbacks.requests.size());
+		return readbacks.requests[index].done;
+	}
+
+	ReadbackRequest* Device::AllocateReadbackNolock(VkDeviceSize size, VkDeviceSize alignment, ReadbackCallback callback)
+	{
+		if (!readbacks.ring)
+		{
+			BufferCreateInfo info = {};
+			info.domain = BufferDomain::CachedHost;
+			info.size = VULKAN_READBACK_RING_SIZE;
+			info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+			info.category = MemoryCategory::Staging;
+			readbacks.ring = CreateBuffer(info);
+			if (readbacks.ring)
+			{
+				readbacks.ring->SetInternalSyncObject();
+				readbacks.ring_mapped = static_cast<uint8_t*>(managers.memory.MapMemory(readbacks.ring->GetAllocation(), MEMORY_ACCESS_READ_BIT));
+			}
+			else
+				QM_LOG_ERROR("Failed to create readback ring.\n");
+		}
+
+		BufferHandle dedicated;
+		VkDeviceSize offset = 0;
+		uint64_t ring_end = 0;
+
+		bool in_ring = false;
+		if (readbacks.ring && size <= VULKAN_READBACK_RING_MAX_ALLOCATION)
+		{
+			uint64_t head = readbacks.ring_head;
+			VkDeviceSize ring_offset = head % VULKAN_READBACK_RING_SIZE;
+			VkDeviceSize aligned = ((ring_offset + alignment - 1) / alignment) * alignment;
+
+			// Regions never wrap around, the rest of the ring is skipped instead
+			if (aligned + size > VULKAN_READBACK_RING_SIZE)
+			{
+				head += VULKAN_READBACK_RING_SIZE - ring_offset;
+				aligned = 0;
+			}
+			else
+				head += aligned - ring_offset;
+
+			if (head + size - readbacks.ring_tail <= VULKAN_READBACK_RING_SIZE)
+			{
+				readbacks.ring_head = head + size;
+				offset = aligned;
+				ring_end = readbacks.ring_head;
+				in_ring = true;
+			}
+		}
+
+		// Never wait for the ring to drain, as the pending readbacks might not even be submitted yet
+		if (!in_ring)
+		{
+			BufferCreateInfo info = {};
+			info.domain = BufferDomain::CachedHost;
+			info.size = size;
+			info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+			info.category = MemoryCategory::Staging;
+			dedicated = CreateBuffer(info);
+			if (!dedicated)
+			{
+				QM_LOG_ERROR("Failed to create readback buffer.\n");
+				return nullptr;
+			}
+			dedicated->SetInternalSyncObject();
+		}
+
+		readbacks.requests.emplace_back();
+		auto& request = readbacks.requests.back();
+		request.ticket = readbacks.next_ticket++;
+		request.buffer = std::move(dedicated);
+		request.offset = offset;
+		request.size = size;
+		request.ring_end = ring_end;
+		request.callback = std::move(callback);
+		return &request;
+	}
+
+	void Device::SubmitReadbackNolock(ReadbackTicket ticket, VkSemaphore timeline, uint64_t timeline_value)
+	{
+		VK_ASSERT(!readbacks.requests.empty() && ticket >= readbacks.requests.front().ticket);
+		auto& request = readbacks.requests[ticket - readbacks.requests.front().ticket];
+
+		request.submitted = true;
+		request.timeline = timeline;
+		request.timeline_value = timeline_value;
+		request.frame_serial = readbacks.frame_serial;
+	}
+
+	bool Device::IsReadbackGPUCompleteNolock(const ReadbackRequest& request)
+	{
+		if (!request.submitted)
+			return false;
+		if (request.gpu_complete)
+			return true;
+
+		if (request.timeline != VK_NULL_HANDLE)
+		{
+			uint64_t value = 0;
+			if (table->vkGetSemaphoreCounterValueKHR(device, request.timeline, &value) != VK_SUCCESS)
+				return false;
+			return value >= request.timeline_value;
+		}
+
+		// Without timeline semaphores, the submission is known to be complete once its frame context has been waited on
+		return readbacks.frame_serial >= request.frame_serial + per_frame.size();
+	}
+
+	void Device::PollReadbacks()
+	{
+		std::vector<std::pair<ReadbackRequest*, const uint8_t*>> inline_requests;
+		{
+			LOCK();
+
+			// Release requests whose callbacks have returned
+			while (!readbacks.requests.empty() && readbacks.requests.front().done)
+			{
+				auto& request = readbacks.requests.front();
+				if (request.buffer)
+					managers.memory.UnmapMemory(request.buffer->GetAllocation(), MEMORY_ACCESS_READ_BIT);
+				else
+					readbacks.ring_tail = request.ring_end;
+				readbacks.requests.pop_front();
+			}
+
+			for (auto& request : readbacks.requests)
+			{
+				if (request.dispatched || !IsReadbackGPUCompleteNolock(request))
+					continue;
+
+				request.dispatched = true;
+
+				const uint8_t* data;
+				if (request.buffer)
+					data = static_cast<const uint8_t*>(managers.memory.MapMemory(request.buffer->GetAllocation(), MEMORY_ACCESS_READ_BIT));
+				else
+				{
+					managers.memory.InvalidateMemory(readbacks.ring->GetAllocation(), request.offset, request.size);
+					data = readbacks.ring_mapped + request.offset;
+				}
+
+				if (readbacks.thread_group)
+				{
+					auto* req = &request;
+					request.task = readbacks.thread_group->create_task([req, data]() {
+						if (req->callback && data)
+							req->callback(data, req->size);
+						req->done = true;
+					});
+					request.task->flush();
+				}
+				else
+				{
+					// Run once the lock is released, the request can't be popped until done is set
+					inline_requests.push_back({ &request, data });
+				}
+			}
+		}
+
+		for (auto& pending : inline_requests)
+		{
+			if (pending.first->callback && pending.second)
+				pending.first->callback(pending.second, pending.first->size);
+			pending.first->done = true;
+		}
+	}
+}
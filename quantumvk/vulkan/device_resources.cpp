@@ -58,6 +58,7 @@ namespace Vulkan
 			BufferCreateInfo buffer;
 			buffer.domain = (info.flags & LINEAR_HOST_IMAGE_HOST_CACHED_BIT) != 0 ? BufferDomain::CachedHost : BufferDomain::Host;
 			buffer.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+			buffer.category = MemoryCategory::Staging;
 			buffer.size = info.width * info.height * TextureFormatLayout::FormatBlockSize(info.format, FormatToAspectMask(info.format));
 			cpu_image = CreateBuffer(buffer);
 			if (!cpu_image)
@@ -206,7 +207,7 @@ namespace Vulkan
 		VmaAllocationCreateInfo alloc_info{};
 		FillBufferAllocInfo(alloc_info, create_info.domain);
 
-		if (!managers.memory.AllocateBuffer(info, alloc_info, &buffer, &allocation))
+		if (!managers.memory.AllocateBuffer(info, alloc_info, create_info.category, &buffer, &allocation))
 			return BufferHandle(nullptr);
 
 
@@ -214,74 +215,126 @@ namespace Vulkan
 		tmpinfo.usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 		BufferHandle handle(handle_pool.buffers.allocate(this, buffer, allocation, tmpinfo));
 
+		const VkBufferUsageFlags texel_usage = VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT;
+		if ((create_info.misc & BUFFER_MISC_DEFRAGMENTABLE_BIT) && create_info.domain == BufferDomain::Device && is_concurrent &&
+			(create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_TRANSFER) != 0 && (info.usage & texel_usage) == 0)
+		{
+			// Buffer views would keep pointing at the old VkBuffer, so buffers with texel usage are never moved
+			DefragmentableBuffer defrag_buffer;
+			defrag_buffer.buffer = handle.Get();
+			defrag_buffer.create_info = info;
+			defrag_buffer.create_info.pQueueFamilyIndices = nullptr;
+			for (uint32_t i = 0; i < info.queueFamilyIndexCount; i++)
+				defrag_buffer.queue_families[i] = info.pQueueFamilyIndices[i];
+
+			LOCK();
+			defrag.buffers[allocation.vma_allocation] = defrag_buffer;
+		}
+
 		if (create_info.domain == BufferDomain::Device && (initial || zero_initialize) && !AllocationHasMemoryPropertyFlags(allocation, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
 		{
-			CommandBufferHandle cmd = RequestCommandBuffer(CommandBuffer::Type::AsyncTransfer);;
+			// Aligned host memory is imported and copied from directly, only its unaligned tail goes through the upload ring
+			BufferAllocation imported;
+			VkDeviceSize import_size = 0;
+			VkDeviceSize import_alignment = GetHostImportAlignment();
+			if (initial && (create_info.misc & BUFFER_MISC_IMPORT_INITIAL_DATA_BIT) && create_info.size > VULKAN_UPLOAD_RING_MAX_ALLOCATION &&
+				import_alignment && (reinterpret_cast<uintptr_t>(initial) % import_alignment) == 0)
+			{
+				VkBufferCreateInfo import_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+				import_info.size = (create_info.size / import_alignment) * import_alignment;
+				import_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+				import_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+				// The data is only read by the transfer queue, the cast just satisfies the import API
+				if (managers.memory.ImportHostBuffer(import_info, const_cast<void*>(initial), MemoryCategory::Staging, &imported.buffer, &imported.alloc))
+					import_size = import_info.size;
+			}
 
-			if (initial)
+			// Large uploads get their own staging buffer instead of filling up the upload ring
+			BufferHandle staging_buffer;
+			if (initial && !import_size && create_info.size > VULKAN_UPLOAD_RING_MAX_ALLOCATION)
 			{
 				auto staging_info = create_info;
 				staging_info.domain = BufferDomain::Host;
 				staging_info.sharing_mode = BufferSharingMode::Exclusive;
 				staging_info.exclusive_owner = BUFFER_COMMAND_QUEUE_ASYNC_TRANSFER;
-				auto staging_buffer = CreateBuffer(staging_info, initial);
-
-				cmd->CopyBuffer(*handle, *staging_buffer);
-			}
-			else
-			{
-				cmd->FillBuffer(*handle, 0);
+				staging_info.category = MemoryCategory::Staging;
+				staging_info.misc = 0;
+				staging_buffer = CreateBuffer(staging_info, initial);
+				if (!staging_buffer)
+					return BufferHandle(nullptr);
 			}
 
-			if (is_concurrent)
+			CommandBuffer::Type exclusive_owner = GetBufferCommandType(create_info.exclusive_owner);
+			bool needs_acquire = false;
+			VkBufferMemoryBarrier release{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+
 			{
-				bool is_concurrent_graphics = (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_GENERIC) || (!is_async_graphics_on_compute_queue && (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_GRAPHICS));
-				bool is_concurrent_compute = (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_COMPUTE) || (is_async_graphics_on_compute_queue && (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_GRAPHICS));
+				LOCK();
+
+				if (import_size)
+				{
+					AddBufferUploadNolock(handle->GetBuffer(), 0, imported.buffer, 0, import_size);
+					uploads.imported.push_back(imported);
+				}
 
-				cmd->BufferBarrier(*handle, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+				VkBuffer src = VK_NULL_HANDLE;
+				VkDeviceSize src_offset = 0;
+				VkDeviceSize remaining = create_info.size - import_size;
+				if (staging_buffer)
+					src = staging_buffer->GetBuffer();
+				else if (initial && remaining && !WriteUploadRingNolock(static_cast<const uint8_t*>(initial) + import_size, remaining, 16, &src, &src_offset))
+					return BufferHandle(nullptr);
 
-				SubmitVisible(cmd, possible_buffer_stages, is_concurrent_graphics, is_concurrent_compute, true);
-			}
-			else
-			{
-				CommandBuffer::Type exclusive_owner = GetBufferCommandType(create_info.exclusive_owner);
-				uint32_t exclusive_queue_family_index = GetQueueFamilyIndex(exclusive_owner);
+				if (remaining)
+					AddBufferUploadNolock(handle->GetBuffer(), import_size, src, src_offset, remaining);
 
-				if (exclusive_queue_family_index == transfer_queue_family_index)
+				if (is_concurrent)
 				{
-					cmd->BufferBarrier(*handle, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+					bool is_concurrent_graphics = (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_GENERIC) || (!is_async_graphics_on_compute_queue && (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_GRAPHICS));
+					bool is_concurrent_compute = (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_COMPUTE) || (is_async_graphics_on_compute_queue && (create_info.concurrent_owners & BUFFER_COMMAND_QUEUE_ASYNC_GRAPHICS));
 
-					Semaphore sem;
-					Submit(cmd, nullptr, 1, &sem);
-					AddWaitSemaphore(exclusive_owner, sem, possible_buffer_stages, true);
+					if (is_concurrent_graphics)
+						AddUploadConsumerNolock(CommandBuffer::Type::Generic, possible_buffer_stages);
+					if (is_concurrent_compute)
+						AddUploadConsumerNolock(CommandBuffer::Type::AsyncCompute, possible_buffer_stages);
 				}
 				else
 				{
-					VkBufferMemoryBarrier release{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
-					release.buffer = handle->GetBuffer();
-					release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-					release.dstAccessMask = 0;
-					release.srcQueueFamilyIndex = transfer_queue_family_index;
-					release.dstQueueFamilyIndex = exclusive_queue_family_index;
-					release.offset = 0;
-					release.size = VK_WHOLE_SIZE;
+					uint32_t exclusive_queue_family_index = GetQueueFamilyIndex(exclusive_owner);
 
-					cmd->Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, nullptr, 1, &release, 0, nullptr);
+					if (exclusive_queue_family_index != transfer_queue_family_index)
+					{
+						release.buffer = handle->GetBuffer();
+						release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+						release.dstAccessMask = 0;
+						release.srcQueueFamilyIndex = transfer_queue_family_index;
+						release.dstQueueFamilyIndex = exclusive_queue_family_index;
+						release.offset = 0;
+						release.size = VK_WHOLE_SIZE;
 
-					Semaphore sem;
-					Submit(cmd, nullptr, 1, &sem);
-					AddWaitSemaphore(exclusive_owner, sem, possible_buffer_stages, true);
+						uploads.buffer_releases.push_back(release);
+						needs_acquire = true;
+					}
 
-					cmd = RequestCommandBuffer(exclusive_owner);
+					AddUploadConsumerNolock(exclusive_owner, possible_buffer_stages);
+				}
 
-					VkBufferMemoryBarrier acquire = release;
-					acquire.srcAccessMask = 0;
-					acquire.dstAccessMask = possible_buffer_access;
+				CommitUploadNolock();
+			}
+
+			if (needs_acquire)
+			{
+				// The owner's submission waits for the upload batch, so the acquire can be enqueued right away
+				auto cmd = RequestCommandBuffer(exclusive_owner);
 
-					cmd->Barrier(possible_buffer_stages, possible_buffer_stages, 0, nullptr, 1, &acquire, 0, nullptr);
+				VkBufferMemoryBarrier acquire = release;
+				acquire.srcAccessMask = 0;
+				acquire.dstAccessMask = possible_buffer_access;
 
-					Submit(cmd);
-				}
+				cmd->Barrier(possible_buffer_stages, possible_buffer_stages, 0, nullptr, 1, &acquire, 0, nullptr);
+
+				Submit(cmd);
 			}
 		}
 		else if (initial || zero_initialize)
@@ -300,6 +353,141 @@ namespace Vulkan
 		return handle;
 	}
 
+	BufferArenaHandle Device::CreateBufferArena(const BufferArenaCreateInfo& create_info)
+	{
+		auto info = create_info;
+
+		// Ranges are aligned to their power of two size, so the smallest one has to satisfy every offset alignment
+		VkDeviceSize alignment = std::max<VkDeviceSize>(16u, info.min_allocation);
+		alignment = std::max(alignment, gpu_props.limits.minStorageBufferOffsetAlignment);
+		alignment = std::max(alignment, gpu_props.limits.minUniformBufferOffsetAlignment);
+		alignment = std::max(alignment, gpu_props.limits.minTexelBufferOffsetAlignment);
+		info.min_allocation = 1;
+		while (info.min_allocation < alignment)
+			info.min_allocation <<= 1;
+
+		info.chunk_size = std::max(info.chunk_size, info.min_allocation);
+		return BufferArenaHandle(handle_pool.buffer_arenas.allocate(this, info));
+	}
+
+	SubBufferHandle Device::CreateSubBuffer(BufferArena& arena, VkDeviceSize size, const void* initial)
+	{
+		if (size == 0)
+			return SubBufferHandle(nullptr);
+
+		// Large uploads get their own staging buffer instead of filling up the upload ring
+		BufferHandle staging_buffer;
+		const auto& arena_info = arena.GetCreateInfo();
+		if (initial && arena_info.domain == BufferDomain::Device && size > VULKAN_UPLOAD_RING_MAX_ALLOCATION)
+		{
+			BufferCreateInfo staging_info;
+			staging_info.domain = BufferDomain::Host;
+			staging_info.size = size;
+			staging_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+			staging_info.sharing_mode = BufferSharingMode::Exclusive;
+			staging_info.exclusive_owner = BUFFER_COMMAND_QUEUE_ASYNC_TRANSFER;
+			staging_info.category = MemoryCategory::Staging;
+			staging_buffer = CreateBuffer(staging_info, initial);
+			if (!staging_buffer)
+				return SubBufferHandle(nullptr);
+		}
+
+		BufferArenaChunk* chunk;
+		VkDeviceSize offset;
+		uint32_t order;
+		{
+			LOCK();
+			if (!arena.Allocate(size, &chunk, &offset, &order))
+				return SubBufferHandle(nullptr);
+
+			if (initial)
+			{
+				auto& allocation = chunk->buffer->GetAllocation();
+				if (AllocationHasMemoryPropertyFlags(allocation, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+				{
+					// Nothing can be using a newly allocated range, so it is written directly
+					auto* ptr = static_cast<uint8_t*>(managers.memory.MapMemory(allocation, MEMORY_ACCESS_WRITE_BIT));
+					memcpy(ptr + offset, initial, size);
+					managers.memory.UnmapMemory(allocation, MEMORY_ACCESS_WRITE_BIT);
+				}
+				else
+				{
+					VkBuffer src;
+					VkDeviceSize src_offset = 0;
+					if (staging_buffer)
+						src = staging_buffer->GetBuffer();
+					else if (!WriteUploadRingNolock(initial, size, 16, &src, &src_offset))
+					{
+						arena.Free(chunk, offset, order);
+						return SubBufferHandle(nullptr);
+					}
+
+					// Chunks are shared concurrently by all queues
+					VkPipelineStageFlags stages = BufferUsageToPossibleStages(arena_info.usage);
+					AddBufferUploadNolock(chunk->buffer->GetBuffer(), offset, src, src_offset, size);
+					AddUploadConsumerNolock(CommandBuffer::Type::Generic, stages);
+					AddUploadConsumerNolock(CommandBuffer::Type::AsyncCompute, stages);
+					CommitUploadNolock();
+				}
+			}
+		}
+
+		return SubBufferHandle(handle_pool.sub_buffers.allocate(this, &arena, chunk, offset, size, order));
+	}
+
+	VkDeviceSize Device::GetHostImportAlignment() const
+	{
+		return ext->supports_external_memory_host ? ext->host_memory_properties.minImportedHostPointerAlignment : 0;
+	}
+
+	BufferHandle Device::ImportHostBuffer(const BufferCreateInfo& create_info, void* host_pointer)
+	{
+		VkDeviceSize alignment = GetHostImportAlignment();
+		if (!alignment || (reinterpret_cast<uintptr_t>(host_pointer) % alignment) != 0 || (create_info.size % alignment) != 0)
+			return BufferHandle(nullptr);
+
+		VkBufferCreateInfo info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+		info.size = create_info.size;
+		info.usage = create_info.usage;
+		info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+		// Concurrent imports are shared by every queue family, there is no upload to narrow them down
+		uint32_t sharing_indices[3];
+		if (create_info.sharing_mode == BufferSharingMode::Concurrent)
+		{
+			uint32_t queueFamilyCount = 0;
+			const auto add_unique_family = [&](uint32_t family) {
+				for (uint32_t i = 0; i < queueFamilyCount; i++)
+				{
+					if (sharing_indices[i] == family)
+						return;
+				}
+				sharing_indices[queueFamilyCount++] = family;
+			};
+
+			add_unique_family(graphics_queue_family_index);
+			add_unique_family(compute_queue_family_index);
+			add_unique_family(transfer_queue_family_index);
+
+			if (queueFamilyCount > 1)
+			{
+				info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+				info.pQueueFamilyIndices = sharing_indices;
+				info.queueFamilyIndexCount = queueFamilyCount;
+			}
+		}
+
+		VkBuffer buffer;
+		DeviceAllocation allocation;
+		if (!managers.memory.ImportHostBuffer(info, host_pointer, create_info.category, &buffer, &allocation))
+			return BufferHandle(nullptr);
+
+		auto tmpinfo = create_info;
+		tmpinfo.domain = BufferDomain::Host;
+		tmpinfo.misc = 0;
+		return BufferHandle(handle_pool.buffers.allocate(this, buffer, allocation, tmpinfo));
+	}
+
 	////////////////////////////
 	//Sampler Creation//////////
 	////////////////////////////
@@ -463,7 +651,8 @@ namespace Vulkan
 		return required_size;
 	}
 
-	InitialImageBuffer Device::CreateUncompressedImageStagingBuffer(const ImageCreateInfo& info, InitialImageData initial)
+	// Packs the levels and layers of uncompressed image data tightly, returning the copies into the image
+	static void PackUncompressedImageData(const ImageCreateInfo& info, const InitialImageData& initial, std::vector<uint8_t>& data, std::vector<ImageStagingCopyInfo>& copies)
 	{
 
 #ifdef VULKAN_DEBUG
@@ -487,7 +676,8 @@ namespace Vulkan
 
 		uint32_t required_size = GetRequiredSize(info, copy_levels);
 
-		uint8_t* dst = static_cast<uint8_t*>(malloc(required_size));
+		data.resize(required_size);
+		uint8_t* dst = data.data();
 
 		uint32_t offset = 0;
 
@@ -498,7 +688,7 @@ namespace Vulkan
 		// Number of bytes each block takes up
 		uint32_t pixel_stride = TextureFormatLayout::FormatBlockSize(info.format, 0);
 
-		std::vector<ImageStagingCopyInfo> copies(copy_levels);
+		copies.resize(copy_levels);
 
 		for (unsigned level = 0; level < copy_levels; level++)
 		{
@@ -537,37 +727,17 @@ namespace Vulkan
 			mip_height = std::max((mip_height >> 1u), 1u);
 			mip_depth = std::max((mip_depth >> 1u), 1u);
 		}
-
-		InitialImageBuffer result = CreateImageStagingBuffer(info, required_size, dst, copies.size(), copies.data());
-
-		free(dst);
-
-		return result;
-
 	}
 
-	InitialImageBuffer Device::CreateImageStagingBuffer(const ImageCreateInfo& info, size_t buffer_size, void* buffer, uint32_t num_copies, ImageStagingCopyInfo* copies)
+	static void FillImageStagingBlits(const ImageCreateInfo& info, uint32_t num_copies, const ImageStagingCopyInfo* copies, std::vector<VkBufferImageCopy>& blits)
 	{
-		InitialImageBuffer result;
-
-		BufferCreateInfo buffer_info = {};
-		buffer_info.domain = BufferDomain::Host;
-		buffer_info.size = buffer_size;
-		buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-		result.buffer = CreateBuffer(buffer_info);
-
-		// And now, do the actual copy.
-		void* mapped = MapHostBuffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT);
-		memcpy(mapped, buffer, buffer_size);
-		UnmapHostBuffer(*result.buffer, MEMORY_ACCESS_WRITE_BIT);
-
-		result.blits.resize(num_copies);
+		blits.resize(num_copies);
 
 		for (uint32_t i = 0; i < num_copies; i++)
 		{
 			const auto& copy = copies[i];
 
-			auto& blit = result.blits[i];
+			auto& blit = blits[i];
 			blit = {};
 			blit.bufferOffset = copy.buffer_offset;
 			blit.bufferRowLength = copy.buffer_row_length;
@@ -579,6 +749,29 @@ namespace Vulkan
 			blit.imageOffset = copy.image_offset;
 			blit.imageExtent = copy.image_extent;
 		}
+	}
+
+	InitialImageBuffer Device::CreateUncompressedImageStagingBuffer(const ImageCreateInfo& info, InitialImageData initial)
+	{
+		std::vector<uint8_t> data;
+		std::vector<ImageStagingCopyInfo> copies;
+		PackUncompressedImageData(info, initial, data, copies);
+
+		return CreateImageStagingBuffer(info, data.size(), data.data(), copies.size(), copies.data());
+	}
+
+	InitialImageBuffer Device::CreateImageStagingBuffer(const ImageCreateInfo& info, size_t buffer_size, const void* buffer, uint32_t num_copies, const ImageStagingCopyInfo* copies)
+	{
+		InitialImageBuffer result;
+
+		BufferCreateInfo buffer_info = {};
+		buffer_info.domain = BufferDomain::Host;
+		buffer_info.size = buffer_size;
+		buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+		buffer_info.category = MemoryCategory::Staging;
+		result.buffer = CreateBuffer(buffer_info, buffer);
+
+		FillImageStagingBlits(info, num_copies, copies, result.blits);
 
 		return result;
 	}
@@ -588,23 +781,28 @@ namespace Vulkan
 		return CreateImageFromStagingBuffer(create_info, nullptr);
 	}
 
-	ImageHandle Device::CreateImage(const ImageCreateInfo& info,  size_t buffer_size, void* buffer, uint32_t num_copies, ImageStagingCopyInfo* copies)
+	ImageHandle Device::CreateImage(const ImageCreateInfo& info, size_t buffer_size, const void* buffer, uint32_t num_copies, const ImageStagingCopyInfo* copies)
 	{
 		if (buffer)
 		{
-			auto staging_buffer = CreateImageStagingBuffer(info, buffer_size, buffer, num_copies, copies);
-			return CreateImageFromStagingBuffer(info, &staging_buffer);
+			// The data is only copied once it is known where the copy will be recorded
+			InitialImageBuffer staging;
+			FillImageStagingBlits(info, num_copies, copies, staging.blits);
+			return CreateImageInner(info, &staging, buffer, buffer_size);
 		}
 		else
 			return CreateImageFromStagingBuffer(info, nullptr);
 	}
 
-	ImageHandle Device::CreateUncompressedImage(const ImageCreateInfo& info,InitialImageData initial)
+	ImageHandle Device::CreateUncompressedImage(const ImageCreateInfo& info, InitialImageData initial)
 	{
 		if (initial.levels)
 		{
-			auto staging_buffer = CreateUncompressedImageStagingBuffer(info, initial);
-			return CreateImageFromStagingBuffer(info, &staging_buffer);
+			std::vector<uint8_t> data;
+			std::vector<ImageStagingCopyInfo> copies;
+			PackUncompressedImageData(info, initial, data, copies);
+
+			return CreateImage(info, data.size(), data.data(), copies.size(), copies.data());
 		}
 		else
 			return CreateImageFromStagingBuffer(info, nullptr);
@@ -624,78 +822,116 @@ namespace Vulkan
 
 	ImageHandle Device::CreateImageFromStagingBuffer(const ImageCreateInfo& create_info, const InitialImageBuffer* staging_buffer)
 	{
+		return CreateImageInner(create_info, staging_buffer, nullptr, 0);
+	}
 
-		bool is_concurrent = (create_info.sharing_mode == ImageSharingMode::Concurrent);
+	static VmaAllocationCreateInfo ImageDomainToAllocationInfo(ImageDomain domain)
+	{
+		VmaAllocationCreateInfo alloc_info{};
 
-		VK_ASSERT((is_concurrent && create_info.concurrent_owners) || (!is_concurrent && create_info.exclusive_owner));
+		if (domain == ImageDomain::Physical)
+		{
+			alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+		}
+		else if (domain == ImageDomain::Transient)
+		{
+			alloc_info.usage = VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED;
+			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+			alloc_info.preferredFlags = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+		}
+		else if (domain == ImageDomain::LinearHost)
+		{
+			alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+			alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+		}
+		else if (domain == ImageDomain::LinearHostCached)
+		{
+			alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+			alloc_info.usage = VMA_MEMORY_USAGE_GPU_TO_CPU;
+			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+			alloc_info.preferredFlags = VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+		}
 
-		
-		bool generate_mips = (create_info.misc & IMAGE_MISC_GENERATE_MIPS_BIT) != 0;
+		return alloc_info;
+	}
 
+	bool Device::FillImageCreateInfo(const ImageCreateInfo& create_info, bool has_staging, VkImageCreateInfo* info, uint32_t* sharing_indices, VkImageFormatListCreateInfoKHR* format_info)
+	{
+		bool is_concurrent = (create_info.sharing_mode == ImageSharingMode::Concurrent);
+		bool generate_mips = (create_info.misc & IMAGE_MISC_GENERATE_MIPS_BIT) != 0;
 		bool is_async_graphics_on_compute_queue = GetPhysicalQueueType(CommandBuffer::Type::AsyncGraphics) == CommandBuffer::Type::AsyncCompute;
 
-		
-		VkImageCreateInfo info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
-		info.format = create_info.format;
-		info.extent.width = create_info.width;
-		info.extent.height = create_info.height;
-		info.extent.depth = create_info.depth;
-		info.imageType = create_info.type;
-		info.mipLevels = create_info.levels;
-		info.arrayLayers = create_info.layers;
-		info.samples = create_info.samples;
+		info->format = create_info.format;
+		info->extent.width = create_info.width;
+		info->extent.height = create_info.height;
+		info->extent.depth = create_info.depth;
+		info->imageType = create_info.type;
+		info->mipLevels = create_info.levels;
+		info->arrayLayers = create_info.layers;
+		info->samples = create_info.samples;
 
 		if (create_info.domain == ImageDomain::LinearHostCached || create_info.domain == ImageDomain::LinearHost)
 		{
-			info.tiling = VK_IMAGE_TILING_LINEAR;
-			info.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
+			info->tiling = VK_IMAGE_TILING_LINEAR;
+			info->initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
 		}
 		else
 		{
-			info.tiling = VK_IMAGE_TILING_OPTIMAL;
-			info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			info->tiling = VK_IMAGE_TILING_OPTIMAL;
+			info->initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 		}
 
-		info.usage = create_info.usage;
-		info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		info->usage = create_info.usage;
+		info->sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 		if (create_info.domain == ImageDomain::Transient)
-			info.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
-		if (staging_buffer)
-			info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-
-		info.flags = 0;
+			info->usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+		if (has_staging)
+			info->usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 
-		if (info.mipLevels == 0)
-			info.mipLevels = ImageNumMipLevels(info.extent);
+		info->flags = 0;
 
-		VkImageFormatListCreateInfoKHR format_info{ VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO_KHR };
+		if (info->mipLevels == 0)
+			info->mipLevels = ImageNumMipLevels(info->extent);
 
 		if (create_info.view_formats == ImageViewFormats::Compatible)
 		{
-			info.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+			info->flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
 		}
 		else if (create_info.view_formats == ImageViewFormats::Custom)
 		{
 			if (create_info.num_custom_view_formats != 0 && create_info.custom_view_formats != nullptr)
 			{
-				format_info.viewFormatCount = create_info.num_custom_view_formats;
-				format_info.pViewFormats = create_info.custom_view_formats;
+				format_info->viewFormatCount = create_info.num_custom_view_formats;
+				format_info->pViewFormats = create_info.custom_view_formats;
 
 				if (ext->supports_image_format_list)
-					info.pNext = &format_info;
+					info->pNext = format_info;
 			}
 
-			info.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+			info->flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
 		}
 
 		if (create_info.misc & IMAGE_MISC_CUBE_COMPATIBLE_BIT)
-			info.flags |= VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+			info->flags |= VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+
+		if (create_info.misc & IMAGE_MISC_SPARSE_RESIDENCY_BIT)
+		{
+			if (!SupportsSparseResidency() || create_info.domain != ImageDomain::Physical || has_staging)
+			{
+				QM_LOG_ERROR("Sparse residency is not supported for this image.\n");
+				return false;
+			}
+
+			info->flags |= VK_IMAGE_CREATE_SPARSE_BINDING_BIT | VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT;
+		}
 
 		if (create_info.misc & IMAGE_MISC_2D_ARRAY_COMPATIBLE_BIT)
 		{
 			if (ext->supports_maintenance_2)
 			{
-				info.flags |= VK_IMAGE_CREATE_2D_ARRAY_COMPATIBLE_BIT_KHR;
+				info->flags |= VK_IMAGE_CREATE_2D_ARRAY_COMPATIBLE_BIT_KHR;
 			}
 			else
 			{
@@ -705,18 +941,17 @@ namespace Vulkan
 
 		/*if ((create_info.usage & VK_IMAGE_USAGE_STORAGE_BIT) || (create_info.misc & IMAGE_MISC_MUTABLE_SRGB_BIT))
 		{
-			info.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+			info->flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
 		}*/
 
 		// Only do this conditionally.
 		// On AMD, using CONCURRENT with async compute disables compression.
-		uint32_t sharing_indices[3] = {};
 
 		if (!is_concurrent)
 		{
-			info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-			info.pQueueFamilyIndices = nullptr;
-			info.queueFamilyIndexCount = 0;
+			info->sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+			info->pQueueFamilyIndices = nullptr;
+			info->queueFamilyIndexCount = 0;
 		}
 		else
 		{
@@ -736,20 +971,20 @@ namespace Vulkan
 				add_unique_family(is_async_graphics_on_compute_queue ? compute_queue_family_index : graphics_queue_family_index);
 			if (create_info.concurrent_owners & IMAGE_COMMAND_QUEUE_ASYNC_COMPUTE)
 				add_unique_family(compute_queue_family_index);
-			if (staging_buffer || (create_info.concurrent_owners & IMAGE_COMMAND_QUEUE_ASYNC_TRANSFER) != 0)
+			if (has_staging || (create_info.concurrent_owners & IMAGE_COMMAND_QUEUE_ASYNC_TRANSFER) != 0)
 				add_unique_family(transfer_queue_family_index);
 
 			if (queueFamilyCount > 1)
 			{
-				info.sharingMode = VK_SHARING_MODE_CONCURRENT;
-				info.pQueueFamilyIndices = sharing_indices;
-				info.queueFamilyIndexCount = queueFamilyCount;
+				info->sharingMode = VK_SHARING_MODE_CONCURRENT;
+				info->pQueueFamilyIndices = sharing_indices;
+				info->queueFamilyIndexCount = queueFamilyCount;
 			}
 			else
 			{
-				info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-				info.pQueueFamilyIndices = nullptr;
-				info.queueFamilyIndexCount = 0;
+				info->sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+				info->pQueueFamilyIndices = nullptr;
+				info->queueFamilyIndexCount = 0;
 			}
 		}
 
@@ -757,66 +992,104 @@ namespace Vulkan
 		if ((create_info.misc & IMAGE_MISC_VERIFY_FORMAT_FEATURE_SAMPLED_LINEAR_FILTER_BIT) != 0)
 			check_extra_features |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
 
-		if (info.tiling == VK_IMAGE_TILING_LINEAR)
+		if (info->tiling == VK_IMAGE_TILING_LINEAR)
 		{
-			if (staging_buffer)
-				return ImageHandle(nullptr);
+			if (has_staging)
+				return false;
 
 			// Do some more stringent checks.
-			if (info.mipLevels > 1 || info.arrayLayers > 1 || info.imageType != VK_IMAGE_TYPE_2D || info.samples != VK_SAMPLE_COUNT_1_BIT)
-				return ImageHandle(nullptr);
+			if (info->mipLevels > 1 || info->arrayLayers > 1 || info->imageType != VK_IMAGE_TYPE_2D || info->samples != VK_SAMPLE_COUNT_1_BIT)
+				return false;
 		
 			VkImageFormatProperties props;
-			if (!GetImageFormatProperties(info.format, info.imageType, info.tiling, info.usage, info.flags, &props))
-				return ImageHandle(nullptr);
+			if (!GetImageFormatProperties(info->format, info->imageType, info->tiling, info->usage, info->flags, &props))
+				return false;
 
 			if (!props.maxArrayLayers ||
 				!props.maxMipLevels ||
-				(info.extent.width > props.maxExtent.width) ||
-				(info.extent.height > props.maxExtent.height) ||
-				(info.extent.depth > props.maxExtent.depth))
+				(info->extent.width > props.maxExtent.width) ||
+				(info->extent.height > props.maxExtent.height) ||
+				(info->extent.depth > props.maxExtent.depth))
 			{
-				return ImageHandle(nullptr);
+				return false;
 			}
 		}
 
-		if (!ImageFormatIsSupported(create_info.format, ImageUsageToFeatures(info.usage) | check_extra_features, info.tiling))
+		if (!ImageFormatIsSupported(create_info.format, ImageUsageToFeatures(info->usage) | check_extra_features, info->tiling))
 		{
 			QM_LOG_ERROR("Format %u is not supported for usage flags!\n", unsigned(create_info.format));
-			return ImageHandle(nullptr);
+			return false;
 		}
 
-		VmaAllocationCreateInfo alloc_info{};
+		return true;
+	}
 
-		if (create_info.domain == ImageDomain::Physical)
-		{
-			alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-		}
-		else if (create_info.domain == ImageDomain::Transient)
-		{
-			alloc_info.usage = VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED;
-			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-			alloc_info.preferredFlags = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
-		}
-		else if (create_info.domain == ImageDomain::LinearHost)
-		{
-			alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-			alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
-		}
-		else if (create_info.domain == ImageDomain::LinearHostCached)
-		{
-			alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-			alloc_info.usage = VMA_MEMORY_USAGE_GPU_TO_CPU;
-			alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
-			alloc_info.preferredFlags = VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-		}
+	bool Device::GetImageMemoryRequirements(const ImageCreateInfo& create_info, VkMemoryRequirements* reqs)
+	{
+		VkImageCreateInfo info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+		VkImageFormatListCreateInfoKHR format_info{ VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO_KHR };
+		uint32_t sharing_indices[3] = {};
+		if (!FillImageCreateInfo(create_info, false, &info, sharing_indices, &format_info))
+			return false;
+
+		// Without maintenance4 the requirements are only known once an image exists
+		VkImage image;
+		if (table->vkCreateImage(device, &info, nullptr, &image) != VK_SUCCESS)
+			return false;
+
+		table->vkGetImageMemoryRequirements(device, image, reqs);
+		table->vkDestroyImage(device, image, nullptr);
+		return true;
+	}
+
+	bool Device::AllocateAliasedMemory(const VkMemoryRequirements& reqs, ImageDomain domain, DeviceAllocation* allocation)
+	{
+		VK_ASSERT(domain == ImageDomain::Physical || domain == ImageDomain::Transient);
+		MemoryCategory category = domain == ImageDomain::Transient ? MemoryCategory::TransientAttachment : MemoryCategory::Image;
+		return managers.memory.AllocateMemory(reqs, ImageDomainToAllocationInfo(domain), category, allocation);
+	}
+
+	ImageHandle Device::CreateAliasedImage(const ImageCreateInfo& info, const DeviceAllocation& memory, VkDeviceSize offset)
+	{
+		VK_ASSERT(info.domain == ImageDomain::Physical || info.domain == ImageDomain::Transient);
+		return CreateImageInner(info, nullptr, nullptr, 0, &memory, offset);
+	}
+
+	ImageHandle Device::CreateImageInner(const ImageCreateInfo& create_info, const InitialImageBuffer* staging_buffer, const void* staging_data, VkDeviceSize staging_size,
+		const DeviceAllocation* alias, VkDeviceSize alias_offset)
+	{
+
+		bool is_concurrent = (create_info.sharing_mode == ImageSharingMode::Concurrent);
+
+		VK_ASSERT((is_concurrent && create_info.concurrent_owners) || (!is_concurrent && create_info.exclusive_owner));
+
+		
+		bool generate_mips = (create_info.misc & IMAGE_MISC_GENERATE_MIPS_BIT) != 0;
+
+		bool is_async_graphics_on_compute_queue = GetPhysicalQueueType(CommandBuffer::Type::AsyncGraphics) == CommandBuffer::Type::AsyncCompute;
+
+		
+		VkImageCreateInfo info = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+		VkImageFormatListCreateInfoKHR format_info{ VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO_KHR };
+		uint32_t sharing_indices[3] = {};
+		if (!FillImageCreateInfo(create_info, staging_buffer != nullptr, &info, sharing_indices, &format_info))
+			return ImageHandle(nullptr);
+
+		VmaAllocationCreateInfo alloc_info = ImageDomainToAllocationInfo(create_info.domain);
 
 		VkImage image;
 		Vulkan::DeviceAllocation allocation;
+		MemoryCategory category = create_info.domain == ImageDomain::Transient ? MemoryCategory::TransientAttachment : MemoryCategory::Image;
+
+		bool allocated;
+		if (alias)
+			allocated = managers.memory.CreateAliasedImage(info, *alias, alias_offset, category, &image, &allocation);
+		else if (create_info.misc & IMAGE_MISC_SPARSE_RESIDENCY_BIT)
+			allocated = managers.memory.CreateSparseImage(info, category, &image, &allocation);
+		else
+			allocated = managers.memory.AllocateImage(info, alloc_info, category, &image, &allocation);
 
-		if (!managers.memory.AllocateImage(info, alloc_info, &image, &allocation))
+		if (!allocated)
 		{
 			if (create_info.domain == ImageDomain::Transient)
 			{
@@ -839,6 +1112,24 @@ namespace Vulkan
 
 		ImageHandle handle(handle_pool.images.allocate(this, image, allocation, tmpinfo));
 
+		// Only batched copies of concurrent images can read from the upload ring, others get a staging buffer of their own
+		InitialImageBuffer host_staging;
+		if (staging_data && (!is_concurrent || staging_size > VULKAN_UPLOAD_RING_MAX_ALLOCATION))
+		{
+			BufferCreateInfo buffer_info = {};
+			buffer_info.domain = BufferDomain::Host;
+			buffer_info.size = staging_size;
+			buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+			buffer_info.category = MemoryCategory::Staging;
+			host_staging.buffer = CreateBuffer(buffer_info, staging_data);
+			if (!host_staging.buffer)
+				return ImageHandle(nullptr);
+
+			host_staging.blits = staging_buffer->blits;
+			staging_buffer = &host_staging;
+			staging_data = nullptr;
+		}
+
 		VkPipelineStageFlags possible_image_stages = ImageUsageToPossibleStages(create_info.usage);
 		VkAccessFlags possible_image_access = ImageUsageToPossibleAccess(create_info.usage) & ImageLayoutToPossibleAccess(create_info.initial_layout);
 
@@ -862,44 +1153,57 @@ namespace Vulkan
 				VK_ASSERT(create_info.domain != ImageDomain::Transient);
 				VK_ASSERT(create_info.initial_layout != VK_IMAGE_LAYOUT_UNDEFINED);
 
-				CommandBufferHandle transfer_cmd = RequestCommandBuffer(CommandBuffer::Type::AsyncTransfer);
-
-				transfer_cmd->ImageBarrier(*handle, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-					VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
-
-				transfer_cmd->CopyBufferToImage(*handle, *staging_buffer->buffer, staging_buffer->blits.size(), staging_buffer->blits.data());
-
-				if (generate_mips)
-				{ // If concurrent and generating mips
-
-					CommandBufferHandle graphics_cmd;
+				{
+					LOCK();
 
-					if (transfer_queue == graphics_queue)
+					VkBuffer src = VK_NULL_HANDLE;
+					VkDeviceSize src_offset = 0;
+					VkDeviceSize src_size = staging_size;
+					if (staging_data)
 					{
-						graphics_cmd = transfer_cmd;
+						// Buffer offsets of copies must be a multiple of both 4 and the texel block size
+						VkDeviceSize alignment = 16;
+						uint32_t block_size = TextureFormatLayout::FormatBlockSize(create_info.format, FormatToAspectMask(create_info.format));
+						while (block_size && (alignment % block_size) != 0)
+							alignment += 16;
+
+						if (!WriteUploadRingNolock(staging_data, staging_size, alignment, &src, &src_offset))
+							return ImageHandle(nullptr);
 					}
 					else
 					{
-						Semaphore sem;
-						Submit(transfer_cmd, nullptr, 1, &sem);
-						AddWaitSemaphore(CommandBuffer::Type::Generic, sem, VK_PIPELINE_STAGE_TRANSFER_BIT, true);
+						src = staging_buffer->buffer->GetBuffer();
+						src_size = staging_buffer->buffer->GetCreateInfo().size;
+					}
 
-						graphics_cmd = RequestCommandBuffer(CommandBuffer::Type::Generic);
+					// With mipmapping the transfer queue leaves the image in TRANSFER_DST for the graphics queue to blit
+					AddImageUploadNolock(*handle, src, src_offset, src_size, uint32_t(staging_buffer->blits.size()), staging_buffer->blits.data(),
+						generate_mips ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : create_info.initial_layout);
+
+					if (generate_mips)
+						AddUploadConsumerNolock(CommandBuffer::Type::Generic, VK_PIPELINE_STAGE_TRANSFER_BIT);
+					else
+					{
+						if (is_concurrent_graphics)
+							AddUploadConsumerNolock(CommandBuffer::Type::Generic, possible_image_stages);
+						if (is_concurrent_compute)
+							AddUploadConsumerNolock(CommandBuffer::Type::AsyncCompute, possible_image_stages);
 					}
 
+					CommitUploadNolock();
+				}
+
+				if (generate_mips)
+				{ // If concurrent and generating mips
+					// The graphics submission waits for the upload batch, so this can be enqueued right away
+					CommandBufferHandle graphics_cmd = RequestCommandBuffer(CommandBuffer::Type::Generic);
+
 					graphics_cmd->BarrierPrepareGenerateMipmap(*handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, true);
 					graphics_cmd->GenerateMipmap(*handle);
 					graphics_cmd->ImageBarrier(*handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, create_info.initial_layout, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, possible_image_stages, possible_image_access);
 
 					SubmitVisible(graphics_cmd, possible_image_stages, true, is_concurrent_compute, is_concurrent_transfer);
 				}
-				else
-				{
-					// If concurrent and not generating mips
-					transfer_cmd->ImageBarrier(*handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, create_info.initial_layout, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, possible_image_stages, possible_image_access);
-
-					SubmitVisible(transfer_cmd, possible_image_stages, is_concurrent_graphics, is_concurrent_compute, true);
-				}
 			}
 			else if (create_info.initial_layout != VK_IMAGE_LAYOUT_UNDEFINED)
 			{
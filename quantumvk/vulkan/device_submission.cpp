@@ -4,6 +4,8 @@
 #include "quantumvk/utils/small_vector.hpp"
 #include "quantumvk/vulkan/misc/type_to_string.hpp"
 
+#include <algorithm>
+
 #ifdef QM_VULKAN_MT
 #include "quantumvk/threading/thread_id.hpp"
 static unsigned GetThreadIndex()
@@ -52,10 +54,48 @@ namespace Vulkan
 		AddFrameCounterNolock();
 		CommandBufferHandle handle(handle_pool.command_buffers.allocate(this, cmd, pipeline_cache, type));
 		handle->SetThreadIndex(thread_index);
+		handle->SetResourceBindings(&GetResourceBindingsNolock(thread_index));
+		handle->SetTransientRings(GetTransientRingsNolock());
 
 		return handle;
 	}
 
+	ResourceBindings& Device::GetResourceBindingsNolock(unsigned thread_index)
+	{
+		VK_ASSERT(thread_index < thread_bindings.size());
+		// Only allocated once a thread actually records something
+		if (!thread_bindings[thread_index])
+			thread_bindings[thread_index].reset(new ResourceBindings());
+		return *thread_bindings[thread_index];
+	}
+
+	TransientRings* Device::GetTransientRingsNolock()
+	{
+		if (!transient_rings_supported || !ImplementationQuirks::get().use_transient_rings)
+			return nullptr;
+
+		// Created on first use in each frame context, a ring which can't be device local and host visible disables them all
+		auto& rings = Frame().transient_rings;
+		if (!rings.vbo.IsValid())
+		{
+			VkDeviceSize ubo_alignment = std::max<VkDeviceSize>(16u, gpu_props.limits.minUniformBufferOffsetAlignment);
+			transient_rings_supported =
+				rings.vbo.Init(this, VULKAN_TRANSIENT_VBO_RING_SIZE, 16, 0, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MemoryCategory::VertexPool) &&
+				rings.ibo.Init(this, VULKAN_TRANSIENT_IBO_RING_SIZE, 16, 0, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, MemoryCategory::IndexPool) &&
+				rings.ubo.Init(this, VULKAN_TRANSIENT_UBO_RING_SIZE, ubo_alignment, VULKAN_MAX_UBO_SIZE, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, MemoryCategory::UniformPool);
+
+			if (!transient_rings_supported)
+			{
+				rings.vbo.Release();
+				rings.ibo.Release();
+				rings.ubo.Release();
+				return nullptr;
+			}
+		}
+
+		return &rings;
+	}
+
 	void Device::SubmitSecondary(CommandBuffer& primary, CommandBuffer& secondary)
 	{
 		{
@@ -74,10 +114,44 @@ namespace Vulkan
 		table->vkCmdExecuteCommands(primary.GetCommandBuffer(), 1, &secondary_cmd);
 	}
 
+	void Device::SubmitSecondaries(CommandBuffer& primary, unsigned count, CommandBufferHandle* secondaries)
+	{
+		auto cmds = AllocateHeapArray<VkCommandBuffer>(count);
+		{
+			LOCK();
+			for (unsigned i = 0; i < count; i++)
+			{
+				auto& secondary = *secondaries[i];
+				secondary.End();
+				DecrementFrameCounterNolock();
+
+#ifdef VULKAN_DEBUG
+				auto& pool = GetCommandPool(secondary.GetCommandBufferType(), secondary.GetThreadIndex());
+				pool.SignalSubmitted(secondary.GetCommandBuffer());
+#endif
+				cmds[i] = secondary.GetCommandBuffer();
+			}
+		}
+
+		table->vkCmdExecuteCommands(primary.GetCommandBuffer(), count, cmds.Data());
+		FreeHeapArray(cmds);
+	}
+
 	CommandBufferHandle Device::RequestSecondaryCommandBufferForThread(unsigned thread_index, const Framebuffer* framebuffer, unsigned subpass, CommandBuffer::Type type)
 	{
 		LOCK();
+		return RequestSecondaryCommandBufferNolock(thread_index, framebuffer, subpass, type);
+	}
+
+	void Device::RequestSecondaryCommandBuffers(unsigned first_thread_index, unsigned count, const Framebuffer* framebuffer, unsigned subpass, CommandBufferHandle* secondaries)
+	{
+		LOCK();
+		for (unsigned i = 0; i < count; i++)
+			secondaries[i] = RequestSecondaryCommandBufferNolock(first_thread_index + i, framebuffer, subpass, CommandBuffer::Type::Generic);
+	}
 
+	CommandBufferHandle Device::RequestSecondaryCommandBufferNolock(unsigned thread_index, const Framebuffer* framebuffer, unsigned subpass, CommandBuffer::Type type)
+	{
 		auto cmd = GetCommandPool(type, thread_index).RequestSecondaryCommandBuffer();
 		VkCommandBufferBeginInfo info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 		VkCommandBufferInheritanceInfo inherit = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
@@ -92,6 +166,8 @@ namespace Vulkan
 		AddFrameCounterNolock();
 		CommandBufferHandle handle(handle_pool.command_buffers.allocate(this, cmd, pipeline_cache, type));
 		handle->SetThreadIndex(thread_index);
+		handle->SetResourceBindings(&GetResourceBindingsNolock(thread_index));
+		handle->SetTransientRings(GetTransientRingsNolock());
 		handle->SetIsSecondary();
 		return handle;
 	}
@@ -191,6 +267,104 @@ namespace Vulkan
 		VK_ASSERT(data.wait_semaphores.size() < 16 * 1024);
 	}
 
+	void Device::AddWaitPoint(CommandBuffer::Type type, const QueuePoint& point, VkPipelineStageFlags stages)
+	{
+		LOCK();
+		AddWaitPointNolock(type, point, stages);
+	}
+
+	void Device::AddWaitPointNolock(CommandBuffer::Type type, const QueuePoint& point, VkPipelineStageFlags stages)
+	{
+		VK_ASSERT(stages != 0);
+		type = GetPhysicalQueueType(type);
+		auto point_type = GetPhysicalQueueType(point.queue);
+		if (!point.value || point_type == type)
+			return;
+
+		auto& point_data = GetQueueData(point_type);
+		VK_ASSERT(point.value <= point_data.current_timeline);
+
+		if (!ext->timeline_semaphore_features.timelineSemaphore)
+		{
+			// Waits for everything submitted to the queue so far instead, which includes the point
+			Semaphore semaphore;
+			SubmitEmptyNolock(point_type, nullptr, 1, &semaphore);
+			AddWaitSemaphoreNolock(type, semaphore, stages, false);
+			return;
+		}
+
+		auto& data = GetQueueData(type);
+		data.need_fence = true;
+
+		// Reaching a value implies reaching all lower ones, so a timeline is only waited on once
+		for (size_t i = 0; i < data.wait_timelines.size(); i++)
+		{
+			if (data.wait_timelines[i] == point_data.timeline_semaphore)
+			{
+				data.wait_timeline_values[i] = std::max(data.wait_timeline_values[i], point.value);
+				data.wait_timeline_stages[i] |= stages;
+				return;
+			}
+		}
+
+		data.wait_timelines.push_back(point_data.timeline_semaphore);
+		data.wait_timeline_values.push_back(point.value);
+		data.wait_timeline_stages.push_back(stages);
+	}
+
+	void Device::BindSparse(const VkBindSparseInfo& info, VkPipelineStageFlags graphics_stages, VkPipelineStageFlags compute_stages)
+	{
+		LOCK();
+		VK_ASSERT(sparse_queue != VK_NULL_HANDLE);
+
+		if (compute_queue == graphics_queue)
+		{
+			graphics_stages |= compute_stages;
+			compute_stages = 0;
+		}
+
+		// Sparse binds aren't ordered against command buffers, even on the same queue
+		VkSemaphore signals[2];
+		unsigned signal_count = 0;
+		if (graphics_stages)
+			signals[signal_count++] = managers.semaphore.RequestClearedSemaphore();
+		if (compute_stages)
+			signals[signal_count++] = managers.semaphore.RequestClearedSemaphore();
+
+		VkBindSparseInfo bind_info = info;
+		bind_info.signalSemaphoreCount = signal_count;
+		bind_info.pSignalSemaphores = signals;
+
+		// Must not overtake submissions which were handed to the submission thread already
+		DrainSubmissionThreadNolock();
+
+		if (queue_lock_callback)
+			queue_lock_callback();
+		VkResult result = table->vkQueueBindSparse(sparse_queue, 1, &bind_info, VK_NULL_HANDLE);
+		if (queue_unlock_callback)
+			queue_unlock_callback();
+
+		if (result != VK_SUCCESS)
+		{
+			QM_LOG_ERROR("vkQueueBindSparse failed (code: %d).\n", int(result));
+			for (unsigned i = 0; i < signal_count; i++)
+				managers.semaphore.RecycleSemaphore(signals[i]);
+			return;
+		}
+
+		unsigned signal_index = 0;
+		if (graphics_stages)
+		{
+			Semaphore sem(handle_pool.semaphores.allocate(this, signals[signal_index++], true));
+			AddWaitSemaphoreNolock(CommandBuffer::Type::Generic, sem, graphics_stages, false);
+		}
+		if (compute_stages)
+		{
+			Semaphore sem(handle_pool.semaphores.allocate(this, signals[signal_index++], true));
+			AddWaitSemaphoreNolock(CommandBuffer::Type::AsyncCompute, sem, compute_stages, false);
+		}
+	}
+
 	void Device::Submit(CommandBufferHandle& cmd, Fence* fence, unsigned semaphore_count, Semaphore* semaphores)
 	{
 		// Lock mutex
@@ -198,6 +372,36 @@ namespace Vulkan
 		SubmitNolock(std::move(cmd), fence, semaphore_count, semaphores);
 	}
 
+	QueuePoint Device::Submit(CommandBufferHandle& cmd, unsigned wait_count, const QueueWait* waits)
+	{
+		LOCK();
+		auto type = GetPhysicalQueueType(cmd->GetCommandBufferType());
+		for (unsigned i = 0; i < wait_count; i++)
+			AddWaitPointNolock(type, waits[i].point, waits[i].stages);
+
+		// The flush assigns the timeline value, it only becomes a batch of its own if there are waits
+		SubmitNolock(std::move(cmd), nullptr, 0, nullptr);
+		SubmitQueue(type, nullptr, 0, nullptr);
+
+		QueuePoint point;
+		point.queue = type;
+		point.value = GetQueueData(type).current_timeline;
+		return point;
+	}
+
+	Fence Device::RequestFence(const QueuePoint& point)
+	{
+		LOCK();
+		auto type = GetPhysicalQueueType(point.queue);
+		if (ext->timeline_semaphore_features.timelineSemaphore)
+			return Fence(handle_pool.fences.allocate(this, point.value, GetQueueData(type).timeline_semaphore));
+
+		// Without timeline semaphores the fence covers everything submitted to the queue so far, which includes the point
+		Fence fence;
+		SubmitEmptyNolock(type, &fence, 0, nullptr);
+		return fence;
+	}
+
 	CommandBuffer::Type Device::GetPhysicalQueueType(CommandBuffer::Type queue_type) const
 	{
 		// This correction only applies to async graphics
@@ -218,6 +422,11 @@ namespace Vulkan
 	{
 		//Get the command buffer type
 		auto type = cmd->GetCommandBufferType();
+
+		// Pending uploads have to execute before transfer work submitted after them
+		if (GetPhysicalQueueType(type) == CommandBuffer::Type::AsyncTransfer)
+			FlushUploadsNolock();
+
 		auto& submissions = GetQueueSubmission(type);
 #ifdef VULKAN_DEBUG
 		auto& pool = GetCommandPool(type, cmd->GetThreadIndex());
@@ -273,16 +482,8 @@ namespace Vulkan
 	void Device::SubmitEmptyInner(CommandBuffer::Type type, InternalFence* fence, unsigned semaphore_count, Semaphore* semaphores)
 	{
 		auto& data = GetQueueData(type);
-		VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-		VkTimelineSemaphoreSubmitInfoKHR timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
-
-		if (ext->timeline_semaphore_features.timelineSemaphore)
-			submit.pNext = &timeline_info;
-
-		VkSemaphore timeline_semaphore = data.timeline_semaphore;
-		uint64_t timeline_value = ++data.current_timeline;
+		++data.current_timeline;
 
-		VkQueue queue = GetVkQueue(type);
 		switch (type)
 		{
 		default:
@@ -292,7 +493,7 @@ namespace Vulkan
 			if (ext->timeline_semaphore_features.timelineSemaphore)
 			{
 				QM_LOG_INFO("Signal graphics: (%p) %u\n",
-					reinterpret_cast<void*>(timeline_semaphore),
+					reinterpret_cast<void*>(data.timeline_semaphore),
 					unsigned(data.current_timeline));
 			}
 #endif
@@ -304,7 +505,7 @@ namespace Vulkan
 			if (ext->timeline_semaphore_features.timelineSemaphore)
 			{
 				QM_LOG_INFO("Signal compute: (%p) %u\n",
-					reinterpret_cast<void*>(timeline_semaphore),
+					reinterpret_cast<void*>(data.timeline_semaphore),
 					unsigned(data.current_timeline));
 			}
 #endif
@@ -316,144 +517,19 @@ namespace Vulkan
 			if (ext->timeline_semaphore_features.timelineSemaphore)
 			{
 				QM_LOG_INFO("Signal transfer: (%p) %u\n",
-					reinterpret_cast<void*>(timeline_semaphore),
+					reinterpret_cast<void*>(data.timeline_semaphore),
 					unsigned(data.current_timeline));
 			}
 #endif
 			break;
 		}
 
-		// Add external signal semaphores.
-		Util::SmallVector<VkSemaphore> signals;
-		if (ext->timeline_semaphore_features.timelineSemaphore)
-		{
-			// Signal once and distribute the timeline value to all.
-			timeline_info.signalSemaphoreValueCount = 1;
-			timeline_info.pSignalSemaphoreValues = &timeline_value;
-			submit.signalSemaphoreCount = 1;
-			submit.pSignalSemaphores = &timeline_semaphore;
-
-			if (fence)
-			{
-				fence->timeline = timeline_semaphore;
-				fence->value = timeline_value;
-				fence->fence = VK_NULL_HANDLE;
-			}
-
-			for (unsigned i = 0; i < semaphore_count; i++)
-			{
-				VK_ASSERT(!semaphores[i]);
-				semaphores[i] = Semaphore(handle_pool.semaphores.allocate(this, timeline_value, timeline_semaphore));
-			}
-		}
-		else
-		{
-			if (fence)
-			{
-				fence->timeline = VK_NULL_HANDLE;
-				fence->value = 0;
-			}
-
-			for (unsigned i = 0; i < semaphore_count; i++)
-			{
-				VkSemaphore cleared_semaphore = managers.semaphore.RequestClearedSemaphore();
-				signals.push_back(cleared_semaphore);
-				VK_ASSERT(!semaphores[i]);
-				semaphores[i] = Semaphore(handle_pool.semaphores.allocate(this, cleared_semaphore, true));
-			}
-
-			submit.signalSemaphoreCount = signals.size();
-			if (!signals.empty())
-				submit.pSignalSemaphores = signals.data();
-		}
-
-		// Add external wait semaphores.
-		Util::SmallVector<VkSemaphore> waits;
-		Util::SmallVector<uint64_t> waits_count;
-		auto stages = std::move(data.wait_stages);
-
-		for (auto& semaphore : data.wait_semaphores)
-		{
-			auto wait = semaphore->Consume();
-			if (!semaphore->GetTimelineValue())
-			{
-				if (semaphore->CanRecycle())
-					Frame().recycled_semaphores.push_back(wait);
-				else
-					Frame().destroyed_semaphores.push_back(wait);
-			}
-			waits.push_back(wait);
-			waits_count.push_back(semaphore->GetTimelineValue());
-		}
-
-		data.wait_stages.clear();
-		data.wait_semaphores.clear();
-
-		submit.waitSemaphoreCount = waits.size();
-		if (!stages.empty())
-			submit.pWaitDstStageMask = stages.data();
-		if (!waits.empty())
-			submit.pWaitSemaphores = waits.data();
-
-		if (!waits_count.empty())
-		{
-			timeline_info.waitSemaphoreValueCount = waits_count.size();
-			timeline_info.pWaitSemaphoreValues = waits_count.data();
-		}
-
-		VkFence cleared_fence = fence && !ext->timeline_semaphore_features.timelineSemaphore ? managers.fence.RequestClearedFence() : VK_NULL_HANDLE;
-		if (fence)
-			fence->fence = cleared_fence;
-
-		if (queue_lock_callback)
-			queue_lock_callback();
-#if defined(VULKAN_DEBUG) && defined(SUBMIT_DEBUG)
-		if (cleared_fence)
-			QM_LOG_INFO("Signalling Fence: %llx\n", reinterpret_cast<unsigned long long>(cleared_fence));
-#endif
-
-		VkResult result = table->vkQueueSubmit(queue, 1, &submit, cleared_fence);
-		if (ImplementationQuirks::get().queue_wait_on_submission)
-			table->vkQueueWaitIdle(queue);
-		if (queue_unlock_callback)
-			queue_unlock_callback();
-
-		if (result != VK_SUCCESS)
-			QM_LOG_ERROR("vkQueueSubmit failed (code: %d).\n", int(result));
-
-		if (!ext->timeline_semaphore_features.timelineSemaphore)
-			data.need_fence = true;
-
-#if defined(VULKAN_DEBUG) && defined(SUBMIT_DEBUG)
-		const char* queue_name = nullptr;
-		switch (type)
-		{
-		default:
-		case CommandBuffer::Type::Generic:
-			queue_name = "Graphics";
-			break;
-		case CommandBuffer::Type::AsyncCompute:
-			queue_name = "Compute";
-			break;
-		case CommandBuffer::Type::AsyncTransfer:
-			queue_name = "Transfer";
-			break;
-		}
-
-		QM_LOG_INFO("Empty submission to %s queue:\n", queue_name);
-		for (uint32_t i = 0; i < submit.waitSemaphoreCount; i++)
-		{
-			//QM_LOG_INFO("  Waiting for semaphore: %llx in stages %s\n",
-				//reinterpret_cast<unsigned long long>(submit.pWaitSemaphores[i]),
-				//StageFlagsToString(submit.pWaitDstStageMask[i]).c_str());
-		}
+		submission_stats.flushes++;
 
-		for (uint32_t i = 0; i < submit.signalSemaphoreCount; i++)
-		{
-			QM_LOG_INFO("  Signalling semaphore: %llx\n",
-				reinterpret_cast<unsigned long long>(submit.pSignalSemaphores[i]));
-		}
-#endif
+		// An empty batch, which only waits and signals
+		auto& batch = AddQueueBatchNolock(data, data.HasWaits());
+		ConsumeWaitSemaphoresNolock(data, batch);
+		FinishQueueBatchNolock(type, fence, semaphore_count, semaphores);
 	}
 
 	void Device::SubmitVisible(CommandBufferHandle& cmd, VkPipelineStageFlags visible_stages, bool graphics_visible, bool compute_visible, bool transfer_visible)
@@ -582,8 +658,6 @@ namespace Vulkan
 
 		VkSemaphore timeline_semaphore = data.timeline_semaphore;
 		uint64_t timeline_value = ++data.current_timeline;
-		//Get the queue
-		VkQueue queue = GetVkQueue(type);
 		switch (type)
 		{
 		default:
@@ -615,181 +689,166 @@ namespace Vulkan
 			break;
 		}
 
-		//TODO persistant memory (aka just a vector in device class)
-
-		//Commands to submit
-		Util::SmallVector<VkCommandBuffer> cmds;
-		cmds.reserve(submissions.size());
+		submission_stats.flushes++;
 
-		//Batched queue submits
-		Util::SmallVector<VkSubmitInfo> submits;
-		Util::SmallVector<VkTimelineSemaphoreSubmitInfoKHR> timeline_infos;
-
-		submits.reserve(2);
-		timeline_infos.reserve(2);
-
-		size_t last_cmd = 0;
-
-		Util::SmallVector<VkSemaphore> waits[2];
-		Util::SmallVector<uint64_t> wait_counts[2];
-		Util::SmallVector<VkFlags> wait_stages[2];
-		Util::SmallVector<VkSemaphore> signals[2];
-		Util::SmallVector<uint64_t> signal_counts[2];
-
-		// Add external wait semaphores.
-		wait_stages[0] = std::move(data.wait_stages);
-
-		for (auto& semaphore : data.wait_semaphores)
+		// Commands go into at most two batches. The first can start immediately,
+		// while the second has commands which touch the swapchain and must wait for the acquire semaphore. For example:
+		// Key: N - command that doesn't touch the swapchain, S - command that involves the swapchain
+		// Batch 1: (N, N, N, N, N) - The first batch doesn't ever use the swapchain, so it doesn't need to wait for it.
+		// Batch 2: (S, N, S, S, N, N) - The second involves the swapchain, so it must wait for VkAquireNextImageKHR to finish.
+		size_t split = 0;
+		if (!wsi.touched && !wsi.consumed)
 		{
-			auto wait = semaphore->Consume();
-			if (!semaphore->GetTimelineValue())
+			for (size_t i = 0; i < submissions.size(); i++)
 			{
-				if (semaphore->CanRecycle())
-					Frame().recycled_semaphores.push_back(wait);
-				else
-					Frame().destroyed_semaphores.push_back(wait);
+				if (submissions[i]->SwapchainTouched())
+				{
+					split = i;
+					//Indicate that the wsi is involved in this submission
+					wsi.touched = true;
+					break;
+				}
 			}
-			wait_counts[0].push_back(semaphore->GetTimelineValue());
-			waits[0].push_back(wait);
 		}
 
-		//Reset wait stages and semaphores
-		data.wait_stages.clear();
-		data.wait_semaphores.clear();
+		bool swapchain_batch = wsi.touched && !wsi.consumed;
+		bool acquire_wait = swapchain_batch && wsi.acquire && wsi.acquire->GetSemaphore() != VK_NULL_HANDLE;
 
-		for (auto& cmd : submissions)
+		if (split != 0)
 		{
-			if (cmd->SwapchainTouched() && !wsi.touched && !wsi.consumed)
-			{
-				// If cmd involves swapchain
-				if (!cmds.empty())
-				{
-					// If submmission contains some commands that don't involve the swapchain
-
-					// Push them into thier own submission.
-
-					// Create new submission and timeline-semaphore-info
-					submits.emplace_back();
-					timeline_infos.emplace_back();
-
-					//Set stype
-					auto& timeline_info = timeline_infos.back();
-					timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
+			auto& batch = AddQueueBatchNolock(data, data.HasWaits());
+			ConsumeWaitSemaphoresNolock(data, batch);
+			for (size_t i = 0; i < split; i++)
+				batch.cmds.push_back(submissions[i]->GetCommandBuffer());
+		}
 
-					auto& submit = submits.back();
-					submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+		// No need to add QueueData wait stages/semaphores to the second batch.
+		// All batches begin execution in order, they just may complete out of order.
+		auto& batch = AddQueueBatchNolock(data, acquire_wait || data.HasWaits());
+		ConsumeWaitSemaphoresNolock(data, batch);
 
-					//If timeline semaphores supported, set pnext
-					if (ext->timeline_semaphore_features.timelineSemaphore)
-						submit.pNext = &timeline_info;
+		if (acquire_wait)
+		{
+			// Basically this batch will wait for vkAquireNextImageKHR to complete before being submitted, as it has commands that depend on the
+			// swapchain image.
+			VK_ASSERT(wsi.acquire->IsSignalled());
+			VkSemaphore sem = wsi.acquire->Consume();
 
-					// This submission will batch the non-swapchain involving commands together
-					submit.commandBufferCount = cmds.size() - last_cmd;
-					submit.pCommandBuffers = cmds.data() + last_cmd;
+			batch.waits.push_back(sem);
+			batch.wait_values.push_back(wsi.acquire->GetTimelineValue());
+			batch.wait_stages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
 
-					last_cmd = cmds.size();
-				}
-				//Indicate that the wsi is involved in this submission
-				wsi.touched = true;
+			if (!wsi.acquire->GetTimelineValue())
+			{
+				if (wsi.acquire->CanRecycle())
+					Frame().recycled_semaphores.push_back(sem);
+				else
+					Frame().destroyed_semaphores.push_back(sem);
 			}
-			//Push command into pending submission queue
-			cmds.push_back(cmd->GetCommandBuffer());
-		}
 
-		if (cmds.size() > last_cmd)
-		{
-			//If there are commands that weren't part of the first submit (which there will always be)
+			wsi.acquire.Reset();
+		}
 
-			unsigned index = submits.size();
+		for (size_t i = split; i < submissions.size(); i++)
+			batch.cmds.push_back(submissions[i]->GetCommandBuffer());
 
-			// Push all pending cmd buffers to their own submission.
-			// Create new submission and timeline-semaphore-info
-			submits.emplace_back();
-			timeline_infos.emplace_back();
+		if (swapchain_batch)
+		{
+			VkSemaphore release = managers.semaphore.RequestClearedSemaphore();
+			wsi.release = Semaphore(handle_pool.semaphores.allocate(this, release, true));
+			wsi.release->SetInternalSyncObject();
+			batch.signals.push_back(release);
+			batch.signal_values.push_back(0);
+			batch.sealed = true;
+			wsi.consumed = true;
+		}
 
-			//Set stype
-			auto& timeline_info = timeline_infos.back();
-			timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
+		// Readbacks complete with this submission's timeline value
+		for (auto& cmd : submissions)
+			for (auto ticket : cmd->GetReadbackTickets())
+				SubmitReadbackNolock(ticket, ext->timeline_semaphore_features.timelineSemaphore ? timeline_semaphore : VK_NULL_HANDLE, timeline_value);
 
-			auto& submit = submits.back();
-			submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+		submissions.clear();
 
-			// If timeline semaphores supported, set pnext
-			if (ext->timeline_semaphore_features.timelineSemaphore)
-				submit.pNext = &timeline_info;
+		FinishQueueBatchNolock(type, fence, semaphore_count, semaphores);
+	}
 
-			submit.commandBufferCount = cmds.size() - last_cmd;
-			submit.pCommandBuffers = cmds.data() + last_cmd;
+	QueueBatch& Device::AddQueueBatchNolock(QueueData& data, bool has_waits)
+	{
+		// Commands without waits can join the previous batch, which then signals the timeline after them instead
+		if (!has_waits && !data.batches.empty() && !data.batches.back().sealed)
+		{
+			submission_stats.merged_flushes++;
+			return data.batches.back();
+		}
 
-			// No need to add QueueData.wait stages/semaphores to this second submission
-			// All queueSubmission begin execution in order. They just may complete out of order.
+		data.batches.emplace_back();
+		return data.batches.back();
+	}
 
-			// If the swapchain is touched and it has an aquire semaphore
-			if (wsi.touched && !wsi.consumed)
+	void Device::ConsumeWaitSemaphoresNolock(QueueData& data, QueueBatch& batch)
+	{
+		for (size_t i = 0; i < data.wait_semaphores.size(); i++)
+		{
+			auto& semaphore = data.wait_semaphores[i];
+			auto wait = semaphore->Consume();
+			if (!semaphore->GetTimelineValue())
 			{
-				static const VkFlags wait = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-				if (wsi.acquire && wsi.acquire->GetSemaphore() != VK_NULL_HANDLE)
-				{
-					// Then make this submission batch (which has one or more swapchain touching commands buffers) wait for the aquire semaphore.
-					// Basically this batch will wait for vkAquireNextImageKHR to complete before being submitted, as it has commands that depend on the
-					// swapchain image.
-					VK_ASSERT(wsi.acquire->IsSignalled());
-					VkSemaphore sem = wsi.acquire->Consume();
-
-					waits[index].push_back(sem);
-					wait_counts[index].push_back(wsi.acquire->GetTimelineValue());
-					wait_stages[index].push_back(wait);
-
-					if (!wsi.acquire->GetTimelineValue())
-					{
-						if (wsi.acquire->CanRecycle())
-							Frame().recycled_semaphores.push_back(sem);
-						else
-							Frame().destroyed_semaphores.push_back(sem);
-					}
-
-					wsi.acquire.Reset();
-				}
-
-				VkSemaphore release = managers.semaphore.RequestClearedSemaphore();
-				wsi.release = Semaphore(handle_pool.semaphores.allocate(this, release, true));
-				wsi.release->SetInternalSyncObject();
-				signals[index].push_back(wsi.release->GetSemaphore());
-				signal_counts[index].push_back(0);
-				wsi.consumed = true;
+				if (semaphore->CanRecycle())
+					Frame().recycled_semaphores.push_back(wait);
+				else
+					Frame().destroyed_semaphores.push_back(wait);
 			}
-			last_cmd = cmds.size();
+
+			batch.waits.push_back(wait);
+			batch.wait_values.push_back(semaphore->GetTimelineValue());
+			batch.wait_stages.push_back(data.wait_stages[i]);
 		}
 
-		// In short, the algorithm above puts commands into at most two batches. The first can be submitted and work on it can start immediately.
-		// While the second must wait for the aquire semaphore to finish. For example:
-		// Key: N - command that doesn't touch the swapchain, S - command that involves the swapchain
-		// Batch 1: (N, N, N, N, N) - The first batch doesn't ever use the swapchain, so it doesn't need to wait for it.
-		// Batch 2: (S, N, S, S, N, N) - The second involves the swapchain, so it must wait for VkAquireNextImageKHR to finish.
+		for (size_t i = 0; i < data.wait_timelines.size(); i++)
+		{
+			batch.waits.push_back(data.wait_timelines[i]);
+			batch.wait_values.push_back(data.wait_timeline_values[i]);
+			batch.wait_stages.push_back(data.wait_timeline_stages[i]);
+		}
 
-		VkFence cleared_fence = fence && !ext->timeline_semaphore_features.timelineSemaphore ? managers.fence.RequestClearedFence() : VK_NULL_HANDLE;
+		//Reset wait stages and semaphores
+		data.wait_stages.clear();
+		data.wait_semaphores.clear();
+		data.wait_timelines.clear();
+		data.wait_timeline_values.clear();
+		data.wait_timeline_stages.clear();
+	}
 
-		if (fence)
-			fence->fence = cleared_fence;
+	void Device::FinishQueueBatchNolock(CommandBuffer::Type type, InternalFence* fence, unsigned semaphore_count, Semaphore* semaphores)
+	{
+		auto& data = GetQueueData(type);
+		auto& batch = data.batches.back();
+		bool timeline_supported = ext->timeline_semaphore_features.timelineSemaphore;
 
-		// Add external signal semaphores.
-		if (ext->timeline_semaphore_features.timelineSemaphore)
+		if (timeline_supported)
 		{
-			// Signal once and distribute the timeline value to all.
-			signals[submits.size() - 1].push_back(timeline_semaphore);
-			signal_counts[submits.size() - 1].push_back(timeline_value);
+			// Signal once and distribute the timeline value to all. A merged batch only signals its last value.
+			auto itr = std::find(batch.signals.begin(), batch.signals.end(), data.timeline_semaphore);
+			if (itr != batch.signals.end())
+				batch.signal_values[itr - batch.signals.begin()] = data.current_timeline;
+			else
+			{
+				batch.signals.push_back(data.timeline_semaphore);
+				batch.signal_values.push_back(data.current_timeline);
+			}
 
 			if (fence)
 			{
-				fence->timeline = timeline_semaphore;
-				fence->value = timeline_value;
+				fence->timeline = data.timeline_semaphore;
+				fence->value = data.current_timeline;
 				fence->fence = VK_NULL_HANDLE;
 			}
 
 			for (unsigned i = 0; i < semaphore_count; i++)
 			{
 				VK_ASSERT(!semaphores[i]);
-				semaphores[i] = Semaphore(handle_pool.semaphores.allocate(this, timeline_value, timeline_semaphore));
+				semaphores[i] = Semaphore(handle_pool.semaphores.allocate(this, data.current_timeline, data.timeline_semaphore));
 			}
 		}
 		else
@@ -803,51 +862,61 @@ namespace Vulkan
 			for (unsigned i = 0; i < semaphore_count; i++)
 			{
 				VkSemaphore cleared_semaphore = managers.semaphore.RequestClearedSemaphore();
-				signals[submits.size() - 1].push_back(cleared_semaphore);
-				signal_counts[submits.size() - 1].push_back(0);
+				batch.signals.push_back(cleared_semaphore);
+				batch.signal_values.push_back(0);
 				VK_ASSERT(!semaphores[i]);
 				semaphores[i] = Semaphore(handle_pool.semaphores.allocate(this, cleared_semaphore, true));
 			}
 		}
 
-		//Gather all infomation for the submits
-		for (unsigned i = 0; i < submits.size(); i++)
-		{
-			auto& submit = submits[i];
-			auto& timeline_submit = timeline_infos[i];
+		VkFence cleared_fence = fence && !timeline_supported ? managers.fence.RequestClearedFence() : VK_NULL_HANDLE;
+		if (fence && !timeline_supported)
+			fence->fence = cleared_fence;
 
-			submit.waitSemaphoreCount = waits[i].size();
-			submit.pWaitSemaphores = waits[i].data();
-			submit.pWaitDstStageMask = wait_stages[i].data();
-			timeline_submit.waitSemaphoreValueCount = submit.waitSemaphoreCount;
-			timeline_submit.pWaitSemaphoreValues = wait_counts[i].data();
+		// Binary semaphores and fences must be submitted before anything can wait on them, timeline values can wait in the batch
+		if (!timeline_supported || !submission_batching)
+			SubmitBatchesNolock(type, cleared_fence);
 
-			submit.signalSemaphoreCount = signals[i].size();
-			submit.pSignalSemaphores = signals[i].data();
-			timeline_submit.signalSemaphoreValueCount = submit.signalSemaphoreCount;
-			timeline_submit.pSignalSemaphoreValues = signal_counts[i].data();
+		if (!timeline_supported)
+			data.need_fence = true;
+	}
+
+	void Device::SubmitBatchesNolock(CommandBuffer::Type type, VkFence fence)
+	{
+		type = GetPhysicalQueueType(type);
+		auto& data = GetQueueData(type);
+		if (data.batches.empty())
+		{
+			VK_ASSERT(fence == VK_NULL_HANDLE);
+			return;
 		}
 
-		if (queue_lock_callback)
-			queue_lock_callback();
-#if defined(VULKAN_DEBUG) && defined(SUBMIT_DEBUG)
-		if (cleared_fence)
-			QM_LOG_ERROR("Signalling fence: %llx\n", reinterpret_cast<unsigned long long>(cleared_fence));
-#endif
-		//Submit the command batches
-		VkResult result = table->vkQueueSubmit(queue, submits.size(), submits.data(), cleared_fence);
-		if (ImplementationQuirks::get().queue_wait_on_submission)
-			table->vkQueueWaitIdle(queue);
-		if (queue_unlock_callback)
-			queue_unlock_callback();
+		// Taken out first, so queues which wait on each other can't recurse forever
+		auto batches = std::move(data.batches);
+		data.batches.clear();
 
-		if (result != VK_SUCCESS)
-			QM_LOG_ERROR("vkQueueSubmit failed (code: %d).\n", int(result));
+		// Timeline values waited on have to be submitted before the wait
+		for (auto& batch : batches)
+			for (size_t i = 0; i < batch.waits.size(); i++)
+				if (batch.wait_values[i])
+					FlushTimelineNolock(batch.waits[i], batch.wait_values[i]);
 
-		submissions.clear();
+		uint64_t signalled_timeline = data.submitted_timeline;
+		for (auto& batch : batches)
+			for (size_t i = 0; i < batch.signals.size(); i++)
+				if (batch.signals[i] == data.timeline_semaphore)
+					signalled_timeline = std::max(signalled_timeline, batch.signal_values[i]);
 
-		if (!ext->timeline_semaphore_features.timelineSemaphore)
-			data.need_fence = true;
+		VkQueue queue = GetVkQueue(type);
+
+#if defined(VULKAN_DEBUG) && defined(SUBMIT_DEBUG)
+		if (fence)
+			QM_LOG_INFO("Signalling fence: %llx\n", reinterpret_cast<unsigned long long>(fence));
+#endif
+
+		data.submitted_timeline = signalled_timeline;
+		submission_stats.queue_submits++;
+		submission_stats.batches += uint32_t(batches.size());
 
 #if defined(VULKAN_DEBUG) && defined(SUBMIT_DEBUG)
 		const char* queue_name = nullptr;
@@ -865,26 +934,243 @@ namespace Vulkan
 			break;
 		}
 
-		for (auto& submit : submits)
+		for (auto& batch : batches)
 		{
 			QM_LOG_INFO("Submission to %s queue:\n", queue_name);
-			for (uint32_t i = 0; i < submit.waitSemaphoreCount; i++)
+			for (size_t i = 0; i < batch.waits.size(); i++)
 			{
 				QM_LOG_INFO("  Waiting for semaphore: %llx in stages %s\n",
-					reinterpret_cast<unsigned long long>(submit.pWaitSemaphores[i]),
-					StageFlagsToString(submit.pWaitDstStageMask[i]).c_str());
+					reinterpret_cast<unsigned long long>(batch.waits[i]),
+					StageFlagsToString(batch.wait_stages[i]).c_str());
+			}
+
+			for (auto cmd : batch.cmds)
+				QM_LOG_INFO(" Command Buffer %llx\n", reinterpret_cast<unsigned long long>(cmd));
+
+			for (auto signal : batch.signals)
+				QM_LOG_INFO("  Signalling semaphore: %llx\n", reinterpret_cast<unsigned long long>(signal));
+		}
+#endif
+
+		if (submission_thread)
+		{
+			SubmissionJob job;
+			job.type = SubmissionJob::Type::Submit;
+			job.queue = queue;
+			job.fence = fence;
+			job.batches = std::move(batches);
+			submission_thread->Push(std::move(job));
+		}
+		else
+			SubmitQueueBatches(queue, batches, fence);
+	}
+
+	VkResult Device::SubmitQueueBatches(VkQueue queue, const std::vector<QueueBatch>& batches, VkFence fence)
+	{
+		VkResult result;
+		if (ext->synchronization2_features.synchronization2)
+		{
+			size_t semaphore_count = 0;
+			size_t cmd_count = 0;
+			for (auto& batch : batches)
+			{
+				semaphore_count += batch.waits.size() + batch.signals.size();
+				cmd_count += batch.cmds.size();
 			}
 
-			for (uint32_t i = 0; i < submit.commandBufferCount; i++)
-				QM_LOG_INFO(" Command Buffer %llx\n", reinterpret_cast<unsigned long long>(submit.pCommandBuffers[i]));
+			// Reserved up front, the submits point into these
+			Util::SmallVector<VkSubmitInfo2KHR> submits;
+			Util::SmallVector<VkSemaphoreSubmitInfoKHR> semaphore_infos;
+			Util::SmallVector<VkCommandBufferSubmitInfoKHR> cmd_infos;
+			submits.reserve(batches.size());
+			semaphore_infos.reserve(semaphore_count);
+			cmd_infos.reserve(cmd_count);
 
-			for (uint32_t i = 0; i < submit.signalSemaphoreCount; i++)
+			for (auto& batch : batches)
 			{
-				QM_LOG_INFO("  Signalling semaphore: %llx\n",
-					reinterpret_cast<unsigned long long>(submit.pSignalSemaphores[i]));
+				VkSubmitInfo2KHR submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2_KHR };
+
+				submit.waitSemaphoreInfoCount = uint32_t(batch.waits.size());
+				submit.pWaitSemaphoreInfos = semaphore_infos.data() + semaphore_infos.size();
+				for (size_t i = 0; i < batch.waits.size(); i++)
+				{
+					VkSemaphoreSubmitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO_KHR };
+					info.semaphore = batch.waits[i];
+					info.value = batch.wait_values[i];
+					info.stageMask = batch.wait_stages[i];
+					semaphore_infos.push_back(info);
+				}
+
+				submit.commandBufferInfoCount = uint32_t(batch.cmds.size());
+				submit.pCommandBufferInfos = cmd_infos.data() + cmd_infos.size();
+				for (auto cmd : batch.cmds)
+				{
+					VkCommandBufferSubmitInfoKHR info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO_KHR };
+					info.commandBuffer = cmd;
+					cmd_infos.push_back(info);
+				}
+
+				submit.signalSemaphoreInfoCount = uint32_t(batch.signals.size());
+				submit.pSignalSemaphoreInfos = semaphore_infos.data() + semaphore_infos.size();
+				for (size_t i = 0; i < batch.signals.size(); i++)
+				{
+					VkSemaphoreSubmitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO_KHR };
+					info.semaphore = batch.signals[i];
+					info.value = batch.signal_values[i];
+					info.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
+					semaphore_infos.push_back(info);
+				}
+
+				submits.push_back(submit);
 			}
+
+			if (queue_lock_callback)
+				queue_lock_callback();
+			result = table->vkQueueSubmit2KHR(queue, uint32_t(submits.size()), submits.data(), fence);
+			if (ImplementationQuirks::get().queue_wait_on_submission)
+				table->vkQueueWaitIdle(queue);
+			if (queue_unlock_callback)
+				queue_unlock_callback();
 		}
-#endif
+		else
+		{
+			// Reserved up front, the submits point into the timeline infos
+			Util::SmallVector<VkSubmitInfo> submits;
+			Util::SmallVector<VkTimelineSemaphoreSubmitInfoKHR> timeline_infos;
+			submits.reserve(batches.size());
+			timeline_infos.reserve(batches.size());
+
+			for (auto& batch : batches)
+			{
+				VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+				VkTimelineSemaphoreSubmitInfoKHR timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
+
+				submit.waitSemaphoreCount = uint32_t(batch.waits.size());
+				submit.pWaitSemaphores = batch.waits.data();
+				submit.pWaitDstStageMask = batch.wait_stages.data();
+				timeline_info.waitSemaphoreValueCount = submit.waitSemaphoreCount;
+				timeline_info.pWaitSemaphoreValues = batch.wait_values.data();
+
+				submit.commandBufferCount = uint32_t(batch.cmds.size());
+				submit.pCommandBuffers = batch.cmds.data();
+
+				submit.signalSemaphoreCount = uint32_t(batch.signals.size());
+				submit.pSignalSemaphores = batch.signals.data();
+				timeline_info.signalSemaphoreValueCount = submit.signalSemaphoreCount;
+				timeline_info.pSignalSemaphoreValues = batch.signal_values.data();
+
+				timeline_infos.push_back(timeline_info);
+				//If timeline semaphores supported, set pnext
+				if (ext->timeline_semaphore_features.timelineSemaphore)
+					submit.pNext = &timeline_infos.back();
+				submits.push_back(submit);
+			}
+
+			if (queue_lock_callback)
+				queue_lock_callback();
+			result = table->vkQueueSubmit(queue, uint32_t(submits.size()), submits.data(), fence);
+			if (ImplementationQuirks::get().queue_wait_on_submission)
+				table->vkQueueWaitIdle(queue);
+			if (queue_unlock_callback)
+				queue_unlock_callback();
+		}
+
+		if (result != VK_SUCCESS)
+			QM_LOG_ERROR("vkQueueSubmit failed (code: %d).\n", int(result));
+
+		return result;
+	}
+
+	void Device::SubmitAllBatchesNolock()
+	{
+		SubmitBatchesNolock(CommandBuffer::Type::AsyncTransfer);
+		SubmitBatchesNolock(CommandBuffer::Type::Generic);
+		SubmitBatchesNolock(CommandBuffer::Type::AsyncCompute);
+	}
+
+	void Device::FlushTimeline(VkSemaphore timeline, uint64_t value)
+	{
+		LOCK();
+		FlushTimelineNolock(timeline, value);
 	}
 
-}
\ No newline at end of file
+	void Device::FlushTimelineNolock(VkSemaphore timeline, uint64_t value)
+	{
+		if (timeline == transfer.timeline_semaphore && value > transfer.submitted_timeline)
+			SubmitBatchesNolock(CommandBuffer::Type::AsyncTransfer);
+		else if (timeline == graphics.timeline_semaphore && value > graphics.submitted_timeline)
+			SubmitBatchesNolock(CommandBuffer::Type::Generic);
+		else if (timeline == compute.timeline_semaphore && value > compute.submitted_timeline)
+			SubmitBatchesNolock(CommandBuffer::Type::AsyncCompute);
+	}
+
+	void Device::SetSubmissionThread(bool enable)
+	{
+		LOCK();
+		if (enable && !submission_thread)
+			submission_thread.reset(new SubmissionThread(*this));
+		else if (!enable)
+			submission_thread.reset();
+	}
+
+	void Device::DrainSubmissionThreadNolock()
+	{
+		if (submission_thread)
+			submission_thread->WaitIdle();
+	}
+
+	VkResult Device::Present(const PresentRequest& request)
+	{
+		// Only the push needs ordering against submits, the present itself must not hold up other threads
+		{
+			LOCK();
+			if (submission_thread)
+			{
+				SubmissionJob job;
+				job.type = SubmissionJob::Type::Present;
+				job.queue = graphics_queue;
+				job.present = request;
+				submission_thread->Push(std::move(job));
+				return submission_thread->ConsumePresentResult();
+			}
+		}
+
+		return PresentQueue(graphics_queue, request);
+	}
+
+	VkResult Device::PresentQueue(VkQueue queue, const PresentRequest& request)
+	{
+		VkResult result = VK_SUCCESS;
+		VkPresentInfoKHR info = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+		info.waitSemaphoreCount = 1;
+		info.pWaitSemaphores = &request.wait_semaphore;
+		info.swapchainCount = 1;
+		info.pSwapchains = &request.swapchain;
+		info.pImageIndices = &request.index;
+		info.pResults = &result;
+
+		VkPresentTimesInfoGOOGLE present_timing = { VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE };
+		if (request.has_present_time)
+		{
+			present_timing.swapchainCount = 1;
+			present_timing.pTimes = &request.present_time;
+			info.pNext = &present_timing;
+		}
+
+		if (queue_lock_callback)
+			queue_lock_callback();
+		VkResult overall = table->vkQueuePresentKHR(queue, &info);
+		if (queue_unlock_callback)
+			queue_unlock_callback();
+
+		return overall != VK_SUCCESS ? overall : result;
+	}
+
+	void Device::SetSubmissionBatching(bool enable)
+	{
+		LOCK();
+		if (!enable)
+			SubmitAllBatchesNolock();
+		submission_batching = enable;
+	}
+}
@@ -0,0 +1,279 @@
+#include "device.hpp"
+#include "images/format.hpp"
+
+#include <string.h>
+
+#ifdef QM_VULKAN_MT
+#include "quantumvk/threading/thread_id.hpp"
+static unsigned GetThreadIndex()
+{
+	return Vulkan::GetCurrentThreadIndex();
+}
+#define LOCK() std::lock_guard<std::mutex> holder__{lock.lock}
+#else
+#define LOCK() ((void)0)
+static unsigned GetThreadIndex()
+{
+	return 0;
+}
+#endif
+
+namespace Vulkan
+{
+	uint64_t Device::GetUploadTimeline()
+	{
+		LOCK();
+		return uploads.submitted_timeline + (HasPendingUploadsNolock() ? 1 : 0);
+	}
+
+	bool Device::IsUploadTimelineComplete(uint64_t value)
+	{
+		LOCK();
+		RetireUploadsNolock();
+		return uploads.completed_timeline >= value;
+	}
+
+	void Device::WaitUploadTimeline(uint64_t value)
+	{
+		LOCK();
+		if (value > uploads.submitted_timeline)
+			FlushUploadsNolock();
+
+		RetireUploadsNolock();
+		while (uploads.completed_timeline < value && !uploads.in_flight.empty())
+		{
+			uploads.in_flight.front().fence->Wait();
+			RetireUploadsNolock();
+		}
+	}
+
+	void Device::FlushUploads()
+	{
+		LOCK();
+		FlushUploadsNolock();
+	}
+
+	bool Device::HasPendingUploadsNolock() const
+	{
+		return !uploads.buffers.empty() || !uploads.images.empty();
+	}
+
+	bool Device::WriteUploadRingNolock(const void* data, VkDeviceSize size, VkDeviceSize alignment, VkBuffer* buffer, VkDeviceSize* offset)
+	{
+		VK_ASSERT(size <= VULKAN_UPLOAD_RING_MAX_ALLOCATION);
+
+		if (!uploads.ring)
+		{
+			BufferCreateInfo info = {};
+			info.domain = BufferDomain::Host;
+			info.size = VULKAN_UPLOAD_RING_SIZE;
+			info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+			info.category = MemoryCategory::Staging;
+			uploads.ring = CreateBuffer(info);
+			if (!uploads.ring)
+			{
+				QM_LOG_ERROR("Failed to create upload ring.\n");
+				return false;
+			}
+
+			uploads.ring->SetInternalSyncObject();
+			uploads.ring_mapped = static_cast<uint8_t*>(managers.memory.MapMemory(uploads.ring->GetAllocation(), MEMORY_ACCESS_WRITE_BIT));
+		}
+
+		for (;;)
+		{
+			uint64_t head = uploads.ring_head;
+			VkDeviceSize ring_offset = head % VULKAN_UPLOAD_RING_SIZE;
+			VkDeviceSize aligned = ((ring_offset + alignment - 1) / alignment) * alignment;
+
+			// Regions never wrap around, the rest of the ring is skipped instead
+			if (aligned + size > VULKAN_UPLOAD_RING_SIZE)
+			{
+				head += VULKAN_UPLOAD_RING_SIZE - ring_offset;
+				aligned = 0;
+			}
+			else
+				head += aligned - ring_offset;
+
+			if (head + size - uploads.ring_tail <= VULKAN_UPLOAD_RING_SIZE)
+			{
+				memcpy(uploads.ring_mapped + aligned, data, size);
+				managers.memory.FlushMemory(uploads.ring->GetAllocation(), aligned, size);
+
+				uploads.ring_head = head + size;
+				*buffer = uploads.ring->GetBuffer();
+				*offset = aligned;
+				return true;
+			}
+
+			// The ring is full, submit what is pending and wait for the oldest batch
+			if (HasPendingUploadsNolock())
+				FlushUploadsNolock();
+
+			if (uploads.in_flight.empty())
+				return false;
+
+			uploads.in_flight.front().fence->Wait();
+			RetireUploadsNolock();
+		}
+	}
+
+	void Device::AddBufferUploadNolock(VkBuffer dst, VkDeviceSize dst_offset, VkBuffer src, VkDeviceSize src_offset, VkDeviceSize size)
+	{
+		uploads.buffers.push_back({ dst, src, src_offset, dst_offset, size });
+		uploads.pending_bytes += size;
+	}
+
+	void Device::AddImageUploadNolock(const Image& image, VkBuffer src, VkDeviceSize src_offset, VkDeviceSize size, uint32_t num_blits, const VkBufferImageCopy* blits, VkImageLayout final_layout)
+	{
+		const auto& info = image.GetCreateInfo();
+
+		VkImageMemoryBarrier transition = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+		transition.srcAccessMask = 0;
+		transition.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		transition.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		transition.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		transition.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		transition.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		transition.image = image.GetImage();
+		transition.subresourceRange.aspectMask = FormatToAspectMask(info.format);
+		transition.subresourceRange.levelCount = info.levels;
+		transition.subresourceRange.layerCount = info.layers;
+		uploads.image_transitions.push_back(transition);
+
+		uint32_t first_blit = uint32_t(uploads.blits.size());
+		for (uint32_t i = 0; i < num_blits; i++)
+		{
+			uploads.blits.push_back(blits[i]);
+			uploads.blits.back().bufferOffset += src_offset;
+		}
+
+		uploads.images.push_back({ image.GetImage(), src, first_blit, num_blits });
+		uploads.pending_bytes += size;
+
+		if (final_layout != VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
+		{
+			VkImageMemoryBarrier release = transition;
+			release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			release.dstAccessMask = 0;
+			release.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			release.newLayout = final_layout;
+			uploads.image_releases.push_back(release);
+		}
+	}
+
+	void Device::AddUploadConsumerNolock(CommandBuffer::Type type, VkPipelineStageFlags stages)
+	{
+		switch (GetPhysicalQueueType(type))
+		{
+		default:
+		case CommandBuffer::Type::Generic:
+			uploads.graphics_stages |= stages;
+			break;
+
+		case CommandBuffer::Type::AsyncCompute:
+		{
+			VkPipelineStageFlags compute_stages = stages & (VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+			uploads.compute_stages |= compute_stages ? compute_stages : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+			break;
+		}
+
+		case CommandBuffer::Type::AsyncTransfer:
+			// Ordered by the barrier at the end of the batch
+			break;
+		}
+	}
+
+	void Device::CommitUploadNolock()
+	{
+		if (uploads.pending_bytes >= VULKAN_UPLOAD_FLUSH_THRESHOLD)
+			FlushUploadsNolock();
+	}
+
+	void Device::FlushUploadsNolock()
+	{
+		if (!HasPendingUploadsNolock())
+			return;
+
+		auto cmd = RequestCommandBufferNolock(GetThreadIndex(), CommandBuffer::Type::AsyncTransfer);
+		VkCommandBuffer vk_cmd = cmd->GetCommandBuffer();
+
+		if (!uploads.image_transitions.empty())
+		{
+			cmd->Barrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, nullptr, 0, nullptr,
+				uint32_t(uploads.image_transitions.size()), uploads.image_transitions.data());
+			cmd->FlushBarriers();
+		}
+
+		for (auto& upload : uploads.buffers)
+		{
+			if (upload.src == VK_NULL_HANDLE)
+				table->vkCmdFillBuffer(vk_cmd, upload.dst, 0, VK_WHOLE_SIZE, 0);
+			else
+			{
+				VkBufferCopy region = { upload.src_offset, upload.dst_offset, upload.size };
+				table->vkCmdCopyBuffer(vk_cmd, upload.src, upload.dst, 1, &region);
+			}
+		}
+
+		for (auto& upload : uploads.images)
+			table->vkCmdCopyBufferToImage(vk_cmd, upload.src, upload.dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, upload.num_blits, uploads.blits.data() + upload.first_blit);
+
+		// One barrier makes every write visible to later work on this queue, and performs the layout transitions and queue family releases
+		VkMemoryBarrier visible = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+		visible.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		visible.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+		cmd->Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 1, &visible,
+			uint32_t(uploads.buffer_releases.size()), uploads.buffer_releases.data(),
+			uint32_t(uploads.image_releases.size()), uploads.image_releases.data());
+
+		VkPipelineStageFlags graphics_stages = graphics_queue != transfer_queue ? uploads.graphics_stages : 0;
+		VkPipelineStageFlags compute_stages = compute_queue != transfer_queue ? uploads.compute_stages : 0;
+
+		UploadBatch batch;
+		batch.timeline = ++uploads.submitted_timeline;
+		batch.ring_end = uploads.ring_head;
+		batch.imported.swap(uploads.imported);
+
+		// Cleared before submitting, SubmitNolock flushes uploads ahead of transfer work
+		uploads.buffers.clear();
+		uploads.images.clear();
+		uploads.blits.clear();
+		uploads.image_transitions.clear();
+		uploads.buffer_releases.clear();
+		uploads.image_releases.clear();
+		uploads.graphics_stages = 0;
+		uploads.compute_stages = 0;
+		uploads.pending_bytes = 0;
+
+		Semaphore sems[2];
+		unsigned sem_count = unsigned(graphics_stages != 0) + unsigned(compute_stages != 0);
+		SubmitNolock(cmd, &batch.fence, sem_count, sems);
+		batch.fence->SetInternalSyncObject();
+
+		// Not flushing, so the semaphores are injected into graphics and compute work which is already enqueued
+		unsigned sem_index = 0;
+		if (graphics_stages)
+			AddWaitSemaphoreNolock(CommandBuffer::Type::Generic, sems[sem_index++], graphics_stages, false);
+		if (compute_stages)
+			AddWaitSemaphoreNolock(CommandBuffer::Type::AsyncCompute, sems[sem_index++], compute_stages, false);
+
+		uploads.in_flight.push_back(std::move(batch));
+	}
+
+	void Device::RetireUploadsNolock()
+	{
+		while (!uploads.in_flight.empty())
+		{
+			auto& batch = uploads.in_flight.front();
+			if (!batch.fence->WaitTimeout(0))
+				break;
+
+			uploads.ring_tail = batch.ring_end;
+			uploads.completed_timeline = batch.timeline;
+			for (auto& imported : batch.imported)
+				managers.memory.FreeBuffer(imported.buffer, imported.alloc);
+			uploads.in_flight.pop_front();
+		}
+	}
+}
@@ -1,6 +1,7 @@
 #include "descriptor_set.hpp"
 #include "quantumvk/vulkan/device.hpp"
 
+#include <algorithm>
 #include <vector>
 
 using namespace Util;
@@ -26,41 +27,6 @@ namespace Vulkan
 		}
 	}
 
-	static inline void FillDescriptorSetArraySizes(Program& program, uint32_t descriptor_set_mask, uint32_t desc_set_array_sizes[][VULKAN_NUM_BINDINGS])
-	{
-		// Fills array info
-		for (unsigned i = 0; i < static_cast<unsigned>(ShaderStage::Count); i++)
-		{
-			ShaderStage shader_type = static_cast<ShaderStage>(i);
-			if (!program.HasShader(shader_type))
-				continue;
-
-			const auto& shader_layout = program.GetShader(shader_type)->GetLayout();
-			for (uint32_t set = 0; set < VULKAN_NUM_DESCRIPTOR_SETS; set++) // For every set.
-			{
-				if ((descriptor_set_mask & (1u << set)) && (shader_layout.set_mask & (1u << set)))// If set active
-				{
-					for (uint32_t binding = 0; binding < VULKAN_NUM_BINDINGS; binding++) // For every binding within that set
-					{
-						uint32_t array_size = shader_layout.sets[set].array_size[binding];
-						if (array_size != 0) // If binding is active 
-						{
-#ifdef VULKAN_DEBUG
-							if (desc_set_array_sizes[set][binding] != 0 && desc_set_array_sizes[set][binding] != array_size) // If array size is set and doesn't match
-								QM_LOG_ERROR("Mismatch between array sizes in different shaders at (set: %u, binding: %u). One array size is %u and the other is %u.\n", set, binding, desc_set_array_sizes[set][binding], array_size); // Error
-							else // Else
-								desc_set_array_sizes[set][binding] = array_size; // Set array size
-#else
-							desc_set_array_sizes[set][binding] = array_size;
-#endif
-						}
-					}
-
-				}
-			}
-		}
-	}
-
 	static inline void FillPerSetStagesAndLayout(Shader& shader, VkShaderStageFlags stage_flags, std::vector<UniformManager::PerSet>& sets)
 	{
 
@@ -159,7 +125,7 @@ namespace Vulkan
 						continue;
 
 					uint32_t array_size = desc_set.layout.array_size[binding];
-					uint32_t pool_array_size = array_size * VULKAN_NUM_SETS_PER_POOL;
+					uint32_t pool_array_size = array_size;
 
 					uint32_t types = 0;
 					if (desc_set.layout.sampled_image_mask & (1u << binding))
@@ -282,9 +248,10 @@ namespace Vulkan
 			QM_LOG_ERROR("Failed to create uniform layout.\n");
 	}
 
-	static inline void CreateUpdateTemplates(Device* device, VkPipelineLayout uniform_layout, uint32_t descriptor_set_mask, std::vector<UniformManager::PerSet>& sets, uint32_t resource_count, uint32_t resource_offsets[][VULKAN_NUM_BINDINGS])
+	static inline void CreateUpdateTemplates(Device* device, VkPipelineLayout uniform_layout, uint32_t descriptor_set_mask, std::vector<UniformManager::PerSet>& sets)
 	{
-		VkDescriptorUpdateTemplateEntryKHR* update_entries = new VkDescriptorUpdateTemplateEntryKHR[resource_count];
+		// A binding can show up once per descriptor type at most
+		VkDescriptorUpdateTemplateEntryKHR update_entries[VULKAN_NUM_BINDINGS * VULKAN_NUM_DESCRIPTOR_TYPES];
 
 		auto& table = device->GetDeviceTable();
 		for (uint32_t desc_set = 0; desc_set < sets.size(); desc_set++)
@@ -303,8 +270,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, buffer);
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, buffer);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			ForEachBit(set_layout.storage_buffer_mask, [&](uint32_t binding) {
@@ -314,8 +281,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, buffer);
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, buffer);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			ForEachBit(set_layout.sampled_buffer_mask, [&](uint32_t binding) {
@@ -325,8 +292,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, buffer_view);
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, buffer_view);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 
@@ -337,9 +304,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, image);
-				//entry.offset = offsetof(UniformBinding, resource) + offsetof(ResourceBinding, image) + sizeof(ResourceBinding) * offsets[binding];
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, image);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			ForEachBit(set_layout.separate_image_mask, [&](uint32_t binding) {
@@ -349,9 +315,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, image);
-				//entry.offset = offsetof(UniformBinding, resource) + offsetof(ResourceBinding, image) + sizeof(ResourceBinding) * offsets[binding];
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, image);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			ForEachBit(set_layout.sampler_mask & ~set_layout.immutable_sampler_mask, [&](uint32_t binding) {
@@ -361,9 +326,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, image);
-				//entry.offset = offsetof(UniformBinding, resource) + offsetof(ResourceBinding, image) + sizeof(ResourceBinding) * offsets[binding];
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, image);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			ForEachBit(set_layout.storage_image_mask, [&](uint32_t binding) {
@@ -373,9 +337,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, image);
-				//entry.offset = offsetof(UniformBinding, resource) + offsetof(ResourceBinding, image) + sizeof(ResourceBinding) * offsets[binding];
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, image);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			ForEachBit(set_layout.input_attachment_mask, [&](uint32_t binding) {
@@ -385,9 +348,8 @@ namespace Vulkan
 				entry.dstBinding = binding;
 				entry.dstArrayElement = 0;
 				entry.descriptorCount = array_size;
-				entry.offset = sizeof(ResourceBinding) * resource_offsets[desc_set][binding] + offsetof(ResourceBinding, image);
-				//entry.offset = offsetof(UniformBinding, resource) + offsetof(ResourceBinding, image) + sizeof(ResourceBinding) * offsets[binding];
-				entry.stride = sizeof(ResourceBinding);
+				entry.offset = sizeof(ResourceInfo) * GetBindingSlot(desc_set, binding, 0) + offsetof(ResourceInfo, image);
+				entry.stride = sizeof(ResourceInfo);
 				});
 
 			VkDescriptorUpdateTemplateCreateInfoKHR info = { VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO_KHR };
@@ -405,8 +367,132 @@ namespace Vulkan
 			}
 
 		}
+	}
+
+	///////////////////////////////////////////////////////////////
+	//Descriptor pool manager//////////////////////////////////////
+	///////////////////////////////////////////////////////////////
+
+	void DescriptorPoolManager::Init(Device* device_)
+	{
+		device = device_;
+		table = &device->GetDeviceTable();
+	}
+
+	DescriptorPoolManager::~DescriptorPoolManager()
+	{
+		for (auto& pool : free_pools)
+			table->vkDestroyDescriptorPool(device->GetDevice(), pool.info.pool, nullptr);
+	}
+
+	DescriptorPoolInfo DescriptorPoolManager::RequestPool(uint32_t max_sets, const std::vector<VkDescriptorPoolSize>& set_sizes)
+	{
+		DescriptorPoolInfo info;
+		info.max_sets = max_sets;
+		for (auto& size : set_sizes)
+			info.type_counts[size.type] += size.descriptorCount * max_sets;
+
+		{
+#ifdef QM_VULKAN_MT
+			std::lock_guard holder{ lock };
+#endif
+			// Find the smallest free pool that can hold everything we need
+			int best = -1;
+			for (unsigned i = 0; i < free_pools.size(); i++)
+			{
+				auto& pool = free_pools[i].info;
+				if (pool.max_sets < max_sets)
+					continue;
+
+				bool compatible = true;
+				for (unsigned type = 0; type < VULKAN_NUM_DESCRIPTOR_TYPES && compatible; type++)
+					compatible = pool.type_counts[type] >= info.type_counts[type];
+
+				if (compatible && (best < 0 || pool.max_sets < free_pools[best].info.max_sets))
+					best = int(i);
+			}
+
+			if (best >= 0)
+			{
+				auto ret = free_pools[best].info;
+				free_pools[best] = free_pools.back();
+				free_pools.pop_back();
+				pools_reused++;
+				return ret;
+			}
+		}
+
+		VkDescriptorPoolSize sizes[VULKAN_NUM_DESCRIPTOR_TYPES];
+		uint32_t num_sizes = 0;
+		for (unsigned type = 0; type < VULKAN_NUM_DESCRIPTOR_TYPES; type++)
+			if (info.type_counts[type])
+				sizes[num_sizes++] = { static_cast<VkDescriptorType>(type), info.type_counts[type] };
+
+		VkDescriptorPoolCreateInfo create_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+		create_info.maxSets = max_sets;
+		if (num_sizes)
+		{
+			create_info.poolSizeCount = num_sizes;
+			create_info.pPoolSizes = sizes;
+		}
 
-		delete[] update_entries;
+		if (table->vkCreateDescriptorPool(device->GetDevice(), &create_info, nullptr, &info.pool) != VK_SUCCESS)
+		{
+			QM_LOG_ERROR("Failed to create descriptor pool.\n");
+			info.pool = VK_NULL_HANDLE;
+			return info;
+		}
+
+		pools_created++;
+		return info;
+	}
+
+	void DescriptorPoolManager::RecyclePool(const DescriptorPoolInfo& pool)
+	{
+		table->vkResetDescriptorPool(device->GetDevice(), pool.pool, 0);
+#ifdef QM_VULKAN_MT
+		std::lock_guard holder{ lock };
+#endif
+		free_pools.push_back({ pool, frame_index });
+	}
+
+	void DescriptorPoolManager::BeginFrame()
+	{
+#ifdef QM_VULKAN_MT
+		// Counts from other threads land either in this frame or the next one, never in neither
+		last_frame_stats.pools_created = pools_created.exchange(0);
+		last_frame_stats.pools_reused = pools_reused.exchange(0);
+		last_frame_stats.sets_allocated = sets_allocated.exchange(0);
+		last_frame_stats.set_updates = set_updates.exchange(0);
+		last_frame_stats.set_cache_hits = set_cache_hits.exchange(0);
+
+		std::lock_guard holder{ lock };
+#else
+		last_frame_stats.pools_created = pools_created;
+		last_frame_stats.pools_reused = pools_reused;
+		last_frame_stats.sets_allocated = sets_allocated;
+		last_frame_stats.set_updates = set_updates;
+		last_frame_stats.set_cache_hits = set_cache_hits;
+
+		pools_created = 0;
+		pools_reused = 0;
+		sets_allocated = 0;
+		set_updates = 0;
+		set_cache_hits = 0;
+#endif
+
+		frame_index++;
+		for (size_t i = 0; i < free_pools.size();)
+		{
+			if (free_pools[i].frame + VULKAN_DESCRIPTOR_POOL_RETIRE_FRAMES <= frame_index)
+			{
+				table->vkDestroyDescriptorPool(device->GetDevice(), free_pools[i].info.pool, nullptr);
+				free_pools[i] = free_pools.back();
+				free_pools.pop_back();
+			}
+			else
+				i++;
+		}
 	}
 
 	///////////////////////////////////////////////////////////////
@@ -425,23 +511,6 @@ namespace Vulkan
 		else
 			descriptor_set_count = Util::GetMostSignificantBitSet(descriptor_set_mask) + 1;
 
-		// -----------------------------------------------
-		// --------FILL RESOURCE OFFSETS AND COUNT--------
-
-		uint32_t desc_set_array_sizes[VULKAN_NUM_DESCRIPTOR_SETS][VULKAN_NUM_BINDINGS] = {};
-
-		FillDescriptorSetArraySizes(program, descriptor_set_mask, desc_set_array_sizes);
-
-		resource_count = 0;
-		for (uint32_t set = 0; set < VULKAN_NUM_DESCRIPTOR_SETS; set++) // For every set.
-		{
-			for (uint32_t binding = 0; binding < VULKAN_NUM_BINDINGS; binding++) // For every binding within that set
-			{
-				resource_offsets[set][binding] = resource_count;
-				resource_count += desc_set_array_sizes[set][binding];
-			}
-		}
-
 		// --------------------------------------------------
 		// ------------FILL PER SET INFO---------------------
 
@@ -465,14 +534,10 @@ namespace Vulkan
 		CreateUniformLayout(device, descriptor_set_mask, sets, push_constant_range, uniform_layout);
 
 		if (device->GetDeviceExtensions().supports_update_template)
-			CreateUpdateTemplates(device, uniform_layout, descriptor_set_mask, sets, resource_count, resource_offsets);
+			CreateUpdateTemplates(device, uniform_layout, descriptor_set_mask, sets);
 
 		// --------------------------------------------------
 
-		threads.resize(device->num_thread_indices);
-
-		// TODO find some alternative to this disgustingly large number of new allocations
-
 		for (auto& set : sets)
 		{
 			for (uint32_t i = 0; i < device->num_thread_indices; i++)
@@ -509,39 +574,31 @@ namespace Vulkan
 	}
 
 
-	ResourceBinding& UniformManager::GetUniformResource(uint32_t thread_index, uint32_t set, uint32_t binding, uint32_t array_index)
-	{
-		CheckForNewThread(thread_index);
-		return *(threads[thread_index].manager.GetResourceArray() + resource_offsets[set][binding] + array_index);
-	}
-
-	void UniformManager::SetUniformResource(uint32_t thread_index, uint32_t set, uint32_t binding, uint32_t array_index, const ResourceBinding& resource)
-	{
-		CheckForNewThread(thread_index);
-		*(threads[thread_index].manager.GetResourceArray() + resource_offsets[set][binding] + array_index) = resource;
-	}
-
-	VkDescriptorSet UniformManager::FlushDescriptorSet(uint32_t thread_index, uint32_t set)
+	VkDescriptorSet UniformManager::FlushDescriptorSet(uint32_t thread_index, uint32_t set, const ResourceBindings& bindings)
 	{
 		VK_ASSERT(device);
 
 		if ((descriptor_set_mask & (1 << set)) == 0)
 			return VK_NULL_HANDLE;
 
-		CheckForNewThread(thread_index);
+		VK_ASSERT(thread_index < device->num_thread_indices);
 
-		auto desc_set = FindDescriptorSet(thread_index, set);
+		auto desc_set = FindDescriptorSet(thread_index, set, bindings);
 
 		// If hash differs, update the resource
 		if (desc_set.needs_update)
 		{
+			device->managers.descriptor_pool.CountSetUpdate();
+
 			auto update_template = sets[set].update_template;
 
 			if (update_template != VK_NULL_HANDLE) // If Update templates exist, use them as they are both faster and easier to use.
-				device->GetDeviceTable().vkUpdateDescriptorSetWithTemplateKHR(device->GetDevice(), desc_set.vk_set, update_template, threads[thread_index].manager.GetResourceArray());
+				device->GetDeviceTable().vkUpdateDescriptorSetWithTemplateKHR(device->GetDevice(), desc_set.vk_set, update_template, bindings.infos);
 			else // Update with standard descriptor writes.
-				UpdateDescriptorSetLegacy(thread_index, set, desc_set.vk_set);
+				UpdateDescriptorSetLegacy(set, desc_set.vk_set, bindings);
 		}
+		else
+			device->managers.descriptor_pool.CountSetCacheHit();
 
 		return desc_set.vk_set;
 	}
@@ -563,29 +620,16 @@ namespace Vulkan
 				for (auto& thr : sets[set].threads)
 				{
 					thr->set_nodes.clear();
+					// Hand the pools back to the device so other programs can reuse them
 					for (auto& pool : thr->pools)
-					{
-						device->GetDeviceTable().vkResetDescriptorPool(device->GetDevice(), pool, 0);
-						device->GetDeviceTable().vkDestroyDescriptorPool(device->GetDevice(), pool, nullptr);
-					}
+						device->managers.descriptor_pool.RecyclePool(pool);
 					thr->pools.clear();
 				}
 			}
 		}
 	}
 
-	void UniformManager::CheckForNewThread(uint32_t thread_index)
-	{
-		VK_ASSERT(thread_index < device->num_thread_indices);
-
-		if (!threads[thread_index].active)
-		{
-			threads[thread_index].manager.CreateResourceArray(resource_count);
-			threads[thread_index].active = true;
-		}
-	}
-
-	UniformManager::HashedDescriptorSet UniformManager::FindDescriptorSet(uint32_t thread_index, uint32_t set)
+	UniformManager::HashedDescriptorSet UniformManager::FindDescriptorSet(uint32_t thread_index, uint32_t set, const ResourceBindings& bindings)
 	{
 		auto& set_layout = sets[set].layout;
 
@@ -594,15 +638,14 @@ namespace Vulkan
 
 		h.u32(set_layout.fp_mask);
 
-		ResourceBinding* resource_array = threads[thread_index].manager.GetResourceArray();
-
 		// UBOs
 		Util::ForEachBit(set_layout.uniform_buffer_mask, [&](uint32_t binding) {
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				h.u32(b.buffer.range);
 				VK_ASSERT(b.buffer.buffer != VK_NULL_HANDLE);
 			}
@@ -613,8 +656,9 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				h.u32(b.buffer.offset);
 				h.u32(b.buffer.range);
 				VK_ASSERT(b.buffer.buffer != VK_NULL_HANDLE);
@@ -626,8 +670,9 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				VK_ASSERT(b.buffer_view != VK_NULL_HANDLE);
 			}
 			});
@@ -637,11 +682,12 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				if (!HasImmutableSampler(set_layout, binding + i))
 				{
-					h.u64(b.secondary_cookie);
+					h.u64(bindings.secondary_cookies[slot]);
 					//VK_ASSERT(b.resource.image.fp.sampler != VK_NULL_HANDLE);
 					VK_ASSERT(b.image.sampler != VK_NULL_HANDLE);
 				}
@@ -655,8 +701,9 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				h.u32(b.image.imageLayout);
 				VK_ASSERT(b.image.imageView != VK_NULL_HANDLE);
 			}
@@ -667,8 +714,9 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				VK_ASSERT(b.image.sampler != VK_NULL_HANDLE);
 			}
 			});
@@ -678,8 +726,9 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				h.u32(b.image.imageLayout);
 				VK_ASSERT(b.image.imageView != VK_NULL_HANDLE);
 			}
@@ -690,8 +739,9 @@ namespace Vulkan
 			unsigned array_size = set_layout.array_size[binding];
 			for (unsigned i = 0; i < array_size; i++)
 			{
-				const auto& b = *(resource_array + resource_offsets[set][binding] + i);
-				h.u64(b.cookie);
+				uint32_t slot = GetBindingSlot(set, binding, i);
+				const auto& b = bindings.infos[slot];
+				h.u64(bindings.cookies[slot]);
 				h.u32(b.image.imageLayout);
 				VK_ASSERT(b.image.imageView != VK_NULL_HANDLE);
 			}
@@ -724,56 +774,63 @@ namespace Vulkan
 			return hashed_set;
 		}
 
-		VkDescriptorPool pool;
-		VkDescriptorPoolCreateInfo info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
-		info.maxSets = VULKAN_NUM_SETS_PER_POOL;
-		if (!sets[set].pool_size.empty())
+		// Out of vacant sets, grab a new pool. Pools grow geometrically so sets with a lot of churn quickly stop creating pools.
+		auto& pool_manager = device->managers.descriptor_pool;
+		uint32_t num_sets = state->next_pool_sets;
+		DescriptorPoolInfo pool = pool_manager.RequestPool(num_sets, sets[set].pool_size);
+		if (pool.pool == VK_NULL_HANDLE)
 		{
-			info.poolSizeCount = sets[set].pool_size.size();
-			info.pPoolSizes = sets[set].pool_size.data();
-		}
-
-		if (device->GetDeviceTable().vkCreateDescriptorPool(device->GetDevice(), &info, nullptr, &pool) != VK_SUCCESS)
-		{
-			QM_LOG_ERROR("Failed to create descriptor pool.\n");
 			hashed_set.vk_set = VK_NULL_HANDLE;
 			hashed_set.needs_update = true;
 			return hashed_set;
 		}
 
-		VkDescriptorSet desc_sets[VULKAN_NUM_SETS_PER_POOL];
-		VkDescriptorSetLayout layouts[VULKAN_NUM_SETS_PER_POOL];
-		std::fill(std::begin(layouts), std::end(layouts), sets[set].vk_set_layout);
+		state->next_pool_sets = std::min(num_sets * 2, VULKAN_MAX_SETS_PER_POOL);
+
+		Util::RetainedDynamicArray<VkDescriptorSet> desc_sets = device->AllocateHeapArray<VkDescriptorSet>(num_sets);
+		Util::RetainedDynamicArray<VkDescriptorSetLayout> layouts = device->AllocateHeapArray<VkDescriptorSetLayout>(num_sets);
+		std::fill(layouts.Data(), layouts.Data() + num_sets, sets[set].vk_set_layout);
 
 		VkDescriptorSetAllocateInfo alloc = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
-		alloc.descriptorPool = pool;
-		alloc.descriptorSetCount = VULKAN_NUM_SETS_PER_POOL;
-		alloc.pSetLayouts = layouts;
+		alloc.descriptorPool = pool.pool;
+		alloc.descriptorSetCount = num_sets;
+		alloc.pSetLayouts = layouts.Data();
 
-		if (device->GetDeviceTable().vkAllocateDescriptorSets(device->GetDevice(), &alloc, desc_sets) != VK_SUCCESS)
+		if (device->GetDeviceTable().vkAllocateDescriptorSets(device->GetDevice(), &alloc, desc_sets.Data()) != VK_SUCCESS)
+		{
 			QM_LOG_ERROR("Failed to allocate descriptor sets.\n");
+			pool_manager.RecyclePool(pool);
+			device->FreeHeapArray(desc_sets);
+			device->FreeHeapArray(layouts);
+			hashed_set.vk_set = VK_NULL_HANDLE;
+			hashed_set.needs_update = true;
+			return hashed_set;
+		}
+
 		state->pools.push_back(pool);
+		pool_manager.CountSetsAllocated(num_sets);
+
+		for (uint32_t i = 0; i < num_sets; i++)
+			state->set_nodes.make_vacant(desc_sets[i]);
 
-		for (auto set : desc_sets)
-			state->set_nodes.make_vacant(set);
+		device->FreeHeapArray(desc_sets);
+		device->FreeHeapArray(layouts);
 
 		hashed_set.vk_set = state->set_nodes.request_vacant(hash)->set;
 		hashed_set.needs_update = true;
 		return hashed_set;
 	}
 
-	void UniformManager::UpdateDescriptorSetLegacy(uint32_t thread_index, uint32_t set, VkDescriptorSet desc_set)
+	void UniformManager::UpdateDescriptorSetLegacy(uint32_t set, VkDescriptorSet desc_set, const ResourceBindings& bindings)
 	{
 		auto& table = device->GetDeviceTable();
 
 		const DescriptorSetLayout& layout = sets[set].layout;
 
-		Util::RetainedDynamicArray<VkWriteDescriptorSet> legacy_set_writes = device->AllocateHeapArray<VkWriteDescriptorSet>(resource_count);
+		Util::RetainedDynamicArray<VkWriteDescriptorSet> legacy_set_writes = device->AllocateHeapArray<VkWriteDescriptorSet>(VULKAN_NUM_BINDING_SLOTS);
 
 		uint32_t num_bindings = 0;
 
-		ResourceBinding* resource_array = threads[thread_index].manager.GetResourceArray();
-
 		Util::ForEachBit(layout.uniform_buffer_mask, [&](uint32_t binding) {
 			unsigned array_size = layout.array_size[binding];
 			for (uint32_t i = 0; i < array_size; i++)
@@ -786,7 +843,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pBufferInfo = &(*(resource_array + resource_offsets[set][binding] + i)).buffer;
+				write.pBufferInfo = &bindings.infos[GetBindingSlot(set, binding, i)].buffer;
 			}
 			});
 
@@ -802,7 +859,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pBufferInfo = &(*(resource_array + resource_offsets[set][binding] + i)).buffer;
+				write.pBufferInfo = &bindings.infos[GetBindingSlot(set, binding, i)].buffer;
 			}
 			});
 
@@ -818,7 +875,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pTexelBufferView = &(*(resource_array + resource_offsets[set][binding] + i)).buffer_view;
+				write.pTexelBufferView = &bindings.infos[GetBindingSlot(set, binding, i)].buffer_view;
 			}
 			});
 
@@ -834,7 +891,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pImageInfo = &(*(resource_array + resource_offsets[set][binding] + i)).image;
+				write.pImageInfo = &bindings.infos[GetBindingSlot(set, binding, i)].image;
 
 				//write.pImageInfo = &GetDescriptor(set, binding, i).resource.image;
 			}
@@ -852,7 +909,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pImageInfo = &(*(resource_array + resource_offsets[set][binding] + i)).image;
+				write.pImageInfo = &bindings.infos[GetBindingSlot(set, binding, i)].image;
 
 				//write.pImageInfo = &GetDescriptor(set, binding, i).resource.image;
 			}
@@ -870,7 +927,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pImageInfo = &(*(resource_array + resource_offsets[set][binding] + i)).image;
+				write.pImageInfo = &bindings.infos[GetBindingSlot(set, binding, i)].image;
 			}
 			});
 
@@ -886,7 +943,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pImageInfo = &(*(resource_array + resource_offsets[set][binding] + i)).image;
+				write.pImageInfo = &bindings.infos[GetBindingSlot(set, binding, i)].image;
 
 				//write.pImageInfo = &GetDescriptor(set, binding, i).resource.image;
 			}
@@ -904,7 +961,7 @@ namespace Vulkan
 				write.dstArrayElement = i;
 				write.dstBinding = binding;
 				write.dstSet = desc_set;
-				write.pImageInfo = &(*(resource_array + resource_offsets[set][binding] + i)).image;
+				write.pImageInfo = &bindings.infos[GetBindingSlot(set, binding, i)].image;
 
 				//write.pImageInfo = &GetDescriptor(set, binding, i).resource.image;
 			}
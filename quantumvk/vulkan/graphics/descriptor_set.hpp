@@ -16,10 +16,20 @@
 #include <utility>
 #include <vector>
 
+#ifdef QM_VULKAN_MT
+#include <atomic>
+#include <mutex>
+#endif
+
 namespace Vulkan
 {
+	// Size of the first pool a set allocates, every following pool doubles in size up to VULKAN_MAX_SETS_PER_POOL
 	static const unsigned VULKAN_NUM_SETS_PER_POOL = 16;
+	static const unsigned VULKAN_MAX_SETS_PER_POOL = 1024;
+	// Recycled pools which no request picked up for this many frames are destroyed
+	static const unsigned VULKAN_DESCRIPTOR_POOL_RETIRE_FRAMES = 16;
 	static const unsigned VULKAN_DESCRIPTOR_RING_SIZE = 8;
+	static const unsigned VULKAN_NUM_DESCRIPTOR_TYPES = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT + 1;
 
 	//Forward declare Device
 	class Device;
@@ -74,53 +84,113 @@ namespace Vulkan
 		layout.immutable_sampler_mask |= 1u << binding;
 	}
 
-	class ImageView;
-
-	// Represents a single descriptor in a descriptor set. 
-	struct ResourceBinding
+	// A descriptor pool and the capacity it was created with
+	struct DescriptorPoolInfo
 	{
-		union
-		{
-			VkDescriptorBufferInfo buffer;
-			VkDescriptorImageInfo image;
-			VkBufferView buffer_view;
-		};
-		VkDeviceSize dynamic_offset;
+		VkDescriptorPool pool = VK_NULL_HANDLE;
+		uint32_t max_sets = 0;
+		uint32_t type_counts[VULKAN_NUM_DESCRIPTOR_TYPES] = {};
+	};
 
-		// Primary object cookie
-		uint64_t cookie = 0;
-		// Secondary object cookie (for example: sampler)
-		uint64_t secondary_cookie = 0;
+	// Descriptor counters for a single frame
+	struct DescriptorStats
+	{
+		// Pools created with vkCreateDescriptorPool
+		uint32_t pools_created = 0;
+		// Pools taken from the free list instead of being created
+		uint32_t pools_reused = 0;
+		// Sets allocated with vkAllocateDescriptorSets
+		uint32_t sets_allocated = 0;
+		// Sets that had to be written (template or legacy writes)
+		uint32_t set_updates = 0;
+		// Sets found in the cache that didn't need to be written
+		uint32_t set_cache_hits = 0;
 	};
 
-	class ResourceManager
+	// Device level free list of descriptor pools. Uniform managers return their pools here (reset) when they are cleared
+	// or destroyed, and any later request with compatible sizes takes them over instead of creating a new pool.
+	class DescriptorPoolManager
 	{
 	public:
+		void Init(Device* device);
+		~DescriptorPoolManager();
 
-		ResourceManager()
-			: resource_array(nullptr)
-		{
-		}
-		~ResourceManager()
-		{
-			if (resource_array)
-				delete[] resource_array;
-		}
+		// Returns a pool able to hold max_sets sets, each needing set_sizes descriptors
+		DescriptorPoolInfo RequestPool(uint32_t max_sets, const std::vector<VkDescriptorPoolSize>& set_sizes);
+		// Resets the pool and puts it on the free list
+		void RecyclePool(const DescriptorPoolInfo& pool);
 
-		void CreateResourceArray(uint32_t resource_count)
-		{
-			if (resource_array)
-				delete[] resource_array;
-			resource_array = new ResourceBinding[resource_count];
-		}
+		void CountSetsAllocated(uint32_t count) { sets_allocated += count; }
+		void CountSetUpdate() { set_updates++; }
+		void CountSetCacheHit() { set_cache_hits++; }
 
-		ResourceBinding* GetResourceArray() { return resource_array; }
+		// Moves the running counters into the last frame's stats and resets them, and destroys pools which stayed free for too long
+		void BeginFrame();
+		// Returns the counters of the last completed frame
+		const DescriptorStats& GetLastFrameStats() const { return last_frame_stats; }
 
 	private:
+		Device* device = nullptr;
+		const VolkDeviceTable* table = nullptr;
 
-		ResourceBinding* resource_array;
+		struct FreePool
+		{
+			DescriptorPoolInfo info;
+			// Frame the pool was recycled in
+			uint64_t frame;
+		};
+		std::vector<FreePool> free_pools;
+		uint64_t frame_index = 0;
+
+#ifdef QM_VULKAN_MT
+		std::mutex lock;
+		std::atomic<uint32_t> pools_created{ 0 };
+		std::atomic<uint32_t> pools_reused{ 0 };
+		std::atomic<uint32_t> sets_allocated{ 0 };
+		std::atomic<uint32_t> set_updates{ 0 };
+		std::atomic<uint32_t> set_cache_hits{ 0 };
+#else
+		uint32_t pools_created = 0;
+		uint32_t pools_reused = 0;
+		uint32_t sets_allocated = 0;
+		uint32_t set_updates = 0;
+		uint32_t set_cache_hits = 0;
+#endif
+
+		DescriptorStats last_frame_stats;
 	};
 
+	class ImageView;
+
+	// Every binding owns enough slots for the largest array it could hold (VULKAN_NUM_BINDINGS - binding),
+	// so all programs share the same slot layout and a thread needs only one set of resource bindings.
+	constexpr unsigned VULKAN_NUM_BINDING_SLOTS = VULKAN_NUM_BINDINGS * (VULKAN_NUM_BINDINGS + 1) / 2;
+
+	// Returns the slot of an array element within the resource bindings.
+	static inline uint32_t GetBindingSlot(uint32_t set, uint32_t binding, uint32_t array_index)
+	{
+		return set * VULKAN_NUM_BINDING_SLOTS + (binding * (2 * VULKAN_NUM_BINDINGS + 1 - binding)) / 2 + array_index;
+	}
+
+	// Vulkan info of a single descriptor
+	union ResourceInfo
+	{
+		VkDescriptorBufferInfo buffer;
+		VkDescriptorImageInfo image;
+		VkBufferView buffer_view;
+	};
+
+	// Descriptor state of a thread, indexed by GetBindingSlot(). 
+	// Cookies are kept apart from the Vulkan infos so the hashing in UniformManager only walks the cookie arrays.
+	struct ResourceBindings
+	{
+		ResourceInfo infos[VULKAN_NUM_DESCRIPTOR_SETS * VULKAN_NUM_BINDING_SLOTS];
+		// Primary object cookie
+		uint64_t cookies[VULKAN_NUM_DESCRIPTOR_SETS * VULKAN_NUM_BINDING_SLOTS];
+		// Secondary object cookie (for example: sampler)
+		uint64_t secondary_cookies[VULKAN_NUM_DESCRIPTOR_SETS * VULKAN_NUM_BINDING_SLOTS];
+		uint32_t dynamic_offsets[VULKAN_NUM_DESCRIPTOR_SETS * VULKAN_NUM_BINDING_SLOTS];
+	};
 
 	class UniformManager
 	{
@@ -133,9 +203,8 @@ namespace Vulkan
 
 		void InitUniforms(Device* device, Program& program);
 
-		ResourceBinding& GetUniformResource(uint32_t thread_index, uint32_t set, uint32_t binding, uint32_t array_index);
-		void SetUniformResource(uint32_t thread_index, uint32_t set, uint32_t binding, uint32_t array_index, const ResourceBinding& resource);
-		VkDescriptorSet FlushDescriptorSet(uint32_t thread_index, uint32_t set);
+		// Returns a descriptor set matching the bindings, writing it if no cached set matches
+		VkDescriptorSet FlushDescriptorSet(uint32_t thread_index, uint32_t set, const ResourceBindings& bindings);
 
 		inline const VkPushConstantRange& GetPushConstantRange() const { return push_constant_range; }
 		inline VkPipelineLayout           GetUniformLayout() const { return uniform_layout; }
@@ -153,16 +222,14 @@ namespace Vulkan
 
 	private:
 
-		void CheckForNewThread(uint32_t thread_index);
-
 		struct HashedDescriptorSet
 		{
 			VkDescriptorSet vk_set = VK_NULL_HANDLE;
 			bool needs_update = false;
 		};
 
-		HashedDescriptorSet FindDescriptorSet(uint32_t thread_index, uint32_t set);
-		void UpdateDescriptorSetLegacy(uint32_t thread_index, uint32_t set, VkDescriptorSet desc_set);
+		HashedDescriptorSet FindDescriptorSet(uint32_t thread_index, uint32_t set, const ResourceBindings& bindings);
+		void UpdateDescriptorSetLegacy(uint32_t set, VkDescriptorSet desc_set, const ResourceBindings& bindings);
 
 	public:
 
@@ -179,16 +246,12 @@ namespace Vulkan
 		struct PerThreadPerSet
 		{
 			Util::TemporaryHashmap<DescriptorSetNode, VULKAN_DESCRIPTOR_RING_SIZE, true> set_nodes;
-			std::vector<VkDescriptorPool> pools;
+			std::vector<DescriptorPoolInfo> pools;
+			// Number of sets the next pool will hold, doubles every time a pool is requested
+			uint32_t next_pool_sets = VULKAN_NUM_SETS_PER_POOL;
 			bool should_begin = true;
 		};
 
-		struct PerThread
-		{
-			ResourceManager manager;
-			bool active = false;
-		};
-
 		struct PerSet
 		{
 			VkShaderStageFlags stages = 0;
@@ -198,6 +261,7 @@ namespace Vulkan
 			VkDescriptorUpdateTemplateKHR update_template;
 
 			VkDescriptorSetLayout vk_set_layout = VK_NULL_HANDLE;
+			// Descriptors needed by a single set
 			std::vector<VkDescriptorPoolSize> pool_size;
 
 			std::vector<std::unique_ptr<PerThreadPerSet>> threads;
@@ -213,11 +277,6 @@ namespace Vulkan
 
 		std::vector<PerSet> sets;
 
-		uint32_t resource_count = 0;
-		uint32_t resource_offsets[VULKAN_NUM_DESCRIPTOR_SETS][VULKAN_NUM_BINDINGS] = {};
-
-		std::vector<PerThread> threads;
-
 		VkPipelineLayout uniform_layout = VK_NULL_HANDLE;
 		VkPushConstantRange push_constant_range = {};
 
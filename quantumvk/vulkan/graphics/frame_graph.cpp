@@ -0,0 +1,1021 @@
+#include "frame_graph.hpp"
+#include "quantumvk/vulkan/device.hpp"
+#include "quantumvk/threading/thread_group.hpp"
+#include "quantumvk/threading/thread_id.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+namespace Vulkan
+{
+	// Accesses an aliased image's memory may have seen through the image placed in it before
+	static const VkAccessFlags ALIASED_WRITE_ACCESS = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+		VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	static const VkPipelineStageFlags DEPTH_STENCIL_STAGES = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+
+	FramePass::FramePass(FrameGraph& graph_, std::string name_, FramePassQueue queue_)
+		: graph(&graph_), name(std::move(name_)), queue(queue_)
+	{
+	}
+
+	void FramePass::AddUse(FrameResource resource, Usage usage, VkPipelineStageFlags stages, VkAccessFlags access, bool write, bool clear, VkClearValue clear_value)
+	{
+		Use use;
+		use.resource = resource;
+		use.usage = usage;
+		use.stages = stages;
+		use.access = access;
+		use.write = write;
+		use.clear = clear;
+		use.clear_value = clear_value;
+		uses.push_back(use);
+		graph->baked = false;
+	}
+
+	void FramePass::AddColorOutput(FrameResource image, bool clear, VkClearColorValue clear_color)
+	{
+		VkClearValue value = {};
+		value.color = clear_color;
+		AddUse(image, Usage::Color, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, true, clear, value);
+	}
+
+	void FramePass::SetDepthStencilOutput(FrameResource image, bool clear, VkClearDepthStencilValue clear_value)
+	{
+		VkClearValue value = {};
+		value.depthStencil = clear_value;
+		AddUse(image, Usage::DepthStencil, DEPTH_STENCIL_STAGES,
+			VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, true, clear, value);
+	}
+
+	void FramePass::SetDepthStencilInput(FrameResource image)
+	{
+		AddUse(image, Usage::DepthStencilRead, DEPTH_STENCIL_STAGES, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, false);
+	}
+
+	void FramePass::AddAttachmentInput(FrameResource image)
+	{
+		AddUse(image, Usage::AttachmentInput, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT, false);
+	}
+
+	void FramePass::AddTextureInput(FrameResource image, VkPipelineStageFlags stages)
+	{
+		AddUse(image, Usage::Texture, stages, VK_ACCESS_SHADER_READ_BIT, false);
+	}
+
+	void FramePass::AddStorageImage(FrameResource image, VkPipelineStageFlags stages, bool write)
+	{
+		AddUse(image, Usage::Storage, stages, VK_ACCESS_SHADER_READ_BIT | (write ? VK_ACCESS_SHADER_WRITE_BIT : 0), write);
+	}
+
+	void FramePass::AddBufferInput(FrameResource buffer, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		AddUse(buffer, Usage::Buffer, stages, access, false);
+	}
+
+	void FramePass::AddBufferOutput(FrameResource buffer, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		AddUse(buffer, Usage::Buffer, stages, access, true);
+	}
+
+	bool FramePass::HasAttachments() const
+	{
+		for (auto& use : uses)
+			if (FrameGraph::IsAttachment(use.usage))
+				return true;
+		return false;
+	}
+
+	////////////////////////////////
+
+	FrameGraph::FrameGraph(Device& device_)
+		: device(device_)
+	{
+	}
+
+	FrameResource FrameGraph::AddResource(const std::string& name, ResourceType type)
+	{
+		auto itr = resource_names.find(name);
+		if (itr != resource_names.end())
+		{
+			auto& resource = resources[itr->second];
+			VK_ASSERT((resource.type == ResourceType::Buffer) == (type == ResourceType::Buffer));
+			resource.type = type;
+			return itr->second;
+		}
+
+		FrameResource index = FrameResource(resources.size());
+		resources.emplace_back();
+		resources.back().name = name;
+		resources.back().type = type;
+		resource_names[name] = index;
+		baked = false;
+		return index;
+	}
+
+	FrameResource FrameGraph::DeclareImage(const std::string& name, const FrameImageInfo& info)
+	{
+		FrameResource index = AddResource(name, ResourceType::Image);
+		auto& resource = resources[index];
+		if (memcmp(&resource.info, &info, sizeof(info)) != 0)
+			baked = false;
+		resource.info = info;
+		resource.view = nullptr;
+		return index;
+	}
+
+	FrameResource FrameGraph::ImportImage(const std::string& name, ImageView& view, VkImageLayout layout,
+		VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout final_layout)
+	{
+		// Imports don't invalidate the bake, so a different image can be imported every frame, e.g. the swapchain image
+		FrameResource index = AddResource(name, ResourceType::ImportedImage);
+		auto& resource = resources[index];
+		resource.view = &view;
+		resource.layout = layout;
+		resource.stages = stages;
+		resource.access = access;
+		resource.final_layout = final_layout;
+		resource.output = true;
+		return index;
+	}
+
+	FrameResource FrameGraph::ImportBuffer(const std::string& name, const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		FrameResource index = AddResource(name, ResourceType::Buffer);
+		auto& resource = resources[index];
+		resource.buffer = &buffer;
+		resource.stages = stages;
+		resource.access = access;
+		resource.output = true;
+		return index;
+	}
+
+	FrameResource FrameGraph::FindResource(const std::string& name) const
+	{
+		auto itr = resource_names.find(name);
+		return itr != resource_names.end() ? itr->second : VULKAN_INVALID_FRAME_RESOURCE;
+	}
+
+	void FrameGraph::SetOutput(FrameResource resource)
+	{
+		VK_ASSERT(resource < resources.size());
+		if (!resources[resource].output)
+			baked = false;
+		resources[resource].output = true;
+	}
+
+	FramePass& FrameGraph::AddPass(const std::string& name, FramePassQueue queue)
+	{
+		passes.emplace_back(new FramePass(*this, name, queue));
+		baked = false;
+		return *passes.back();
+	}
+
+	ImageView& FrameGraph::GetImageView(FrameResource image)
+	{
+		VK_ASSERT(image < resources.size());
+		auto& resource = resources[image];
+		VK_ASSERT(resource.type != ResourceType::Buffer);
+		if (resource.type == ResourceType::ImportedImage)
+			return *resource.view;
+
+		VK_ASSERT(baked && resource.first_pass != UINT32_MAX);
+		return device.GetAliasedAttachmentAllocator().GetAttachment(resource.alias_index);
+	}
+
+	const Buffer& FrameGraph::GetBuffer(FrameResource buffer) const
+	{
+		VK_ASSERT(buffer < resources.size());
+		VK_ASSERT(resources[buffer].type == ResourceType::Buffer);
+		return *resources[buffer].buffer;
+	}
+
+	Image& FrameGraph::GetImage(FrameResource resource)
+	{
+		return GetImageView(resource).GetImage();
+	}
+
+	void FrameGraph::Reset()
+	{
+		passes.clear();
+		resources.clear();
+		resource_names.clear();
+		physical_passes.clear();
+		baked = false;
+		stats = {};
+	}
+
+	bool FrameGraph::IsAttachment(FramePass::Usage usage)
+	{
+		return usage == FramePass::Usage::Color || usage == FramePass::Usage::DepthStencil ||
+			usage == FramePass::Usage::DepthStencilRead || usage == FramePass::Usage::AttachmentInput;
+	}
+
+	VkImageLayout FrameGraph::UseLayout(const FramePass::Use& use)
+	{
+		VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		switch (use.usage)
+		{
+		case FramePass::Usage::Color:
+			layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			break;
+		case FramePass::Usage::DepthStencil:
+			layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			break;
+		case FramePass::Usage::DepthStencilRead:
+			layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+			break;
+		case FramePass::Usage::AttachmentInput:
+		case FramePass::Usage::Texture:
+			layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			break;
+		case FramePass::Usage::Storage:
+			return VK_IMAGE_LAYOUT_GENERAL;
+		case FramePass::Usage::Buffer:
+			return VK_IMAGE_LAYOUT_UNDEFINED;
+		}
+
+		// Images created with a general layout stay in it
+		if (resources[use.resource].type == ResourceType::ImportedImage)
+			return resources[use.resource].view->GetImage().GetLayout(layout);
+		return layout;
+	}
+
+	void FrameGraph::GetImageSize(FrameResource image, uint32_t& width, uint32_t& height)
+	{
+		auto& resource = resources[image];
+		if (resource.type == ResourceType::ImportedImage)
+		{
+			uint32_t level = resource.view->GetCreateInfo().base_level;
+			width = resource.view->GetImage().GetWidth(level);
+			height = resource.view->GetImage().GetHeight(level);
+		}
+		else
+		{
+			width = resource.info.width;
+			height = resource.info.height;
+		}
+	}
+
+	bool FrameGraph::GetAttachmentSize(const FramePass& pass, uint32_t& width, uint32_t& height)
+	{
+		for (auto& use : pass.uses)
+		{
+			if (IsAttachment(use.usage))
+			{
+				GetImageSize(use.resource, width, height);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool FrameGraph::Validate()
+	{
+		for (auto& pass : passes)
+		{
+			uint32_t width = 0, height = 0;
+			GetAttachmentSize(*pass, width, height);
+
+			uint32_t num_attachments = 0;
+			FrameResource depth_stencil = VULKAN_INVALID_FRAME_RESOURCE;
+
+			for (auto& use : pass->uses)
+			{
+				if (use.resource >= resources.size())
+				{
+					QM_LOG_ERROR("Pass %s uses a resource which doesn't exist.\n", pass->name.c_str());
+					return false;
+				}
+
+				auto& resource = resources[use.resource];
+				if ((resource.type == ResourceType::Buffer) != (use.usage == FramePass::Usage::Buffer))
+				{
+					QM_LOG_ERROR("Pass %s uses %s as the wrong kind of resource.\n", pass->name.c_str(), resource.name.c_str());
+					return false;
+				}
+
+				if (resource.type == ResourceType::ImportedImage && resource.view->GetImage().IsSwapchainImage() && use.usage != FramePass::Usage::Color)
+				{
+					QM_LOG_ERROR("Pass %s uses swapchain image %s as something else than a color output.\n", pass->name.c_str(), resource.name.c_str());
+					return false;
+				}
+
+				if (!IsAttachment(use.usage))
+					continue;
+
+				if (pass->queue == FramePassQueue::AsyncCompute)
+				{
+					QM_LOG_ERROR("Async compute pass %s has attachments.\n", pass->name.c_str());
+					return false;
+				}
+
+				uint32_t use_width = 0, use_height = 0;
+				GetImageSize(use.resource, use_width, use_height);
+				if (use_width != width || use_height != height)
+				{
+					QM_LOG_ERROR("Attachments of pass %s have different sizes.\n", pass->name.c_str());
+					return false;
+				}
+
+				if (use.usage == FramePass::Usage::DepthStencil || use.usage == FramePass::Usage::DepthStencilRead)
+				{
+					if (depth_stencil != VULKAN_INVALID_FRAME_RESOURCE && depth_stencil != use.resource)
+					{
+						QM_LOG_ERROR("Pass %s has more than one depth stencil attachment.\n", pass->name.c_str());
+						return false;
+					}
+					depth_stencil = use.resource;
+				}
+				else
+					num_attachments++;
+			}
+
+			for (auto& use : pass->uses)
+			{
+				if (use.usage == FramePass::Usage::AttachmentInput && use.resource == depth_stencil)
+				{
+					QM_LOG_ERROR("Pass %s reads its depth stencil attachment as an input attachment.\n", pass->name.c_str());
+					return false;
+				}
+
+				// Feedback loops would need the GENERAL layout, which barriers aren't inferred for
+				if (use.usage == FramePass::Usage::AttachmentInput)
+				{
+					for (auto& other : pass->uses)
+					{
+						if (other.usage == FramePass::Usage::Color && other.resource == use.resource)
+						{
+							QM_LOG_ERROR("Pass %s reads its color attachment %s as an input attachment.\n", pass->name.c_str(), resources[use.resource].name.c_str());
+							return false;
+						}
+					}
+				}
+			}
+
+			if (num_attachments > VULKAN_NUM_ATTACHMENTS)
+			{
+				QM_LOG_ERROR("Pass %s has too many color and input attachments.\n", pass->name.c_str());
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool FrameGraph::CanMerge(const PhysicalPass& physical, const FramePass& pass)
+	{
+		if (physical.subpasses.empty() || physical.subpasses.size() >= 32)
+			return false;
+
+		uint32_t width = 0, height = 0, pass_width = 0, pass_height = 0;
+		GetAttachmentSize(*passes[physical.passes.front()], width, height);
+		GetAttachmentSize(pass, pass_width, pass_height);
+		if (width != pass_width || height != pass_height)
+			return false;
+
+		uint32_t new_attachments = 0;
+		for (auto& use : pass.uses)
+		{
+			// How the render pass uses the resource so far
+			bool used = false, as_color = false, as_input = false, as_depth_stencil = false, as_texture = false, as_other = false;
+			for (uint32_t index : physical.passes)
+			{
+				for (auto& other : passes[index]->uses)
+				{
+					if (other.resource != use.resource)
+						continue;
+
+					used = true;
+					switch (other.usage)
+					{
+					case FramePass::Usage::Color:
+						as_color = true;
+						break;
+					case FramePass::Usage::AttachmentInput:
+						as_input = true;
+						break;
+					case FramePass::Usage::DepthStencil:
+					case FramePass::Usage::DepthStencilRead:
+						as_depth_stencil = true;
+						break;
+					case FramePass::Usage::Texture:
+						as_texture = true;
+						break;
+					default:
+						as_other = true;
+						break;
+					}
+				}
+			}
+
+			// Barriers can only be recorded before the render pass, so a resource can't change how it's used within it
+			switch (use.usage)
+			{
+			case FramePass::Usage::Color:
+				if (as_input || as_depth_stencil || as_texture || as_other)
+					return false;
+				if (!as_color)
+					new_attachments++;
+				break;
+
+			case FramePass::Usage::AttachmentInput:
+				if (as_depth_stencil || as_texture || as_other)
+					return false;
+				if (!used)
+					new_attachments++;
+				break;
+
+			case FramePass::Usage::DepthStencil:
+			case FramePass::Usage::DepthStencilRead:
+				if (physical.depth_stencil != VULKAN_INVALID_FRAME_RESOURCE && physical.depth_stencil != use.resource)
+					return false;
+				if (as_color || as_input || as_texture || as_other)
+					return false;
+				break;
+
+			case FramePass::Usage::Texture:
+				if (as_color || as_input || as_depth_stencil || as_other)
+					return false;
+				break;
+
+			default:
+				if (used)
+					return false;
+				break;
+			}
+		}
+
+		return physical.colors.size() + new_attachments <= VULKAN_NUM_ATTACHMENTS;
+	}
+
+	void FrameGraph::AddToPhysicalPass(PhysicalPass& physical, uint32_t pass_index)
+	{
+		auto& pass = *passes[pass_index];
+		physical.passes.push_back(pass_index);
+		if (!pass.HasAttachments())
+			return;
+
+		auto find_color = [&](const FramePass::Use& use, bool& added) -> uint32_t {
+			auto itr = std::find(physical.colors.begin(), physical.colors.end(), use.resource);
+			added = itr == physical.colors.end();
+			if (!added)
+				return uint32_t(itr - physical.colors.begin());
+
+			physical.color_layouts[physical.colors.size()] = UseLayout(use);
+			physical.colors.push_back(use.resource);
+			return uint32_t(physical.colors.size() - 1);
+		};
+
+		RenderPassInfo::Subpass subpass;
+		subpass.depth_stencil_mode = RenderPassInfo::DepthStencil::None;
+
+		for (auto& use : pass.uses)
+		{
+			bool added = false;
+			switch (use.usage)
+			{
+			case FramePass::Usage::Color:
+			{
+				uint32_t index = find_color(use, added);
+				if (added && use.clear)
+				{
+					physical.clear_attachments |= 1u << index;
+					physical.clear_colors[index] = use.clear_value.color;
+				}
+				subpass.color_attachments[subpass.num_color_attachments++] = index;
+				break;
+			}
+
+			case FramePass::Usage::AttachmentInput:
+				subpass.input_attachments[subpass.num_input_attachments++] = find_color(use, added);
+				break;
+
+			case FramePass::Usage::DepthStencil:
+			case FramePass::Usage::DepthStencilRead:
+				if (physical.depth_stencil == VULKAN_INVALID_FRAME_RESOURCE)
+				{
+					physical.depth_stencil = use.resource;
+					physical.depth_stencil_layout = UseLayout(use);
+					if (use.clear)
+					{
+						physical.op_flags |= RENDER_PASS_OP_CLEAR_DEPTH_STENCIL_BIT;
+						physical.clear_depth_stencil = use.clear_value.depthStencil;
+					}
+				}
+				subpass.depth_stencil_mode = use.usage == FramePass::Usage::DepthStencil ?
+					RenderPassInfo::DepthStencil::ReadWrite : RenderPassInfo::DepthStencil::ReadOnly;
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		physical.subpasses.push_back(subpass);
+	}
+
+	void FrameGraph::SetupLoadStore(uint32_t physical_index)
+	{
+		auto& physical = physical_passes[physical_index];
+
+		auto load_store = [&](FrameResource index, bool& load, bool& store) {
+			auto& resource = resources[index];
+			// Swapchain images have no contents before they're first written in the frame
+			bool has_contents = resource.first_pass < physical_index;
+			if (resource.type == ResourceType::ImportedImage && !resource.view->GetImage().IsSwapchainImage())
+				has_contents = has_contents || resource.layout != VK_IMAGE_LAYOUT_UNDEFINED;
+
+			load = has_contents;
+			store = resource.output || resource.type == ResourceType::ImportedImage || resource.last_pass > physical_index;
+		};
+
+		for (uint32_t i = 0; i < physical.colors.size(); i++)
+		{
+			bool load, store;
+			load_store(physical.colors[i], load, store);
+			if (load && !(physical.clear_attachments & (1u << i)))
+				physical.load_attachments |= 1u << i;
+			if (store)
+				physical.store_attachments |= 1u << i;
+		}
+
+		if (physical.depth_stencil != VULKAN_INVALID_FRAME_RESOURCE)
+		{
+			bool load, store;
+			load_store(physical.depth_stencil, load, store);
+			if (load && !(physical.op_flags & RENDER_PASS_OP_CLEAR_DEPTH_STENCIL_BIT))
+				physical.op_flags |= RENDER_PASS_OP_LOAD_DEPTH_STENCIL_BIT;
+			if (store)
+				physical.op_flags |= RENDER_PASS_OP_STORE_DEPTH_STENCIL_BIT;
+		}
+	}
+
+	void FrameGraph::FindQueueDependencies()
+	{
+		struct QueueUse
+		{
+			// Last pass using the resource, and the last one writing it or changing its layout
+			uint32_t last_use = UINT32_MAX;
+			uint32_t last_write = UINT32_MAX;
+		};
+
+		// Uses of every resource on each queue, the layout of every resource after the last use on either queue,
+		// and the latest pass of the other queue each queue has waited for
+		std::vector<QueueUse> queue_uses[2] = { std::vector<QueueUse>(resources.size()), std::vector<QueueUse>(resources.size()) };
+		std::vector<VkImageLayout> layouts(resources.size(), VK_IMAGE_LAYOUT_UNDEFINED);
+		std::vector<bool> used(resources.size(), false);
+		uint32_t synced[2] = { UINT32_MAX, UINT32_MAX };
+
+		for (uint32_t i = 0; i < physical_passes.size(); i++)
+		{
+			auto& physical = physical_passes[i];
+			unsigned queue = unsigned(physical.queue);
+			unsigned other_queue = queue ^ 1;
+
+			for (uint32_t index : physical.passes)
+			{
+				for (auto& use : passes[index]->uses)
+				{
+					auto& other = queue_uses[other_queue][use.resource];
+					VkImageLayout layout = UseLayout(use);
+					bool write = use.write || (used[use.resource] && layouts[use.resource] != layout);
+
+					// Reads wait for the other queue's last write, writes and layout transitions for all of its uses
+					uint32_t wait = write ? other.last_use : other.last_write;
+					if (wait != UINT32_MAX && (synced[queue] == UINT32_MAX || wait > synced[queue]))
+					{
+						if (physical.wait_pass == UINT32_MAX || wait > physical.wait_pass)
+							physical.wait_pass = wait;
+					}
+
+					auto& own = queue_uses[queue][use.resource];
+					own.last_use = i;
+					if (write)
+						own.last_write = i;
+					layouts[use.resource] = layout;
+					used[use.resource] = true;
+				}
+			}
+
+			if (physical.wait_pass == UINT32_MAX)
+				continue;
+
+			// All resources of the pass wait, even those which didn't need to, a pass has a single wait stage mask
+			for (uint32_t index : physical.passes)
+				for (auto& use : passes[index]->uses)
+					physical.wait_stages |= use.stages;
+
+			physical_passes[physical.wait_pass].signal_count++;
+			synced[queue] = physical.wait_pass;
+		}
+	}
+
+	bool FrameGraph::Bake()
+	{
+		physical_passes.clear();
+		stats = {};
+		stats.passes = uint32_t(passes.size());
+		baked = false;
+
+		if (!Validate())
+			return false;
+
+		async_compute = device.GetVkQueue(CommandBuffer::Type::AsyncCompute) != device.GetVkQueue(CommandBuffer::Type::Generic);
+
+		// Culls backwards from the outputs. Uses which aren't cleared may read what earlier passes left in the resource.
+		std::vector<bool> needed(resources.size());
+		for (uint32_t i = 0; i < resources.size(); i++)
+			needed[i] = resources[i].output;
+
+		std::vector<bool> live(passes.size());
+		for (uint32_t i = uint32_t(passes.size()); i-- > 0;)
+		{
+			for (auto& use : passes[i]->uses)
+				if (use.write && needed[use.resource])
+					live[i] = true;
+
+			if (!live[i])
+			{
+				stats.culled_passes++;
+				continue;
+			}
+
+			for (auto& use : passes[i]->uses)
+				if (!use.clear)
+					needed[use.resource] = true;
+		}
+
+		for (uint32_t i = 0; i < passes.size(); i++)
+		{
+			if (!live[i])
+				continue;
+
+			auto& pass = *passes[i];
+			if (pass.HasAttachments() && !physical_passes.empty() && CanMerge(physical_passes.back(), pass))
+			{
+				AddToPhysicalPass(physical_passes.back(), i);
+				stats.merged_passes++;
+				continue;
+			}
+
+			physical_passes.emplace_back();
+			physical_passes.back().queue = async_compute ? pass.queue : FramePassQueue::Graphics;
+			AddToPhysicalPass(physical_passes.back(), i);
+		}
+
+		for (auto& resource : resources)
+		{
+			resource.usage = 0;
+			resource.first_pass = UINT32_MAX;
+			resource.last_pass = 0;
+			resource.async = false;
+			resource.transient = false;
+		}
+
+		for (uint32_t i = 0; i < physical_passes.size(); i++)
+		{
+			auto& physical = physical_passes[i];
+			if (physical.queue == FramePassQueue::AsyncCompute)
+				stats.async_compute_passes++;
+
+			for (uint32_t index : physical.passes)
+			{
+				for (auto& use : passes[index]->uses)
+				{
+					auto& resource = resources[use.resource];
+					resource.first_pass = std::min(resource.first_pass, i);
+					resource.last_pass = std::max(resource.last_pass, i);
+					resource.async = resource.async || physical.queue == FramePassQueue::AsyncCompute;
+					if (use.usage == FramePass::Usage::Storage)
+						resource.usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+				}
+			}
+		}
+
+		// Images which only live within one render pass never need memory behind them
+		for (auto& resource : resources)
+			resource.transient = resource.type == ResourceType::Image && !resource.output && resource.first_pass != UINT32_MAX &&
+				resource.first_pass == resource.last_pass;
+
+		for (auto& physical : physical_passes)
+			for (uint32_t index : physical.passes)
+				for (auto& use : passes[index]->uses)
+					if (!IsAttachment(use.usage))
+						resources[use.resource].transient = false;
+
+		std::vector<AliasedAttachmentInfo> infos;
+		for (auto& resource : resources)
+		{
+			if (resource.type != ResourceType::Image || resource.first_pass == UINT32_MAX)
+				continue;
+
+			AliasedAttachmentInfo info;
+			info.width = resource.info.width;
+			info.height = resource.info.height;
+			info.format = resource.info.format;
+			info.samples = resource.info.samples;
+			info.layers = resource.info.layers;
+			info.transient = resource.transient;
+			info.usage = resource.usage;
+
+			// The allocator orders passes on a single queue, images used by async compute live for the whole frame.
+			// Outputs are read after the graph, so they keep their memory until the end of the frame.
+			info.first_pass = resource.async ? 0 : resource.first_pass;
+			info.last_pass = resource.async || resource.output ? uint32_t(physical_passes.size() - 1) : resource.last_pass;
+
+			resource.alias_index = uint32_t(infos.size());
+			infos.push_back(info);
+		}
+
+		auto& allocator = device.GetAliasedAttachmentAllocator();
+		if (!infos.empty() && !allocator.Plan(infos.data(), uint32_t(infos.size())))
+		{
+			QM_LOG_ERROR("Failed to allocate the images of the frame graph.\n");
+			return false;
+		}
+
+		for (uint32_t i = 0; i < physical_passes.size(); i++)
+			if (!physical_passes[i].subpasses.empty())
+				SetupLoadStore(i);
+
+		if (async_compute)
+			FindQueueDependencies();
+
+		stats.physical_passes = uint32_t(physical_passes.size());
+		stats.aliasing = allocator.GetStats();
+		baked = true;
+		return true;
+	}
+
+	void FrameGraph::InferBarriers(ResourceTracker& tracker, std::vector<uint32_t>& last_physical, uint32_t physical_index)
+	{
+		auto& physical = physical_passes[physical_index];
+		physical.barriers = {};
+		physical.post_barriers = {};
+
+		struct AttachmentState
+		{
+			VkImageLayout layout;
+			VkPipelineStageFlags stages;
+			VkAccessFlags access;
+		};
+		std::unordered_map<FrameResource, AttachmentState> attachments;
+
+		for (uint32_t index : physical.passes)
+		{
+			for (auto& use : passes[index]->uses)
+			{
+				auto& resource = resources[use.resource];
+				if (resource.transient)
+					continue;
+
+				bool is_image = resource.type != ResourceType::Buffer;
+				if (is_image && GetImage(use.resource).IsSwapchainImage())
+					continue;
+
+				// A semaphore ordered the last use on the other queue before this pass, the state continues from the stages which waited on it
+				uint32_t last = last_physical[use.resource];
+				if (last != UINT32_MAX && last != physical_index && physical_passes[last].queue != physical.queue)
+				{
+					if (is_image)
+					{
+						auto& image = GetImage(use.resource);
+						tracker.TrackImage(image, tracker.GetLayout(image, 0, 0), use.stages, 0);
+					}
+					else
+						tracker.TrackBuffer(*resource.buffer, use.stages, 0);
+				}
+				last_physical[use.resource] = physical_index;
+
+				if (!is_image)
+				{
+					tracker.UseBuffer(*resource.buffer, use.stages, use.access, physical.barriers);
+					continue;
+				}
+
+				VkImageSubresourceRange range = { 0, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+				auto& image = GetImage(use.resource);
+
+				if (!IsAttachment(use.usage))
+				{
+					tracker.UseImage(image, range, UseLayout(use), use.stages, use.access, physical.barriers);
+					continue;
+				}
+
+				// Attachments are transitioned to their layout of the first subpass before the render pass, the render pass does the rest
+				auto itr = attachments.find(use.resource);
+				if (itr == attachments.end())
+				{
+					tracker.UseImage(image, range, UseLayout(use), use.stages, use.access, physical.barriers);
+					attachments[use.resource] = { UseLayout(use), use.stages, use.access };
+				}
+				else
+				{
+					itr->second.layout = UseLayout(use);
+					itr->second.stages |= use.stages;
+					itr->second.access |= use.access;
+				}
+			}
+		}
+
+		for (auto& attachment : attachments)
+			tracker.TrackImage(GetImage(attachment.first), attachment.second.layout, attachment.second.stages, attachment.second.access);
+
+		// Imported images go to their final layout after their last use
+		for (FrameResource i = 0; i < resources.size(); i++)
+		{
+			auto& resource = resources[i];
+			if (resource.type != ResourceType::ImportedImage || resource.final_layout == VK_IMAGE_LAYOUT_UNDEFINED ||
+				resource.last_pass != physical_index || resource.first_pass == UINT32_MAX || resource.view->GetImage().IsSwapchainImage())
+				continue;
+
+			VkImageSubresourceRange range = { 0, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+			tracker.UseImage(GetImage(i), range, resource.final_layout, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+				VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT, physical.post_barriers);
+		}
+	}
+
+	static void RecordBarriers(CommandBuffer& cmd, const InferredBarriers& barriers)
+	{
+		if (barriers.Empty())
+			return;
+
+		cmd.Barrier(barriers.src_stages, barriers.dst_stages, 0, nullptr,
+			unsigned(barriers.buffers.size()), barriers.buffers.data(),
+			unsigned(barriers.images.size()), barriers.images.data());
+	}
+
+	void FrameGraph::Record(PhysicalPass& physical, unsigned thread_index)
+	{
+		auto type = physical.queue == FramePassQueue::AsyncCompute ? CommandBuffer::Type::AsyncCompute : CommandBuffer::Type::Generic;
+		physical.cmd = device.RequestCommandBufferForThread(thread_index, type);
+		auto& cmd = *physical.cmd;
+
+		RecordBarriers(cmd, physical.barriers);
+
+		if (physical.subpasses.empty())
+		{
+			auto& pass = *passes[physical.passes.front()];
+			if (pass.record)
+				pass.record(cmd);
+		}
+		else
+		{
+			RenderPassInfo info;
+			info.num_color_attachments = uint32_t(physical.colors.size());
+			for (uint32_t i = 0; i < physical.colors.size(); i++)
+			{
+				auto& attachment = info.color_attachments[i];
+				attachment.view = &GetImageView(physical.colors[i]);
+				attachment.initial_layout = resources[physical.colors[i]].transient ? VK_IMAGE_LAYOUT_UNDEFINED : physical.color_layouts[i];
+				attachment.final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+				attachment.clear_color = physical.clear_colors[i];
+			}
+
+			if (physical.depth_stencil != VULKAN_INVALID_FRAME_RESOURCE)
+			{
+				info.depth_stencil.view = &GetImageView(physical.depth_stencil);
+				info.depth_stencil.initial_layout = resources[physical.depth_stencil].transient ? VK_IMAGE_LAYOUT_UNDEFINED : physical.depth_stencil_layout;
+				info.depth_stencil.final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+				info.depth_stencil.clear_value = physical.clear_depth_stencil;
+			}
+
+			info.clear_attachments = physical.clear_attachments;
+			info.load_attachments = physical.load_attachments;
+			info.store_attachments = physical.store_attachments;
+			info.op_flags = physical.op_flags;
+			info.num_subpasses = uint32_t(physical.subpasses.size());
+			info.subpasses = physical.subpasses.data();
+
+			cmd.BeginRenderPass(info);
+			for (uint32_t i = 0; i < physical.passes.size(); i++)
+			{
+				if (i)
+					cmd.NextSubpass();
+
+				auto& pass = *passes[physical.passes[i]];
+				if (pass.record)
+					pass.record(cmd);
+			}
+			cmd.EndRenderPass();
+		}
+
+		RecordBarriers(cmd, physical.post_barriers);
+	}
+
+	void FrameGraph::Execute(Quantum::ThreadGroup* group)
+	{
+		if (!baked && !Bake())
+		{
+			QM_LOG_ERROR("Frame graph is invalid, nothing is executed.\n");
+			return;
+		}
+
+		if (physical_passes.empty())
+			return;
+
+		stats.queue_waits = 0;
+		stats.barriers = 0;
+
+		auto& allocator = device.GetAliasedAttachmentAllocator();
+
+		// Barriers are inferred in submission order up front, so passes can be recorded independently
+		ResourceTracker tracker;
+		for (FrameResource i = 0; i < resources.size(); i++)
+		{
+			auto& resource = resources[i];
+			if (resource.first_pass == UINT32_MAX || resource.transient)
+				continue;
+
+			switch (resource.type)
+			{
+			case ResourceType::Image:
+			{
+				// Memory shared with another image may still be written through it
+				bool aliased = !resource.async && allocator.IsAliased(resource.alias_index);
+				tracker.TrackImage(GetImage(i), VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, aliased ? ALIASED_WRITE_ACCESS : 0);
+				break;
+			}
+
+			case ResourceType::ImportedImage:
+				if (!resource.view->GetImage().IsSwapchainImage())
+					tracker.TrackImage(GetImage(i), resource.layout, resource.stages, resource.access);
+				break;
+
+			case ResourceType::Buffer:
+				tracker.TrackBuffer(*resource.buffer, resource.stages, resource.access);
+				break;
+			}
+		}
+
+		std::vector<uint32_t> last_physical(resources.size(), UINT32_MAX);
+		for (uint32_t i = 0; i < physical_passes.size(); i++)
+		{
+			InferBarriers(tracker, last_physical, i);
+			auto& physical = physical_passes[i];
+			stats.barriers += uint32_t(physical.barriers.buffers.size() + physical.barriers.images.size());
+			stats.barriers += uint32_t(physical.post_barriers.buffers.size() + physical.post_barriers.images.size());
+		}
+
+		// Thread index 0 is the thread calling Execute(), workers record contiguous ranges of passes with their own indices
+		unsigned num_workers = 0;
+		if (group && device.GetNumThreadIndices() > 1)
+			num_workers = std::min(std::min(group->get_num_threads(), device.GetNumThreadIndices() - 1), unsigned(physical_passes.size()));
+
+		if (num_workers > 1)
+		{
+			auto task = group->create_task();
+			unsigned count = unsigned(physical_passes.size());
+			for (unsigned worker = 0; worker < num_workers; worker++)
+			{
+				unsigned begin = count * worker / num_workers;
+				unsigned end = count * (worker + 1) / num_workers;
+				group->enqueue_task(task, [this, begin, end, worker]() {
+					for (unsigned i = begin; i < end; i++)
+						Record(physical_passes[i], worker + 1);
+				});
+			}
+			group->submit(task);
+			task->wait();
+		}
+		else
+		{
+			unsigned thread_index = GetCurrentThreadIndex();
+			for (auto& physical : physical_passes)
+				Record(physical, thread_index);
+		}
+
+		// The queues also wait for each other's work of the previous frame, graph resources are reused every frame
+		if (stats.async_compute_passes)
+		{
+			Semaphore to_compute, to_graphics;
+			device.SubmitEmpty(CommandBuffer::Type::Generic, nullptr, 1, &to_compute);
+			device.SubmitEmpty(CommandBuffer::Type::AsyncCompute, nullptr, 1, &to_graphics);
+			device.AddWaitSemaphore(CommandBuffer::Type::AsyncCompute, to_compute, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, false);
+			device.AddWaitSemaphore(CommandBuffer::Type::Generic, to_graphics, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, false);
+		}
+
+		// Passes other passes wait for return the point their queue reaches, waits on those need no semaphores
+		std::vector<QueuePoint> points(physical_passes.size());
+		for (uint32_t i = 0; i < physical_passes.size(); i++)
+		{
+			auto& physical = physical_passes[i];
+			QueueWait wait;
+			unsigned wait_count = 0;
+			if (physical.wait_pass != UINT32_MAX)
+			{
+				wait.point = points[physical.wait_pass];
+				wait.stages = physical.wait_stages;
+				wait_count = 1;
+				stats.queue_waits++;
+			}
+
+			if (wait_count || physical.signal_count)
+				points[i] = device.Submit(physical.cmd, wait_count, &wait);
+			else
+				device.Submit(physical.cmd);
+		}
+	}
+}
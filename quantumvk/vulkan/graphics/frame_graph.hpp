@@ -0,0 +1,267 @@
+#pragma once
+
+#include "quantumvk/vulkan/vulkan_headers.hpp"
+#include "quantumvk/vulkan/command_buffer.hpp"
+#include "quantumvk/vulkan/graphics/render_pass.hpp"
+#include "quantumvk/vulkan/sync/resource_tracker.hpp"
+#include "quantumvk/vulkan/sync/semaphore.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Quantum
+{
+	class ThreadGroup;
+}
+
+namespace Vulkan
+{
+	class Device;
+
+	// Identifies an image or buffer of a FrameGraph
+	using FrameResource = uint32_t;
+	static const FrameResource VULKAN_INVALID_FRAME_RESOURCE = UINT32_MAX;
+
+	enum class FramePassQueue
+	{
+		// Generic queue, the only one which can run render passes
+		Graphics,
+		// Async compute queue, falls back to the generic queue if the device has none
+		AsyncCompute
+	};
+
+	// Image owned by a FrameGraph. Its memory may be shared with other graph images whose lifetimes don't overlap.
+	struct FrameImageInfo
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		VkFormat format = VK_FORMAT_UNDEFINED;
+		VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+		uint32_t layers = 1;
+	};
+
+	struct FrameGraphStats
+	{
+		uint32_t passes = 0;
+		uint32_t culled_passes = 0;
+		// Render passes and compute passes after merging
+		uint32_t physical_passes = 0;
+		// Passes which became a subpass of the previous render pass
+		uint32_t merged_passes = 0;
+		uint32_t async_compute_passes = 0;
+		// Semaphore waits between the graphics and async compute queue in the last Execute()
+		uint32_t queue_waits = 0;
+		// Image and buffer barriers recorded by the last Execute()
+		uint32_t barriers = 0;
+		AliasedAttachmentStats aliasing;
+	};
+
+	class FrameGraph;
+
+	// A pass of a FrameGraph. Declares the resources it reads and writes, the graph derives the barriers and the order of queues from them.
+	class FramePass
+	{
+	public:
+		// Attachments, only for Graphics passes. All attachments of a pass must have the same size.
+		void AddColorOutput(FrameResource image, bool clear = false, VkClearColorValue clear_color = {});
+		void SetDepthStencilOutput(FrameResource image, bool clear = false, VkClearDepthStencilValue clear_value = { 1.0f, 0 });
+		void SetDepthStencilInput(FrameResource image);
+		// Read with subpassLoad(). If the image is written by the previous pass, both passes can become subpasses of one render pass.
+		void AddAttachmentInput(FrameResource image);
+
+		void AddTextureInput(FrameResource image, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+		void AddStorageImage(FrameResource image, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, bool write = true);
+		void AddBufferInput(FrameResource buffer, VkPipelineStageFlags stages, VkAccessFlags access);
+		void AddBufferOutput(FrameResource buffer, VkPipelineStageFlags stages, VkAccessFlags access);
+
+		// Records the pass. Graphics passes with attachments are recorded inside their (sub)pass of the render pass.
+		// May be called on a worker thread of the ThreadGroup given to FrameGraph::Execute().
+		void SetRecordCallback(std::function<void(CommandBuffer&)> callback)
+		{
+			record = std::move(callback);
+		}
+
+		const std::string& GetName() const
+		{
+			return name;
+		}
+
+		FramePassQueue GetQueue() const
+		{
+			return queue;
+		}
+
+	private:
+		friend class FrameGraph;
+
+		enum class Usage
+		{
+			Color,
+			DepthStencil,
+			DepthStencilRead,
+			AttachmentInput,
+			Texture,
+			Storage,
+			Buffer
+		};
+
+		struct Use
+		{
+			FrameResource resource;
+			Usage usage;
+			VkPipelineStageFlags stages;
+			VkAccessFlags access;
+			bool write;
+			bool clear;
+			VkClearValue clear_value;
+		};
+
+		FramePass(FrameGraph& graph, std::string name, FramePassQueue queue);
+
+		void AddUse(FrameResource resource, Usage usage, VkPipelineStageFlags stages, VkAccessFlags access, bool write, bool clear = false, VkClearValue clear_value = {});
+		bool HasAttachments() const;
+
+		FrameGraph* graph;
+		std::string name;
+		FramePassQueue queue;
+		std::vector<Use> uses;
+		std::function<void(CommandBuffer&)> record;
+	};
+
+	// Schedules the passes of a frame. Bake() culls passes whose results aren't used, merges consecutive graphics passes into
+	// subpasses, plans the memory of graph images by their lifetimes and finds the dependencies between the graphics and async compute queue.
+	// Execute() infers the barriers of every pass, records the passes, in parallel if a ThreadGroup is given, and submits them in order.
+	//
+	// Passes must be added in an order in which they could execute, every pass after the passes writing what it reads.
+	// Graph images are placed by the device's AliasedAttachmentAllocator, which shouldn't be used for anything else while a graph is in use.
+	class FrameGraph
+	{
+	public:
+		explicit FrameGraph(Device& device);
+
+		FrameGraph(const FrameGraph&) = delete;
+		void operator=(const FrameGraph&) = delete;
+
+		// Declaring or importing a name again updates the resource and returns the same id
+		FrameResource DeclareImage(const std::string& name, const FrameImageInfo& info);
+		// layout, stages and access describe the last use of the image before the graph. final_layout is the layout the image is left in,
+		// VK_IMAGE_LAYOUT_UNDEFINED to leave it in the layout of its last use. Swapchain images may only be used as color outputs.
+		FrameResource ImportImage(const std::string& name, ImageView& view, VkImageLayout layout,
+			VkPipelineStageFlags stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VkAccessFlags access = 0, VkImageLayout final_layout = VK_IMAGE_LAYOUT_UNDEFINED);
+		FrameResource ImportBuffer(const std::string& name, const Buffer& buffer,
+			VkPipelineStageFlags stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VkAccessFlags access = 0);
+		FrameResource FindResource(const std::string& name) const;
+
+		// Passes writing an output are never culled. Imported resources are always outputs.
+		void SetOutput(FrameResource resource);
+
+		FramePass& AddPass(const std::string& name, FramePassQueue queue = FramePassQueue::Graphics);
+
+		// Must be called after passes or resources were added, or graph images were redeclared. Returns false if the graph is invalid.
+		bool Bake();
+		// Records and submits the baked graph. Recording in parallel uses thread indices 1 to n of the device,
+		// no other thread may record with those while Execute() runs.
+		void Execute(Quantum::ThreadGroup* group = nullptr);
+
+		// Views and buffers to bind in record callbacks. Views of graph images are only valid after Bake().
+		ImageView& GetImageView(FrameResource image);
+		const Buffer& GetBuffer(FrameResource buffer) const;
+
+		// Removes all passes and resources
+		void Reset();
+
+		FrameGraphStats GetStats() const
+		{
+			return stats;
+		}
+
+	private:
+		friend class FramePass;
+
+		enum class ResourceType
+		{
+			Image,
+			ImportedImage,
+			Buffer
+		};
+
+		struct Resource
+		{
+			std::string name;
+			ResourceType type;
+			FrameImageInfo info;
+			ImageView* view = nullptr;
+			const Buffer* buffer = nullptr;
+			VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			VkPipelineStageFlags stages = 0;
+			VkAccessFlags access = 0;
+			VkImageLayout final_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			bool output = false;
+
+			// Set by Bake()
+			VkImageUsageFlags usage = 0;
+			uint32_t alias_index = 0;
+			uint32_t first_pass = UINT32_MAX;
+			uint32_t last_pass = 0;
+			bool async = false;
+			bool transient = false;
+		};
+
+		// A render pass or a pass without attachments
+		struct PhysicalPass
+		{
+			FramePassQueue queue;
+			// Logical passes, one per subpass
+			std::vector<uint32_t> passes;
+			// Attachments of the render pass, and the layouts they're in before it
+			std::vector<FrameResource> colors;
+			VkImageLayout color_layouts[VULKAN_NUM_ATTACHMENTS] = {};
+			FrameResource depth_stencil = VULKAN_INVALID_FRAME_RESOURCE;
+			VkImageLayout depth_stencil_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			std::vector<RenderPassInfo::Subpass> subpasses;
+			uint32_t clear_attachments = 0;
+			uint32_t load_attachments = 0;
+			uint32_t store_attachments = 0;
+			RenderPassOpFlags op_flags = 0;
+			VkClearColorValue clear_colors[VULKAN_NUM_ATTACHMENTS] = {};
+			VkClearDepthStencilValue clear_depth_stencil = { 1.0f, 0 };
+
+			// Latest pass on the other queue which must complete first, and the stages which wait for it
+			uint32_t wait_pass = UINT32_MAX;
+			VkPipelineStageFlags wait_stages = 0;
+			// Number of passes on the other queue waiting for this one
+			uint32_t signal_count = 0;
+
+			// Set by Execute()
+			InferredBarriers barriers;
+			InferredBarriers post_barriers;
+			CommandBufferHandle cmd;
+		};
+
+		FrameResource AddResource(const std::string& name, ResourceType type);
+		static bool IsAttachment(FramePass::Usage usage);
+		VkImageLayout UseLayout(const FramePass::Use& use);
+		Image& GetImage(FrameResource resource);
+		void GetImageSize(FrameResource image, uint32_t& width, uint32_t& height);
+		bool GetAttachmentSize(const FramePass& pass, uint32_t& width, uint32_t& height);
+		bool Validate();
+		bool CanMerge(const PhysicalPass& physical, const FramePass& pass);
+		void AddToPhysicalPass(PhysicalPass& physical, uint32_t pass_index);
+		void SetupLoadStore(uint32_t physical_index);
+		void FindQueueDependencies();
+		void InferBarriers(ResourceTracker& tracker, std::vector<uint32_t>& last_physical, uint32_t physical_index);
+		void Record(PhysicalPass& physical, unsigned thread_index);
+
+		Device& device;
+		std::vector<Resource> resources;
+		std::unordered_map<std::string, FrameResource> resource_names;
+		std::vector<std::unique_ptr<FramePass>> passes;
+		std::vector<PhysicalPass> physical_passes;
+		bool async_compute = false;
+		bool baked = false;
+		FrameGraphStats stats;
+	};
+}
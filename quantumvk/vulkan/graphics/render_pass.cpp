@@ -5,6 +5,7 @@
 #include "quantumvk/vulkan/misc/quirks.hpp"
 
 #include <utility>
+#include <algorithm>
 #include <cstring>
 
 using namespace std;
@@ -1046,4 +1047,283 @@ namespace Vulkan
 
 		return *node->view;
 	}
+
+	bool AliasedAttachmentAllocator::Plan(const AliasedAttachmentInfo* infos, uint32_t count)
+	{
+		Hasher h;
+		h.u32(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			h.u32(infos[i].width);
+			h.u32(infos[i].height);
+			h.u32(infos[i].format);
+			h.u32(infos[i].samples);
+			h.u32(infos[i].layers);
+			h.u32(infos[i].transient);
+			h.u32(infos[i].usage);
+			h.u32(infos[i].first_pass);
+			h.u32(infos[i].last_pass);
+		}
+
+		auto hash = h.get();
+
+		LOCK();
+		if (hash == plan_hash)
+			return true;
+
+		// Images of the old plan may still be in use by recorded work
+		for (auto& attachment : attachments)
+			retired_attachments.push_back(std::move(attachment));
+		for (auto& block : blocks)
+			retired_blocks.push_back(block);
+		attachments.clear();
+		blocks.clear();
+		plan_hash = 0;
+		stats = {};
+
+		std::vector<ImageCreateInfo> image_infos(count);
+		std::vector<VkMemoryRequirements> reqs(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			VK_ASSERT(infos[i].first_pass <= infos[i].last_pass);
+
+			auto& image_info = image_infos[i];
+			if (infos[i].transient)
+			{
+				image_info = ImageCreateInfo::TransientRenderTarget(infos[i].width, infos[i].height, infos[i].format);
+			}
+			else
+			{
+				image_info = ImageCreateInfo::RenderTarget(infos[i].width, infos[i].height, infos[i].format);
+				image_info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+				image_info.usage |= VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | infos[i].usage;
+			}
+
+			image_info.samples = infos[i].samples;
+			image_info.layers = infos[i].layers;
+			image_info.sharing_mode = ImageSharingMode::Concurrent;
+			image_info.concurrent_owners = IMAGE_COMMAND_QUEUE_GENERIC | IMAGE_COMMAND_QUEUE_ASYNC_COMPUTE | IMAGE_COMMAND_QUEUE_ASYNC_GRAPHICS | IMAGE_COMMAND_QUEUE_ASYNC_TRANSFER;
+
+			if (!device->GetImageMemoryRequirements(image_info, &reqs[i]))
+			{
+				QM_LOG_ERROR("Failed to query memory requirements of aliased attachment %u.\n", i);
+				return false;
+			}
+
+			stats.unaliased_bytes += reqs[i].size;
+		}
+
+		// Largest attachments are placed first, so smaller ones fill the gaps between them
+		std::vector<uint32_t> order(count);
+		for (uint32_t i = 0; i < count; i++)
+			order[i] = i;
+		sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+			return reqs[a].size != reqs[b].size ? reqs[a].size > reqs[b].size : a < b;
+		});
+
+		struct BlockPlan
+		{
+			bool transient;
+			uint32_t type_bits;
+			VkDeviceSize size;
+			VkDeviceSize alignment;
+		};
+		std::vector<BlockPlan> block_plans;
+
+		attachments.resize(count);
+		for (uint32_t index : order)
+		{
+			auto& info = infos[index];
+			auto& req = reqs[index];
+
+			// Attachments share a block as long as one memory type suits all of them
+			uint32_t block = UINT32_MAX;
+			for (uint32_t b = 0; b < block_plans.size(); b++)
+			{
+				if (block_plans[b].transient == info.transient && (block_plans[b].type_bits & req.memoryTypeBits) != 0)
+				{
+					block = b;
+					break;
+				}
+			}
+
+			if (block == UINT32_MAX)
+			{
+				block = uint32_t(block_plans.size());
+				block_plans.push_back({ info.transient, req.memoryTypeBits, 0, 1 });
+			}
+
+			// Lowest offset which doesn't overlap an attachment used during the same passes
+			VkDeviceSize offset = 0;
+			bool moved = true;
+			while (moved)
+			{
+				moved = false;
+				for (uint32_t i = 0; i < count; i++)
+				{
+					auto& other = attachments[i];
+					if (other.size == 0 || other.block != block)
+						continue;
+					if (infos[i].last_pass < info.first_pass || infos[i].first_pass > info.last_pass)
+						continue;
+
+					if (offset < other.offset + other.size && other.offset < offset + req.size)
+					{
+						offset = ((other.offset + other.size + req.alignment - 1) / req.alignment) * req.alignment;
+						moved = true;
+					}
+				}
+			}
+
+			auto& attachment = attachments[index];
+			attachment.block = block;
+			attachment.offset = offset;
+			attachment.size = req.size;
+
+			auto& block_plan = block_plans[block];
+			block_plan.type_bits &= req.memoryTypeBits;
+			block_plan.size = std::max(block_plan.size, offset + req.size);
+			block_plan.alignment = std::max(block_plan.alignment, req.alignment);
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			for (uint32_t j = i + 1; j < count; j++)
+			{
+				auto& a = attachments[i];
+				auto& b = attachments[j];
+				if (a.block == b.block && a.offset < b.offset + b.size && b.offset < a.offset + a.size)
+				{
+					a.aliased = true;
+					b.aliased = true;
+				}
+			}
+		}
+
+		for (auto& block_plan : block_plans)
+		{
+			VkMemoryRequirements block_reqs = {};
+			block_reqs.size = block_plan.size;
+			block_reqs.alignment = block_plan.alignment;
+			block_reqs.memoryTypeBits = block_plan.type_bits;
+
+			Block block;
+			block.transient = block_plan.transient;
+			if (!device->AllocateAliasedMemory(block_reqs, block_plan.transient ? ImageDomain::Transient : ImageDomain::Physical, &block.memory))
+			{
+				QM_LOG_ERROR("Failed to allocate %llu bytes of aliased attachment memory.\n", static_cast<unsigned long long>(block_plan.size));
+				attachments.clear();
+				for (auto& allocated : blocks)
+					retired_blocks.push_back(allocated);
+				blocks.clear();
+				return false;
+			}
+
+			stats.aliased_bytes += block.memory.size;
+			blocks.push_back(block);
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			auto& attachment = attachments[i];
+			attachment.image = device->CreateAliasedImage(image_infos[i], blocks[attachment.block].memory, attachment.offset);
+			if (!attachment.image)
+			{
+				QM_LOG_ERROR("Failed to create aliased attachment %u.\n", i);
+				for (auto& created : attachments)
+					retired_attachments.push_back(std::move(created));
+				for (auto& allocated : blocks)
+					retired_blocks.push_back(allocated);
+				attachments.clear();
+				blocks.clear();
+				return false;
+			}
+
+			ImageViewCreateInfo view_info{};
+			view_info.image = attachment.image;
+			view_info.base_layer = 0;
+			view_info.base_level = 0;
+			view_info.levels = 1;
+			view_info.layers = infos[i].layers;
+			view_info.view_type = (infos[i].layers > 1) ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+
+			attachment.view = device->CreateImageView(view_info);
+			if (!attachment.view)
+			{
+				QM_LOG_ERROR("Failed to create view of aliased attachment %u.\n", i);
+				for (auto& created : attachments)
+					retired_attachments.push_back(std::move(created));
+				for (auto& allocated : blocks)
+					retired_blocks.push_back(allocated);
+				attachments.clear();
+				blocks.clear();
+				return false;
+			}
+
+			attachment.image->SetInternalSyncObject();
+			attachment.view->SetInternalSyncObject();
+		}
+
+		stats.num_attachments = count;
+		stats.num_blocks = uint32_t(blocks.size());
+		plan_hash = hash;
+		return true;
+	}
+
+	ImageView& AliasedAttachmentAllocator::GetAttachment(uint32_t index)
+	{
+		LOCK();
+		VK_ASSERT(index < attachments.size());
+		return *attachments[index].view;
+	}
+
+	bool AliasedAttachmentAllocator::IsAliased(uint32_t index) const
+	{
+		VK_ASSERT(index < attachments.size());
+		return attachments[index].aliased;
+	}
+
+	void AliasedAttachmentAllocator::AliasingBarrier(CommandBuffer& cmd, uint32_t index, VkImageLayout layout, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access)
+	{
+		const Image* image;
+		{
+			LOCK();
+			VK_ASSERT(index < attachments.size());
+			image = attachments[index].image.Get();
+		}
+
+		// Orders against all earlier writes to the memory, whichever attachment they went through
+		cmd.ImageBarrier(*image, VK_IMAGE_LAYOUT_UNDEFINED, layout, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+			dst_stages, dst_access);
+	}
+
+	AliasedAttachmentStats AliasedAttachmentAllocator::GetStats() const
+	{
+		return stats;
+	}
+
+	void AliasedAttachmentAllocator::ReleaseNolock(std::vector<Attachment>& released_attachments, std::vector<Block>& released_blocks)
+	{
+		// Images are queued for destruction before their memory, so they're destroyed first
+		released_attachments.clear();
+		for (auto& block : released_blocks)
+			device->FreeAliasedMemoryNolock(block.memory);
+		released_blocks.clear();
+	}
+
+	void AliasedAttachmentAllocator::BeginFrame()
+	{
+		LOCK();
+		ReleaseNolock(retired_attachments, retired_blocks);
+	}
+
+	void AliasedAttachmentAllocator::Clear()
+	{
+		LOCK();
+		ReleaseNolock(retired_attachments, retired_blocks);
+		ReleaseNolock(attachments, blocks);
+		plan_hash = 0;
+		stats = {};
+	}
 }
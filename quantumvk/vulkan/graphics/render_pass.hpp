@@ -301,5 +301,92 @@ namespace Vulkan
 		}
 	};
 
+
+	// Describes an attachment whose memory may be shared with attachments used in other passes of a frame
+	struct AliasedAttachmentInfo
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		VkFormat format = VK_FORMAT_UNDEFINED;
+		VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+		uint32_t layers = 1;
+		// Transient attachments are never stored, they get lazily allocated memory if available
+		bool transient = false;
+		// Usage in addition to the attachment, sampled and input attachment usage, ignored for transient attachments
+		VkImageUsageFlags usage = 0;
+		// First and last pass of the frame using the attachment, inclusive
+		uint32_t first_pass = 0;
+		uint32_t last_pass = 0;
+	};
+
+	struct AliasedAttachmentStats
+	{
+		// Size of the shared memory blocks
+		VkDeviceSize aliased_bytes = 0;
+		// Memory the attachments would need with an allocation each
+		VkDeviceSize unaliased_bytes = 0;
+		uint32_t num_attachments = 0;
+		uint32_t num_blocks = 0;
+	};
+
+	class CommandBuffer;
+
+	// Places attachments whose pass ranges don't overlap in the same memory. The placement is kept until the attachments change.
+	// Passes are assumed to be recorded in order on a single queue.
+	class AliasedAttachmentAllocator
+	{
+	public:
+		explicit AliasedAttachmentAllocator(Device* device_)
+			: device(device_)
+		{
+		}
+
+		// Places the attachments of a frame, reusing the previous placement if the infos are unchanged. Returns false if allocation failed.
+		bool Plan(const AliasedAttachmentInfo* infos, uint32_t count);
+		// Returns the view of an attachment of the last plan
+		ImageView& GetAttachment(uint32_t index);
+		// Must be recorded before the first use of an attachment in a frame, as its memory may have been written through another attachment.
+		// Contents are discarded and the image is transitioned from UNDEFINED to layout.
+		void AliasingBarrier(CommandBuffer& cmd, uint32_t index, VkImageLayout layout, VkPipelineStageFlags dst_stages, VkAccessFlags dst_access);
+		// Returns true if the attachment shares memory with another attachment
+		bool IsAliased(uint32_t index) const;
+
+		AliasedAttachmentStats GetStats() const;
+
+		void BeginFrame();
+		void Clear();
+
+	private:
+		struct Attachment
+		{
+			ImageHandle image;
+			ImageViewHandle view;
+			uint32_t block = 0;
+			VkDeviceSize offset = 0;
+			VkDeviceSize size = 0;
+			bool aliased = false;
+		};
+
+		struct Block
+		{
+			DeviceAllocation memory;
+			bool transient = false;
+		};
+
+		void ReleaseNolock(std::vector<Attachment>& attachments, std::vector<Block>& blocks);
+
+		Device* device;
+		std::vector<Attachment> attachments;
+		std::vector<Block> blocks;
+		// Placements replaced by Plan(), released by BeginFrame() when the device lock is held
+		std::vector<Attachment> retired_attachments;
+		std::vector<Block> retired_blocks;
+		Util::Hash plan_hash = 0;
+		AliasedAttachmentStats stats;
+#ifdef QM_VULKAN_MT
+		std::mutex lock;
+#endif
+	};
+
 }
 
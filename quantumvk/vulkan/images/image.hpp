@@ -197,7 +197,9 @@ namespace Vulkan
 		IMAGE_MISC_2D_ARRAY_COMPATIBLE_BIT = 1 << 2,
 		// This flags make the CreateImage call check that linear filtering is supported. If not, a null image is returned.
 		IMAGE_MISC_VERIFY_FORMAT_FEATURE_SAMPLED_LINEAR_FILTER_BIT = 1 << 7,
-		IMAGE_MISC_LINEAR_IMAGE_IGNORE_DEVICE_LOCAL_BIT = 1 << 8
+		IMAGE_MISC_LINEAR_IMAGE_IGNORE_DEVICE_LOCAL_BIT = 1 << 8,
+		// Creates a partially resident sparse image without memory. Tiles are committed by a ResidencyManager. Physical domain only, no initial data.
+		IMAGE_MISC_SPARSE_RESIDENCY_BIT = 1 << 9
 	};
 	using ImageMiscFlags = uint32_t;
 
@@ -21,6 +21,12 @@ namespace Vulkan
 			device->DestroyBuffer(buffer, alloc);
 	}
 
+	void Buffer::Relocate(VkBuffer new_buffer)
+	{
+		buffer = new_buffer;
+		RefreshCookie(device);
+	}
+
 	void BufferDeleter::operator()(Buffer* buffer)
 	{
 		buffer->device->handle_pool.buffers.free(buffer);
@@ -62,7 +62,14 @@ namespace Vulkan
 	//Flags for BufferCreateInfo
 	enum BufferMiscFlagBits
 	{
-		BUFFER_MISC_ZERO_INITIALIZE_BIT = 1 << 0
+		BUFFER_MISC_ZERO_INITIALIZE_BIT = 1 << 0,
+		// The buffer may be moved by the incremental defragmenter (see Device::SetDefragmentation).
+		// Only honored for device local buffers shared concurrently with the async transfer queue and without texel usage.
+		BUFFER_MISC_DEFRAGMENTABLE_BIT = 1 << 1,
+		// Large initial data is imported as host memory and copied from directly instead of through a staging buffer, if it is
+		// suitably aligned (see Device::GetHostImportAlignment). The data must then stay valid until the upload timeline
+		// value read with Device::GetUploadTimeline() right after creation is complete.
+		BUFFER_MISC_IMPORT_INITIAL_DATA_BIT = 1 << 2
 	};
 
 	using BufferMiscFlags = uint32_t;
@@ -94,6 +101,8 @@ namespace Vulkan
 		VkBufferUsageFlags usage = 0;
 		//Misc buffer flags
 		BufferMiscFlags misc = 0;
+		//What the buffer is used for, only affects memory accounting
+		MemoryCategory category = MemoryCategory::Buffer;
 
 		BufferSharingMode sharing_mode = BufferSharingMode::Concurrent;
 		BufferCommandQueueFlagBits exclusive_owner = BUFFER_COMMAND_QUEUE_GENERIC;
@@ -155,8 +164,12 @@ namespace Vulkan
 
 	private:
 		friend class Util::ObjectPool<Buffer>;
+		friend class Device;
 		Buffer(Device* device, VkBuffer buffer, const DeviceAllocation& alloc, const BufferCreateInfo& info);
 
+		//Points the buffer to the VkBuffer bound at its new place after defragmentation. A new cookie invalidates cached descriptor sets.
+		void Relocate(VkBuffer new_buffer);
+
 		Device* device;
 		VkBuffer buffer;
 		DeviceAllocation alloc;
@@ -0,0 +1,172 @@
+#include "buffer_arena.hpp"
+#include "quantumvk/vulkan/device.hpp"
+#include <algorithm>
+
+namespace Vulkan
+{
+	BufferArena::BufferArena(Device* device_, const BufferArenaCreateInfo& info_)
+		: device(device_)
+		, info(info_)
+	{
+		while ((info.min_allocation << max_order) < info.chunk_size)
+			max_order++;
+		info.chunk_size = info.min_allocation << max_order;
+	}
+
+	BufferArena::~BufferArena()
+	{
+		// SubBuffers keep their arena alive, so every range has been freed by now
+		for (auto& chunk : chunks)
+			VK_ASSERT(chunk->allocations == 0);
+
+		// The chunk buffers are internally synced, so they have to be released with the device lock held
+		if (internal_sync)
+			chunks.clear();
+		else
+			device->ReleaseBufferArenaChunks(chunks);
+	}
+
+	bool BufferArena::Allocate(VkDeviceSize size, BufferArenaChunk** chunk, VkDeviceSize* offset, uint32_t* order)
+	{
+		uint32_t alloc_order = 0;
+		while ((info.min_allocation << alloc_order) < size)
+			alloc_order++;
+
+		if (alloc_order > max_order)
+		{
+			QM_LOG_ERROR("SubBuffer of %llu bytes is larger than the arena's chunk size.\n", static_cast<unsigned long long>(size));
+			return false;
+		}
+
+		// Newer chunks are at the back, fill the older ones first so the newer ones can drain and be released
+		for (auto& candidate : chunks)
+		{
+			if (AllocateFromChunk(*candidate, alloc_order, offset))
+			{
+				*chunk = candidate.get();
+				*order = alloc_order;
+				return true;
+			}
+		}
+
+		BufferCreateInfo buffer_info;
+		buffer_info.domain = info.domain;
+		buffer_info.size = info.chunk_size;
+		buffer_info.usage = info.usage;
+		buffer_info.category = info.category;
+
+		std::unique_ptr<BufferArenaChunk> new_chunk(new BufferArenaChunk);
+		new_chunk->buffer = device->CreateBuffer(buffer_info);
+		if (!new_chunk->buffer)
+		{
+			QM_LOG_ERROR("Failed to create buffer arena chunk.\n");
+			return false;
+		}
+		new_chunk->buffer->SetInternalSyncObject();
+
+		// Every node starts out as one free block of its own order
+		new_chunk->longest.resize((size_t(2) << max_order) - 1);
+		for (uint32_t depth = 0; depth <= max_order; depth++)
+		{
+			size_t first = (size_t(1) << depth) - 1;
+			std::fill(new_chunk->longest.begin() + first, new_chunk->longest.begin() + 2 * first + 1, uint8_t(max_order - depth + 1));
+		}
+
+		bool allocated = AllocateFromChunk(*new_chunk, alloc_order, offset);
+		VK_ASSERT(allocated);
+		(void)allocated;
+
+		*chunk = new_chunk.get();
+		*order = alloc_order;
+		chunks.push_back(std::move(new_chunk));
+		return true;
+	}
+
+	bool BufferArena::AllocateFromChunk(BufferArenaChunk& chunk, uint32_t order, VkDeviceSize* offset)
+	{
+		auto& longest = chunk.longest;
+		if (longest[0] < order + 1)
+			return false;
+
+		// Walk down to a free block of exactly the requested order, preferring the left child
+		uint32_t node = 0;
+		for (uint32_t node_order = max_order; node_order != order; node_order--)
+		{
+			uint32_t left = 2 * node + 1;
+			node = longest[left] >= order + 1 ? left : left + 1;
+		}
+
+		longest[node] = 0;
+
+		uint32_t depth = max_order - order;
+		VkDeviceSize index = node - ((1u << depth) - 1);
+		*offset = index * (info.min_allocation << order);
+
+		UpdateParents(chunk, node, order);
+		chunk.allocations++;
+		allocated_size += info.min_allocation << order;
+		return true;
+	}
+
+	void BufferArena::UpdateParents(BufferArenaChunk& chunk, uint32_t node, uint32_t order)
+	{
+		auto& longest = chunk.longest;
+		while (node)
+		{
+			node = (node - 1) / 2;
+			order++;
+
+			// Two completely free buddies merge into a free block of the parent's order
+			uint8_t left = longest[2 * node + 1];
+			uint8_t right = longest[2 * node + 2];
+			longest[node] = (left == order && right == order) ? uint8_t(order + 1) : std::max(left, right);
+		}
+	}
+
+	void BufferArena::Free(BufferArenaChunk* chunk, VkDeviceSize offset, uint32_t order)
+	{
+		uint32_t depth = max_order - order;
+		uint32_t node = uint32_t((1u << depth) - 1 + offset / (info.min_allocation << order));
+		VK_ASSERT(chunk->longest[node] == 0);
+
+		chunk->longest[node] = uint8_t(order + 1);
+		UpdateParents(*chunk, node, order);
+		chunk->allocations--;
+		allocated_size -= info.min_allocation << order;
+
+		if (chunk->allocations == 0 && chunks.size() > 1)
+		{
+			auto itr = std::find_if(chunks.begin(), chunks.end(), [chunk](const std::unique_ptr<BufferArenaChunk>& c) { return c.get() == chunk; });
+			VK_ASSERT(itr != chunks.end());
+			chunks.erase(itr);
+		}
+	}
+
+	void BufferArenaDeleter::operator()(BufferArena* arena)
+	{
+		arena->device->handle_pool.buffer_arenas.free(arena);
+	}
+
+	SubBuffer::SubBuffer(Device* device_, BufferArena* arena_, BufferArenaChunk* chunk_, VkDeviceSize offset_, VkDeviceSize size_, uint32_t order_)
+		: device(device_)
+		, arena(arena_)
+		, chunk(chunk_)
+		, offset(offset_)
+		, size(size_)
+		, order(order_)
+	{
+	}
+
+	SubBuffer::~SubBuffer()
+	{
+		if (internal_sync)
+			device->FreeSubBufferNolock(arena, chunk, offset, order);
+		else
+			device->FreeSubBuffer(arena, chunk, offset, order);
+	}
+
+	void SubBufferDeleter::operator()(SubBuffer* buffer)
+	{
+		buffer->device->handle_pool.sub_buffers.free(buffer);
+	}
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "quantumvk/vulkan/vulkan_common.hpp"
+#include "quantumvk/vulkan/vulkan_headers.hpp"
+#include "quantumvk/vulkan/misc/cookie.hpp"
+#include "quantumvk/vulkan/memory/buffer.hpp"
+#include <memory>
+#include <vector>
+
+namespace Vulkan
+{
+	//Foward declare Device
+	class Device;
+	struct PerFrame;
+
+	//Info on how to create a buffer arena
+	struct BufferArenaCreateInfo
+	{
+		//Memory type of the arena's buffers
+		BufferDomain domain = BufferDomain::Device;
+		//Usage of the arena's buffers
+		VkBufferUsageFlags usage = 0;
+		//Size of each VkBuffer the arena suballocates from, rounded up to a power of two. Also the largest possible SubBuffer.
+		VkDeviceSize chunk_size = 4 * 1024 * 1024;
+		//Smallest range handed out, rounded up to a power of two and the device's offset alignments
+		VkDeviceSize min_allocation = 256;
+		//What the arena is used for, only affects memory accounting
+		MemoryCategory category = MemoryCategory::Buffer;
+	};
+
+	//A VkBuffer of an arena, suballocated with a buddy allocator
+	struct BufferArenaChunk
+	{
+		BufferHandle buffer;
+		//Implicit binary tree over the chunk. Each node holds the order + 1 of the largest free block below it, 0 if there is none.
+		std::vector<uint8_t> longest;
+		uint32_t allocations = 0;
+	};
+
+	//Forward declaration of buffer arena
+	class BufferArena;
+	//BufferArena deletion functor
+	struct BufferArenaDeleter
+	{
+		void operator()(BufferArena* arena);
+	};
+
+	class BufferArena : public Util::IntrusivePtrEnabled<BufferArena, BufferArenaDeleter, HandleCounter>, public InternalSyncEnabled
+	{
+	public:
+		friend struct BufferArenaDeleter;
+		//Releases the arena's buffers, which are destroyed once the current frame context is finished
+		~BufferArena();
+
+		//Return the arena's create info, with sizes rounded up
+		const BufferArenaCreateInfo& GetCreateInfo() const
+		{
+			return info;
+		}
+
+		//Return the bytes handed out to live and pending free SubBuffers, including rounding
+		VkDeviceSize GetAllocatedSize() const
+		{
+			return allocated_size;
+		}
+
+		//Return the number of VkBuffers the arena currently owns
+		uint32_t GetChunkCount() const
+		{
+			return uint32_t(chunks.size());
+		}
+
+	private:
+		friend class Util::ObjectPool<BufferArena>;
+		friend class Device;
+		friend struct PerFrame;
+		BufferArena(Device* device, const BufferArenaCreateInfo& info);
+
+		//Suballocates a range of at least size bytes, creating a new chunk if needed. Must be called with the device lock held.
+		bool Allocate(VkDeviceSize size, BufferArenaChunk** chunk, VkDeviceSize* offset, uint32_t* order);
+		//Returns a range to its chunk, empty chunks are released unless they are the last one. Must be called with the device lock held.
+		void Free(BufferArenaChunk* chunk, VkDeviceSize offset, uint32_t order);
+
+		bool AllocateFromChunk(BufferArenaChunk& chunk, uint32_t order, VkDeviceSize* offset);
+		void UpdateParents(BufferArenaChunk& chunk, uint32_t node, uint32_t order);
+
+		Device* device;
+		BufferArenaCreateInfo info;
+		uint32_t max_order = 0;
+		VkDeviceSize allocated_size = 0;
+		std::vector<std::unique_ptr<BufferArenaChunk>> chunks;
+	};
+	using BufferArenaHandle = Util::IntrusivePtr<BufferArena>;
+
+	//Forward declaration of sub buffer
+	class SubBuffer;
+	//SubBuffer deletion functor
+	struct SubBufferDeleter
+	{
+		void operator()(SubBuffer* buffer);
+	};
+
+	//A range of a BufferArena's buffer. Many SubBuffers share one VkBuffer and cookie, so bind them with their offset.
+	class SubBuffer : public Util::IntrusivePtrEnabled<SubBuffer, SubBufferDeleter, HandleCounter>, public InternalSyncEnabled
+	{
+	public:
+		friend struct SubBufferDeleter;
+		//Delays returning the range to the arena until current frame context is finished or device is destroyed
+		~SubBuffer();
+
+		//Return the buffer the range lives in
+		const Buffer& GetBuffer() const
+		{
+			return *chunk->buffer;
+		}
+
+		//Return the offset of the range in GetBuffer()
+		VkDeviceSize GetOffset() const
+		{
+			return offset;
+		}
+
+		//Return the requested size of the range
+		VkDeviceSize GetSize() const
+		{
+			return size;
+		}
+
+	private:
+		friend class Util::ObjectPool<SubBuffer>;
+		friend class Device;
+		SubBuffer(Device* device, BufferArena* arena, BufferArenaChunk* chunk, VkDeviceSize offset, VkDeviceSize size, uint32_t order);
+
+		Device* device;
+		BufferArenaHandle arena;
+		BufferArenaChunk* chunk;
+		VkDeviceSize offset;
+		VkDeviceSize size;
+		uint32_t order;
+	};
+	using SubBufferHandle = Util::IntrusivePtr<SubBuffer>;
+}
@@ -15,6 +15,15 @@ namespace Vulkan
 		alignment = alignment_;
 		usage = usage_;
 		need_device_local = need_device_local_;
+
+		if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)
+			category = MemoryCategory::VertexPool;
+		else if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+			category = MemoryCategory::IndexPool;
+		else if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+			category = MemoryCategory::UniformPool;
+		else
+			category = MemoryCategory::Staging;
 	}
 
 	void BufferPool::SetSpillRegionSize(VkDeviceSize spill_size_)
@@ -28,7 +37,54 @@ namespace Vulkan
 
 	void BufferPool::Reset()
 	{
-		blocks.clear();
+		for (auto& list : blocks)
+		{
+			for (auto& free_block : list)
+				ReleaseBlock(move(free_block.block));
+			list.clear();
+		}
+	}
+
+	void BufferPool::BeginFrame()
+	{
+		frame++;
+		if (!trim_frames || frame <= trim_frames)
+			return;
+
+		for (auto& list : blocks)
+		{
+			// The oldest blocks are at the front
+			auto itr = list.begin();
+			while (itr != list.end() && itr->last_used + trim_frames < frame)
+			{
+				ReleaseBlock(move(itr->block));
+				stats.trimmed_blocks++;
+				++itr;
+			}
+			list.erase(list.begin(), itr);
+		}
+	}
+
+	void BufferPool::SetTrimFrames(uint32_t frames)
+	{
+		trim_frames = frames;
+	}
+
+	unsigned BufferPool::GetSizeClass(VkDeviceSize size) const
+	{
+		unsigned size_class = 0;
+		while (size_class < VULKAN_BUFFER_POOL_SIZE_CLASSES && (block_size << size_class) < size)
+			size_class++;
+		return size_class;
+	}
+
+	void BufferPool::ReleaseBlock(BufferBlock&& block)
+	{
+		stats.free_blocks--;
+		stats.free_bytes -= block.size;
+		stats.live_blocks--;
+		stats.live_bytes -= block.size;
+		BufferBlock released = move(block);
 	}
 
 	BufferBlock BufferPool::AllocateBlock(VkDeviceSize size)
@@ -44,6 +100,7 @@ namespace Vulkan
 		info.domain = ideal_domain;
 		info.size = size;
 		info.usage = usage | extra_usage;
+		info.category = category;
 
 		block.gpu = device->CreateBuffer(info);
 		block.gpu->SetInternalSyncObject();
@@ -62,6 +119,7 @@ namespace Vulkan
 			cpu_info.domain = BufferDomain::Host;
 			cpu_info.size = size;
 			cpu_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+			cpu_info.category = category;
 
 			block.cpu = device->CreateBuffer(cpu_info);
 
@@ -75,19 +133,35 @@ namespace Vulkan
 		block.alignment = alignment;
 		block.size = size;
 		block.spill_size = spill_size;
+
+		stats.live_blocks++;
+		stats.live_bytes += size;
+		stats.peak_bytes = max(stats.peak_bytes, stats.live_bytes);
 		return block;
 	}
 
 	BufferBlock BufferPool::RequestBlock(VkDeviceSize minimum_size)
 	{
-		if ((minimum_size > block_size) || blocks.empty())
-		{ // If the request is too large or the pool empty, allocate a new block.
-			return AllocateBlock(max(block_size, minimum_size));
+		if (minimum_size > block_size)
+			stats.spill_allocations++;
+
+		unsigned size_class = GetSizeClass(minimum_size);
+		if (size_class == VULKAN_BUFFER_POOL_SIZE_CLASSES)
+		{ // Too large for any size class, allocate a one-off block.
+			return AllocateBlock(minimum_size);
+		}
+
+		auto& list = blocks[size_class];
+		if (list.empty())
+		{ // If the pool has no block of this class, allocate a new block.
+			return AllocateBlock(block_size << size_class);
 		}
 		else
-		{ // Else get the last block in the pool
-			auto back = move(blocks.back());
-			blocks.pop_back();
+		{ // Else get the most recently used block of the class
+			auto back = move(list.back().block);
+			list.pop_back();
+			stats.free_blocks--;
+			stats.free_bytes -= back.size;
 
 			back.mapped = static_cast<uint8_t*>(device->MapHostBuffer(*back.cpu, MEMORY_ACCESS_WRITE_BIT));
 			back.offset = 0;
@@ -97,13 +171,24 @@ namespace Vulkan
 
 	void BufferPool::RecycleBlock(BufferBlock&& block)
 	{
-		VK_ASSERT(block.size == block_size);
-		blocks.push_back(move(block));
+		stats.free_blocks++;
+		stats.free_bytes += block.size;
+
+		// One-off blocks are not kept
+		unsigned size_class = GetSizeClass(block.size);
+		if (size_class == VULKAN_BUFFER_POOL_SIZE_CLASSES || (block_size << size_class) != block.size)
+		{
+			ReleaseBlock(move(block));
+			return;
+		}
+
+		blocks[size_class].push_back({ move(block), frame });
 	}
 
 	BufferPool::~BufferPool()
 	{
-		VK_ASSERT(blocks.empty());
+		for (auto& list : blocks)
+			VK_ASSERT(list.empty());
 	}
 
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "quantumvk/vulkan/vulkan_headers.hpp"
 #include "quantumvk/utils/intrusive.hpp"
+#include "quantumvk/vulkan/memory/memory_allocator.hpp"
 #include <vector>
 #include <algorithm>
 
@@ -51,6 +52,27 @@ namespace Vulkan
 		}
 	};
 
+	//Blocks of block_size << n for n below this are kept for reuse, larger ones are freed as soon as they are recycled
+	static const unsigned VULKAN_BUFFER_POOL_SIZE_CLASSES = 4;
+	//Free blocks unused for this many frames are released by default
+	static const uint32_t VULKAN_BUFFER_POOL_TRIM_FRAMES = 120;
+
+	//Counters of a BufferPool
+	struct BufferPoolStats
+	{
+		//Blocks allocated by the pool which are still alive, both in use and free
+		uint32_t live_blocks = 0;
+		VkDeviceSize live_bytes = 0;
+		VkDeviceSize peak_bytes = 0;
+		//Blocks waiting for reuse in the free lists
+		uint32_t free_blocks = 0;
+		VkDeviceSize free_bytes = 0;
+		//Requests larger than the block size
+		uint64_t spill_allocations = 0;
+		//Free blocks released by the trim policy
+		uint64_t trimmed_blocks = 0;
+	};
+
 	//A Pool of BufferBlocks
 	class BufferPool
 	{
@@ -58,8 +80,19 @@ namespace Vulkan
 
 		~BufferPool();
 		void Init(Device* device, VkDeviceSize block_size, VkDeviceSize alignment, VkBufferUsageFlags usage, bool need_device_local);
+		//Frees every free block
 		void Reset();
 
+		//Advances the frame counter and frees blocks which have not been reused for the trim frame count
+		void BeginFrame();
+		//Sets how many frames a free block is kept, 0 never trims
+		void SetTrimFrames(uint32_t frames);
+
+		const BufferPoolStats& GetStats() const
+		{
+			return stats;
+		}
+
 		// Used for allocating UBOs, where we want to specify a fixed size for range,
 		// and we need to make sure we don't allocate beyond the block.
 		void SetSpillRegionSize(VkDeviceSize spill_size);
@@ -71,7 +104,7 @@ namespace Vulkan
 
 		//Request a new block of a certain size frome the pool
 		BufferBlock RequestBlock(VkDeviceSize minimum_size);
-		//Recycle an old unused block. Release block back to pool
+		//Recycle an old unused block. Release block back to pool, every block the pool handed out must come back through here.
 		void RecycleBlock(BufferBlock&& block);
 
 	private:
@@ -80,8 +113,24 @@ namespace Vulkan
 		VkDeviceSize alignment = 0;
 		VkDeviceSize spill_size = 0;
 		VkBufferUsageFlags usage = 0;
-		std::vector<BufferBlock> blocks;
+
+		struct FreeBlock
+		{
+			BufferBlock block;
+			uint64_t last_used;
+		};
+
+		//One free list per size class, most recently recycled blocks at the back
+		std::vector<FreeBlock> blocks[VULKAN_BUFFER_POOL_SIZE_CLASSES];
+		uint64_t frame = 0;
+		uint32_t trim_frames = VULKAN_BUFFER_POOL_TRIM_FRAMES;
+		BufferPoolStats stats;
+
+		//Returns the size class fitting size, or VULKAN_BUFFER_POOL_SIZE_CLASSES if it is too large for all of them
+		unsigned GetSizeClass(VkDeviceSize size) const;
 		BufferBlock AllocateBlock(VkDeviceSize size);
+		void ReleaseBlock(BufferBlock&& block);
 		bool need_device_local = false;
+		MemoryCategory category = MemoryCategory::Buffer;
 	};
 }
\ No newline at end of file
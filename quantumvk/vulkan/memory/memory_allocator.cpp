@@ -1,14 +1,14 @@
 #include "memory_allocator.hpp"
 #include "quantumvk/vulkan/device.hpp"
 
+#ifdef QM_VULKAN_MT
+#include "quantumvk/threading/thread_id.hpp"
+#endif
+
 namespace Vulkan
 {
 	void DeviceAllocator::Init(Device* device)
 	{
-#ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
-#endif
-
 		mem_props = device->GetMemoryProperties();
 
 		const VolkDeviceTable& table = device->GetDeviceTable();
@@ -39,6 +39,8 @@ namespace Vulkan
 
 		VmaAllocatorCreateInfo create_info{};
 		create_info.flags = 0;
+		if (device->GetDeviceExtensions().supports_memory_budget)
+			create_info.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 		create_info.frameInUseCount = 0;
 		create_info.pAllocationCallbacks = nullptr;
 		create_info.pDeviceMemoryCallbacks = nullptr;
@@ -53,78 +55,291 @@ namespace Vulkan
 		create_info.device = device->GetDevice();
 
 		vmaCreateAllocator(&create_info, &allocator);
+
+		QueryHeapBudgets(heap_budgets);
+
+		vk_device = device->GetDevice();
+		this->table = &table;
+
+#ifdef QM_VULKAN_MT
+		query_dedicated = device->GetDeviceExtensions().supports_dedicated && device->GetDeviceExtensions().supports_get_memory_requirements2;
+
+		if (device->GetNumThreadIndices() > 1)
+			thread_pools.resize(device->GetNumThreadIndices());
+#endif
 	}
 
 	DeviceAllocator::~DeviceAllocator()
 	{
+		if (sparse_pool.allocation != VK_NULL_HANDLE)
+			vmaFreeMemory(allocator, sparse_pool.allocation);
+
 #ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
+		for (auto& thread : thread_pools)
+			for (VmaPool pool : thread.pools)
+				if (pool != VK_NULL_HANDLE)
+					vmaDestroyPool(allocator, pool);
 #endif
 
 		vmaDestroyAllocator(allocator);
 	}
 
-	bool DeviceAllocator::AllocateBuffer(const VkBufferCreateInfo& buffer_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkBuffer* buffer, DeviceAllocation* allocation)
+	bool DeviceAllocator::AllocateBuffer(const VkBufferCreateInfo& buffer_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, MemoryCategory category, VkBuffer* buffer, DeviceAllocation* allocation)
 	{
+		VmaAllocationInfo alloc_info{};
+		bool allocated;
+
 #ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
+		// Large or dedicated buffers skip the thread pools, so let VMA handle them in one go
+		if (!thread_pools.empty() && buffer_create_info.size <= VULKAN_THREAD_POOL_MAX_ALLOCATION && (mem_alloc_create_info.flags & VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT) == 0)
+			allocated = AllocateBufferFromThreadPool(buffer_create_info, mem_alloc_create_info, buffer, &allocation->vma_allocation, &alloc_info);
+		else
 #endif
+			allocated = vmaCreateBuffer(allocator, &buffer_create_info, &mem_alloc_create_info, buffer, &allocation->vma_allocation, &alloc_info) == VK_SUCCESS;
 
-		VmaAllocationInfo alloc_info{};
-
-		if (vmaCreateBuffer(allocator, &buffer_create_info, &mem_alloc_create_info, buffer, &allocation->vma_allocation, &alloc_info) == VK_SUCCESS)
+		if (allocated)
 		{
 
 			allocation->size = buffer_create_info.size;
 			allocation->mem_type = alloc_info.memoryType;
 			allocation->host_base = (uint8_t*)alloc_info.pMappedData;
 			allocation->persistantly_mapped = (mem_alloc_create_info.flags & VMA_ALLOCATION_CREATE_MAPPED_BIT);
+			allocation->category = category;
+			category_bytes[unsigned(category)] += allocation->size;
 			return true;
 		}
 		return false;
 	}
 
-	bool DeviceAllocator::AllocateImage(const VkImageCreateInfo& image_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkImage* image, DeviceAllocation* allocation)
+	bool DeviceAllocator::AllocateImage(const VkImageCreateInfo& image_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, MemoryCategory category, VkImage* image, DeviceAllocation* allocation)
 	{
+		VmaAllocationInfo alloc_info{};
+		bool allocated;
+
 #ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
+		// The image size is only known once the image exists, GetThreadPool() falls back to the default pools for large images
+		if (!thread_pools.empty() && (mem_alloc_create_info.flags & VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT) == 0)
+			allocated = AllocateImageFromThreadPool(image_create_info, mem_alloc_create_info, image, &allocation->vma_allocation, &alloc_info);
+		else
 #endif
+			allocated = vmaCreateImage(allocator, &image_create_info, &mem_alloc_create_info, image, &allocation->vma_allocation, &alloc_info) == VK_SUCCESS;
 
-		VmaAllocationInfo alloc_info{};
-
-		if (vmaCreateImage(allocator, &image_create_info, &mem_alloc_create_info, image, &allocation->vma_allocation, &alloc_info) == VK_SUCCESS)
+		if (allocated)
 		{
 			allocation->size = alloc_info.size;
 			allocation->mem_type = alloc_info.memoryType;
 			allocation->host_base = (uint8_t*)alloc_info.pMappedData;
 			allocation->persistantly_mapped = (mem_alloc_create_info.flags & VMA_ALLOCATION_CREATE_MAPPED_BIT);
+			allocation->category = category;
+			category_bytes[unsigned(category)] += allocation->size;
 			return true;
 		}
 		return false;
 	}
 
-	void DeviceAllocator::FreeBuffer(VkBuffer buffer, const DeviceAllocation& allocation)
+	bool DeviceAllocator::ImportHostBuffer(const VkBufferCreateInfo& buffer_create_info, void* host_pointer, MemoryCategory category, VkBuffer* buffer, DeviceAllocation* allocation)
 	{
-#ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
-#endif
+		VkMemoryHostPointerPropertiesEXT host_props = { VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT };
+		if (table->vkGetMemoryHostPointerPropertiesEXT(vk_device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, host_pointer, &host_props) != VK_SUCCESS)
+			return false;
+
+		VkExternalMemoryBufferCreateInfo external_info = { VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO };
+		external_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+		VkBufferCreateInfo info = buffer_create_info;
+		info.pNext = &external_info;
+
+		if (table->vkCreateBuffer(vk_device, &info, nullptr, buffer) != VK_SUCCESS)
+			return false;
+
+		VkMemoryRequirements reqs;
+		table->vkGetBufferMemoryRequirements(vk_device, *buffer, &reqs);
 
-		vmaDestroyBuffer(allocator, buffer, allocation.vma_allocation);
+		// Only coherent types are used, so imported memory never needs flushing or invalidation
+		uint32_t type_bits = reqs.memoryTypeBits & host_props.memoryTypeBits;
+		uint32_t mem_type = UINT32_MAX;
+		for (uint32_t i = 0; i < mem_props.memoryTypeCount; i++)
+		{
+			if ((type_bits & (1u << i)) && (mem_props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+			{
+				mem_type = i;
+				break;
+			}
+		}
+
+		if (mem_type == UINT32_MAX || reqs.size > buffer_create_info.size)
+		{
+			table->vkDestroyBuffer(vk_device, *buffer, nullptr);
+			return false;
+		}
+
+		VkImportMemoryHostPointerInfoEXT import_info = { VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT };
+		import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+		import_info.pHostPointer = host_pointer;
+
+		VkMemoryAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+		alloc_info.pNext = &import_info;
+		alloc_info.allocationSize = buffer_create_info.size;
+		alloc_info.memoryTypeIndex = mem_type;
+
+		VkDeviceMemory memory;
+		if (table->vkAllocateMemory(vk_device, &alloc_info, nullptr, &memory) != VK_SUCCESS)
+		{
+			table->vkDestroyBuffer(vk_device, *buffer, nullptr);
+			return false;
+		}
+
+		if (table->vkBindBufferMemory(vk_device, *buffer, memory, 0) != VK_SUCCESS)
+		{
+			table->vkDestroyBuffer(vk_device, *buffer, nullptr);
+			table->vkFreeMemory(vk_device, memory, nullptr);
+			return false;
+		}
+
+		allocation->vma_allocation = VK_NULL_HANDLE;
+		allocation->imported_memory = memory;
+		allocation->size = buffer_create_info.size;
+		allocation->mem_type = mem_type;
+		allocation->host_base = static_cast<uint8_t*>(host_pointer);
+		allocation->persistantly_mapped = true;
+		allocation->category = category;
+		category_bytes[unsigned(category)] += allocation->size;
+		return true;
 	}
 
-	void DeviceAllocator::FreeImage(VkImage image, const DeviceAllocation& allocation)
+	bool DeviceAllocator::AllocateMemory(const VkMemoryRequirements& reqs, const VmaAllocationCreateInfo& mem_alloc_create_info, MemoryCategory category, DeviceAllocation* allocation)
 	{
-#ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
-#endif
+		VmaAllocationInfo alloc_info{};
+		if (vmaAllocateMemory(allocator, &reqs, &mem_alloc_create_info, &allocation->vma_allocation, &alloc_info) != VK_SUCCESS)
+			return false;
+
+		allocation->size = alloc_info.size;
+		allocation->mem_type = alloc_info.memoryType;
+		allocation->host_base = (uint8_t*)alloc_info.pMappedData;
+		allocation->persistantly_mapped = (mem_alloc_create_info.flags & VMA_ALLOCATION_CREATE_MAPPED_BIT);
+		allocation->category = category;
+		category_bytes[unsigned(category)] += allocation->size;
+		return true;
+	}
+
+	bool DeviceAllocator::CreateAliasedImage(const VkImageCreateInfo& image_create_info, const DeviceAllocation& memory, VkDeviceSize offset, MemoryCategory category, VkImage* image, DeviceAllocation* allocation)
+	{
+		if (table->vkCreateImage(vk_device, &image_create_info, nullptr, image) != VK_SUCCESS)
+			return false;
+
+		if (vmaBindImageMemory2(allocator, memory.vma_allocation, offset, *image, nullptr) != VK_SUCCESS)
+		{
+			table->vkDestroyImage(vk_device, *image, nullptr);
+			return false;
+		}
+
+		// The memory is accounted for by the aliased allocation, FreeImage() only destroys the image
+		allocation->vma_allocation = VK_NULL_HANDLE;
+		allocation->size = 0;
+		allocation->mem_type = memory.mem_type;
+		allocation->host_base = nullptr;
+		allocation->persistantly_mapped = false;
+		allocation->category = category;
+		return true;
+	}
+
+	bool DeviceAllocator::CreateSparseImage(const VkImageCreateInfo& image_create_info, MemoryCategory category, VkImage* image, DeviceAllocation* allocation)
+	{
+		VK_ASSERT(image_create_info.flags & VK_IMAGE_CREATE_SPARSE_BINDING_BIT);
+		if (table->vkCreateImage(vk_device, &image_create_info, nullptr, image) != VK_SUCCESS)
+			return false;
+
+		allocation->vma_allocation = VK_NULL_HANDLE;
+		allocation->size = 0;
+		allocation->mem_type = sparse_pool.mem_type;
+		allocation->host_base = nullptr;
+		allocation->persistantly_mapped = false;
+		allocation->category = category;
+		return true;
+	}
+
+	bool DeviceAllocator::InitSparsePagePool(const VkMemoryRequirements& page_reqs, uint32_t page_count)
+	{
+		VK_ASSERT(sparse_pool.allocation == VK_NULL_HANDLE);
+		VK_ASSERT(page_count > 0);
+
+		VkMemoryRequirements reqs = {};
+		reqs.size = page_reqs.alignment * page_count;
+		reqs.alignment = page_reqs.alignment;
+		reqs.memoryTypeBits = page_reqs.memoryTypeBits;
+
+		VmaAllocationCreateInfo create_info = {};
+		create_info.flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT;
+		create_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+		create_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+		VmaAllocationInfo alloc_info = {};
+		if (vmaAllocateMemory(allocator, &reqs, &create_info, &sparse_pool.allocation, &alloc_info) != VK_SUCCESS)
+		{
+			sparse_pool.allocation = VK_NULL_HANDLE;
+			return false;
+		}
 
+		sparse_pool.memory = alloc_info.deviceMemory;
+		sparse_pool.base_offset = alloc_info.offset;
+		sparse_pool.page_size = page_reqs.alignment;
+		sparse_pool.mem_type = alloc_info.memoryType;
+		sparse_pool.page_count = page_count;
+
+		// Popped from the back, so low pages are handed out first
+		sparse_pool.free_pages.resize(page_count);
+		for (uint32_t i = 0; i < page_count; i++)
+			sparse_pool.free_pages[i] = page_count - i - 1;
+
+		category_bytes[unsigned(MemoryCategory::SparsePages)] += reqs.size;
+		return true;
+	}
+
+	bool DeviceAllocator::AllocateSparsePage(uint32_t memory_type_bits, SparsePage* page)
+	{
+		if (sparse_pool.free_pages.empty() || (memory_type_bits & (1u << sparse_pool.mem_type)) == 0)
+			return false;
+
+		page->index = sparse_pool.free_pages.back();
+		page->memory = sparse_pool.memory;
+		page->offset = sparse_pool.base_offset + page->index * sparse_pool.page_size;
+		sparse_pool.free_pages.pop_back();
+		return true;
+	}
+
+	void DeviceAllocator::FreeSparsePage(const SparsePage& page)
+	{
+		VK_ASSERT(page.index < sparse_pool.page_count);
+		sparse_pool.free_pages.push_back(page.index);
+	}
+
+	void DeviceAllocator::FreeMemory(const DeviceAllocation& allocation)
+	{
+		vmaFreeMemory(allocator, allocation.vma_allocation);
+		category_bytes[unsigned(allocation.category)] -= allocation.size;
+	}
+
+	void DeviceAllocator::FreeBuffer(VkBuffer buffer, const DeviceAllocation& allocation)
+	{
+		if (allocation.imported_memory != VK_NULL_HANDLE)
+		{
+			table->vkDestroyBuffer(vk_device, buffer, nullptr);
+			table->vkFreeMemory(vk_device, allocation.imported_memory, nullptr);
+		}
+		else
+			vmaDestroyBuffer(allocator, buffer, allocation.vma_allocation);
+		category_bytes[unsigned(allocation.category)] -= allocation.size;
+	}
+
+	void DeviceAllocator::FreeImage(VkImage image, const DeviceAllocation& allocation)
+	{
 		vmaDestroyImage(allocator, image, allocation.vma_allocation);
+		category_bytes[unsigned(allocation.category)] -= allocation.size;
 	}
 
 	void* DeviceAllocator::MapMemory(const DeviceAllocation& alloc, MemoryAccessFlags flags)
 	{
 #ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
+		std::lock_guard lock(map_mutex);
 #endif
 
 		if (!HasMemoryPropertyFlags(alloc, mem_props, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
@@ -155,7 +370,7 @@ namespace Vulkan
 	void DeviceAllocator::UnmapMemory(const DeviceAllocation& alloc, MemoryAccessFlags flags)
 	{
 #ifdef QM_VULKAN_MT
-		std::lock_guard lock(m_mutex);
+		std::lock_guard lock(map_mutex);
 #endif
 
 		if (!HasMemoryPropertyFlags(alloc, mem_props, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
@@ -164,6 +379,10 @@ namespace Vulkan
 			return;
 		}
 
+		//Imported memory stays mapped at the host pointer
+		if (alloc.imported_memory != VK_NULL_HANDLE)
+			return;
+
 		if (!alloc.persistantly_mapped)
 		{
 			vmaUnmapMemory(allocator, alloc.vma_allocation);
@@ -180,4 +399,218 @@ namespace Vulkan
 			vmaFlushAllocation(allocator, alloc.vma_allocation, 0, VK_WHOLE_SIZE);
 		}
 	}
+
+	void DeviceAllocator::FlushMemory(const DeviceAllocation& alloc, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (!HasMemoryPropertyFlags(alloc, mem_props, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+			vmaFlushAllocation(allocator, alloc.vma_allocation, offset, size);
+	}
+
+	void DeviceAllocator::InvalidateMemory(const DeviceAllocation& alloc, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (!HasMemoryPropertyFlags(alloc, mem_props, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+			vmaInvalidateAllocation(allocator, alloc.vma_allocation, offset, size);
+	}
+
+	void DeviceAllocator::BeginFrame()
+	{
+		vmaSetCurrentFrameIndex(allocator, ++frame_index);
+		QueryHeapBudgets(heap_budgets);
+	}
+
+	void DeviceAllocator::QueryHeapBudgets(MemoryHeapBudget* budgets)
+	{
+		VmaBudget vma_budgets[VK_MAX_MEMORY_HEAPS];
+		vmaGetBudget(allocator, vma_budgets);
+
+		for (uint32_t i = 0; i < mem_props.memoryHeapCount; i++)
+		{
+			budgets[i].block_bytes = vma_budgets[i].blockBytes;
+			budgets[i].allocation_bytes = vma_budgets[i].allocationBytes;
+			budgets[i].usage = vma_budgets[i].usage;
+			budgets[i].budget = vma_budgets[i].budget;
+		}
+	}
+
+	VmaDefragmentationContext DeviceAllocator::BeginDefragmentation(const VmaAllocation* allocations, uint32_t count, VkDeviceSize max_bytes)
+	{
+		VmaDefragmentationInfo2 info{};
+		info.flags = VMA_DEFRAGMENTATION_FLAG_INCREMENTAL;
+		info.allocationCount = count;
+		info.pAllocations = allocations;
+		// Moves are always copied on the gpu by the caller, never with memmove
+		info.maxCpuBytesToMove = 0;
+		info.maxCpuAllocationsToMove = 0;
+		info.maxGpuBytesToMove = max_bytes;
+		info.maxGpuAllocationsToMove = UINT32_MAX;
+
+		VmaDefragmentationContext context = VK_NULL_HANDLE;
+		if (vmaDefragmentationBegin(allocator, &info, nullptr, &context) < VK_SUCCESS)
+		{
+			QM_LOG_ERROR("Failed to begin defragmentation.\n");
+			return VK_NULL_HANDLE;
+		}
+		return context;
+	}
+
+	uint32_t DeviceAllocator::BeginDefragmentationPass(VmaDefragmentationContext context, VmaDefragmentationPassMoveInfo* moves, uint32_t max_moves)
+	{
+		VmaDefragmentationPassInfo pass{};
+		pass.moveCount = max_moves;
+		pass.pMoves = moves;
+		vmaBeginDefragmentationPass(allocator, context, &pass);
+		return pass.moveCount;
+	}
+
+	bool DeviceAllocator::EndDefragmentationPass(VmaDefragmentationContext context)
+	{
+		return vmaEndDefragmentationPass(allocator, context) == VK_SUCCESS;
+	}
+
+	void DeviceAllocator::EndDefragmentation(VmaDefragmentationContext context)
+	{
+		vmaDefragmentationEnd(allocator, context);
+	}
+
+	void DeviceAllocator::GetAllocationInfo(VmaAllocation allocation, VmaAllocationInfo* info)
+	{
+		vmaGetAllocationInfo(allocator, allocation, info);
+	}
+
+#ifdef QM_VULKAN_MT
+	VmaPool DeviceAllocator::GetThreadPool(const VkMemoryRequirements& reqs, bool wants_dedicated, const VmaAllocationCreateInfo& info)
+	{
+		if (wants_dedicated || reqs.size > VULKAN_THREAD_POOL_MAX_ALLOCATION || info.usage == VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED)
+			return VK_NULL_HANDLE;
+
+		// Unregistered threads would all share index 0 with the main thread, so they use the default pools
+		if (!IsThreadIndexRegistered())
+			return VK_NULL_HANDLE;
+
+		unsigned thread_index = GetCurrentThreadIndex();
+		if (thread_index >= thread_pools.size())
+			return VK_NULL_HANDLE;
+
+		uint32_t memory_type;
+		if (vmaFindMemoryTypeIndex(allocator, reqs.memoryTypeBits, &info, &memory_type) != VK_SUCCESS)
+			return VK_NULL_HANDLE;
+
+		VmaPool& pool = thread_pools[thread_index].pools[memory_type];
+		if (pool == VK_NULL_HANDLE)
+		{
+			VmaPoolCreateInfo pool_info{};
+			pool_info.memoryTypeIndex = memory_type;
+			pool_info.blockSize = VULKAN_THREAD_POOL_BLOCK_SIZE;
+
+			if (vmaCreatePool(allocator, &pool_info, &pool) != VK_SUCCESS)
+			{
+				QM_LOG_WARN("Failed to create thread pool for memory type %u.\n", memory_type);
+				pool = VK_NULL_HANDLE;
+			}
+		}
+
+		return pool;
+	}
+
+	bool DeviceAllocator::AllocateBufferFromThreadPool(const VkBufferCreateInfo& buffer_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkBuffer* buffer, VmaAllocation* vma_allocation, VmaAllocationInfo* alloc_info)
+	{
+		if (table->vkCreateBuffer(vk_device, &buffer_create_info, nullptr, buffer) != VK_SUCCESS)
+			return false;
+
+		VkMemoryRequirements reqs;
+		bool wants_dedicated = false;
+
+		if (query_dedicated)
+		{
+			VkBufferMemoryRequirementsInfo2KHR info = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2_KHR };
+			info.buffer = *buffer;
+			VkMemoryDedicatedRequirementsKHR dedicated = { VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR };
+			VkMemoryRequirements2KHR reqs2 = { VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2_KHR };
+			reqs2.pNext = &dedicated;
+
+			table->vkGetBufferMemoryRequirements2KHR(vk_device, &info, &reqs2);
+			reqs = reqs2.memoryRequirements;
+			wants_dedicated = dedicated.requiresDedicatedAllocation || dedicated.prefersDedicatedAllocation;
+		}
+		else
+			table->vkGetBufferMemoryRequirements(vk_device, *buffer, &reqs);
+
+		VmaAllocationCreateInfo create_info = mem_alloc_create_info;
+		create_info.pool = GetThreadPool(reqs, wants_dedicated, mem_alloc_create_info);
+
+		VkResult result = vmaAllocateMemoryForBuffer(allocator, *buffer, &create_info, vma_allocation, alloc_info);
+		if (result != VK_SUCCESS && create_info.pool != VK_NULL_HANDLE)
+		{
+			// The pool's memory type might be exhausted while another type allowed by the default pools isn't
+			create_info.pool = VK_NULL_HANDLE;
+			result = vmaAllocateMemoryForBuffer(allocator, *buffer, &create_info, vma_allocation, alloc_info);
+		}
+
+		if (result == VK_SUCCESS)
+		{
+			result = vmaBindBufferMemory(allocator, *vma_allocation, *buffer);
+			if (result == VK_SUCCESS)
+			{
+				vmaGetAllocationInfo(allocator, *vma_allocation, alloc_info);
+				return true;
+			}
+			vmaFreeMemory(allocator, *vma_allocation);
+		}
+
+		table->vkDestroyBuffer(vk_device, *buffer, nullptr);
+		*buffer = VK_NULL_HANDLE;
+		*vma_allocation = VK_NULL_HANDLE;
+		return false;
+	}
+
+	bool DeviceAllocator::AllocateImageFromThreadPool(const VkImageCreateInfo& image_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkImage* image, VmaAllocation* vma_allocation, VmaAllocationInfo* alloc_info)
+	{
+		if (table->vkCreateImage(vk_device, &image_create_info, nullptr, image) != VK_SUCCESS)
+			return false;
+
+		VkMemoryRequirements reqs;
+		bool wants_dedicated = false;
+
+		if (query_dedicated)
+		{
+			VkImageMemoryRequirementsInfo2KHR info = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2_KHR };
+			info.image = *image;
+			VkMemoryDedicatedRequirementsKHR dedicated = { VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR };
+			VkMemoryRequirements2KHR reqs2 = { VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2_KHR };
+			reqs2.pNext = &dedicated;
+
+			table->vkGetImageMemoryRequirements2KHR(vk_device, &info, &reqs2);
+			reqs = reqs2.memoryRequirements;
+			wants_dedicated = dedicated.requiresDedicatedAllocation || dedicated.prefersDedicatedAllocation;
+		}
+		else
+			table->vkGetImageMemoryRequirements(vk_device, *image, &reqs);
+
+		VmaAllocationCreateInfo create_info = mem_alloc_create_info;
+		create_info.pool = GetThreadPool(reqs, wants_dedicated, mem_alloc_create_info);
+
+		VkResult result = vmaAllocateMemoryForImage(allocator, *image, &create_info, vma_allocation, alloc_info);
+		if (result != VK_SUCCESS && create_info.pool != VK_NULL_HANDLE)
+		{
+			create_info.pool = VK_NULL_HANDLE;
+			result = vmaAllocateMemoryForImage(allocator, *image, &create_info, vma_allocation, alloc_info);
+		}
+
+		if (result == VK_SUCCESS)
+		{
+			result = vmaBindImageMemory(allocator, *vma_allocation, *image);
+			if (result == VK_SUCCESS)
+			{
+				vmaGetAllocationInfo(allocator, *vma_allocation, alloc_info);
+				return true;
+			}
+			vmaFreeMemory(allocator, *vma_allocation);
+		}
+
+		table->vkDestroyImage(vk_device, *image, nullptr);
+		*image = VK_NULL_HANDLE;
+		*vma_allocation = VK_NULL_HANDLE;
+		return false;
+	}
+#endif
 }
\ No newline at end of file
@@ -14,6 +14,7 @@
 #include <quantumvk/extern_build/vma_include.hpp>
 
 #ifdef QM_VULKAN_MT
+#include <atomic>
 #include <mutex>
 #endif
 
@@ -31,6 +32,47 @@ namespace Vulkan
 
 	using MemoryAccessFlags = uint32_t;
 
+	// What an allocation is used for. The allocator keeps a running byte count for each category.
+	enum class MemoryCategory : uint8_t
+	{
+		Buffer,
+		Image,
+		Staging,
+		VertexPool,
+		IndexPool,
+		UniformPool,
+		TransientAttachment,
+		SparsePages,
+		Count
+	};
+
+	// Usage and budget of a single memory heap
+	struct MemoryHeapBudget
+	{
+		// Size of all VkDeviceMemory blocks allocated from the heap
+		VkDeviceSize block_bytes = 0;
+		// Size of all allocations living in those blocks
+		VkDeviceSize allocation_bytes = 0;
+		// Estimated usage of the whole process. Equals block_bytes without VK_EXT_memory_budget.
+		VkDeviceSize usage = 0;
+		// Estimated amount of memory available to the process. Without VK_EXT_memory_budget VMA estimates it as 80% of the heap size.
+		VkDeviceSize budget = 0;
+	};
+
+	// Allocations up to VULKAN_THREAD_POOL_MAX_ALLOCATION are made from pools owned by the calling thread index,
+	// so threads allocating at the same time don't contend on the block lists of VMA's default pools.
+	static const VkDeviceSize VULKAN_THREAD_POOL_BLOCK_SIZE = 32 * 1024 * 1024;
+	static const VkDeviceSize VULKAN_THREAD_POOL_MAX_ALLOCATION = VULKAN_THREAD_POOL_BLOCK_SIZE / 4;
+
+	// Limits of the incremental defragmenter
+	struct DefragmentationInfo
+	{
+		// Allocations moved per frame context
+		uint32_t max_moves_per_frame = 16;
+		// Bytes moved by one defragmentation plan before a new plan is made
+		VkDeviceSize max_bytes_per_cycle = 64 * 1024 * 1024;
+	};
+
 	struct DeviceAllocation
 	{
 		VmaAllocation vma_allocation = VK_NULL_HANDLE;
@@ -39,6 +81,17 @@ namespace Vulkan
 		uint32_t mem_type = 0;
 		mutable uint8_t* host_base = nullptr;
 		bool persistantly_mapped = false;
+		MemoryCategory category = MemoryCategory::Buffer;
+		//Memory imported from a host pointer, not owned by VMA. vma_allocation is VK_NULL_HANDLE if set.
+		VkDeviceMemory imported_memory = VK_NULL_HANDLE;
+	};
+
+	// A page of the sparse page pool, bound to sparse resources with vkQueueBindSparse
+	struct SparsePage
+	{
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0;
+		uint32_t index = UINT32_MAX;
 	};
 
 	inline bool HasMemoryPropertyFlags(const DeviceAllocation& alloc, const VkPhysicalDeviceMemoryProperties& mem_props, VkMemoryPropertyFlags flags)
@@ -50,15 +103,42 @@ namespace Vulkan
 	{
 	public:
 
-		//Inits and creates the device allocator
+		//Inits and creates the device allocator. VMA is internally synchronized, so all functions may be called from any thread,
+		//except for the defragmentation functions, which must be externally synchronized.
 		void Init(Device* device);
 		//Cleans up the device allocator
 		~DeviceAllocator();
 
 		//Allocate Memory for new buffer, create the buffer and bind the memory to it
-		bool AllocateBuffer(const VkBufferCreateInfo& buffer_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkBuffer* buffer, DeviceAllocation* allocation);
+		bool AllocateBuffer(const VkBufferCreateInfo& buffer_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, MemoryCategory category, VkBuffer* buffer, DeviceAllocation* allocation);
 		//Allocate Memory for new image, create the image, and bind the memory to it
-		bool AllocateImage(const VkImageCreateInfo& image_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkImage* image, DeviceAllocation* allocation);
+		bool AllocateImage(const VkImageCreateInfo& image_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, MemoryCategory category, VkImage* image, DeviceAllocation* allocation);
+
+		//Create a buffer backed by host memory imported with VK_EXT_external_memory_host. host_pointer and the buffer size must be
+		//multiples of minImportedHostPointerAlignment, and the memory must stay valid until the buffer is freed.
+		bool ImportHostBuffer(const VkBufferCreateInfo& buffer_create_info, void* host_pointer, MemoryCategory category, VkBuffer* buffer, DeviceAllocation* allocation);
+
+		//Allocate memory with the given requirements without creating a resource, so several images can alias it
+		bool AllocateMemory(const VkMemoryRequirements& reqs, const VmaAllocationCreateInfo& mem_alloc_create_info, MemoryCategory category, DeviceAllocation* allocation);
+		//Create an image and bind it to memory allocated with AllocateMemory at offset. The image allocation doesn't own memory and has a size of 0.
+		bool CreateAliasedImage(const VkImageCreateInfo& image_create_info, const DeviceAllocation& memory, VkDeviceSize offset, MemoryCategory category, VkImage* image, DeviceAllocation* allocation);
+		//Free memory allocated with AllocateMemory
+		void FreeMemory(const DeviceAllocation& allocation);
+
+		//Create a sparse image without memory. The image allocation has a size of 0, its memory is bound from the sparse page pool.
+		bool CreateSparseImage(const VkImageCreateInfo& image_create_info, MemoryCategory category, VkImage* image, DeviceAllocation* allocation);
+
+		//Allocates the fixed size pool sparse pages are taken from, sized and aligned to page_reqs.alignment. The pool is created once and never grows,
+		//which bounds the memory of all sparse resources. The sparse page functions must be externally synchronized.
+		bool InitSparsePagePool(const VkMemoryRequirements& page_reqs, uint32_t page_count);
+		//Takes a page from the pool. Returns false if the pool is exhausted or its memory type isn't in memory_type_bits.
+		bool AllocateSparsePage(uint32_t memory_type_bits, SparsePage* page);
+		//Returns a page to the pool, it must not be bound to any resource the gpu may still access
+		void FreeSparsePage(const SparsePage& page);
+		bool HasSparsePagePool() const { return sparse_pool.allocation != VK_NULL_HANDLE; }
+		VkDeviceSize GetSparsePageSize() const { return sparse_pool.page_size; }
+		uint32_t GetSparsePageCount() const { return sparse_pool.page_count; }
+		uint32_t GetFreeSparsePageCount() const { return uint32_t(sparse_pool.free_pages.size()); }
 
 		//Destroy and Free Buffer
 		void FreeBuffer(VkBuffer buffer, const DeviceAllocation& allocation);
@@ -69,13 +149,71 @@ namespace Vulkan
 		void* MapMemory(const DeviceAllocation& alloc, MemoryAccessFlags flags);
 		//Unmap Allocation memory
 		void UnmapMemory(const DeviceAllocation& alloc, MemoryAccessFlags flags);
+		//Flush host writes to a range of a mapped allocation, if its memory isn't coherent
+		void FlushMemory(const DeviceAllocation& alloc, VkDeviceSize offset, VkDeviceSize size);
+		//Invalidate a range of a mapped allocation before host reads, if its memory isn't coherent
+		void InvalidateMemory(const DeviceAllocation& alloc, VkDeviceSize offset, VkDeviceSize size);
+
+		//Advances the VMA frame index and refreshes the cached heap budgets
+		void BeginFrame();
+		//Returns the heap budgets as queried at the start of the frame
+		const MemoryHeapBudget* GetHeapBudgets() const { return heap_budgets; }
+		//Queries up to date heap budgets. budgets must hold one entry per memory heap.
+		void QueryHeapBudgets(MemoryHeapBudget* budgets);
+		//Returns the bytes currently allocated for a category
+		VkDeviceSize GetCategoryUsage(MemoryCategory category) const { return category_bytes[unsigned(category)]; }
+
+		//Starts an incremental defragmentation of the allocations, moving at most max_bytes with gpu copies. Returns VK_NULL_HANDLE if there is nothing to do.
+		VmaDefragmentationContext BeginDefragmentation(const VmaAllocation* allocations, uint32_t count, VkDeviceSize max_bytes);
+		//Fills moves with at most max_moves planned moves and returns their number. Copies must be recorded by the caller.
+		uint32_t BeginDefragmentationPass(VmaDefragmentationContext context, VmaDefragmentationPassMoveInfo* moves, uint32_t max_moves);
+		//Commits the moves of the last pass once their copies completed. Returns true when no moves are left.
+		bool EndDefragmentationPass(VmaDefragmentationContext context);
+		//Ends the defragmentation, the allocations may be freed again afterwards
+		void EndDefragmentation(VmaDefragmentationContext context);
+		//Returns the memory type and the size VMA reserved for an allocation
+		void GetAllocationInfo(VmaAllocation allocation, VmaAllocationInfo* info);
 
 	private:
 
 		VmaAllocator allocator = VK_NULL_HANDLE;
 		VkPhysicalDeviceMemoryProperties mem_props{};
+		uint32_t frame_index = 0;
+		MemoryHeapBudget heap_budgets[VK_MAX_MEMORY_HEAPS] = {};
+		VkDevice vk_device = VK_NULL_HANDLE;
+		const VolkDeviceTable* table = nullptr;
+
+		struct SparsePagePool
+		{
+			VmaAllocation allocation = VK_NULL_HANDLE;
+			VkDeviceMemory memory = VK_NULL_HANDLE;
+			VkDeviceSize base_offset = 0;
+			VkDeviceSize page_size = 0;
+			uint32_t mem_type = 0;
+			uint32_t page_count = 0;
+			std::vector<uint32_t> free_pages;
+		};
+		SparsePagePool sparse_pool;
 #ifdef QM_VULKAN_MT
-		std::mutex m_mutex;
+		struct ThreadPools
+		{
+			VmaPool pools[VK_MAX_MEMORY_TYPES] = {};
+		};
+
+		//Returns the calling thread's pool for an allocation, or VK_NULL_HANDLE if it should come from the default pools
+		VmaPool GetThreadPool(const VkMemoryRequirements& reqs, bool wants_dedicated, const VmaAllocationCreateInfo& info);
+		bool AllocateBufferFromThreadPool(const VkBufferCreateInfo& buffer_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkBuffer* buffer, VmaAllocation* vma_allocation, VmaAllocationInfo* alloc_info);
+		bool AllocateImageFromThreadPool(const VkImageCreateInfo& image_create_info, const VmaAllocationCreateInfo& mem_alloc_create_info, VkImage* image, VmaAllocation* vma_allocation, VmaAllocationInfo* alloc_info);
+
+		bool query_dedicated = false;
+
+		//One entry per thread index, only ever touched by that thread. Empty if the device uses a single thread index.
+		std::vector<ThreadPools> thread_pools;
+		//Guards host_base and the map count of allocations mapped and unmapped from several threads
+		std::mutex map_mutex;
+		std::atomic<VkDeviceSize> category_bytes[unsigned(MemoryCategory::Count)] = {};
+#else
+		VkDeviceSize category_bytes[unsigned(MemoryCategory::Count)] = {};
 #endif
 
 	};
@@ -0,0 +1,543 @@
+#include "residency_manager.hpp"
+#include "quantumvk/vulkan/device.hpp"
+
+#include <algorithm>
+
+//The sparse page pool is shared by all managers, and the device lock guards it
+#ifdef QM_VULKAN_MT
+#define POOL_LOCK() std::lock_guard<std::mutex> holder__{device.lock.lock}
+#else
+#define POOL_LOCK() ((void)0)
+#endif
+
+namespace Vulkan
+{
+	//Stages which may sample sparse images or copy into their tiles
+	static const VkPipelineStageFlags SPARSE_GRAPHICS_STAGES = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+	static const VkPipelineStageFlags SPARSE_COMPUTE_STAGES = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+	ResidencyManager::ResidencyManager(Device& device_, uint32_t feedback_capacity_, VkDeviceSize pool_size_)
+		: device(device_), feedback_capacity(feedback_capacity_), pool_size(pool_size_), result(std::make_shared<FeedbackResult>())
+	{
+		VK_ASSERT(device.SupportsSparseResidency());
+
+		BufferCreateInfo info = {};
+		info.domain = BufferDomain::Device;
+		info.size = VkDeviceSize(std::max(feedback_capacity, 1u)) * sizeof(uint32_t);
+		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		info.misc = BUFFER_MISC_ZERO_INITIALIZE_BIT;
+		feedback = device.CreateBuffer(info);
+		if (!feedback)
+			QM_LOG_ERROR("Failed to create residency feedback buffer.\n");
+	}
+
+	ResidencyManager::~ResidencyManager()
+	{
+		//Pages are only returned to the pool once nothing can access them anymore
+		device.WaitIdle();
+
+		POOL_LOCK();
+		for (auto& release : pending_releases)
+			device.managers.memory.FreeSparsePage(release.page);
+
+		for (auto& sparse : images)
+		{
+			for (auto& page : sparse.tail_pages)
+				device.managers.memory.FreeSparsePage(page);
+			for (auto& tile : sparse.tiles)
+				if (tile.resident)
+					device.managers.memory.FreeSparsePage(tile.page);
+		}
+	}
+
+	bool ResidencyManager::InitPagePool(const VkMemoryRequirements& reqs)
+	{
+		uint32_t page_count = uint32_t(pool_size / reqs.alignment);
+		if (!device.managers.memory.InitSparsePagePool(reqs, page_count))
+		{
+			QM_LOG_ERROR("Failed to allocate sparse page pool of %u pages.\n", page_count);
+			return false;
+		}
+		return true;
+	}
+
+	SparseImageID ResidencyManager::RegisterImage(const ImageHandle& image)
+	{
+		const auto& info = image->GetCreateInfo();
+		if ((info.misc & IMAGE_MISC_SPARSE_RESIDENCY_BIT) == 0 || info.type != VK_IMAGE_TYPE_2D || info.layers != 1)
+		{
+			QM_LOG_ERROR("Only single layer 2D sparse images can be registered.\n");
+			return VULKAN_INVALID_SPARSE_IMAGE;
+		}
+
+		auto& table = device.GetDeviceTable();
+		VkDevice vk_device = device.GetDevice();
+
+		VkMemoryRequirements mem_reqs;
+		table.vkGetImageMemoryRequirements(vk_device, image->GetImage(), &mem_reqs);
+
+		uint32_t req_count = 0;
+		table.vkGetImageSparseMemoryRequirements(vk_device, image->GetImage(), &req_count, nullptr);
+		std::vector<VkSparseImageMemoryRequirements> sparse_reqs(req_count);
+		table.vkGetImageSparseMemoryRequirements(vk_device, image->GetImage(), &req_count, sparse_reqs.data());
+
+		SparseImage sparse;
+		sparse.image = image;
+		sparse.memory_type_bits = mem_reqs.memoryTypeBits;
+
+		std::vector<VkSparseMemoryBind> tail_binds;
+		{
+			POOL_LOCK();
+			auto& memory = device.managers.memory;
+			if (!memory.HasSparsePagePool() && !InitPagePool(mem_reqs))
+				return VULKAN_INVALID_SPARSE_IMAGE;
+
+			VkDeviceSize page_size = memory.GetSparsePageSize();
+			if (page_size % mem_reqs.alignment)
+			{
+				QM_LOG_ERROR("Sparse image alignment doesn't match the sparse page pool.\n");
+				return VULKAN_INVALID_SPARSE_IMAGE;
+			}
+
+			bool has_tiles = false;
+			for (auto& req : sparse_reqs)
+			{
+				bool metadata = (req.formatProperties.aspectMask & VK_IMAGE_ASPECT_METADATA_BIT) != 0;
+
+				//Metadata only has a mip tail, the other aspect determines the tiles
+				if (!metadata)
+				{
+					if (has_tiles)
+					{
+						QM_LOG_ERROR("Sparse images with several aspects are not supported.\n");
+						for (auto& page : sparse.tail_pages)
+							memory.FreeSparsePage(page);
+						return VULKAN_INVALID_SPARSE_IMAGE;
+					}
+
+					has_tiles = true;
+					sparse.aspect = req.formatProperties.aspectMask;
+					sparse.granularity = req.formatProperties.imageGranularity;
+					sparse.mip_tail_level = std::min(req.imageMipTailFirstLod, info.levels);
+				}
+
+				for (VkDeviceSize offset = 0; offset < req.imageMipTailSize; offset += page_size)
+				{
+					SparsePage page;
+					if (!memory.AllocateSparsePage(sparse.memory_type_bits, &page))
+					{
+						QM_LOG_ERROR("Not enough sparse pages for the mip tail.\n");
+						for (auto& allocated : sparse.tail_pages)
+							memory.FreeSparsePage(allocated);
+						return VULKAN_INVALID_SPARSE_IMAGE;
+					}
+
+					VkSparseMemoryBind bind = {};
+					bind.resourceOffset = req.imageMipTailOffset + offset;
+					bind.size = std::min(page_size, req.imageMipTailSize - offset);
+					bind.memory = page.memory;
+					bind.memoryOffset = page.offset;
+					bind.flags = metadata ? VK_SPARSE_MEMORY_BIND_METADATA_BIT : 0;
+					tail_binds.push_back(bind);
+					sparse.tail_pages.push_back(page);
+				}
+			}
+		}
+
+		for (uint32_t level = 0; level < sparse.mip_tail_level; level++)
+		{
+			uint32_t width = std::max(info.width >> level, 1u);
+			uint32_t height = std::max(info.height >> level, 1u);
+
+			VkExtent2D grid;
+			grid.width = (width + sparse.granularity.width - 1) / sparse.granularity.width;
+			grid.height = (height + sparse.granularity.height - 1) / sparse.granularity.height;
+
+			sparse.level_offsets.push_back(sparse.tile_count);
+			sparse.level_grids.push_back(grid);
+			sparse.tile_count += grid.width * grid.height;
+		}
+		sparse.tiles.resize(sparse.tile_count);
+
+		//Reuse the feedback entries of an unregistered image if they're enough
+		SparseImageID id = VULKAN_INVALID_SPARSE_IMAGE;
+		for (SparseImageID i = 0; i < images.size(); i++)
+		{
+			if (!images[i].registered && images[i].feedback_size >= sparse.tile_count)
+			{
+				id = i;
+				sparse.feedback_offset = images[i].feedback_offset;
+				sparse.feedback_size = images[i].feedback_size;
+				break;
+			}
+		}
+
+		if (id == VULKAN_INVALID_SPARSE_IMAGE)
+		{
+			if (feedback_used + sparse.tile_count > feedback_capacity)
+			{
+				QM_LOG_ERROR("Residency feedback buffer is full.\n");
+				POOL_LOCK();
+				for (auto& page : sparse.tail_pages)
+					device.managers.memory.FreeSparsePage(page);
+				return VULKAN_INVALID_SPARSE_IMAGE;
+			}
+
+			id = SparseImageID(images.size());
+			sparse.feedback_offset = feedback_used;
+			sparse.feedback_size = sparse.tile_count;
+			feedback_used += sparse.tile_count;
+			images.emplace_back();
+		}
+
+		if (!tail_binds.empty())
+		{
+			VkSparseImageOpaqueMemoryBindInfo opaque = {};
+			opaque.image = image->GetImage();
+			opaque.bindCount = uint32_t(tail_binds.size());
+			opaque.pBinds = tail_binds.data();
+
+			VkBindSparseInfo bind_info = { VK_STRUCTURE_TYPE_BIND_SPARSE_INFO };
+			bind_info.imageOpaqueBindCount = 1;
+			bind_info.pImageOpaqueBinds = &opaque;
+			device.BindSparse(bind_info, SPARSE_GRAPHICS_STAGES, SPARSE_COMPUTE_STAGES);
+		}
+
+		sparse.registered = true;
+		images[id] = std::move(sparse);
+		return id;
+	}
+
+	void ResidencyManager::UnregisterImage(SparseImageID id)
+	{
+		VK_ASSERT(id < images.size() && images[id].registered);
+		ReleasePages(id);
+
+		auto& sparse = images[id];
+		sparse.image.Reset();
+		sparse.tiles.clear();
+		sparse.level_offsets.clear();
+		sparse.level_grids.clear();
+		sparse.tile_count = 0;
+		sparse.mip_tail_level = 0;
+		sparse.registered = false;
+	}
+
+	void ResidencyManager::ReleasePages(SparseImageID id)
+	{
+		auto& sparse = images[id];
+
+		//The image goes away, so its pages are only returned without unbinding
+		for (auto& release : pending_releases)
+			if (release.id == id)
+				release.unbind = false;
+
+		for (uint32_t i = 0; i < sparse.tile_count; i++)
+		{
+			auto& tile = sparse.tiles[i];
+			if (!tile.resident)
+				continue;
+
+			pending_releases.push_back({ tile.page, frame, id, i, false });
+			tile.resident = false;
+			stats.resident_tiles--;
+		}
+
+		for (auto& page : sparse.tail_pages)
+			pending_releases.push_back({ page, frame, id, 0, false });
+		sparse.tail_pages.clear();
+	}
+
+	void ResidencyManager::Evict(SparseImageID id, uint32_t tile_index)
+	{
+		auto& tile = images[id].tiles[tile_index];
+		VK_ASSERT(tile.resident);
+
+		//Frames recorded up to now may still sample the tile, so it's only unbound once they completed
+		pending_releases.push_back({ tile.page, frame, id, tile_index, true });
+		tile.page = {};
+		tile.resident = false;
+		stats.resident_tiles--;
+		stats.evictions++;
+	}
+
+	VkSparseImageMemoryBind ResidencyManager::TileBind(const SparseImage& sparse, uint32_t tile, const SparsePage* page) const
+	{
+		uint32_t level = 0;
+		while (level + 1 < sparse.mip_tail_level && sparse.level_offsets[level + 1] <= tile)
+			level++;
+
+		const auto& grid = sparse.level_grids[level];
+		uint32_t index = tile - sparse.level_offsets[level];
+		uint32_t x = (index % grid.width) * sparse.granularity.width;
+		uint32_t y = (index / grid.width) * sparse.granularity.height;
+
+		const auto& info = sparse.image->GetCreateInfo();
+		uint32_t width = std::max(info.width >> level, 1u);
+		uint32_t height = std::max(info.height >> level, 1u);
+
+		VkSparseImageMemoryBind bind = {};
+		bind.subresource.aspectMask = sparse.aspect;
+		bind.subresource.mipLevel = level;
+		bind.subresource.arrayLayer = 0;
+		bind.offset = { int32_t(x), int32_t(y), 0 };
+		//Tiles on the right and bottom edge end at the edge of the level
+		bind.extent.width = std::min(sparse.granularity.width, width - x);
+		bind.extent.height = std::min(sparse.granularity.height, height - y);
+		bind.extent.depth = 1;
+		if (page)
+		{
+			bind.memory = page->memory;
+			bind.memoryOffset = page->offset;
+		}
+		return bind;
+	}
+
+	void ResidencyManager::Update(CommandBuffer& cmd)
+	{
+		VK_ASSERT(cmd.GetCommandBufferType() == CommandBuffer::Type::Generic);
+
+		frame++;
+		stats.commits = 0;
+		stats.evictions = 0;
+		stats.deferred = 0;
+		committed_tiles.clear();
+
+		//One bind list per image, as each image gets a VkSparseImageMemoryBindInfo of its own
+		std::vector<std::vector<VkSparseImageMemoryBind>> binds(images.size());
+
+		uint64_t frames_in_flight = device.GetNumFrameContexts();
+		{
+			POOL_LOCK();
+			auto itr = std::remove_if(pending_releases.begin(), pending_releases.end(), [&](const PendingRelease& release) {
+				if (release.frame + frames_in_flight > frame)
+					return false;
+
+				//The tile may have been committed again with another page in the meantime
+				if (release.unbind && !images[release.id].tiles[release.tile].resident)
+					binds[release.id].push_back(TileBind(images[release.id], release.tile, nullptr));
+
+				device.managers.memory.FreeSparsePage(release.page);
+				return true;
+			});
+			pending_releases.erase(itr, pending_releases.end());
+		}
+
+		bool has_feedback = false;
+		{
+			std::lock_guard<std::mutex> holder{ result->lock };
+			if (result->ready)
+			{
+				requests.swap(result->requests);
+				result->ready = false;
+				has_feedback = true;
+			}
+		}
+
+		if (has_feedback)
+		{
+			struct Candidate
+			{
+				SparseImageID id;
+				uint32_t tile;
+				uint32_t level;
+			};
+			std::vector<Candidate> candidates;
+
+			for (SparseImageID id = 0; id < images.size(); id++)
+			{
+				auto& sparse = images[id];
+				if (!sparse.registered)
+					continue;
+
+				for (uint32_t level = 0; level < sparse.mip_tail_level; level++)
+				{
+					uint32_t end = level + 1 < sparse.mip_tail_level ? sparse.level_offsets[level + 1] : sparse.tile_count;
+					for (uint32_t tile = sparse.level_offsets[level]; tile < end; tile++)
+					{
+						uint32_t entry = sparse.feedback_offset + tile;
+						if (entry >= requests.size() || requests[entry] == 0)
+							continue;
+
+						sparse.tiles[tile].last_requested = frame;
+						if (!sparse.tiles[tile].resident)
+							candidates.push_back({ id, tile, level });
+					}
+				}
+			}
+
+			//Coarse levels first, they cover the most area and finer levels fall back to them
+			std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+				return a.level > b.level;
+			});
+
+			//Tiles which weren't requested for a while are evicted, the least recently requested ones if the pool runs dry
+			struct Resident
+			{
+				uint64_t last_requested;
+				SparseImageID id;
+				uint32_t tile;
+			};
+			std::vector<Resident> lru;
+
+			for (SparseImageID id = 0; id < images.size(); id++)
+			{
+				auto& sparse = images[id];
+				for (uint32_t tile = 0; tile < sparse.tile_count; tile++)
+				{
+					if (!sparse.tiles[tile].resident)
+						continue;
+
+					if (sparse.tiles[tile].last_requested + eviction_frames < frame)
+						Evict(id, tile);
+					else if (sparse.tiles[tile].last_requested < frame)
+						lru.push_back({ sparse.tiles[tile].last_requested, id, tile });
+				}
+			}
+
+			std::sort(lru.begin(), lru.end(), [](const Resident& a, const Resident& b) {
+				return a.last_requested < b.last_requested;
+			});
+			size_t lru_index = 0;
+
+			for (auto& candidate : candidates)
+			{
+				auto& sparse = images[candidate.id];
+
+				if (stats.commits >= max_commits)
+				{
+					stats.deferred++;
+					continue;
+				}
+
+				SparsePage page;
+				bool allocated;
+				{
+					POOL_LOCK();
+					allocated = device.managers.memory.AllocateSparsePage(sparse.memory_type_bits, &page);
+				}
+
+				if (!allocated)
+				{
+					//Evicted pages are only reusable in a later frame, the tile is retried then
+					if (lru_index < lru.size())
+					{
+						Evict(lru[lru_index].id, lru[lru_index].tile);
+						lru_index++;
+					}
+					stats.deferred++;
+					continue;
+				}
+
+				auto& tile = sparse.tiles[candidate.tile];
+				tile.page = page;
+				tile.resident = true;
+				binds[candidate.id].push_back(TileBind(sparse, candidate.tile, &page));
+
+				const auto& grid = sparse.level_grids[candidate.level];
+				uint32_t index = candidate.tile - sparse.level_offsets[candidate.level];
+				committed_tiles.push_back({ candidate.id, candidate.level, index % grid.width, index / grid.width });
+
+				stats.resident_tiles++;
+				stats.commits++;
+			}
+		}
+
+		std::vector<VkSparseImageMemoryBindInfo> image_binds;
+		for (SparseImageID id = 0; id < images.size(); id++)
+		{
+			if (binds[id].empty())
+				continue;
+
+			VkSparseImageMemoryBindInfo image_bind = {};
+			image_bind.image = images[id].image->GetImage();
+			image_bind.bindCount = uint32_t(binds[id].size());
+			image_bind.pBinds = binds[id].data();
+			image_binds.push_back(image_bind);
+		}
+
+		if (!image_binds.empty())
+		{
+			VkBindSparseInfo bind_info = { VK_STRUCTURE_TYPE_BIND_SPARSE_INFO };
+			bind_info.imageBindCount = uint32_t(image_binds.size());
+			bind_info.pImageBinds = image_binds.data();
+			device.BindSparse(bind_info, SPARSE_GRAPHICS_STAGES, SPARSE_COMPUTE_STAGES);
+		}
+
+		{
+			POOL_LOCK();
+			stats.pool_pages = device.managers.memory.GetSparsePageCount();
+			stats.free_pages = device.managers.memory.GetFreeSparsePageCount();
+		}
+
+		if (!feedback || feedback_used == 0)
+			return;
+
+		VkDeviceSize feedback_bytes = VkDeviceSize(feedback_used) * sizeof(uint32_t);
+		cmd.Barrier(VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+
+		auto feedback_result = result;
+		device.RequestReadback(cmd, *feedback, 0, feedback_bytes, [feedback_result](const void* data, VkDeviceSize size) {
+			auto* entries = static_cast<const uint32_t*>(data);
+			std::lock_guard<std::mutex> holder{ feedback_result->lock };
+			feedback_result->requests.assign(entries, entries + size / sizeof(uint32_t));
+			feedback_result->ready = true;
+		});
+
+		//The clear must not overwrite entries before the copy read them
+		cmd.Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		cmd.FillBuffer(*feedback, 0, 0, feedback_bytes);
+		cmd.Barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	}
+
+	uint32_t ResidencyManager::GetFeedbackOffset(SparseImageID id, uint32_t level) const
+	{
+		VK_ASSERT(id < images.size() && images[id].registered);
+		VK_ASSERT(level < images[id].mip_tail_level || level == 0);
+		return images[id].feedback_offset + (level < images[id].mip_tail_level ? images[id].level_offsets[level] : 0);
+	}
+
+	VkExtent2D ResidencyManager::GetTileGrid(SparseImageID id, uint32_t level) const
+	{
+		VK_ASSERT(id < images.size() && images[id].registered);
+		if (level >= images[id].mip_tail_level)
+			return { 0, 0 };
+		return images[id].level_grids[level];
+	}
+
+	VkExtent3D ResidencyManager::GetTileExtent(SparseImageID id) const
+	{
+		VK_ASSERT(id < images.size() && images[id].registered);
+		return images[id].granularity;
+	}
+
+	uint32_t ResidencyManager::GetMipTailLevel(SparseImageID id) const
+	{
+		VK_ASSERT(id < images.size() && images[id].registered);
+		return images[id].mip_tail_level;
+	}
+
+	bool ResidencyManager::IsResident(SparseImageID id, uint32_t level, uint32_t x, uint32_t y) const
+	{
+		VK_ASSERT(id < images.size() && images[id].registered);
+		auto& sparse = images[id];
+		if (level >= sparse.mip_tail_level)
+			return true;
+
+		const auto& grid = sparse.level_grids[level];
+		VK_ASSERT(x < grid.width && y < grid.height);
+		return sparse.tiles[sparse.level_offsets[level] + y * grid.width + x].resident;
+	}
+
+	void ResidencyManager::SetMaxCommitsPerUpdate(uint32_t count)
+	{
+		max_commits = count;
+	}
+
+	void ResidencyManager::SetEvictionFrames(uint32_t frames)
+	{
+		eviction_frames = frames;
+	}
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "quantumvk/vulkan/vulkan_headers.hpp"
+#include "quantumvk/vulkan/memory/buffer.hpp"
+#include "quantumvk/vulkan/memory/memory_allocator.hpp"
+#include "quantumvk/vulkan/images/image.hpp"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Vulkan
+{
+	//Forward declare device
+	class Device;
+	class CommandBuffer;
+
+	//Size of the sparse page pool created by the first ResidencyManager, bounding the memory of all sparse images together
+	static const VkDeviceSize VULKAN_SPARSE_PAGE_POOL_SIZE = 256 * 1024 * 1024;
+	//Frames a tile stays resident after it was last requested
+	static const uint32_t VULKAN_SPARSE_EVICTION_FRAMES = 60;
+	//Tiles committed by a single Update()
+	static const uint32_t VULKAN_SPARSE_MAX_COMMITS_PER_UPDATE = 256;
+
+	//Identifies an image registered with a ResidencyManager
+	using SparseImageID = uint32_t;
+	static const SparseImageID VULKAN_INVALID_SPARSE_IMAGE = UINT32_MAX;
+
+	//A tile committed by ResidencyManager::Update(), its contents are undefined until written
+	struct SparseTile
+	{
+		SparseImageID id;
+		uint32_t level;
+		uint32_t x;
+		uint32_t y;
+	};
+
+	struct ResidencyStats
+	{
+		uint32_t resident_tiles = 0;
+		uint32_t pool_pages = 0;
+		uint32_t free_pages = 0;
+		//Tiles committed and evicted by the last Update()
+		uint32_t commits = 0;
+		uint32_t evictions = 0;
+		//Requested tiles the last Update() couldn't commit, because of the commit limit or as every page was in use
+		uint32_t deferred = 0;
+	};
+
+	//Commits and decommits tiles of sparse images (IMAGE_MISC_SPARSE_RESIDENCY_BIT) on the sparse queue, driven by a feedback buffer
+	//shaders write the tiles they need to. Page memory comes from the fixed size sparse page pool of the DeviceAllocator, so the
+	//memory used stays bounded regardless of the total size of the images. The least recently requested tiles are evicted to make room.
+	//
+	//Only single layer 2D images are supported. Mip levels from the mip tail on are always resident.
+	//The manager isn't thread safe, Update() is meant to be called once per frame from the thread recording the frame.
+	class ResidencyManager
+	{
+	public:
+		//feedback_capacity is the number of tiles of all registered images together. pool_size is only used if the sparse page pool doesn't exist yet.
+		ResidencyManager(Device& device, uint32_t feedback_capacity, VkDeviceSize pool_size = VULKAN_SPARSE_PAGE_POOL_SIZE);
+		~ResidencyManager();
+
+		ResidencyManager(const ResidencyManager&) = delete;
+		void operator=(const ResidencyManager&) = delete;
+
+		//Registers an image and binds its mip tail. Returns VULKAN_INVALID_SPARSE_IMAGE if the image isn't supported or there's not enough memory.
+		SparseImageID RegisterImage(const ImageHandle& image);
+		//Releases all pages of an image, they are reused once the current frames completed. The image must not be sampled afterwards.
+		void UnregisterImage(SparseImageID id);
+
+		//Storage buffer of uint32_t, shaders write a non-zero value to the entries of the tiles they sample
+		const Buffer& GetFeedbackBuffer() const
+		{
+			return *feedback;
+		}
+		//Index of an image's first feedback entry. Entries are ordered by mip level, then row, then column of the tile grid.
+		uint32_t GetFeedbackOffset(SparseImageID id, uint32_t level = 0) const;
+		//Number of tiles of a mip level, 0 for levels in the mip tail
+		VkExtent2D GetTileGrid(SparseImageID id, uint32_t level) const;
+		//Texel size of a tile
+		VkExtent3D GetTileExtent(SparseImageID id) const;
+		//First level of the mip tail
+		uint32_t GetMipTailLevel(SparseImageID id) const;
+
+		//Whether a tile is bound, levels in the mip tail are always resident
+		bool IsResident(SparseImageID id, uint32_t level, uint32_t x, uint32_t y) const;
+
+		//Commits requested tiles from the latest feedback which has been read back, and evicts those which weren't requested recently.
+		//Then records the readback and reset of the feedback buffer into cmd, which must be a Generic command buffer
+		//recorded after all the frame's work writing feedback and submitted before the next Update().
+		void Update(CommandBuffer& cmd);
+
+		//Tiles committed by the last Update(), to be filled by the caller before they're sampled
+		const std::vector<SparseTile>& GetCommittedTiles() const
+		{
+			return committed_tiles;
+		}
+
+		void SetMaxCommitsPerUpdate(uint32_t count);
+		void SetEvictionFrames(uint32_t frames);
+
+		ResidencyStats GetStats() const
+		{
+			return stats;
+		}
+
+	private:
+		struct Tile
+		{
+			SparsePage page;
+			uint64_t last_requested = 0;
+			bool resident = false;
+		};
+
+		struct SparseImage
+		{
+			ImageHandle image;
+			VkImageAspectFlags aspect = 0;
+			uint32_t memory_type_bits = 0;
+			VkExtent3D granularity = {};
+			uint32_t mip_tail_level = 0;
+			uint32_t feedback_offset = 0;
+			//Feedback entries reserved for the image, kept when it's unregistered so images with fewer tiles can reuse them
+			uint32_t feedback_size = 0;
+			uint32_t tile_count = 0;
+			std::vector<uint32_t> level_offsets;
+			std::vector<VkExtent2D> level_grids;
+			std::vector<Tile> tiles;
+			std::vector<SparsePage> tail_pages;
+			bool registered = false;
+		};
+
+		//A page which stops being bound once the frames which might still access it completed
+		struct PendingRelease
+		{
+			SparsePage page;
+			uint64_t frame;
+			SparseImageID id;
+			uint32_t tile;
+			bool unbind;
+		};
+
+		//Written by the readback callback, which may run on another thread
+		struct FeedbackResult
+		{
+			std::mutex lock;
+			std::vector<uint32_t> requests;
+			bool ready = false;
+		};
+
+		bool InitPagePool(const VkMemoryRequirements& reqs);
+		VkSparseImageMemoryBind TileBind(const SparseImage& image, uint32_t tile, const SparsePage* page) const;
+		void Evict(SparseImageID id, uint32_t tile);
+		void ReleasePages(SparseImageID id);
+
+		Device& device;
+		BufferHandle feedback;
+		uint32_t feedback_capacity;
+		uint32_t feedback_used = 0;
+		VkDeviceSize pool_size;
+		std::shared_ptr<FeedbackResult> result;
+		std::vector<uint32_t> requests;
+
+		std::vector<SparseImage> images;
+		std::vector<PendingRelease> pending_releases;
+		std::vector<SparseTile> committed_tiles;
+		uint64_t frame = 0;
+		uint32_t max_commits = VULKAN_SPARSE_MAX_COMMITS_PER_UPDATE;
+		uint32_t eviction_frames = VULKAN_SPARSE_EVICTION_FRAMES;
+		ResidencyStats stats;
+	};
+}
@@ -0,0 +1,77 @@
+#include "transient_ring.hpp"
+#include "quantumvk/vulkan/device.hpp"
+
+namespace Vulkan
+{
+	bool TransientRing::Init(Device* device, VkDeviceSize size_, VkDeviceSize alignment_, VkDeviceSize spill_size_, VkBufferUsageFlags usage, MemoryCategory category)
+	{
+		BufferCreateInfo info;
+		info.domain = BufferDomain::LinkedDeviceHost;
+		info.size = size_;
+		info.usage = usage;
+		info.category = category;
+
+		buffer = device->CreateBuffer(info);
+		if (!buffer)
+			return false;
+
+		buffer->SetInternalSyncObject();
+
+		// Without ReBAR or UMA memory the block pools are used, as they can stage through the DMA queues
+		const VkMemoryPropertyFlags required = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		if ((device->GetMemoryProperties().memoryTypes[buffer->GetAllocation().mem_type].propertyFlags & required) != required)
+		{
+			buffer.Reset();
+			return false;
+		}
+
+		VK_ASSERT(buffer->GetAllocation().persistantly_mapped);
+		mapped = static_cast<uint8_t*>(device->MapHostBuffer(*buffer, MEMORY_ACCESS_WRITE_BIT));
+		size = size_;
+		alignment = alignment_;
+		spill_size = spill_size_;
+		offset = 0;
+		return true;
+	}
+
+	void TransientRing::Release()
+	{
+		buffer.Reset();
+		mapped = nullptr;
+		size = 0;
+		offset = 0;
+	}
+
+	void TransientRing::Reset()
+	{
+		offset = 0;
+	}
+
+	BufferBlockAllocation TransientRing::Allocate(VkDeviceSize allocate_size)
+	{
+		VkDeviceSize aligned_offset;
+#ifdef QM_VULKAN_MT
+		VkDeviceSize current = offset.load(std::memory_order_relaxed);
+		do
+		{
+			aligned_offset = (current + alignment - 1) & ~(alignment - 1);
+			if (aligned_offset + allocate_size > size)
+				return { nullptr, 0, 0 };
+		} while (!offset.compare_exchange_weak(current, aligned_offset + allocate_size, std::memory_order_relaxed));
+#else
+		aligned_offset = (offset + alignment - 1) & ~(alignment - 1);
+		if (aligned_offset + allocate_size > size)
+			return { nullptr, 0, 0 };
+		offset = aligned_offset + allocate_size;
+#endif
+
+		VkDeviceSize padded_size = std::max(allocate_size, spill_size);
+		padded_size = std::min(padded_size, size - aligned_offset);
+		return { mapped + aligned_offset, aligned_offset, padded_size };
+	}
+
+	VkDeviceSize TransientRing::GetUsedSize() const
+	{
+		return offset;
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "quantumvk/vulkan/vulkan_headers.hpp"
+#include "quantumvk/vulkan/memory/buffer.hpp"
+#include "quantumvk/vulkan/memory/buffer_pool.hpp"
+
+#ifdef QM_VULKAN_MT
+#include <atomic>
+#endif
+
+namespace Vulkan
+{
+	//Forward declare device
+	class Device;
+
+	//A persistently mapped buffer owned by a frame context. Every thread recording in that frame context suballocates from it
+	//by bumping an atomic offset, and the offset is reset once the frame context's work has completed.
+	class TransientRing
+	{
+	public:
+		//Creates the ring buffer, returns false unless it landed in device local, host visible and coherent memory
+		bool Init(Device* device, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize spill_size, VkBufferUsageFlags usage, MemoryCategory category);
+		//Frees the ring buffer
+		void Release();
+		//Makes the whole ring available again. Only call once the GPU is done with every allocation.
+		void Reset();
+
+		bool IsValid() const
+		{
+			return bool(buffer);
+		}
+
+		//Suballocate from the ring, returns a null host pointer if the ring is full
+		BufferBlockAllocation Allocate(VkDeviceSize allocate_size);
+
+		const Buffer& GetBuffer() const
+		{
+			return *buffer;
+		}
+
+		//Return the number of bytes allocated since the last reset
+		VkDeviceSize GetUsedSize() const;
+
+	private:
+		BufferHandle buffer;
+		uint8_t* mapped = nullptr;
+		VkDeviceSize size = 0;
+		VkDeviceSize alignment = 0;
+		VkDeviceSize spill_size = 0;
+#ifdef QM_VULKAN_MT
+		std::atomic<VkDeviceSize> offset{ 0 };
+#else
+		VkDeviceSize offset = 0;
+#endif
+	};
+
+	//The transient rings of a frame context
+	struct TransientRings
+	{
+		TransientRing vbo;
+		TransientRing ibo;
+		TransientRing ubo;
+	};
+}
@@ -7,4 +7,9 @@ namespace Vulkan
         : cookie(device->AllocateCookie())
     {
     }
+
+    void Cookie::RefreshCookie(Device* device)
+    {
+        cookie = device->AllocateCookie();
+    }
 }
\ No newline at end of file
@@ -19,6 +19,10 @@ namespace Vulkan
 			return cookie;
 		}
 
+	protected:
+		//Gives the object a new cookie, for objects whose underlying vulkan handle changed
+		void RefreshCookie(Device* device);
+
 	private:
 		uint64_t cookie;
 	};
@@ -14,6 +14,7 @@ namespace Vulkan
 		bool clustering_force_cpu = false;
 		bool queue_wait_on_submission = false;
 		bool staging_need_device_local = false;
+		bool use_transient_rings = true;
 		bool use_async_compute_post = true;
 		bool render_graph_force_single_queue = false;
 		bool force_no_subgroups = false;
@@ -34,6 +34,12 @@ namespace Vulkan
 		if (timeline_value != 0)
 		{
 			VK_ASSERT(timeline_semaphore);
+			// The value may still be in a batch which hasn't been submitted
+			if (internal_sync)
+				device->FlushTimelineNolock(timeline_semaphore, timeline_value);
+			else
+				device->FlushTimeline(timeline_semaphore, timeline_value);
+
 			VkSemaphoreWaitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
 			info.semaphoreCount = 1;
 			info.pSemaphores = &timeline_semaphore;
@@ -59,6 +65,11 @@ namespace Vulkan
 		if (timeline_value != 0)
 		{
 			VK_ASSERT(timeline_semaphore);
+			if (internal_sync)
+				device->FlushTimelineNolock(timeline_semaphore, timeline_value);
+			else
+				device->FlushTimeline(timeline_semaphore, timeline_value);
+
 			VkSemaphoreWaitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
 			info.semaphoreCount = 1;
 			info.pSemaphores = &timeline_semaphore;
@@ -73,6 +84,36 @@ namespace Vulkan
 		return ret;
 	}
 
+	bool FenceHolder::TryWait()
+	{
+		auto& table = device->GetDeviceTable();
+
+#ifdef QM_VULKAN_MT
+		std::lock_guard<std::mutex> holder{ lock };
+#endif
+		if (observed_wait)
+			return true;
+
+		if (timeline_value != 0)
+		{
+			VK_ASSERT(timeline_semaphore);
+			// A value still in a batch would never be reached otherwise
+			if (internal_sync)
+				device->FlushTimelineNolock(timeline_semaphore, timeline_value);
+			else
+				device->FlushTimeline(timeline_semaphore, timeline_value);
+
+			uint64_t value = 0;
+			if (table.vkGetSemaphoreCounterValueKHR(device->GetDevice(), timeline_semaphore, &value) != VK_SUCCESS)
+				return false;
+			observed_wait = value >= timeline_value;
+		}
+		else
+			observed_wait = table.vkGetFenceStatus(device->GetDevice(), fence) == VK_SUCCESS;
+
+		return observed_wait;
+	}
+
 	void FenceHolderDeleter::operator()(Vulkan::FenceHolder* fence)
 	{
 		fence->device->handle_pool.fences.free(fence);
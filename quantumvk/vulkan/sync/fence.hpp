@@ -29,6 +29,8 @@ namespace Vulkan
 		~FenceHolder();
 		void Wait();
 		bool WaitTimeout(uint64_t nsec);
+		// Returns whether the fence is signalled, never blocks
+		bool TryWait();
 
 	private:
 		friend class Util::ObjectPool<FenceHolder>;
@@ -0,0 +1,223 @@
+#include "resource_tracker.hpp"
+#include "quantumvk/vulkan/images/format.hpp"
+#include "quantumvk/vulkan/images/image.hpp"
+#include "quantumvk/vulkan/memory/buffer.hpp"
+
+namespace Vulkan
+{
+	static const VkAccessFlags WRITE_ACCESS_FLAGS = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+	bool ResourceTracker::AccessState::operator==(const AccessState& other) const
+	{
+		return layout == other.layout &&
+			write_stages == other.write_stages &&
+			write_access == other.write_access &&
+			read_stages == other.read_stages &&
+			visible_stages == other.visible_stages &&
+			visible_access == other.visible_access;
+	}
+
+	ResourceTracker::AccessState ResourceTracker::InitialState(VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		AccessState state;
+		state.layout = layout;
+		if (access & WRITE_ACCESS_FLAGS)
+		{
+			state.write_stages = stages;
+			state.write_access = access & WRITE_ACCESS_FLAGS;
+		}
+		else
+			state.read_stages = stages;
+		return state;
+	}
+
+	bool ResourceTracker::Infer(AccessState& state, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access,
+		VkPipelineStageFlags& src_stages, VkAccessFlags& src_access)
+	{
+		VkAccessFlags write_access = access & WRITE_ACCESS_FLAGS;
+
+		if (layout != state.layout)
+		{
+			// The transition has to wait for every access, and later uses in other stages have to wait for the transition
+			src_stages = state.write_stages | state.read_stages;
+			src_access = state.write_access;
+			if (!src_stages)
+				src_stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+
+			state = {};
+			state.layout = layout;
+			state.write_stages = stages;
+			state.write_access = write_access;
+			if (!write_access)
+			{
+				state.visible_stages = stages;
+				state.visible_access = access;
+			}
+			return true;
+		}
+
+		if (write_access)
+		{
+			// Write after write and write after read
+			src_stages = state.write_stages | state.read_stages;
+			src_access = state.write_access;
+
+			state.write_stages = stages;
+			state.write_access = write_access;
+			state.read_stages = 0;
+			state.visible_stages = 0;
+			state.visible_access = 0;
+			return src_stages != 0;
+		}
+
+		state.read_stages |= stages;
+
+		// Read after write, unless an earlier barrier made the write visible to this use already
+		if (!state.write_stages || ((stages & ~state.visible_stages) == 0 && (access & ~state.visible_access) == 0))
+			return false;
+
+		src_stages = state.write_stages;
+		src_access = state.write_access;
+		state.visible_stages |= stages;
+		state.visible_access |= access;
+		return true;
+	}
+
+	void ResourceTracker::TrackImage(const Image& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		auto& state = images[image.GetImage()];
+		state.aspect = FormatToAspectMask(image.GetFormat());
+		state.levels = image.GetCreateInfo().levels;
+		state.layers = image.GetCreateInfo().layers;
+		state.subresources.assign(state.levels * state.layers, InitialState(layout, stages, access));
+	}
+
+	void ResourceTracker::TrackBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access)
+	{
+		buffers[buffer.GetBuffer()] = InitialState(VK_IMAGE_LAYOUT_UNDEFINED, stages, access);
+	}
+
+	bool ResourceTracker::IsTracked(const Image& image) const
+	{
+		return images.count(image.GetImage()) != 0;
+	}
+
+	bool ResourceTracker::IsTracked(const Buffer& buffer) const
+	{
+		return buffers.count(buffer.GetBuffer()) != 0;
+	}
+
+	void ResourceTracker::UseImage(const Image& image, const VkImageSubresourceRange& range, VkImageLayout layout,
+		VkPipelineStageFlags stages, VkAccessFlags access, InferredBarriers& barriers)
+	{
+		auto itr = images.find(image.GetImage());
+		VK_ASSERT(itr != images.end());
+		auto& state = itr->second;
+
+		uint32_t base_level = range.baseMipLevel;
+		uint32_t base_layer = range.baseArrayLayer;
+		uint32_t levels = range.levelCount == VK_REMAINING_MIP_LEVELS ? state.levels - base_level : range.levelCount;
+		uint32_t layers = range.layerCount == VK_REMAINING_ARRAY_LAYERS ? state.layers - base_layer : range.layerCount;
+		VK_ASSERT(base_level + levels <= state.levels);
+		VK_ASSERT(base_layer + layers <= state.layers);
+
+		auto subresource = [&](uint32_t level, uint32_t layer) -> AccessState& {
+			return state.subresources[level * state.layers + layer];
+		};
+
+		// Subresources in the same state need the same barrier, so a block of them is transitioned with a single one
+		auto use = [&](uint32_t level, uint32_t level_count, uint32_t layer, uint32_t layer_count) {
+			AccessState old = subresource(level, layer);
+			AccessState next = old;
+			VkPipelineStageFlags src_stages = 0;
+			VkAccessFlags src_access = 0;
+			bool needs_barrier = Infer(next, layout, stages, access, src_stages, src_access);
+
+			for (uint32_t i = level; i < level + level_count; i++)
+				for (uint32_t j = layer; j < layer + layer_count; j++)
+					subresource(i, j) = next;
+
+			if (!needs_barrier)
+				return;
+
+			VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+			barrier.srcAccessMask = src_access;
+			barrier.dstAccessMask = access;
+			barrier.oldLayout = old.layout;
+			barrier.newLayout = layout;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.image = image.GetImage();
+			barrier.subresourceRange.aspectMask = range.aspectMask ? range.aspectMask : state.aspect;
+			barrier.subresourceRange.baseMipLevel = level;
+			barrier.subresourceRange.levelCount = level_count;
+			barrier.subresourceRange.baseArrayLayer = layer;
+			barrier.subresourceRange.layerCount = layer_count;
+
+			barriers.src_stages |= src_stages;
+			barriers.dst_stages |= stages;
+			barriers.images.push_back(barrier);
+		};
+
+		bool uniform = true;
+		const AccessState& first = subresource(base_level, base_layer);
+		for (uint32_t i = base_level; i < base_level + levels && uniform; i++)
+			for (uint32_t j = base_layer; j < base_layer + layers && uniform; j++)
+				uniform = subresource(i, j) == first;
+
+		if (uniform)
+		{
+			use(base_level, levels, base_layer, layers);
+			return;
+		}
+
+		// Otherwise each level is split into runs of layers in the same state
+		for (uint32_t i = base_level; i < base_level + levels; i++)
+		{
+			uint32_t run = base_layer;
+			for (uint32_t j = base_layer + 1; j <= base_layer + layers; j++)
+			{
+				if (j == base_layer + layers || !(subresource(i, j) == subresource(i, run)))
+				{
+					use(i, 1, run, j - run);
+					run = j;
+				}
+			}
+		}
+	}
+
+	void ResourceTracker::UseBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access, InferredBarriers& barriers)
+	{
+		auto& state = buffers[buffer.GetBuffer()];
+
+		VkPipelineStageFlags src_stages = 0;
+		VkAccessFlags src_access = 0;
+		if (!Infer(state, VK_IMAGE_LAYOUT_UNDEFINED, stages, access, src_stages, src_access))
+			return;
+
+		VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+		barrier.srcAccessMask = src_access;
+		barrier.dstAccessMask = access;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.buffer = buffer.GetBuffer();
+		barrier.offset = 0;
+		barrier.size = VK_WHOLE_SIZE;
+
+		barriers.src_stages |= src_stages;
+		barriers.dst_stages |= stages;
+		barriers.buffers.push_back(barrier);
+	}
+
+	VkImageLayout ResourceTracker::GetLayout(const Image& image, uint32_t level, uint32_t layer) const
+	{
+		auto itr = images.find(image.GetImage());
+		if (itr == images.end())
+			return VK_IMAGE_LAYOUT_UNDEFINED;
+
+		auto& state = itr->second;
+		VK_ASSERT(level < state.levels && layer < state.layers);
+		return state.subresources[level * state.layers + layer].layout;
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "quantumvk/vulkan/vulkan_headers.hpp"
+#include "quantumvk/utils/small_vector.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+namespace Vulkan
+{
+	class Buffer;
+	class Image;
+
+	//Barriers a ResourceTracker inferred for a use, to be recorded before it
+	struct InferredBarriers
+	{
+		VkPipelineStageFlags src_stages = 0;
+		VkPipelineStageFlags dst_stages = 0;
+		Util::SmallVector<VkBufferMemoryBarrier> buffers;
+		Util::SmallVector<VkImageMemoryBarrier> images;
+
+		bool Empty() const
+		{
+			return buffers.empty() && images.empty();
+		}
+	};
+
+	//Tracks the layout and the accesses since the last write of buffers and of every subresource of images, so the
+	//barrier needed before a use follows from the use alone. Only stages and accesses which actually conflict are waited on.
+	class ResourceTracker
+	{
+	public:
+		//Starts tracking a resource, or resets its state. stages and access are those of the last use before tracking started.
+		void TrackImage(const Image& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access);
+		void TrackBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access);
+
+		bool IsTracked(const Image& image) const;
+		bool IsTracked(const Buffer& buffer) const;
+
+		//Adds the barriers needed before the use to barriers. The image must be tracked.
+		void UseImage(const Image& image, const VkImageSubresourceRange& range, VkImageLayout layout,
+			VkPipelineStageFlags stages, VkAccessFlags access, InferredBarriers& barriers);
+		//Adds the barrier needed before the use to barriers. Buffers which aren't tracked start being tracked, assuming earlier work was synchronized by the submission.
+		void UseBuffer(const Buffer& buffer, VkPipelineStageFlags stages, VkAccessFlags access, InferredBarriers& barriers);
+
+		//Layout of a subresource after the last use, VK_IMAGE_LAYOUT_UNDEFINED if the image isn't tracked
+		VkImageLayout GetLayout(const Image& image, uint32_t level, uint32_t layer) const;
+
+	private:
+		struct AccessState
+		{
+			VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			//Stages and accesses of the last write or layout transition
+			VkPipelineStageFlags write_stages = 0;
+			VkAccessFlags write_access = 0;
+			//Stages which read since the last write
+			VkPipelineStageFlags read_stages = 0;
+			//Where the last write has been made visible already
+			VkPipelineStageFlags visible_stages = 0;
+			VkAccessFlags visible_access = 0;
+
+			bool operator==(const AccessState& other) const;
+		};
+
+		struct ImageState
+		{
+			VkImageAspectFlags aspect = 0;
+			uint32_t levels = 0;
+			uint32_t layers = 0;
+			//Indexed by level * layers + layer
+			std::vector<AccessState> subresources;
+		};
+
+		static AccessState InitialState(VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access);
+		//Updates state for the use, returns whether it needs a barrier and from which stages and accesses
+		static bool Infer(AccessState& state, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access,
+			VkPipelineStageFlags& src_stages, VkAccessFlags& src_access);
+
+		std::unordered_map<VkImage, ImageState> images;
+		std::unordered_map<VkBuffer, AccessState> buffers;
+	};
+}
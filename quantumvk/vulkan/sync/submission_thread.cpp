@@ -0,0 +1,95 @@
+#include "submission_thread.hpp"
+#include "quantumvk/vulkan/device.hpp"
+
+namespace Vulkan
+{
+	SubmissionThread::SubmissionThread(Device& device_)
+		: device(device_)
+	{
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+		present_result.store(VK_SUCCESS, std::memory_order_relaxed);
+		sleeping.store(false, std::memory_order_relaxed);
+		thread = std::thread(&SubmissionThread::Loop, this);
+	}
+
+	SubmissionThread::~SubmissionThread()
+	{
+		WaitIdle();
+		{
+			std::lock_guard<std::mutex> holder{ wake_lock };
+			running = false;
+		}
+		wake_cond.notify_one();
+		thread.join();
+	}
+
+	void SubmissionThread::Push(SubmissionJob job)
+	{
+		uint64_t write = head.load(std::memory_order_relaxed);
+
+		// The consumer frees up a slot with every job, so this is a short wait
+		while (write - tail.load(std::memory_order_acquire) >= RING_SIZE)
+			std::this_thread::yield();
+
+		ring[write % RING_SIZE] = std::move(job);
+		head.store(write + 1, std::memory_order_seq_cst);
+
+		// Pairs with the consumer setting sleeping before it checks head a last time
+		if (sleeping.load(std::memory_order_seq_cst))
+		{
+			std::lock_guard<std::mutex> holder{ wake_lock };
+			wake_cond.notify_one();
+		}
+	}
+
+	void SubmissionThread::WaitIdle()
+	{
+		std::unique_lock<std::mutex> holder{ wake_lock };
+		idle_cond.wait(holder, [&]() {
+			return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+		});
+	}
+
+	VkResult SubmissionThread::ConsumePresentResult()
+	{
+		return VkResult(present_result.exchange(VK_SUCCESS, std::memory_order_acq_rel));
+	}
+
+	void SubmissionThread::Loop()
+	{
+		for (;;)
+		{
+			uint64_t read = tail.load(std::memory_order_relaxed);
+			if (read == head.load(std::memory_order_acquire))
+			{
+				std::unique_lock<std::mutex> holder{ wake_lock };
+				idle_cond.notify_all();
+
+				sleeping.store(true, std::memory_order_seq_cst);
+				wake_cond.wait(holder, [&]() {
+					return head.load(std::memory_order_seq_cst) != read || !running;
+				});
+				sleeping.store(false, std::memory_order_relaxed);
+
+				if (head.load(std::memory_order_acquire) == read && !running)
+					return;
+				continue;
+			}
+
+			auto& job = ring[read % RING_SIZE];
+			if (job.type == SubmissionJob::Type::Present)
+			{
+				VkResult result = device.PresentQueue(job.queue, job.present);
+				if (result != VK_SUCCESS)
+					present_result.store(result, std::memory_order_release);
+			}
+			else
+				device.SubmitQueueBatches(job.queue, job.batches, job.fence);
+
+			// Releases what the batches hold on to before the slot is handed back to the producer
+			job.batches.clear();
+			tail.store(read + 1, std::memory_order_release);
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "quantumvk/vulkan/vulkan_headers.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Vulkan
+{
+	class Device;
+	struct QueueBatch;
+
+	// A present, with everything copied out of VkPresentInfoKHR so it can be executed later
+	struct PresentRequest
+	{
+		VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+		uint32_t index = 0;
+		VkSemaphore wait_semaphore = VK_NULL_HANDLE;
+		bool has_present_time = false;
+		VkPresentTimeGOOGLE present_time = {};
+	};
+
+	struct SubmissionJob
+	{
+		enum class Type
+		{
+			Submit,
+			Present
+		};
+
+		Type type = Type::Submit;
+		VkQueue queue = VK_NULL_HANDLE;
+		VkFence fence = VK_NULL_HANDLE;
+		std::vector<QueueBatch> batches;
+		PresentRequest present;
+	};
+
+	// Thread which owns all vkQueueSubmit and vkQueuePresentKHR calls of a device once enabled, so recording threads don't pay for driver submit latency.
+	// Jobs are executed in the order they were pushed. Pushing is lock-free, but pushes must be serialized, the device does this under its lock.
+	class SubmissionThread
+	{
+	public:
+		explicit SubmissionThread(Device& device);
+		~SubmissionThread();
+
+		SubmissionThread(const SubmissionThread&) = delete;
+		void operator=(const SubmissionThread&) = delete;
+
+		// Only blocks if the ring is full
+		void Push(SubmissionJob job);
+		// Blocks until every pushed job was executed
+		void WaitIdle();
+
+		// Returns the result of the last executed present which failed, and resets it to VK_SUCCESS
+		VkResult ConsumePresentResult();
+
+		// Jobs pushed and not executed yet
+		uint32_t GetQueueDepth() const
+		{
+			return uint32_t(head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire));
+		}
+
+	private:
+		static const uint64_t RING_SIZE = 64;
+
+		void Loop();
+
+		Device& device;
+		SubmissionJob ring[RING_SIZE];
+		// Written by the producer and consumer respectively
+		std::atomic<uint64_t> head;
+		std::atomic<uint64_t> tail;
+		std::atomic<int32_t> present_result;
+
+		// Only used to sleep when there's nothing to do
+		std::mutex wake_lock;
+		std::condition_variable wake_cond;
+		std::condition_variable idle_cond;
+		std::atomic_bool sleeping;
+		bool running = true;
+
+		std::thread thread;
+	};
+}
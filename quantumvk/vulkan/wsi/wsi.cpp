@@ -408,43 +408,31 @@ namespace Vulkan
 			auto release_semaphore = release->GetSemaphore();
 			VK_ASSERT(release_semaphore != VK_NULL_HANDLE);
 
-			VkResult result = VK_SUCCESS;
-			VkPresentInfoKHR info = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
-			info.waitSemaphoreCount = 1;
-			info.pWaitSemaphores = &release_semaphore;
-			info.swapchainCount = 1;
-			info.pSwapchains = &swapchain;
-			info.pImageIndices = &swapchain_index;
-			info.pResults = &result;
-
-			VkPresentTimeGOOGLE present_time;
-			VkPresentTimesInfoGOOGLE present_timing = { VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE };
-			present_timing.swapchainCount = 1;
-			present_timing.pTimes = &present_time;
-
-			if (using_display_timing && timing.FillPresentInfoTiming(present_time))
-			{
-				info.pNext = &present_timing;
-			}
+			PresentRequest request;
+			request.swapchain = swapchain;
+			request.index = swapchain_index;
+			request.wait_semaphore = release_semaphore;
+
+			if (using_display_timing && timing.FillPresentInfoTiming(request.present_time))
+				request.has_present_time = true;
 
 #ifdef VULKAN_WSI_TIMING_DEBUG
 			auto present_start = Util::get_current_time_nsecs();
 #endif
 
+			// Goes through the device so it's ordered with the submission thread. With one, errors show up a frame late.
 			//auto present_ts = device->write_calibrated_timestamp();
-			VkResult overall = table->vkQueuePresentKHR(context->GetGraphicsQueue(), &info);
+			VkResult result = device->Present(request);
 			//device->register_time_interval("WSI", std::move(present_ts), device->write_calibrated_timestamp(), "present");
 
 #ifdef ANDROID
 			// Android 10 can return suboptimal here, only because of pre-transform.
 			// We don't care about that, and treat this as success.
-			if (overall == VK_SUBOPTIMAL_KHR)
-				overall = VK_SUCCESS;
 			if (result == VK_SUBOPTIMAL_KHR)
 				result = VK_SUCCESS;
 #endif
 
-			if (overall == VK_ERROR_FULL_SCREEN_EXCLUSIVE_MODE_LOST_EXT || result == VK_ERROR_FULL_SCREEN_EXCLUSIVE_MODE_LOST_EXT)
+			if (result == VK_ERROR_FULL_SCREEN_EXCLUSIVE_MODE_LOST_EXT)
 			{
 				QM_LOG_ERROR("Lost exclusive full-screen ...\n");
 			}
@@ -454,7 +442,7 @@ namespace Vulkan
 			QM_LOG_INFO("vkQueuePresentKHR took %.3f ms.\n", (present_end - present_start) * 1e-6);
 #endif
 
-			if (overall != VK_SUCCESS || result != VK_SUCCESS)
+			if (result != VK_SUCCESS)
 			{
 				QM_LOG_ERROR("vkQueuePresentKHR failed.\n");
 				TearDownSwapchain();